@@ -0,0 +1,240 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2025 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// まとめて捨てるためのメモリ領域 (アリーナ)
+//
+
+// 1メッセージの処理中に作っては捨てる string/ustring を malloc/free せず
+// ここから切り出し、メッセージの処理が終わったら arena_reset() で全部
+// まとめて解放する。
+// 基本はポインタを進めるだけで、最後に確保した領域なら拡大や解放も
+// その場で行う (スタックのように使われることが多いので)。
+// reset 時に複数のチャンクに分かれていたら次回は1つで収まるように
+// 作り直すので、定常状態ではヒープの操作は起きない。
+
+#include "common.h"
+#include <err.h>
+#include <string.h>
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	uint size;				// data[] のバイト数
+	uint used;				// data[] の使用済みバイト数
+	uint64 data[0];			// 8 バイト境界に揃えるため uint64 にしてある
+};
+
+struct arena {
+	struct arena_chunk *chunk;	// 使用中のチャンク。古いのは next 以降
+	uint chunksize;				// チャンクの最小サイズ
+	uint total;					// 全チャンクの data[] の合計
+};
+
+#define ARENA_ALIGN(n)	roundup((n), sizeof(uint64))
+
+static struct arena_chunk *arena_new_chunk(struct arena *, uint);
+
+// 現在 string/ustring の確保先になっているアリーナ。
+static struct arena *current_arena;
+
+// アリーナを作成する。
+// chunksize は最初に確保するチャンクのバイト数。
+struct arena *
+arena_create(uint chunksize)
+{
+	struct arena *a = calloc(1, sizeof(*a));
+	if (a == NULL) {
+		return NULL;
+	}
+	a->chunksize = ARENA_ALIGN(chunksize);
+	if (arena_new_chunk(a, a->chunksize) == NULL) {
+		free(a);
+		return NULL;
+	}
+	return a;
+}
+
+// アリーナを解放する。
+void
+arena_destroy(struct arena *a)
+{
+	if (a) {
+		struct arena_chunk *c;
+		struct arena_chunk *next;
+		for (c = a->chunk; c; c = next) {
+			next = c->next;
+			free(c);
+		}
+		free(a);
+	}
+}
+
+// size バイト以上のチャンクを追加して先頭に繋ぐ。
+static struct arena_chunk *
+arena_new_chunk(struct arena *a, uint size)
+{
+	struct arena_chunk *c = malloc(sizeof(*c) + size);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->next = a->chunk;
+	c->size = size;
+	c->used = 0;
+	a->chunk = c;
+	a->total += size;
+	return c;
+}
+
+// アリーナから確保した領域を全部捨てる。
+void
+arena_reset(struct arena *a)
+{
+	assert(a);
+
+	if (__predict_false(a->chunk->next != NULL)) {
+		// 溢れていたら、次回は1チャンクで収まる大きさで作り直す。
+		uint total = a->total;
+		struct arena_chunk *c;
+		struct arena_chunk *next;
+		for (c = a->chunk; c; c = next) {
+			next = c->next;
+			free(c);
+		}
+		a->chunk = NULL;
+		a->total = 0;
+		if (arena_new_chunk(a, total) == NULL) {
+			// 作れなければ最小サイズで。これも失敗したら諦める。
+			if (arena_new_chunk(a, a->chunksize) == NULL) {
+				err(1, "%s", __func__);
+			}
+		}
+	} else {
+		a->chunk->used = 0;
+	}
+}
+
+// アリーナから size バイトを確保する。
+// 確保出来なければ NULL を返す。
+void *
+arena_alloc(struct arena *a, uint size)
+{
+	assert(a);
+
+	struct arena_chunk *c = a->chunk;
+	size = ARENA_ALIGN(size);
+	if (__predict_false(c->used + size > c->size)) {
+		// 足りなければ倍々で増やす。
+		uint newsize = MAX(a->total, size);
+		c = arena_new_chunk(a, newsize);
+		if (c == NULL) {
+			return NULL;
+		}
+	}
+
+	void *p = (char *)c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+// アリーナから size バイトを確保してゼロクリアする。
+void *
+arena_calloc(struct arena *a, uint size)
+{
+	void *p = arena_alloc(a, size);
+	if (p) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+// アリーナから確保した oldsize バイトの領域 p を newsize バイトに拡大する。
+// p が直近に確保した領域で後ろが空いていればその場で伸ばす。
+// そうでなければ新しく確保して内容をコピーする (元の領域は reset まで
+// そのまま)。
+// p が NULL なら arena_alloc() と同じ。
+// 拡大出来なければ NULL を返す (p はそのまま)。
+void *
+arena_grow(struct arena *a, void *p, uint oldsize, uint newsize)
+{
+	assert(a);
+
+	if (p == NULL) {
+		return arena_alloc(a, newsize);
+	}
+
+	struct arena_chunk *c = a->chunk;
+	oldsize = ARENA_ALIGN(oldsize);
+	newsize = ARENA_ALIGN(newsize);
+	char *top = (char *)c->data + c->used;
+	if ((char *)p + oldsize == top && c->used - oldsize + newsize <= c->size) {
+		c->used = c->used - oldsize + newsize;
+		return p;
+	}
+
+	void *newp = arena_alloc(a, newsize);
+	if (newp == NULL) {
+		return NULL;
+	}
+	memcpy(newp, p, oldsize);
+	return newp;
+}
+
+// アリーナから確保した size バイトの領域 p を返却する。
+// p が直近に確保した領域ならその分を巻き戻す。
+// そうでなければ何もしない (reset までそのまま)。
+void
+arena_release(struct arena *a, void *p, uint size)
+{
+	assert(a);
+
+	if (p == NULL) {
+		return;
+	}
+
+	struct arena_chunk *c = a->chunk;
+	size = ARENA_ALIGN(size);
+	if ((char *)p + size == (char *)c->data + c->used) {
+		c->used -= size;
+	}
+}
+
+// a をこれ以降に作成する string/ustring の確保先にする。
+// NULL ならヒープに戻す。
+// 以前の確保先を返す。
+struct arena *
+arena_set_current(struct arena *a)
+{
+	struct arena *prev = current_arena;
+	current_arena = a;
+	return prev;
+}
+
+// 現在の string/ustring の確保先を返す。ヒープなら NULL。
+struct arena *
+arena_get_current(void)
+{
+	return current_arena;
+}
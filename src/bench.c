@@ -0,0 +1,236 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 再生のベンチマークモード (--play と --bench)
+//
+
+// 出力は標準出力を一時ファイルに差し替えて受け、1メッセージごとに
+// バイト数を数えて巻き戻す (ほぼすべての出力が直接 stdout に書かれて
+// いるため)。別プロセスで読み捨てると、その切り替えが出力側の段階の
+// 時間に入ってしまう。
+// 処理段階ごとの時間は bench_enter()/bench_leave() で区切った区間の
+// 経過時間を段階ごとに積算する。
+// CPU 時間を段階ごとに取ると clock_gettime() がシステムコールになる
+// 環境が多く計測自体が重くなるので、段階別は経過時間、全体の CPU 時間は
+// getrusage() で別に表示する。
+
+#include "sayaka.h"
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+bool bench_enabled;
+
+static const char * const stage_names[BENCH_MAX] = {
+	"read",
+	"wait",
+	"json",
+	"format",
+	"ng",
+	"image",
+	"sixel",
+};
+
+static uint cur_stage;				// 現在の段階
+static uint64 stage_start;			// 現在の段階に入った時刻
+static uint64 stage_usec[BENCH_MAX];// 段階ごとの積算時間
+
+static uint32 *latency;				// メッセージごとの遅延 [usec]
+static uint nlatency;
+static uint latency_cap;
+
+static uint64 start_usec;
+static struct rusage start_ru;
+static int saved_stdout = -1;
+static uint64 output_bytes;			// 出力の積算バイト数
+
+static void bench_count_output(void);
+static uint64 timeval_diff(const struct timeval *, const struct timeval *);
+static int  cmp_uint32(const void *, const void *);
+
+static inline uint64
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_usec(&ts);
+}
+
+// ベンチマークを開始する。
+// 以降、標準出力への出力は捨てられる。
+bool
+bench_start(void)
+{
+	fflush(stdout);
+	FILE *tmp = tmpfile();
+	if (tmp == NULL) {
+		warn("%s: tmpfile", __func__);
+		return false;
+	}
+	saved_stdout = dup(STDOUT_FILENO);
+	if (saved_stdout < 0 || dup2(fileno(tmp), STDOUT_FILENO) < 0) {
+		warn("%s: dup2", __func__);
+		if (saved_stdout >= 0) {
+			close(saved_stdout);
+			saved_stdout = -1;
+		}
+		fclose(tmp);
+		return false;
+	}
+	fclose(tmp);
+
+	output_bytes = 0;
+	bench_enabled = true;
+	getrusage(RUSAGE_SELF, &start_ru);
+	start_usec = bench_now();
+	stage_start = start_usec;
+	cur_stage = BENCH_READ;
+	return true;
+}
+
+// ここまでの出力のバイト数を数えて、一時ファイルを巻き戻す。
+static void
+bench_count_output(void)
+{
+	fflush(stdout);
+	off_t pos = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+	if (pos > 0) {
+		output_bytes += pos;
+		lseek(STDOUT_FILENO, 0, SEEK_SET);
+	}
+}
+
+// 段階を stage に切り替え、それまでの段階を返す。
+// bench_enter() から呼ばれる。
+uint
+bench_switch(uint stage)
+{
+	uint64 now = bench_now();
+
+	stage_usec[cur_stage] += now - stage_start;
+	stage_start = now;
+
+	uint prev = cur_stage;
+	cur_stage = stage;
+	return prev;
+}
+
+// 到着時刻 arrival (CLOCK_MONOTONIC の usec) のメッセージの処理が
+// 終わったことを記録する。
+void
+bench_message(uint64 arrival)
+{
+	bench_count_output();
+
+	if (nlatency >= latency_cap) {
+		uint newcap = MAX(latency_cap * 2, 1024);
+		uint32 *newbuf = realloc(latency, newcap * sizeof(latency[0]));
+		if (newbuf == NULL) {
+			return;
+		}
+		latency = newbuf;
+		latency_cap = newcap;
+	}
+	uint64 now = bench_now();
+	latency[nlatency++] = (now > arrival) ? MIN(now - arrival, UINT32_MAX) : 0;
+}
+
+// ベンチマークを終了して結果を表示する。
+void
+bench_report(void)
+{
+	struct rusage ru;
+
+	if (bench_enabled == false) {
+		return;
+	}
+	bench_switch(cur_stage);
+	uint64 elapsed = bench_now() - start_usec;
+	getrusage(RUSAGE_SELF, &ru);
+	bench_enabled = false;
+
+	// 標準出力を戻すと一時ファイルは閉じて消える。
+	bench_count_output();
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	saved_stdout = -1;
+
+	double sec = (double)elapsed / 1000000;
+	uint64 user = timeval_diff(&ru.ru_utime, &start_ru.ru_utime);
+	uint64 sys  = timeval_diff(&ru.ru_stime, &start_ru.ru_stime);
+
+	printf("messages: %u in %.3f sec (%.1f msgs/sec)\n",
+		nlatency, sec, sec > 0 ? nlatency / sec : 0);
+	printf("output  : %" PRIu64 " bytes (%.1f bytes/msg)\n",
+		output_bytes, nlatency ? (double)output_bytes / nlatency : 0);
+	printf("cpu     : user %.3f sec, sys %.3f sec\n",
+		(double)user / 1000000, (double)sys / 1000000);
+	// 段階別は CPU 時間ではなく経過時間。
+	printf("stage   : %10s %6s %10s\n", "wall msec", "ratio", "usec/msg");
+	for (uint i = 0; i < BENCH_MAX; i++) {
+		printf("  %-6s: %10.3f %5.1f%% %10.2f\n", stage_names[i],
+			(double)stage_usec[i] / 1000,
+			elapsed ? (double)stage_usec[i] * 100 / elapsed : 0,
+			nlatency ? (double)stage_usec[i] / nlatency : 0);
+	}
+
+	if (nlatency > 0) {
+		qsort(latency, nlatency, sizeof(latency[0]), cmp_uint32);
+		printf("latency : p50 %u, p90 %u, p99 %u, max %u [usec]\n",
+			latency[(nlatency - 1) * 50 / 100],
+			latency[(nlatency - 1) * 90 / 100],
+			latency[(nlatency - 1) * 99 / 100],
+			latency[nlatency - 1]);
+	}
+	fflush(stdout);
+
+	free(latency);
+	latency = NULL;
+	nlatency = 0;
+	latency_cap = 0;
+}
+
+// end - start を usec で返す。
+static uint64
+timeval_diff(const struct timeval *end, const struct timeval *start)
+{
+	return (uint64)(end->tv_sec - start->tv_sec) * 1000000
+		+ end->tv_usec - start->tv_usec;
+}
+
+static int
+cmp_uint32(const void *a, const void *b)
+{
+	uint32 x = *(const uint32 *)a;
+	uint32 y = *(const uint32 *)b;
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,125 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 参照カウント付きバッファ (ソケットから画像ローダまでの受け渡し用)
+//
+
+// 受信したデータは bblock に直接読み込み、その一部を指す bslice の形で
+// net -> httpclient -> pstream -> 画像ローダと受け渡す。
+// 各段はスライスの参照を増減させるだけで中身はコピーしない。
+// ブロックは最後のスライスが解放された時点で解放される。
+// 参照しているのが自分だけ (refcnt == 1) になったブロックは、
+// 書き込み側が先頭から再利用してよい。
+
+#include "common.h"
+
+// size バイトのデータ領域を持つブロックを確保する。
+// 参照カウントは 1 で返る。
+// 確保出来なければ NULL を返す。
+struct bblock *
+bblock_alloc(uint size)
+{
+	struct bblock *b = malloc(sizeof(*b) + size);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->refcnt = 1;
+	b->size = size;
+	return b;
+}
+
+// ブロックの参照を1つ増やして b を返す。
+struct bblock *
+bblock_ref(struct bblock *b)
+{
+	assert(b);
+	assert(b->refcnt > 0);
+
+	b->refcnt++;
+	return b;
+}
+
+// ブロックの参照を1つ減らし、0 になれば解放する。
+// b が NULL なら何もしない。
+void
+bblock_unref(struct bblock *b)
+{
+	if (b) {
+		assert(b->refcnt > 0);
+		if (--b->refcnt == 0) {
+			free(b);
+		}
+	}
+}
+
+// ブロック b の ptr から len バイトを指すスライスを sp に作る。
+// ブロックの参照を1つ増やす。
+void
+bslice_set(struct bslice *sp, struct bblock *b, const uint8 *ptr, uint len)
+{
+	assert(b);
+	assert(b->data <= ptr && ptr + len <= b->data + b->size);
+
+	sp->block = bblock_ref(b);
+	sp->ptr = ptr;
+	sp->len = len;
+}
+
+// スライスを解放する。空のスライスに対しては何もしない。
+void
+bslice_release(struct bslice *sp)
+{
+	bblock_unref(sp->block);
+	sp->block = NULL;
+	sp->ptr = NULL;
+	sp->len = 0;
+}
+
+// 書き込み側が次に読み込むための空き領域を用意する。
+// *bp は書き込み先のブロック (NULL なら新規に確保する)、*posp はその
+// 書き込み位置で、未読のデータは残っていない状態で呼ぶこと。
+// 他から参照されていなければ先頭から再利用し、参照されていて後ろに
+// 空きがなければ size バイトの新しいブロックに差し替える。
+// 書き込めるバイト数を返す。確保に失敗すれば 0 を返す。
+uint
+bblock_prepare(struct bblock **bp, uint *posp, uint size)
+{
+	struct bblock *b = *bp;
+
+	if (b && b->refcnt == 1) {
+		*posp = 0;
+	} else if (b == NULL || *posp == b->size) {
+		bblock_unref(b);
+		b = bblock_alloc(size);
+		*bp = b;
+		*posp = 0;
+		if (b == NULL) {
+			return 0;
+		}
+	}
+	return b->size - *posp;
+}
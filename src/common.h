@@ -56,6 +56,7 @@
 } while (0)
 
 struct net;
+struct netstat_req;
 
 struct diag
 {
@@ -87,9 +88,25 @@ struct string_ {
 	char *buf;		// len == 0 の時 buf を触らないこと。
 	uint len;		// 文字列の長さ ('\0' の位置)
 	uint capacity;	// 確保してあるバイト数
+	struct arena *arena;	// 確保元のアリーナ。ヒープなら NULL
 };
 typedef struct string_ string;
 
+// 参照カウント付きのバッファブロック。
+struct bblock {
+	uint refcnt;			// 参照カウント
+	uint size;				// data[] のバイト数
+	uint8 data[0];
+};
+
+// ブロックの一部を指すスライス。
+// block が NULL なら空のスライス。
+struct bslice {
+	struct bblock *block;
+	const uint8 *ptr;		// 先頭
+	uint len;				// 長さ
+};
+
 struct urlinfo {
 	string *scheme;
 	string *host;
@@ -99,6 +116,20 @@ struct urlinfo {
 	string *pqf;
 };
 
+// bufchain.c
+extern struct bblock *bblock_alloc(uint);
+extern struct bblock *bblock_ref(struct bblock *);
+extern void bblock_unref(struct bblock *);
+extern uint bblock_prepare(struct bblock **, uint *, uint);
+extern void bslice_set(struct bslice *, struct bblock *, const uint8 *, uint);
+extern void bslice_release(struct bslice *);
+// スライスの先頭 n バイトを消費する。
+static inline void bslice_advance(struct bslice *sp, uint n) {
+	assert(n <= sp->len);
+	sp->ptr += n;
+	sp->len -= n;
+}
+
 // diag.c
 static inline int diag_get_level(const struct diag *diag)
 {
@@ -111,13 +142,37 @@ extern void diag_set_timestamp(struct diag *, bool);
 extern void diag_print(const struct diag *, const char *, ...)
 	__attribute__((format(printf, 2, 3)));
 
+// evloop.c
+// 待つイベント (evloop_add_fd() の events、net_get_want() の戻り値)
+#define EV_READ		(0x01)
+#define EV_WRITE	(0x02)
+#define EV_ERROR	(0x04)	// revents のみ
+struct evloop;
+typedef void (*evloop_fd_cb)(struct evloop *, int, uint, void *);
+typedef void (*evloop_timer_cb)(struct evloop *, void *);
+extern struct evloop *evloop_create(const struct diag *);
+extern void evloop_destroy(struct evloop *);
+extern bool evloop_add_fd(struct evloop *, int, uint, evloop_fd_cb, void *);
+extern void evloop_set_fd(struct evloop *, int, uint);
+extern void evloop_del_fd(struct evloop *, int);
+extern uint evloop_count_fd(const struct evloop *);
+extern uint evloop_add_timer(struct evloop *, uint, uint,
+	evloop_timer_cb, void *);
+extern void evloop_del_timer(struct evloop *, uint);
+extern int  evloop_run_once(struct evloop *, int);
+
 // httpclient.c
+struct httpclient;
+typedef void (*httpclient_done_cb)(struct httpclient *, int, void *);
 extern struct httpclient *httpclient_create(const struct diag *);
 extern void httpclient_destroy(struct httpclient *);
 extern int  httpclient_connect(struct httpclient *, const char *,
 	const struct net_opt *);
+extern int  httpclient_fetch_async(struct httpclient *, struct evloop *,
+	const char *, const struct net_opt *, uint, httpclient_done_cb, void *);
 extern const char *httpclient_get_resmsg(const struct httpclient *);
-extern FILE *httpclient_fopen(struct httpclient *);
+extern struct pstream *httpclient_open_pstream(struct httpclient *);
+extern int  httpclient_read_slice(struct httpclient *, struct bslice *, uint);
 extern void diag_http_header(const struct diag *, const string *);
 
 // net.c
@@ -130,19 +185,69 @@ extern struct net *net_create(const struct diag *);
 extern void net_destroy(struct net *);
 extern int  net_connect(struct net *, const char *, const char *, const char *,
 	const struct net_opt *);
+extern int  net_connect_async(struct net *, const char *, const char *,
+	const char *, const struct net_opt *);
+extern int  net_connect_step(struct net *);
+extern int  net_set_nonblock(struct net *);
 extern string *net_gets(struct net *);
 extern int  net_read(struct net *, void *, uint);
+extern int  net_read_slice(struct net *, struct bslice *, uint);
 extern int  net_write(struct net *, const void *, uint);
 extern void net_shutdown_half(struct net *);
 extern void net_close(struct net *);
 extern int  net_get_fd(const struct net *);
+extern uint net_get_want(const struct net *);
+extern struct netstat_req *net_get_stat(struct net *);
+
+// netstat.c
+// 1リクエストの処理段階。
+enum {
+	NETSTAT_DNS,			// 名前解決
+	NETSTAT_CONNECT,		// TCP 接続
+	NETSTAT_TLS,			// TLS ハンドシェイク
+	NETSTAT_TTFB,			// 接続完了から応答の1行目の受信まで
+	NETSTAT_BODY,			// 応答ヘッダの残りと本文の受信
+	NETSTAT_MAX,
+};
+// 1リクエスト分の計測値。
+struct netstat_req {
+	uint64 mark;				// 直前の段階の終了時刻 [usec]。0 なら無効
+	uint32 usec[NETSTAT_MAX];	// 段階ごとの所要時間 [usec]
+	uint done;					// 計測した段階のビットマップ
+	uint64 sent;				// 送信バイト数
+	uint64 recv;				// 受信バイト数
+};
+extern void netstat_begin(struct netstat_req *);
+extern void netstat_mark(struct netstat_req *, uint);
+extern void netstat_record(const struct diag *, const char *,
+	const struct netstat_req *);
+extern uint netstat_get_hist(const char *, uint, uint);
+extern void netstat_clear(void);
+extern void netstat_dump(FILE *);
+
+// arena.c
+struct arena;
+extern struct arena *arena_create(uint);
+extern void arena_destroy(struct arena *);
+extern void arena_reset(struct arena *);
+extern void *arena_alloc(struct arena *, uint);
+extern void *arena_calloc(struct arena *, uint);
+extern void *arena_grow(struct arena *, void *, uint, uint);
+extern void arena_release(struct arena *, void *, uint);
+extern struct arena *arena_set_current(struct arena *);
+extern struct arena *arena_get_current(void);
 
 // pstream.c
 extern struct pstream *pstream_init_fp(FILE *);
 extern struct pstream *pstream_init_fd(int);
+extern struct pstream *pstream_init_slice(
+	int (*)(void *, struct bslice *, uint), void *);
 extern void pstream_cleanup(struct pstream *);
 extern FILE *pstream_open_for_peek(struct pstream *);
 extern FILE *pstream_open_for_read(struct pstream *);
+extern int  pstream_peek(struct pstream *, void *, uint);
+extern int  pstream_read_slice(struct pstream *, struct bslice *, uint);
+extern int  pstream_read(struct pstream *, void *, uint);
 
 // string.c
 extern string *string_init(void);
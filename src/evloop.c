@@ -0,0 +1,382 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// イベントループ (1スレッドで複数のソケットとタイマーを待つ)
+//
+
+// NetBSD でもそのまま動くよう epoll/kqueue ではなく poll(2) を使う。
+// 扱うディスクリプタはせいぜい数十なので線形探索で十分。
+//
+// コールバック中に fd やタイマーを追加・削除してもよい。
+// 削除されたエントリは印を付けておいて、ディスパッチが終わってから詰める。
+
+#include "common.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+struct evloop_fd {
+	int fd;					// -1 なら削除済み
+	uint events;			// 待つイベント (EV_READ | EV_WRITE)
+	evloop_fd_cb cb;
+	void *arg;
+};
+
+struct evloop_timer {
+	uint id;				// 0 なら削除済み
+	uint interval_msec;		// 0 なら1回きり
+	uint64 expire_usec;		// 次に発火する時刻 (CLOCK_MONOTONIC)
+	evloop_timer_cb cb;
+	void *arg;
+};
+
+struct evloop {
+	struct evloop_fd *fds;
+	uint nfds;
+	uint fdcap;
+
+	struct pollfd *pfds;	// poll(2) に渡す作業領域 (fdcap 個)
+
+	struct evloop_timer *timers;
+	uint ntimers;
+	uint timercap;
+	uint next_id;			// 次に払い出すタイマー ID
+
+	bool dirty;				// 削除済みエントリが残っている
+
+	const struct diag *diag;
+};
+
+static struct evloop_fd *evloop_find_fd(struct evloop *, int);
+static uint64 evloop_now_usec(void);
+static void evloop_compact(struct evloop *);
+
+// イベントループを作成する。
+// 失敗すれば errno をセットして NULL を返す。
+struct evloop *
+evloop_create(const struct diag *diag)
+{
+	struct evloop *loop = calloc(1, sizeof(*loop));
+	if (loop == NULL) {
+		return NULL;
+	}
+	loop->next_id = 1;
+	loop->diag = diag;
+	return loop;
+}
+
+// イベントループを解放する。登録されている fd は閉じない。
+void
+evloop_destroy(struct evloop *loop)
+{
+	if (loop) {
+		free(loop->fds);
+		free(loop->pfds);
+		free(loop->timers);
+		free(loop);
+	}
+}
+
+// fd を events で待つよう登録する。
+// fd に events のいずれかが起きると cb(loop, fd, revents, arg) が呼ばれる。
+// revents には EV_ERROR が立つこともある。
+// 成功すれば true、失敗すれば errno をセットして false を返す。
+bool
+evloop_add_fd(struct evloop *loop, int fd, uint events,
+	evloop_fd_cb cb, void *arg)
+{
+	assert(fd >= 0);
+	assert(evloop_find_fd(loop, fd) == NULL);
+
+	if (loop->nfds == loop->fdcap) {
+		uint newcap = loop->fdcap ? loop->fdcap * 2 : 8;
+		struct evloop_fd *newfds =
+			realloc(loop->fds, sizeof(*newfds) * newcap);
+		if (newfds == NULL) {
+			return false;
+		}
+		loop->fds = newfds;
+		struct pollfd *newpfds =
+			realloc(loop->pfds, sizeof(*newpfds) * newcap);
+		if (newpfds == NULL) {
+			return false;
+		}
+		loop->pfds = newpfds;
+		loop->fdcap = newcap;
+	}
+
+	struct evloop_fd *e = &loop->fds[loop->nfds++];
+	e->fd = fd;
+	e->events = events;
+	e->cb = cb;
+	e->arg = arg;
+	Trace(loop->diag, "%s: fd=%d events=%x", __func__, fd, events);
+	return true;
+}
+
+// 登録済みの fd の待つイベントを変更する。
+// events が 0 なら登録したまま待たない。
+void
+evloop_set_fd(struct evloop *loop, int fd, uint events)
+{
+	struct evloop_fd *e = evloop_find_fd(loop, fd);
+	assert(e);
+	e->events = events;
+}
+
+// fd の登録を解除する。登録されていなければ何もしない。
+void
+evloop_del_fd(struct evloop *loop, int fd)
+{
+	struct evloop_fd *e = evloop_find_fd(loop, fd);
+	if (e) {
+		Trace(loop->diag, "%s: fd=%d", __func__, fd);
+		e->fd = -1;
+		loop->dirty = true;
+	}
+}
+
+// 登録されている fd の数を返す。
+uint
+evloop_count_fd(const struct evloop *loop)
+{
+	uint n = 0;
+	for (uint i = 0; i < loop->nfds; i++) {
+		if (loop->fds[i].fd >= 0) {
+			n++;
+		}
+	}
+	return n;
+}
+
+// msec ミリ秒後に cb(loop, arg) を呼ぶタイマーを登録する。
+// interval_msec が 0 なら1回きり、そうでなければ以降その間隔で繰り返す。
+// 成功すればタイマー ID (0 以外) を返す。
+// 失敗すれば errno をセットして 0 を返す。
+uint
+evloop_add_timer(struct evloop *loop, uint msec, uint interval_msec,
+	evloop_timer_cb cb, void *arg)
+{
+	if (loop->ntimers == loop->timercap) {
+		uint newcap = loop->timercap ? loop->timercap * 2 : 8;
+		struct evloop_timer *newtimers =
+			realloc(loop->timers, sizeof(*newtimers) * newcap);
+		if (newtimers == NULL) {
+			return 0;
+		}
+		loop->timers = newtimers;
+		loop->timercap = newcap;
+	}
+
+	struct evloop_timer *t = &loop->timers[loop->ntimers++];
+	t->id = loop->next_id++;
+	if (__predict_false(loop->next_id == 0)) {
+		loop->next_id = 1;
+	}
+	t->interval_msec = interval_msec;
+	t->expire_usec = evloop_now_usec() + (uint64)msec * 1000;
+	t->cb = cb;
+	t->arg = arg;
+	return t->id;
+}
+
+// タイマー id を削除する。id が 0 か、すでに発火済みなら何もしない。
+void
+evloop_del_timer(struct evloop *loop, uint id)
+{
+	if (id == 0) {
+		return;
+	}
+	for (uint i = 0; i < loop->ntimers; i++) {
+		struct evloop_timer *t = &loop->timers[i];
+		if (t->id == id) {
+			t->id = 0;
+			loop->dirty = true;
+			return;
+		}
+	}
+}
+
+// イベントを1回待って、起きたものを全部処理する。
+// timeout_msec は最大の待ち時間で、-1 なら (タイマー以外では) 無制限に待つ。
+// 処理したコールバックの数を返す。
+// シグナルで中断された場合は 0 を返す。
+// エラーなら errno をセットして -1 を返す。
+int
+evloop_run_once(struct evloop *loop, int timeout_msec)
+{
+	const struct diag *diag = loop->diag;
+	int ndispatch = 0;
+
+	// 一番近いタイマーまでしか待たない。
+	uint64 now = evloop_now_usec();
+	for (uint i = 0; i < loop->ntimers; i++) {
+		const struct evloop_timer *t = &loop->timers[i];
+		if (t->id == 0) {
+			continue;
+		}
+		int msec;
+		if (t->expire_usec <= now) {
+			msec = 0;
+		} else {
+			// 切り上げないと早く起きすぎて空回りする。
+			msec = (t->expire_usec - now + 999) / 1000;
+		}
+		if (timeout_msec < 0 || msec < timeout_msec) {
+			timeout_msec = msec;
+		}
+	}
+
+	uint npfds = 0;
+	for (uint i = 0; i < loop->nfds; i++) {
+		const struct evloop_fd *e = &loop->fds[i];
+		if (e->fd < 0 || e->events == 0) {
+			continue;
+		}
+		struct pollfd *p = &loop->pfds[npfds++];
+		p->fd = e->fd;
+		p->events = 0;
+		if ((e->events & EV_READ)) {
+			p->events |= POLLIN;
+		}
+		if ((e->events & EV_WRITE)) {
+			p->events |= POLLOUT;
+		}
+		p->revents = 0;
+	}
+
+	Verbose(diag, "%s: poll(nfds=%u, timeout=%d)", __func__,
+		npfds, timeout_msec);
+	int r = poll(loop->pfds, npfds, timeout_msec);
+	if (r < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		Debug(diag, "%s: poll: %s", __func__, strerrno());
+		return -1;
+	}
+
+	// fd のイベント。
+	// コールバック中に pfds は変わらないが fds は変わることがある。
+	for (uint i = 0; i < npfds && r > 0; i++) {
+		const struct pollfd *p = &loop->pfds[i];
+		if (p->revents == 0) {
+			continue;
+		}
+		r--;
+		struct evloop_fd *e = evloop_find_fd(loop, p->fd);
+		if (e == NULL) {
+			// 先に処理したコールバックで削除された。
+			continue;
+		}
+		uint revents = 0;
+		if ((p->revents & (POLLIN | POLLHUP))) {
+			revents |= EV_READ;
+		}
+		if ((p->revents & POLLOUT)) {
+			revents |= EV_WRITE;
+		}
+		if ((p->revents & (POLLERR | POLLNVAL))) {
+			revents |= EV_ERROR;
+		}
+		e->cb(loop, p->fd, revents, e->arg);
+		ndispatch++;
+	}
+
+	// タイマー。
+	// コールバック中に追加されたタイマーはここでは見ない。
+	now = evloop_now_usec();
+	uint ntimers = loop->ntimers;
+	for (uint i = 0; i < ntimers; i++) {
+		struct evloop_timer *t = &loop->timers[i];
+		if (t->id == 0 || t->expire_usec > now) {
+			continue;
+		}
+		// コールバック中に timers が realloc されることがあるので
+		// 必要なものは先に取り出しておく。
+		evloop_timer_cb cb = t->cb;
+		void *arg = t->arg;
+		if (t->interval_msec == 0) {
+			t->id = 0;
+			loop->dirty = true;
+		} else {
+			t->expire_usec = now + (uint64)t->interval_msec * 1000;
+		}
+		cb(loop, arg);
+		ndispatch++;
+	}
+
+	if (loop->dirty) {
+		evloop_compact(loop);
+	}
+
+	return ndispatch;
+}
+
+// fd に対応するエントリを返す。なければ NULL を返す。
+static struct evloop_fd *
+evloop_find_fd(struct evloop *loop, int fd)
+{
+	for (uint i = 0; i < loop->nfds; i++) {
+		if (loop->fds[i].fd == fd) {
+			return &loop->fds[i];
+		}
+	}
+	return NULL;
+}
+
+// 削除済みのエントリを詰める。
+static void
+evloop_compact(struct evloop *loop)
+{
+	uint j = 0;
+	for (uint i = 0; i < loop->nfds; i++) {
+		if (loop->fds[i].fd >= 0) {
+			loop->fds[j++] = loop->fds[i];
+		}
+	}
+	loop->nfds = j;
+
+	j = 0;
+	for (uint i = 0; i < loop->ntimers; i++) {
+		if (loop->timers[i].id != 0) {
+			loop->timers[j++] = loop->timers[i];
+		}
+	}
+	loop->ntimers = j;
+
+	loop->dirty = false;
+}
+
+static uint64
+evloop_now_usec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_usec(&now);
+}
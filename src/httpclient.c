@@ -32,9 +32,6 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#if defined(HAVE_BSD_BSD_H)
-#include <bsd/stdio.h>
-#endif
 
 struct httpclient {
 	struct net *net;
@@ -52,21 +49,73 @@ struct httpclient {
 	uint recvhdr_num;
 
 	// チャンク
-	uint8 *chunk_buf;
-	uint chunk_cap;		// 確保してあるバッファサイズ
-	uint chunk_len;		// 現在のバッファの有効長
-	uint chunk_pos;		// 現在位置
+	bool chunked;		// Transfer-Encoding: chunked なら true
+	bool chunk_eof;		// 最後のチャンクまで読んだ
+	bool chunk_crlf;	// チャンク末尾の CRLF をまだ読み捨てていない
+	uint chunk_remain;	// 現在のチャンクの残りバイト数
+
+	// 非同期取得 (httpclient_fetch_async)。
+	// イベントループでソケットを待ちながら state を進める。
+	uint state;
+	const struct net_opt *opt;
+	struct evloop *loop;
+	int fd;				// loop に登録しているソケット。なければ -1
+	uint deadline_id;	// 期限のタイマー ID。なければ 0
+	uint connect_id;	// 接続の期限のタイマー ID。なければ 0
+	httpclient_done_cb done_cb;
+	void *done_arg;
+
+	// 非同期取得で受信した本文。
+	// collected なら httpclient_read_slice() はソケットではなくここから
+	// 順に返す。
+	struct bslice *body;
+	uint nbody;
+	uint bodycap;
+	uint bodypos;		// 次に返す body
+	bool collected;
+
+	// net の計測値を統計に記録したら true。
+	bool stat_recorded;
 
 	const struct diag *diag;
 };
 
-static int  do_connect(struct httpclient *, const struct net_opt *);
+// 非同期取得の状態。
+enum {
+	HTTP_STATE_IDLE = 0,
+	HTTP_STATE_CONNECT,	// 接続中
+	HTTP_STATE_HEADER,	// 応答ヘッダ受信中
+	HTTP_STATE_BODY,	// 本文受信中
+	HTTP_STATE_DONE,	// 完了 (成否問わず)
+};
+
+// 非同期取得で一度に受信する本文の最大長。
+#define HTTP_BODY_READLEN	(IMAGE_BUFSIZE)
+
+static int  http_fetch_async_main(struct httpclient *, struct evloop *,
+	const char *, const struct net_opt *, uint, httpclient_done_cb, void *);
+static int  set_url(struct httpclient *, const char *);
+static int  do_connect(struct httpclient *, const struct net_opt *, bool);
+static int  send_request(struct httpclient *);
 static int  recv_header(struct httpclient *);
+static int  recv_header_line(struct httpclient *, string *);
+static int  parse_resline(struct httpclient *);
+static int  finish_header(struct httpclient *, int);
+static void http_step(struct httpclient *);
+static void http_watch(struct httpclient *, uint);
+static void http_finish(struct httpclient *, int);
+static void http_unwatch_fd(struct httpclient *);
+static void http_unwatch(struct httpclient *);
+static void http_fd_cb(struct evloop *, int, uint, void *);
+static bool http_set_connect_timer(struct httpclient *);
+static void http_deadline_cb(struct evloop *, void *);
+static void http_connect_timeout_cb(struct evloop *, void *);
+static bool http_append_body(struct httpclient *, const struct bslice *);
 static const char *find_recvhdr(const struct httpclient *, const char *);
 static void clear_recvhdr(struct httpclient *);
-static int  http_net_read_cb(void *, char *, int);
-static int  http_chunk_read_cb(void *, char *, int);
-static int  read_chunk(struct httpclient *);
+static int  http_slice_cb(void *, struct bslice *, uint);
+static int  read_chunk_header(struct httpclient *);
+static void http_record_stat(struct httpclient *);
 
 struct httpclient *
 httpclient_create(const struct diag *diag)
@@ -78,6 +127,7 @@ httpclient_create(const struct diag *diag)
 		return NULL;
 	}
 
+	http->fd = -1;
 	http->diag = diag;
 
 	return http;
@@ -87,11 +137,17 @@ void
 httpclient_destroy(struct httpclient *http)
 {
 	if (http) {
+		// 取得中ならイベントループから外す。
+		http_unwatch(http);
+		http_record_stat(http);
+		for (uint i = http->bodypos; i < http->nbody; i++) {
+			bslice_release(&http->body[i]);
+		}
+		free(http->body);
 		string_free(http->resline);
 		clear_recvhdr(http);
 		net_destroy(http->net);
 		urlinfo_free(http->url);
-		free(http->chunk_buf);
 		free(http);
 	}
 }
@@ -106,30 +162,13 @@ httpclient_connect(struct httpclient *http, const char *urlstr,
 {
 	const struct diag *diag = http->diag;
 
-	http->url = urlinfo_parse(urlstr);
-	if (http->url == NULL) {
-		Debug(diag, "%s: urlinfo_parse failed", __func__);
+	if (set_url(http, urlstr) < 0) {
 		return -1;
 	}
-	if (diag_get_level(diag) >= 2) {
-		string *u = urlinfo_to_string(http->url);
-		diag_print(diag, "%s: initial url |%s|", __func__, string_get(u));
-		string_free(u);
-	}
 
 	for (;;) {
-		// net を(再)生成。
-		if (http->net) {
-			net_destroy(http->net);
-		}
-		http->net = net_create(diag);
-		if (http->net == NULL) {
-			Debug(diag, "%s: net_create failed", __func__);
-			return -1;
-		}
-
 		// 接続。
-		int r = do_connect(http, opt);
+		int r = do_connect(http, opt, false);
 		if (r < 0) {
 			Debug(diag, "%s: do_connect failed: %s", __func__,
 				(r == -1 ? strerrno() : "SSL not compiled"));
@@ -137,52 +176,21 @@ httpclient_connect(struct httpclient *http, const char *urlstr,
 		}
 
 		// ヘッダを送信。
-		const char *host = string_get(http->url->host);
-		const char *pqf  = string_get(http->url->pqf);
-		string *hdr = string_init();
-		string_append_printf(hdr, "GET %s HTTP/1.1\r\n", pqf);
-		string_append_printf(hdr, "Host: %s\r\n", host);
-		string_append_cstr(hdr,   "Connection: close\r\n");
-		string_append_printf(hdr, "User-Agent: %s/%s\r\n", progname, progver);
-		string_append_cstr(hdr,   "\r\n");
-		if (__predict_false(diag_get_level(diag) >= 2)) {
-			diag_http_header(http->diag, hdr);	// デバッグ表示
-		}
-		net_write(http->net, string_get(hdr), string_len(hdr));
-		string_free(hdr);
+		send_request(http);
 
 		// 応答を受信。
 		int code = recv_header(http);
+		if (code < 0) {
+			return -1;
+		}
 
-		if (300 <= code && code < 400) {
-			const char *location = find_recvhdr(http, "Location:");
-			if (location) {
-				struct urlinfo *newurl = urlinfo_parse(location);
-				if (string_len(newurl->scheme) != 0) {
-					// scheme があればフル URL とみなす。
-					urlinfo_free(http->url);
-					http->url = newurl;
-				} else {
-					// そうでなければ相対パスとみなす。
-					urlinfo_update_path(http->url, newurl);
-					urlinfo_free(newurl);
-				}
-				if (diag_get_level(diag) >= 1) {
-					string *u = urlinfo_to_string(http->url);
-					diag_print(diag, "Redirected url |%s|", string_get(u));
-					string_free(u);
-				}
-				// 内部状態をリセット。
-				net_close(http->net);
-				clear_recvhdr(http);
-				string_free(http->resline);
-				http->resline = NULL;
-				http->rescode = 0;
-				http->resmsg = NULL;
-				continue;
-			}
-		} else if (code >= 400) {
-			return code;
+		r = finish_header(http, code);
+		if (r == 1) {
+			// リダイレクト。
+			continue;
+		}
+		if (r != 0) {
+			return r;
 		}
 
 		Trace(diag, "%s: connected.", __func__);
@@ -191,15 +199,124 @@ httpclient_connect(struct httpclient *http, const char *urlstr,
 	}
 }
 
-// http->url に接続するところまで。
-// 接続できれば 0 を返す。
+// url の取得を evloop 上で非同期に開始する。
+// 取得が終わると (成否によらず) loop の中から
+// done_cb(http, code, arg) が呼ばれる。
+// code は成功なら 0 で、本文は受信済み。これ以降
+// httpclient_open_pstream() と httpclient_read_slice() は受信済みの
+// 本文を返す。失敗なら httpclient_connect() と同じく -1 (errno がセット
+// されている) か HTTP のエラーコード。
+// deadline_msec が 0 でなければ、開始からその時間で完了しなければ
+// ETIMEDOUT で失敗にする。
+// opt->timeout_msec が 0 でなければ、接続 (リダイレクト先への接続も)
+// がその時間で完了しなければ ETIMEDOUT で失敗にする。
+// opt は完了まで保持しておくこと。
+// 開始できれば 0 を返す。開始できなければ done_cb は呼ばずに
+// httpclient_connect() と同じ負数を返す。
+// 取得は呼び出し元より長生きするので、アリーナを使っている最中に
+// 呼ばれても内部で持つものはすべてヒープに置く。
+int
+httpclient_fetch_async(struct httpclient *http, struct evloop *loop,
+	const char *urlstr, const struct net_opt *opt, uint deadline_msec,
+	httpclient_done_cb done_cb, void *done_arg)
+{
+	struct arena *prev = arena_set_current(NULL);
+	int r = http_fetch_async_main(http, loop, urlstr, opt, deadline_msec,
+		done_cb, done_arg);
+	arena_set_current(prev);
+	return r;
+}
+
+static int
+http_fetch_async_main(struct httpclient *http, struct evloop *loop,
+	const char *urlstr, const struct net_opt *opt, uint deadline_msec,
+	httpclient_done_cb done_cb, void *done_arg)
+{
+	const struct diag *diag = http->diag;
+
+	assert(http->state == HTTP_STATE_IDLE);
+
+	if (set_url(http, urlstr) < 0) {
+		return -1;
+	}
+
+	http->opt = opt;
+	http->loop = loop;
+	http->done_cb = done_cb;
+	http->done_arg = done_arg;
+
+	int r = do_connect(http, opt, true);
+	if (r < 0) {
+		Debug(diag, "%s: do_connect failed: %s", __func__,
+			(r == -1 ? strerrno() : "SSL not compiled"));
+		return r;
+	}
+	http->state = HTTP_STATE_CONNECT;
+
+	if (deadline_msec != 0) {
+		http->deadline_id = evloop_add_timer(loop, deadline_msec, 0,
+			http_deadline_cb, http);
+		if (http->deadline_id == 0) {
+			return -1;
+		}
+	}
+	if (http_set_connect_timer(http) == false) {
+		http_unwatch(http);
+		return -1;
+	}
+
+	// 処理はソケットの準備ができてから (done_cb をこの中から呼ばないため)。
+	// すでに接続できていることもあるので、最初は書き込みを待つ。
+	// TCP の接続中なら同じことで、TLS のハンドシェイク中なら
+	// 次の http_step() で待つものが正しく決まる。
+	http_watch(http, EV_WRITE);
+	if (http->fd < 0) {
+		http_unwatch(http);
+		return -1;
+	}
+	return 0;
+}
+
+// urlstr を http->url にセットする。
+// 成功すれば 0、失敗すれば -1 を返す。
+static int
+set_url(struct httpclient *http, const char *urlstr)
+{
+	const struct diag *diag = http->diag;
+
+	http->url = urlinfo_parse(urlstr);
+	if (http->url == NULL) {
+		Debug(diag, "%s: urlinfo_parse failed", __func__);
+		return -1;
+	}
+	if (diag_get_level(diag) >= 2) {
+		string *u = urlinfo_to_string(http->url);
+		diag_print(diag, "%s: initial url |%s|", __func__, string_get(u));
+		string_free(u);
+	}
+	return 0;
+}
+
+// http->url に接続するところまで。net はここで(再)生成する。
+// async なら接続を開始するところまで。
+// 接続できれば (async なら開始できれば) 0 を返す。
 // 失敗すれば errno をセットして -1 を返す。
 // SSL 接続なのに SSL ライブラリが有効でない時は -2 を返す。
 static int
-do_connect(struct httpclient *http, const struct net_opt *opt)
+do_connect(struct httpclient *http, const struct net_opt *opt, bool async)
 {
 	const struct diag *diag = http->diag;
 
+	if (http->net) {
+		net_destroy(http->net);
+	}
+	http->net = net_create(diag);
+	if (http->net == NULL) {
+		Debug(diag, "%s: net_create failed", __func__);
+		return -1;
+	}
+	http->stat_recorded = false;
+
 	const char *scheme = string_get(http->url->scheme);
 	const char *host = string_get(http->url->host);
 	const char *serv = string_get(http->url->port);
@@ -215,7 +332,12 @@ do_connect(struct httpclient *http, const struct net_opt *opt)
 	}
 
 	Trace(diag, "%s: connecting %s://%s:%s", __func__, scheme, host, serv);
-	int r = net_connect(http->net, scheme, host, serv, opt);
+	int r;
+	if (async) {
+		r = net_connect_async(http->net, scheme, host, serv, opt);
+	} else {
+		r = net_connect(http->net, scheme, host, serv, opt);
+	}
 	if (r < 0) {
 		Debug(diag, "%s: %s://%s:%s failed: %s", __func__,
 			scheme, host, serv,
@@ -226,6 +348,29 @@ do_connect(struct httpclient *http, const struct net_opt *opt)
 	return 0;
 }
 
+// リクエストヘッダを送信する。
+// 戻り値は net_write() のもの。
+static int
+send_request(struct httpclient *http)
+{
+	const struct diag *diag = http->diag;
+
+	const char *host = string_get(http->url->host);
+	const char *pqf  = string_get(http->url->pqf);
+	string *hdr = string_init();
+	string_append_printf(hdr, "GET %s HTTP/1.1\r\n", pqf);
+	string_append_printf(hdr, "Host: %s\r\n", host);
+	string_append_cstr(hdr,   "Connection: close\r\n");
+	string_append_printf(hdr, "User-Agent: %s/%s\r\n", progname, progver);
+	string_append_cstr(hdr,   "\r\n");
+	if (__predict_false(diag_get_level(diag) >= 2)) {
+		diag_http_header(http->diag, hdr);	// デバッグ表示
+	}
+	int r = net_write(http->net, string_get(hdr), string_len(hdr));
+	string_free(hdr);
+	return r;
+}
+
 // 送信ヘッダをデバッグ表示する。
 // ログレベルが有効な場合のみ呼ぶこと。
 void
@@ -264,49 +409,76 @@ recv_header(struct httpclient *http)
 {
 	const struct diag *diag = http->diag;
 
-	// 応答の1行目を受信。
-	http->resline = net_gets(http->net);
-	if (http->resline == NULL) {
-		Debug(diag, "%s: %s", __func__, strerrno());
-		return -1;
-	}
-	if (string_len(http->resline) == 0) {
-		Debug(diag, "%s: No HTTP response?", __func__);
-		string_free(http->resline);
-		http->resline = NULL;
-		return -1;
-	}
-	string_rtrim_inplace(http->resline);
-	Trace(diag, "--> |%s|", string_get(http->resline));
-
-	// 残りのヘッダを受信。
 	for (;;) {
-		string *recv;
-
-		recv = net_gets(http->net);
+		string *recv = net_gets(http->net);
 		if (recv == NULL) {
 			Debug(diag, "%s: net_gets failed: %s", __func__, strerrno());
 			return -1;
 		}
-		if (string_len(recv) == 0) {
-			string_free(recv);
+		int r = recv_header_line(http, recv);
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
 			break;
 		}
+	}
 
-		string_rtrim_inplace(recv);
-		Trace(diag, "--> |%s|", string_get(recv));
-		if (string_len(recv) != 0) {
-			// XXX 足りなくなったら無視…
-			if (http->recvhdr_num < countof(http->recvhdr)) {
-				http->recvhdr[http->recvhdr_num++] = recv;
-			} else {
-				string_free(recv);
-			}
+	return parse_resline(http);
+}
+
+// 受信した応答ヘッダ1行 line を処理する。line の所有権はこちらに移る。
+// 続きの行が必要なら 1、ヘッダが終わったら 0 を返す。
+// エラーなら -1 を返す。
+static int
+recv_header_line(struct httpclient *http, string *line)
+{
+	const struct diag *diag = http->diag;
+
+	// 応答の1行目。
+	if (http->resline == NULL) {
+		if (string_len(line) == 0) {
+			Debug(diag, "%s: No HTTP response?", __func__);
+			string_free(line);
+			errno = EIO;
+			return -1;
+		}
+		netstat_mark(net_get_stat(http->net), NETSTAT_TTFB);
+		string_rtrim_inplace(line);
+		Trace(diag, "--> |%s|", string_get(line));
+		http->resline = line;
+		return 1;
+	}
+
+	// 残りのヘッダ。
+	if (string_len(line) == 0) {
+		// EOF
+		string_free(line);
+		return 0;
+	}
+
+	string_rtrim_inplace(line);
+	Trace(diag, "--> |%s|", string_get(line));
+	if (string_len(line) != 0) {
+		// XXX 足りなくなったら無視…
+		if (http->recvhdr_num < countof(http->recvhdr)) {
+			http->recvhdr[http->recvhdr_num++] = line;
 		} else {
-			string_free(recv);
-			break;
+			string_free(line);
 		}
+		return 1;
+	} else {
+		string_free(line);
+		return 0;
 	}
+}
+
+// 応答の1行目をチェックして HTTP 応答コードを返す。
+// エラーなら -1 を返す。
+static int
+parse_resline(struct httpclient *http)
+{
+	const struct diag *diag = http->diag;
 
 	// 1行目を雑にチェックする。
 	// "HTTP/1.1 200 OK\r\n"。
@@ -339,6 +511,308 @@ recv_header(struct httpclient *http)
 	return http->rescode;
 }
 
+// 応答ヘッダを受信し終えた後の処理。code は応答コード。
+// リダイレクトなら http->url を更新して 1 を返すので、
+// 呼び出し側は接続からやり直すこと。
+// 本文を受信できる状態なら 0 を返す。
+// 400 以上なら HTTP のエラーコードを返す。
+static int
+finish_header(struct httpclient *http, int code)
+{
+	const struct diag *diag = http->diag;
+
+	if (300 <= code && code < 400) {
+		const char *location = find_recvhdr(http, "Location:");
+		if (location) {
+			// リダイレクト元への分はここまで。
+			http_record_stat(http);
+
+			struct urlinfo *newurl = urlinfo_parse(location);
+			if (string_len(newurl->scheme) != 0) {
+				// scheme があればフル URL とみなす。
+				urlinfo_free(http->url);
+				http->url = newurl;
+			} else {
+				// そうでなければ相対パスとみなす。
+				urlinfo_update_path(http->url, newurl);
+				urlinfo_free(newurl);
+			}
+			if (diag_get_level(diag) >= 1) {
+				string *u = urlinfo_to_string(http->url);
+				diag_print(diag, "Redirected url |%s|", string_get(u));
+				string_free(u);
+			}
+			// 内部状態をリセット。
+			net_close(http->net);
+			clear_recvhdr(http);
+			string_free(http->resline);
+			http->resline = NULL;
+			http->rescode = 0;
+			http->resmsg = NULL;
+			return 1;
+		}
+	} else if (code >= 400) {
+		return code;
+	}
+
+	const char *transfer = find_recvhdr(http, "Transfer-Encoding:");
+	if (transfer && strcasecmp(transfer, "chunked") == 0) {
+		http->chunked = true;
+	}
+	return 0;
+}
+
+// 非同期取得の処理を、ソケットを待つ必要があるところまで進める。
+static void
+http_step(struct httpclient *http)
+{
+	const struct diag *diag = http->diag;
+	int r;
+
+	for (;;) {
+		switch (http->state) {
+		 case HTTP_STATE_CONNECT:
+			r = net_connect_step(http->net);
+			if (r == 1) {
+				goto wait;
+			}
+			if (r < 0) {
+				Debug(diag, "%s: connect failed: %s", __func__, strerrno());
+				goto fail;
+			}
+			if (http->connect_id != 0) {
+				evloop_del_timer(http->loop, http->connect_id);
+				http->connect_id = 0;
+			}
+			if (send_request(http) < 0) {
+				Debug(diag, "%s: net_write failed: %s", __func__, strerrno());
+				goto fail;
+			}
+			http->state = HTTP_STATE_HEADER;
+			break;
+
+		 case HTTP_STATE_HEADER:
+		 {
+			string *line = net_gets(http->net);
+			if (line == NULL) {
+				if (errno == EAGAIN) {
+					goto wait;
+				}
+				Debug(diag, "%s: net_gets failed: %s", __func__, strerrno());
+				goto fail;
+			}
+			r = recv_header_line(http, line);
+			if (r < 0) {
+				goto fail;
+			}
+			if (r == 1) {
+				break;
+			}
+
+			int code = parse_resline(http);
+			if (code < 0) {
+				goto fail;
+			}
+			r = finish_header(http, code);
+			if (r == 1) {
+				// リダイレクト。接続からやり直す。
+				http_unwatch_fd(http);
+				r = do_connect(http, http->opt, true);
+				if (r < 0) {
+					http_finish(http, r);
+					return;
+				}
+				http->state = HTTP_STATE_CONNECT;
+				if (http_set_connect_timer(http) == false) {
+					goto fail;
+				}
+				break;
+			}
+			if (r != 0) {
+				http_finish(http, r);
+				return;
+			}
+			net_shutdown_half(http->net);
+			http->state = HTTP_STATE_BODY;
+			break;
+		 }
+
+		 case HTTP_STATE_BODY:
+		 {
+			struct bslice slice;
+			r = httpclient_read_slice(http, &slice, HTTP_BODY_READLEN);
+			if (r < 0) {
+				if (errno == EAGAIN) {
+					goto wait;
+				}
+				Debug(diag, "%s: httpclient_read_slice failed: %s",
+					__func__, strerrno());
+				goto fail;
+			}
+			if (r == 0) {
+				Trace(diag, "%s: done (%u slices)", __func__, http->nbody);
+				http_finish(http, 0);
+				return;
+			}
+			if (http_append_body(http, &slice) == false) {
+				bslice_release(&slice);
+				goto fail;
+			}
+			break;
+		 }
+
+		 default:
+			return;
+		}
+	}
+
+ wait:
+	http_watch(http, net_get_want(http->net));
+	return;
+
+ fail:
+	http_finish(http, -1);
+}
+
+// net のソケットを events を待つようイベントループに登録する。
+// リダイレクトでソケットが変わっていたら登録し直す。
+static void
+http_watch(struct httpclient *http, uint events)
+{
+	int fd = net_get_fd(http->net);
+
+	if (http->fd == fd) {
+		evloop_set_fd(http->loop, fd, events);
+		return;
+	}
+	http_unwatch_fd(http);
+	if (fd >= 0) {
+		if (evloop_add_fd(http->loop, fd, events, http_fd_cb, http)) {
+			http->fd = fd;
+		}
+	}
+}
+
+// ソケットをイベントループから外す。
+static void
+http_unwatch_fd(struct httpclient *http)
+{
+	if (http->fd >= 0) {
+		evloop_del_fd(http->loop, http->fd);
+		http->fd = -1;
+	}
+}
+
+// 非同期取得をイベントループから外す。
+static void
+http_unwatch(struct httpclient *http)
+{
+	http_unwatch_fd(http);
+	if (http->deadline_id != 0) {
+		evloop_del_timer(http->loop, http->deadline_id);
+		http->deadline_id = 0;
+	}
+	if (http->connect_id != 0) {
+		evloop_del_timer(http->loop, http->connect_id);
+		http->connect_id = 0;
+	}
+}
+
+// 接続の期限のタイマーを (再) 設定する。
+// opt->timeout_msec が 0 なら何もしない。
+// タイマーを登録できなければ false を返す。
+static bool
+http_set_connect_timer(struct httpclient *http)
+{
+	if (http->connect_id != 0) {
+		evloop_del_timer(http->loop, http->connect_id);
+		http->connect_id = 0;
+	}
+	if (http->opt->timeout_msec != 0) {
+		http->connect_id = evloop_add_timer(http->loop,
+			http->opt->timeout_msec, 0, http_connect_timeout_cb, http);
+		if (http->connect_id == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// 非同期取得を終了して、完了コールバックを呼ぶ。
+// code は done_cb に渡す値。
+static void
+http_finish(struct httpclient *http, int code)
+{
+	int saved_errno = errno;
+
+	http_unwatch(http);
+	http->state = HTTP_STATE_DONE;
+	if (code == 0) {
+		http->collected = true;
+	}
+
+	errno = saved_errno;
+	if (http->done_cb) {
+		http->done_cb(http, code, http->done_arg);
+	}
+}
+
+static void
+http_fd_cb(struct evloop *loop, int fd, uint revents, void *arg)
+{
+	struct httpclient *http = (struct httpclient *)arg;
+
+	// 応答行やヘッダも取得が終わるまで持つのでヒープに置く。
+	struct arena *prev = arena_set_current(NULL);
+	http_step(http);
+	arena_set_current(prev);
+}
+
+static void
+http_deadline_cb(struct evloop *loop, void *arg)
+{
+	struct httpclient *http = (struct httpclient *)arg;
+
+	// 1回きりのタイマーなのでもう削除されている。
+	http->deadline_id = 0;
+
+	Debug(http->diag, "%s: timed out", __func__);
+	errno = ETIMEDOUT;
+	http_finish(http, -1);
+}
+
+static void
+http_connect_timeout_cb(struct evloop *loop, void *arg)
+{
+	struct httpclient *http = (struct httpclient *)arg;
+
+	// 1回きりのタイマーなのでもう削除されている。
+	http->connect_id = 0;
+
+	Debug(http->diag, "%s: connection timed out", __func__);
+	errno = ETIMEDOUT;
+	http_finish(http, -1);
+}
+
+// 受信した本文のスライスを末尾に追加する。
+// スライスの参照はこちらに移る。
+static bool
+http_append_body(struct httpclient *http, const struct bslice *sp)
+{
+	if (http->nbody == http->bodycap) {
+		uint newcap = http->bodycap ? http->bodycap * 2 : 16;
+		struct bslice *newbody =
+			realloc(http->body, sizeof(*newbody) * newcap);
+		if (newbody == NULL) {
+			return false;
+		}
+		http->body = newbody;
+		http->bodycap = newcap;
+	}
+	http->body[http->nbody++] = *sp;
+	return true;
+}
+
 // 受信ヘッダからヘッダ名 key (":" を含むこと) に対応する値を返す。
 // 戻り値は http->recvhdr 内を指しているので解放不要。
 // 見付からなければ NULL を返す。
@@ -378,72 +852,122 @@ httpclient_get_resmsg(const struct httpclient *http)
 	return http->resmsg;
 }
 
-// ストリームを返す。
-// httpclient_connect() が成功した場合のみ有効。
-// 受け取った fp は fclose() すること。
-FILE *
-httpclient_fopen(struct httpclient *http)
+// 本文を読み込むピークストリームを返す。
+// httpclient_connect() が成功した場合か、
+// httpclient_fetch_async() が成功で完了した場合のみ有効。
+// 受信バッファからコピーせずに読み込む。
+// 受け取った pstream は pstream_cleanup() すること。
+struct pstream *
+httpclient_open_pstream(struct httpclient *http)
 {
-	FILE *fp;
-
-	const char *transfer = find_recvhdr(http, "Transfer-Encoding:");
-	if (transfer && strcasecmp(transfer, "chunked") == 0) {
-		fp = funopen(http, http_chunk_read_cb, NULL, NULL, NULL);
-		if (fp == NULL) {
-			Debug(http->diag, "%s: funopen(chunk) failed: %s", __func__,
-				strerrno());
-			return NULL;
-		}
-	} else {
-		fp = funopen(http, http_net_read_cb, NULL, NULL, NULL);
-		if (fp == NULL) {
-			Debug(http->diag, "%s: funopen(net) failed: %s", __func__,
-				strerrno());
-			return NULL;
-		}
-	}
-	return fp;
+	return pstream_init_slice(http_slice_cb, http);
 }
 
 static int
-http_net_read_cb(void *arg, char *dst, int dstsize)
+http_slice_cb(void *arg, struct bslice *sp, uint maxlen)
 {
 	struct httpclient *http = (struct httpclient *)arg;
-	int n = net_read(http->net, dst, dstsize);
-	return n;
+	return httpclient_read_slice(http, sp, maxlen);
 }
 
-static int
-http_chunk_read_cb(void *arg, char *dst, int dstsize)
+// 本文を最大 maxlen バイト受信して、受信バッファを指すスライスを sp に
+// 返す。チャンク形式ならチャンクヘッダを取り除いた本文部分だけを返す。
+// httpclient_connect() が成功した場合か、
+// httpclient_fetch_async() が成功で完了した場合のみ有効。
+// sp は使い終わったら bslice_release() すること。
+// 受信したバイト数を返す。本文の終わりなら 0 を返す。
+// 失敗すれば errno をセットして -1 を返す。
+int
+httpclient_read_slice(struct httpclient *http, struct bslice *sp, uint maxlen)
 {
-	struct httpclient *http = (struct httpclient *)arg;
 	const struct diag *diag = http->diag;
 
-	Verbose(diag, "%s(%d)", __func__, dstsize);
+	// 非同期取得で受信済みならそれを順に返す。
+	if (http->collected) {
+		if (http->bodypos == http->nbody) {
+			memset(sp, 0, sizeof(*sp));
+			return 0;
+		}
+		struct bslice *b = &http->body[http->bodypos];
+		if (b->len <= maxlen) {
+			// 参照ごと渡す。
+			*sp = *b;
+			memset(b, 0, sizeof(*b));
+			http->bodypos++;
+		} else {
+			bslice_set(sp, b->block, b->ptr, maxlen);
+			bslice_advance(b, maxlen);
+		}
+		return sp->len;
+	}
+
+	if (http->chunked == false) {
+		int n = net_read_slice(http->net, sp, maxlen);
+		if (n == 0) {
+			http_record_stat(http);
+		}
+		return n;
+	}
+
+	memset(sp, 0, sizeof(*sp));
+
+	// 前のチャンク末尾の CRLF を読み捨てる。
+	// ノンブロッキングだと読めないことがあるので、次のチャンクヘッダを
+	// 読む直前のここで行う。
+	if (http->chunk_crlf) {
+		string *dummy = net_gets(http->net);
+		if (dummy == NULL) {
+			return -1;
+		}
+		string_free(dummy);
+		http->chunk_crlf = false;
+	}
 
-	// バッファが空なら次のチャンクを読み込む。
-	if (http->chunk_pos == http->chunk_len) {
-		Verbose(diag, "%s Need to fill", __func__);
-		int r = read_chunk(http);
-		Verbose(diag, "%s read_chunk filled %d", __func__, r);
+	// 現在のチャンクを読み終えていたら次のチャンクヘッダを読む。
+	if (http->chunk_remain == 0) {
+		if (http->chunk_eof) {
+			http_record_stat(http);
+			return 0;
+		}
+		int r = read_chunk_header(http);
+		Verbose(diag, "%s read_chunk_header %d", __func__, r);
 		if (__predict_false(r < 1)) {
+			if (r == 0) {
+				http_record_stat(http);
+			}
 			return r;
 		}
 	}
 
-	// バッファから dst に入るだけコピー。
-	uint copylen = MIN(http->chunk_len - http->chunk_pos, dstsize);
-	Verbose(diag, "%s copylen=%d", __func__, copylen);
-	memcpy(dst, http->chunk_buf + http->chunk_pos, copylen);
-	http->chunk_pos += copylen;
-	return copylen;
+	int n = net_read_slice(http->net, sp, MIN(maxlen, http->chunk_remain));
+	if (__predict_false(n < 0)) {
+		if (errno != EAGAIN) {
+			Debug(diag, "%s: net_read_slice failed: %s", __func__,
+				strerrno());
+		}
+		return -1;
+	}
+	if (__predict_false(n == 0)) {
+		Debug(diag, "%s: Unexpected EOF (remain=%u)", __func__,
+			http->chunk_remain);
+		errno = EIO;
+		return -1;
+	}
+	http->chunk_remain -= n;
+	Verbose(diag, "%s read=%d remain=%u", __func__, n, http->chunk_remain);
+
+	if (http->chunk_remain == 0) {
+		// チャンク末尾の CRLF は次回読み捨てる。
+		http->chunk_crlf = true;
+	}
+	return n;
 }
 
-// 1つのチャンクを読み込む。
-// 成功すれば読み込んだバイト数を返す。
+// チャンクヘッダを読み込む。
+// 成功すれば、このチャンクの長さを返す。最後のチャンクなら 0 を返す。
 // 失敗すれば errno をセットして -1 を返す。
 static int
-read_chunk(struct httpclient *http)
+read_chunk_header(struct httpclient *http)
 {
 	const struct diag *diag = http->diag;
 	int chunklen = -1;
@@ -451,12 +975,15 @@ read_chunk(struct httpclient *http)
 	// 先頭行はチャンク長 + CRLF。
 	string *slen = net_gets(http->net);
 	if (__predict_false(slen == NULL)) {
-		Debug(diag, "%s: %s", __func__, strerrno());
+		if (errno != EAGAIN) {
+			Debug(diag, "%s: %s", __func__, strerrno());
+		}
 		return -1;
 	}
 	if (__predict_false(string_len(slen) == 0)) {
 		Debug(diag, "%s: Unexpected EOF while reading chunk length?", __func__);
 		chunklen = 0;
+		http->chunk_eof = true;
 		goto done;
 	}
 
@@ -483,55 +1010,33 @@ read_chunk(struct httpclient *http)
 		// データ終わり。CRLF を読み捨てる。
 		string *dummy = net_gets(http->net);
 		string_free(dummy);
-		Verbose(diag, "%s: This wa sthe last chunk.", __func__);
-		goto done;
-	}
-
-	// チャンク本体を読み込む。
-	if (chunklen > http->chunk_cap) {
-		uint8 *newbuf = realloc(http->chunk_buf, chunklen);
-		if (newbuf == NULL) {
-			Debug(diag, "%s: realloc failed: %s", __func__, strerrno());
-			chunklen = -1;
-			goto done;
-		}
-		http->chunk_buf = newbuf;
-		http->chunk_cap = chunklen;
-		Verbose(diag, "%s realloc %u", __func__, http->chunk_cap);
-	}
-	int readlen = 0;
-	while (readlen < chunklen) {
-		int r;
-		r = net_read(http->net, http->chunk_buf + readlen, chunklen - readlen);
-		if (r < 0) {
-			Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
-			chunklen = -1;
-			goto done;
-		}
-		if (r == 0) {
-			break;
-		}
-		readlen += r;
-		Verbose(diag, "read=%d readlen=%d", r, readlen);
-	}
-	if (__predict_false(readlen != chunklen)) {
-		Debug(diag, "%s: readlen=%d chunklen=%d", __func__, readlen, chunklen);
-		errno = EIO;
-		chunklen = -1;
+		Verbose(diag, "%s: This was the last chunk.", __func__);
+		http->chunk_eof = true;
 		goto done;
 	}
-	http->chunk_len = readlen;
-	http->chunk_pos = 0;
-
-	// 最後の CRLF を読み捨てる。
-	string *dummy = net_gets(http->net);
-	string_free(dummy);
+	http->chunk_remain = chunklen;
 
  done:
 	string_free(slen);
 	return chunklen;
 }
 
+// 現在のコネクションの計測値を統計に記録する (1コネクションにつき1回)。
+// 本文の終わりか、途中で止めた時 (破棄やリダイレクト) に呼ぶ。
+static void
+http_record_stat(struct httpclient *http)
+{
+	if (http->net == NULL || http->stat_recorded) {
+		return;
+	}
+
+	struct netstat_req *st = net_get_stat(http->net);
+	if ((st->done & (1U << NETSTAT_TTFB))) {
+		netstat_mark(st, NETSTAT_BODY);
+	}
+	netstat_record(http->diag, string_get(http->url->host), st);
+	http->stat_recorded = true;
+}
 
 #if defined(TEST)
 
@@ -571,6 +1076,70 @@ testhttp(const struct diag *diag, int ac, char *av[])
 	return 0;
 }
 
+static uint async_remain;
+
+static void
+testasync_done(struct httpclient *http, int code, void *arg)
+{
+	const char *url = (const char *)arg;
+	struct bslice slice;
+	uint total = 0;
+
+	if (code == 0) {
+		while (httpclient_read_slice(http, &slice, 65536) > 0) {
+			total += slice.len;
+			bslice_release(&slice);
+		}
+		printf("%s: %u bytes\n", url, total);
+	} else if (code < 0) {
+		printf("%s: %s\n", url, strerrno());
+	} else {
+		printf("%s: HTTP %u %s\n", url, code, httpclient_get_resmsg(http));
+	}
+	async_remain--;
+}
+
+// 引数の URL を全部同時に取得する。
+static int
+testasync(const struct diag *diag, int ac, char *av[])
+{
+	struct httpclient *http[ac];
+	struct net_opt netopt;
+	struct evloop *loop;
+
+	net_opt_init(&netopt);
+	loop = evloop_create(diag);
+	if (loop == NULL) {
+		err(1, "%s: evloop_create failed", __func__);
+	}
+
+	for (int i = 2; i < ac; i++) {
+		http[i] = httpclient_create(diag);
+		if (http[i] == NULL) {
+			err(1, "%s: http_create failed", __func__);
+		}
+		int r = httpclient_fetch_async(http[i], loop, av[i], &netopt,
+			30 * 1000, testasync_done, av[i]);
+		if (r < 0) {
+			warn("%s: %s", __func__, av[i]);
+			continue;
+		}
+		async_remain++;
+	}
+
+	while (async_remain > 0) {
+		if (evloop_run_once(loop, -1) < 0) {
+			err(1, "%s: evloop_run_once failed", __func__);
+		}
+	}
+
+	for (int i = 2; i < ac; i++) {
+		httpclient_destroy(http[i]);
+	}
+	evloop_destroy(loop);
+	return 0;
+}
+
 int
 main(int ac, char *av[])
 {
@@ -582,9 +1151,14 @@ main(int ac, char *av[])
 	if (ac == 3 && strcmp(av[1], "http") == 0) {
 		return testhttp(diag, ac, av);
 	}
+	if (ac >= 3 && strcmp(av[1], "async") == 0) {
+		return testasync(diag, ac, av);
+	}
 
 	printf("usage: %s http <url> ... HTTP/HTTPS client\n",
 		getprogname());
+	printf("       %s async <url>... ... fetch URLs concurrently\n",
+		getprogname());
 	return 0;
 }
 #endif // TEST
@@ -149,6 +149,9 @@ static inline void set_err_asr(ColorRGBint16 *, int, const ColorRGBint32 *,
 static inline uint8 saturate_uint8(int);
 static inline int16 saturate_adderr(int16, int);
 
+static void image_scaler_flush(struct image_scaler *);
+static int  image_match_signature(const uint8 *, uint);
+
 static const ColorRGB palette_fixed8[];
 static const ColorRGB palette_vga16[];
 
@@ -391,6 +394,37 @@ image_get_preferred_size(
 	}
 }
 
+// 幅 width, 高さ height の画像をローダが hint に従って読み込む時の
+// 出力サイズを *widthp, *heightp に返す。
+// ローダでは縮小だけ行い、拡大が必要なら元のサイズのまま (後段に任せる)。
+// 縮小する場合は true を返す。
+bool
+image_get_read_size(uint width, uint height, const image_read_hint *hint,
+	uint *widthp, uint *heightp)
+{
+	uint pref_width;
+	uint pref_height;
+
+	*widthp = width;
+	*heightp = height;
+	if (hint->width == 0 && hint->height == 0) {
+		return false;
+	}
+
+	image_get_preferred_size(width, height,
+		hint->axis, hint->width, hint->height,
+		&pref_width, &pref_height);
+	if (pref_width == 0 || pref_width >= width ||
+		pref_height == 0 || pref_height >= height)
+	{
+		return false;
+	}
+
+	*widthp = pref_width;
+	*heightp = pref_height;
+	return true;
+}
+
 // ローダごとにサポートしているファイル形式をビットマップフラグにしたもの。
 #define LOADERMAP_bmp	(1U << IMAGE_LOADER_BMP)
 #define LOADERMAP_gif	(1U << IMAGE_LOADER_GIF)
@@ -418,25 +452,29 @@ image_get_preferred_size(
 // サポートしているローダ。処理順に並べること。
 static const struct {
 	image_match_t match;
-	image_read_t  read;
+	image_read_t  read;		// FILE* から読み込むローダ
+	image_read_ps_t read_ps;	// pstream から直接読み込むローダ
 	const char *libname;	// image_get_loaderinfo() で表示する名前
 	const char *name;		// マクロ展開用とデバッグログとかで使う短縮名
 	uint32 supported;		// このローダがサポートしている画像形式
 } loader[] = {
 #define ENTRY(name, libname, map)	\
-	{ image_##name##_match, image_##name##_read, \
+	{ image_##name##_match, image_##name##_read, NULL, \
+	  #libname, #name, map }
+#define ENTRY_PS(name, libname, map)	\
+	{ image_##name##_match, NULL, image_##name##_read, \
 	  #libname, #name, map }
 #if defined(USE_LIBWEBP)
-	ENTRY(webp, libwebp, LOADERMAP_webp),
+	ENTRY_PS(webp, libwebp, LOADERMAP_webp),
 #endif
 #if defined(USE_LIBJPEG)
 	ENTRY(jpeg, libjpeg, LOADERMAP_jpeg),
 #endif
 #if defined(USE_LIBJXL)
-	ENTRY(jxl, libjxl, LOADERMAP_jxl),
+	ENTRY_PS(jxl, libjxl, LOADERMAP_jxl),
 #endif
 #if defined(USE_LIBPNG)
-	ENTRY(png, libpng, LOADERMAP_png),
+	ENTRY_PS(png, libpng, LOADERMAP_png),
 #endif
 #if defined(USE_GIFLIB)
 	ENTRY(gif, giflib, LOADERMAP_gif),
@@ -466,9 +504,41 @@ static const struct {
 	ENTRY(ypic, builtin, LOADERMAP_ypic),
 #endif
 #if defined(USE_STB_IMAGE)
-	ENTRY(stb, stb_image, LOADERMAP_stb),
+	ENTRY_PS(stb, stb_image, LOADERMAP_stb),
 #endif
 #undef ENTRY
+#undef ENTRY_PS
+};
+
+// 先頭のシグネチャと画像形式 (IMAGE_LOADER_*) の対応。
+// sig の '?' の位置は比較しない。
+// ここで決まらなければ各ローダの match 関数で判定する。
+static const struct {
+	uint type;
+	uint len;
+	const char *sig;
+} signatures[] = {
+	{ IMAGE_LOADER_PNG,		8,	"\x89PNG\r\n\x1a\n" },
+	{ IMAGE_LOADER_JPEG,	2,	"\xff\xd8" },
+	{ IMAGE_LOADER_WEBP,	12,	"RIFF????WEBP" },
+	{ IMAGE_LOADER_GIF,		4,	"GIF8" },
+	{ IMAGE_LOADER_JXL,		2,	"\xff\x0a" },
+	{ IMAGE_LOADER_JXL,		12,	"\0\0\0\x0cJXL \r\n\x87\n" },
+	{ IMAGE_LOADER_BMP,		2,	"BM" },
+	{ IMAGE_LOADER_TIFF,	4,	"II*\0" },
+	{ IMAGE_LOADER_TIFF,	4,	"MM\0*" },
+	{ IMAGE_LOADER_TIFF,	4,	"II+\0" },	// BigTIFF
+	{ IMAGE_LOADER_TIFF,	4,	"MM\0+" },	// BigTIFF
+	{ IMAGE_LOADER_PNM5,	2,	"P5" },
+	{ IMAGE_LOADER_PNM6,	2,	"P6" },
+	{ IMAGE_LOADER_PNM1,	2,	"P1" },
+	{ IMAGE_LOADER_PNM2,	2,	"P2" },
+	{ IMAGE_LOADER_PNM3,	2,	"P3" },
+	{ IMAGE_LOADER_PNM4,	2,	"P4" },
+	{ IMAGE_LOADER_ICO,		4,	"\0\0\1\0" },
+	{ IMAGE_LOADER_ICO,		4,	"\0\0\2\0" },	// CUR
+	{ IMAGE_LOADER_MAG,		8,	"MAKI02  " },
+	{ IMAGE_LOADER_YPIC,	3,	"PIC" },
 };
 
 // サポートしているローダの一覧を返す。
@@ -516,6 +586,40 @@ image_get_loaderinfo(void)
 	return dst;
 }
 
+// 先頭 len バイトの head をシグネチャ表と照合して、その画像形式を
+// サポートしている最初のローダ種別を返す。
+// 決まらなければ -1 を返す。
+static int
+image_match_signature(const uint8 *head, uint len)
+{
+	for (uint i = 0; i < countof(signatures); i++) {
+		const uint8 *sig = (const uint8 *)signatures[i].sig;
+		uint siglen = signatures[i].len;
+		if (len < siglen) {
+			continue;
+		}
+
+		uint j;
+		for (j = 0; j < siglen; j++) {
+			if (sig[j] != '?' && sig[j] != head[j]) {
+				break;
+			}
+		}
+		if (j < siglen) {
+			continue;
+		}
+
+		// この形式をサポートしているローダを処理順に探す。
+		uint32 map = 1U << signatures[i].type;
+		for (uint n = 0; n < countof(loader); n++) {
+			if ((loader[n].supported & map) != 0) {
+				return n;
+			}
+		}
+	}
+	return -1;
+}
+
 // pstream の画像形式を判定する。
 // 判定出来れば非負のローダ種別を返す。これは image_read() に渡すのに使う。
 // 判定出来なければ -1 を返す。
@@ -524,8 +628,24 @@ int
 image_match(struct pstream *ps, const struct diag *diag)
 {
 	FILE *fp;
+	uint8 head[16];
 	int type = -1;
 
+	// まず先頭のシグネチャで判定する。
+	// ほとんどの画像はここで決まるので、FILE* を作って各ローダの
+	// match 関数を順に呼ぶ必要はない。
+	int n = pstream_peek(ps, head, sizeof(head));
+	if (n < 0) {
+		Debug(diag, "pstream_peek() failed: %s", strerrno());
+		return -1;
+	}
+	type = image_match_signature(head, n);
+	if (type >= 0) {
+		Trace(diag, "%s: signature matched %s", __func__, loader[type].name);
+		return type;
+	}
+
+	// 決まらなければ各ローダの match 関数で判定する。
 	fp = pstream_open_for_peek(ps);
 	if (fp == NULL) {
 		Debug(diag, "pstream_open_for_peek() failed");
@@ -556,8 +676,9 @@ image_match(struct pstream *ps, const struct diag *diag)
 
 // pstream から画像を読み込んで image を作成して返す。
 // type は image_match() で返されたローダ種別。
-// axis, width, height はリサイズ用のヒントで、これを使うかどうかは
-// 画像ローダによる (今の所 jpeg のみ)。
+// hint の axis, width, height はリサイズ用のヒントで、これを使うかどうかは
+// 画像ローダによる (JPEG, PNG, TIFF, WebP, JPEG XL, stb_image は
+// 読み込みながら縮小する)。
 // デコードに失敗すると NULL を返す。
 struct image *
 image_read(struct pstream *ps, int type, const image_read_hint *hint,
@@ -565,6 +686,11 @@ image_read(struct pstream *ps, int type, const image_read_hint *hint,
 {
 	FILE *fp;
 
+	// メモリ上のデータを受け付けるローダにはスライスのまま渡す。
+	if (loader[type].read_ps) {
+		return loader[type].read_ps(ps, hint, diag);
+	}
+
 	fp = pstream_open_for_read(ps);
 	if (fp == NULL) {
 		Debug(diag, "%s: pstream_open_for_read() failed", __func__);
@@ -576,6 +702,23 @@ image_read(struct pstream *ps, int type, const image_read_hint *hint,
 	return img;
 }
 
+// pstream から読み込むローダ read_ps で fp の現在位置から読み込む。
+// BMP や ICO に埋め込まれた PNG などを読み込むのに使う。
+struct image *
+image_read_fp(FILE *fp, image_read_ps_t read_ps, const image_read_hint *hint,
+	const struct diag *diag)
+{
+	struct pstream *ps = pstream_init_fp(fp);
+	if (ps == NULL) {
+		Debug(diag, "%s: pstream_init_fp() failed", __func__);
+		return NULL;
+	}
+	struct image *img = read_ps(ps, hint, diag);
+	pstream_cleanup(ps);
+
+	return img;
+}
+
 // 入力画像を 16bit 内部形式にインプレース変換する。
 void
 image_convert_to16(struct image *img)
@@ -614,6 +757,156 @@ image_convert_to16(struct image *img)
 	img->format = IMAGE_FMT_ARGB16;
 }
 
+//
+// ラスター単位の縮小
+//
+
+// ラスターを1本ずつ受け取りながら dst_width x dst_height に縮小 (平均画素法)
+// した ARGB16 画像を作る準備をする。
+// 入力は src_width x src_height で、形式 src_format は RGB24 か ARGB32。
+// 出力サイズは入力サイズ以下であること (同じなら形式変換のみ)。
+// 失敗すれば false を返す。
+bool
+image_scaler_init(struct image_scaler *sc, uint src_width, uint src_height,
+	uint src_format, uint dst_width, uint dst_height)
+{
+	assert(src_format == IMAGE_FMT_RGB24 || src_format == IMAGE_FMT_ARGB32);
+	assert(0 < dst_width  && dst_width  <= src_width);
+	assert(0 < dst_height && dst_height <= src_height);
+
+	memset(sc, 0, sizeof(*sc));
+	sc->srcwidth  = src_width;
+	sc->srcheight = src_height;
+	sc->srcfmt    = src_format;
+
+	sc->img = image_create(dst_width, dst_height, IMAGE_FMT_ARGB16);
+	if (sc->img == NULL) {
+		goto abort;
+	}
+	sc->img->has_alpha = (src_format == IMAGE_FMT_ARGB32);
+
+	sc->xmap = malloc(sizeof(sc->xmap[0]) * src_width);
+	sc->xcount = calloc(dst_width, sizeof(sc->xcount[0]));
+	sc->acc = calloc(dst_width * 4, sizeof(sc->acc[0]));
+	if (sc->xmap == NULL || sc->xcount == NULL || sc->acc == NULL) {
+		goto abort;
+	}
+
+	// 入力の各 X 座標がどの出力ピクセルに入るか。
+	for (uint x = 0; x < src_width; x++) {
+		uint dx = (uint64)x * dst_width / src_width;
+		sc->xmap[x] = dx;
+		sc->xcount[dx]++;
+	}
+	return true;
+
+ abort:
+	image_scaler_cleanup(sc);
+	return false;
+}
+
+// 入力ラスターを1本 (上から順に) 追加する。
+// 出力ラスター1本分が揃ったところでそれを書き出す。
+void
+image_scaler_put(struct image_scaler *sc, const uint8 *src)
+{
+	uint64 *acc = sc->acc;
+
+	assert(sc->srcy < sc->srcheight);
+
+	if (sc->srcfmt == IMAGE_FMT_ARGB32) {
+		// 透明なピクセルの色が混ざらないよう A で重み付けする。
+		// ただし全部透明の場合も色は必要なので重みは A + 1 にしておく。
+		for (uint x = 0; x < sc->srcwidth; x++) {
+			uint64 *d = &acc[sc->xmap[x] * 4];
+			uint a = src[3];
+			uint w = a + 1;
+			d[0] += src[0] * w;
+			d[1] += src[1] * w;
+			d[2] += src[2] * w;
+			d[3] += a;
+			src += 4;
+		}
+	} else {
+		for (uint x = 0; x < sc->srcwidth; x++) {
+			uint64 *d = &acc[sc->xmap[x] * 4];
+			d[0] += src[0];
+			d[1] += src[1];
+			d[2] += src[2];
+			src += 3;
+		}
+	}
+	sc->rows++;
+	sc->srcy++;
+
+	// 次の入力ラスターが別の出力ラスターに入るならここで書き出す。
+	if (sc->srcy == sc->srcheight ||
+		(uint64)sc->srcy * sc->img->height / sc->srcheight != sc->dsty)
+	{
+		image_scaler_flush(sc);
+	}
+}
+
+// 溜まっている分を出力ラスター1本として書き出す。
+static void
+image_scaler_flush(struct image_scaler *sc)
+{
+	struct image *img = sc->img;
+	uint16 *d = (uint16 *)img->buf + sc->dsty * img->width;
+	const uint64 *acc = sc->acc;
+
+	for (uint x = 0; x < img->width; x++, acc += 4) {
+		uint64 n = (uint64)sc->xcount[x] * sc->rows;
+		uint16 v;
+
+		if (sc->srcfmt == IMAGE_FMT_ARGB32) {
+			uint64 a = acc[3];
+			uint64 w = a + n;
+			v = RGB888_to_ARGB16(acc[0] / w, acc[1] / w, acc[2] / w);
+			// A(不透明度)の平均が半分以下なら透明(0x8000)とする。
+			if (a < n * 0x80) {
+				v |= 0x8000;
+			}
+		} else {
+			v = RGB888_to_ARGB16(acc[0] / n, acc[1] / n, acc[2] / n);
+		}
+		*d++ = v;
+	}
+
+	memset(sc->acc, 0, sizeof(sc->acc[0]) * img->width * 4);
+	sc->rows = 0;
+	sc->dsty++;
+}
+
+// 出来上がった画像を返す。画像の所有権は呼び出し側に移る。
+// 入力ラスターが全部揃っていなければ NULL を返す。
+struct image *
+image_scaler_finish(struct image_scaler *sc)
+{
+	struct image *img = NULL;
+
+	if (sc->img != NULL && sc->srcy == sc->srcheight) {
+		img = sc->img;
+		sc->img = NULL;
+	}
+	image_scaler_cleanup(sc);
+	return img;
+}
+
+// sc の資源を解放する。何度呼んでもよい。
+void
+image_scaler_cleanup(struct image_scaler *sc)
+{
+	image_free(sc->img);
+	sc->img = NULL;
+	free(sc->xmap);
+	sc->xmap = NULL;
+	free(sc->xcount);
+	sc->xcount = NULL;
+	free(sc->acc);
+	sc->acc = NULL;
+}
+
 // src 画像を (dst_width, dst_height) にリサイズしながら同時に
 // colormode に減色した新しい image を作成して返す。
 // 適応パレット(COLOR_MODE_ADAPTIVE) なら、デバッグ表示用に
@@ -247,7 +247,7 @@ struct image
 // image_read() に対するヒント。
 typedef struct image_read_hint_ {
 	// 必要な読み込みサイズ。
-	// 通常のラスター形式の画像では意味を持たない。
+	// ローダはこのサイズまで (拡大はせず) 縮小しながら読み込んでよい。
 	// プログレッシブ画像 (で no_progressive == true でない) なら、
 	// このサイズを満たしたところで早期終了してもよい。
 	// Blurhash はこの hint を使わない。
@@ -36,7 +36,19 @@
 #include <string.h>
 #include <math.h>
 
-#define L2SRGBSIZE	(64)
+// リニアから sRGB への変換表の大きさ (2^L2SRGBBITS)。
+#define L2SRGBBITS	(6)
+#define L2SRGBSIZE	(1U << L2SRGBBITS)
+
+// 高速版で内部グリッドを作る際の、1コンポーネントあたりの標本数。
+// Blurhash は最大でも (9-1)/2 周期の余弦の重ね合わせなので、
+// これくらいあればリニアで直線補間した差は sRGB 変換表の1段程度に収まる。
+#define BLURHASH_GRID	(8)
+
+// 高速版の固定小数点。
+#define BASE_SHIFT	(14)	// 基底 (-1..1)
+#define VALUE_SHIFT	(12)	// 色 (リニア)
+#define ROUND		(1 << (BASE_SHIFT - 1))
 
 struct colorf {
 	float r;
@@ -44,12 +56,30 @@ struct colorf {
 	float b;
 };
 
+// デコードしたパラメータ。
+struct blurhash {
+	uint compx;
+	uint compy;
+	uint width;				// 出力画像の幅
+	uint height;			// 出力画像の高さ
+	struct colorf *values;	// [compy][compx]
+};
+
+static struct image *image_blurhash_read_common(FILE *, int, int, bool,
+	const struct diag *);
+static bool blurhash_decode(struct blurhash *, const string *, int, int,
+	const struct diag *);
+static bool blurhash_render_exact(struct image *, const struct blurhash *);
+static bool blurhash_render_fast(struct image *, const struct blurhash *);
+static int32 *blurhash_grid_bases(uint, uint, uint);
+static void blurhash_upscale(struct image *, const int32 *, uint, uint);
 static uint decode83(const char *, uint, uint);
 static void decode_dc(struct colorf *, uint);
 static float decode_acq(uint);
 static float decode_maxac(int);
 static float srgb2linear(int);
 static uint linear2srgb(float);
+static inline uint linear2srgb_fixed(int32);
 static float *bases_for(uint, uint);
 
 static const uint8 table_L2SRGB[L2SRGBSIZE];
@@ -58,27 +88,73 @@ static const uint8 table_base83[0x60];
 // bw, bh は出力サイズ指定。指定方法は2通りあり、
 // 正数ならそのままピクセルサイズ、
 // 負数なら (符号を取り除いて) コンポーネントの倍率を示す。0 は不正。
+// Blurhash は滑らかなので、小さい内部グリッドで展開してから
+// 出力サイズに直線補間する。
 struct image *
 image_blurhash_read(FILE *fp, int bw, int bh, const struct diag *diag)
 {
+	return image_blurhash_read_common(fp, bw, bh, false, diag);
+}
+
+// 全ピクセルで基底を評価し、sRGB への変換も表を使わずに計算する厳密版。
+// 引数は image_blurhash_read() と同じ。精度の比較用。
+struct image *
+image_blurhash_read_exact(FILE *fp, int bw, int bh, const struct diag *diag)
+{
+	return image_blurhash_read_common(fp, bw, bh, true, diag);
+}
+
+static struct image *
+image_blurhash_read_common(FILE *fp, int bw, int bh, bool exact,
+	const struct diag *diag)
+{
+	struct blurhash ctx;
 	string *s;
-	const char *src;
-	uint width;
-	uint height;
-	float maxvalue;
-	struct colorf *v;
 	struct image *img = NULL;
-	struct colorf *values = NULL;
-	float *bases_x = NULL;
-	float *bases_y = NULL;
 	bool success = false;
 
+	memset(&ctx, 0, sizeof(ctx));
+
 	s = string_fgets(fp);
 	if (s == NULL) {
 		return NULL;
 	}
 	string_rtrim_inplace(s);
-	src = string_get(s);
+
+	if (blurhash_decode(&ctx, s, bw, bh, diag) == false) {
+		goto abort;
+	}
+
+	img = image_create(ctx.width, ctx.height, IMAGE_FMT_RGB24);
+	if (img == NULL) {
+		goto abort;
+	}
+
+	if (exact) {
+		success = blurhash_render_exact(img, &ctx);
+	} else {
+		success = blurhash_render_fast(img, &ctx);
+	}
+
+ abort:
+	free(ctx.values);
+	string_free(s);
+	if (success == false) {
+		image_free(img);
+		img = NULL;
+	}
+	return img;
+}
+
+// Blurhash 文字列 s をデコードして ctx に格納する。
+// 成功すれば true を返す。ctx->values は呼び出し側で解放すること。
+static bool
+blurhash_decode(struct blurhash *ctx, const string *s, int bw, int bh,
+	const struct diag *diag)
+{
+	const char *src = string_get(s);
+	float maxvalue;
+	struct colorf *v;
 
 	uint comp = decode83(src, 0, 1);
 	uint compx = (comp % 9) + 1;
@@ -89,51 +165,50 @@ image_blurhash_read(FILE *fp, int bw, int bh, const struct diag *diag)
 	uint datalen = compx * compy * 2 + 4;
 	if (srclen < datalen) {
 		Debug(diag, "%s: too short (%u < %u)", __func__, srclen, datalen);
-		goto abort;
+		return false;
 	}
 
 	// 作成する画像サイズ。
 	if (bw > 0) {
-		width = bw;
+		ctx->width = bw;
 	} else if (bw < 0) {
-		width = compx * -bw;
+		ctx->width = compx * -bw;
 	} else {
 		Debug(diag, "%s: bw == 0 is invalid", __func__);
 		errno = EINVAL;
-		goto abort;
+		return false;
 	}
 	if (bh > 0) {
-		height = bh;
+		ctx->height = bh;
 	} else if (bh < 0) {
-		height = compy * -bh;
+		ctx->height = compy * -bh;
 	} else {
 		Debug(diag, "%s: bh == 0 is invalid", __func__);
 		errno = EINVAL;
-		goto abort;
+		return false;
 	}
+	ctx->compx = compx;
+	ctx->compy = compy;
 
 	Debug(diag, "Blurhash: Component=(%u, %u) Size=(%u, %u)",
-		compx, compy, width, height);
-
-	img = image_create(width, height, IMAGE_FMT_RGB24);
-	if (img == NULL) {
-		goto abort;
-	}
+		compx, compy, ctx->width, ctx->height);
 
 	// Decode quantized max value.
 	maxvalue = decode_maxac(decode83(src, 1, 1));
 
+	// 描画は compx * compy 個しか参照しないが、それより長い入力も
+	// これまで通り受け付ける。
 	uint valuelen = 1 + (srclen - 6) / 2;
-	values = malloc(sizeof(struct colorf) * valuelen);
-	if (values == NULL) {
-		goto abort;
+	ctx->values = malloc(sizeof(struct colorf) * valuelen);
+	if (ctx->values == NULL) {
+		return false;
 	}
 
 	// 1つ目。
-	decode_dc(&values[0], decode83(src, 2, 4));
+	decode_dc(&ctx->values[0], decode83(src, 2, 4));
 
 	// 残り。
-	v = &values[1];
+	v = &ctx->values[1];
 	for (uint pos = 6, end = srclen; pos < end; pos += 2) {
 		uint q = decode83(src, pos, 2);
 		uint qr =  q / (19 * 19);
@@ -145,6 +220,21 @@ image_blurhash_read(FILE *fp, int bw, int bh, const struct diag *diag)
 		v++;
 	}
 
+	return true;
+}
+
+// 全ピクセルで基底を評価して img に展開する。
+static bool
+blurhash_render_exact(struct image *img, const struct blurhash *ctx)
+{
+	const uint width  = ctx->width;
+	const uint height = ctx->height;
+	const uint compx  = ctx->compx;
+	const uint compy  = ctx->compy;
+	float *bases_x;
+	float *bases_y;
+	bool rv = false;
+
 	bases_x = bases_for(width,  compx);
 	bases_y = bases_for(height, compy);
 	if (bases_x == NULL || bases_y == NULL) {
@@ -162,7 +252,7 @@ image_blurhash_read(FILE *fp, int bw, int bh, const struct diag *diag)
 				for (int nx = 0; nx < compx; nx++) {
 					float base = bases_x[x * compx + nx] *
 					             bases_y[y * compy + ny];
-					v = &values[ny * compx + nx];
+					const struct colorf *v = &ctx->values[ny * compx + nx];
 					c.r += v->r * base;
 					c.g += v->g * base;
 					c.b += v->b * base;
@@ -173,18 +263,177 @@ image_blurhash_read(FILE *fp, int bw, int bh, const struct diag *diag)
 			*d++ = linear2srgb(c.b);
 		}
 	}
+	rv = true;
+
+ abort:
+	free(bases_x);
+	free(bases_y);
+	return rv;
+}
+
+// 縦横それぞれ最大 comp * BLURHASH_GRID 点の内部グリッドを固定小数点で
+// 展開し、それを出力サイズに直線補間して img に展開する。
+// グリッドが出力サイズと同じならそのまま使うので、厳密版と同じ位置で
+// 評価していることになる。
+static bool
+blurhash_render_fast(struct image *img, const struct blurhash *ctx)
+{
+	const uint compx = ctx->compx;
+	const uint compy = ctx->compy;
+	const uint gw = MIN(ctx->width,  compx * BLURHASH_GRID);
+	const uint gh = MIN(ctx->height, compy * BLURHASH_GRID);
+	int32 *bases_x;
+	int32 *bases_y;
+	int32 *values = NULL;
+	int32 *rows = NULL;
+	int32 *grid = NULL;
+	bool direct;
+	bool rv = false;
+
+	bases_x = blurhash_grid_bases(ctx->width,  gw, compx);
+	bases_y = blurhash_grid_bases(ctx->height, gh, compy);
+	values = malloc(sizeof(int32) * compx * compy * 3);
+	rows = malloc(sizeof(int32) * compy * gw * 3);
+	if (bases_x == NULL || bases_y == NULL || values == NULL || rows == NULL) {
+		goto abort;
+	}
+
+	// 直接書き込めるならそうする。
+	// そうでなければグリッドはリニアのまま持っておき、補間してから sRGB
+	// にする (sRGB で補間すると暗部や飽和した所の誤差が大きい)。
+	direct = (gw == ctx->width && gh == ctx->height);
+	if (direct == false) {
+		grid = malloc(sizeof(int32) * gw * gh * 3);
+		if (grid == NULL) {
+			goto abort;
+		}
+	}
+
+	for (uint i = 0; i < compx * compy; i++) {
+		const struct colorf *v = &ctx->values[i];
+		values[i * 3 + 0] = (int32)lround(v->r * (1U << VALUE_SHIFT));
+		values[i * 3 + 1] = (int32)lround(v->g * (1U << VALUE_SHIFT));
+		values[i * 3 + 2] = (int32)lround(v->b * (1U << VALUE_SHIFT));
+	}
+
+	// 基底は縦横に分離できるので、先に横方向だけ畳み込んでおく。
+	// rows[ny][gx] = Σnx values[ny][nx] * bases_x[gx][nx]
+	for (uint ny = 0; ny < compy; ny++) {
+		const int32 *v = &values[ny * compx * 3];
+		int32 *r = &rows[ny * gw * 3];
+		for (uint gx = 0; gx < gw; gx++) {
+			const int32 *b = &bases_x[gx * compx];
+			int64 cr = ROUND;
+			int64 cg = ROUND;
+			int64 cb = ROUND;
+			for (uint nx = 0; nx < compx; nx++) {
+				cr += (int64)v[nx * 3 + 0] * b[nx];
+				cg += (int64)v[nx * 3 + 1] * b[nx];
+				cb += (int64)v[nx * 3 + 2] * b[nx];
+			}
+			*r++ = cr >> BASE_SHIFT;
+			*r++ = cg >> BASE_SHIFT;
+			*r++ = cb >> BASE_SHIFT;
+		}
+	}
+
+	// 縦方向を畳み込む。
+	uint8 *d = img->buf;
+	int32 *g = grid;
+	for (uint gy = 0; gy < gh; gy++) {
+		const int32 *b = &bases_y[gy * compy];
+		for (uint gx = 0; gx < gw * 3; gx++) {
+			int64 c = ROUND;
+			for (uint ny = 0; ny < compy; ny++) {
+				c += (int64)rows[ny * gw * 3 + gx] * b[ny];
+			}
+			if (direct) {
+				*d++ = linear2srgb_fixed(c >> BASE_SHIFT);
+			} else {
+				*g++ = c >> BASE_SHIFT;
+			}
+		}
+	}
+
+	if (direct == false) {
+		blurhash_upscale(img, grid, gw, gh);
+	}
+	rv = true;
 
-	success = true;
  abort:
+	free(grid);
+	free(rows);
 	free(values);
 	free(bases_x);
 	free(bases_y);
-	string_free(s);
-	if (success == false) {
-		image_free(img);
-		img = NULL;
+	return rv;
+}
+
+// 長さ pixels の軸を gn 点で標本化した時の各点の基底を返す。
+// 標本点は両端のピクセルを含むよう等間隔に置く。
+// 戻り値は [gn][comp] の配列で、値は BASE_SHIFT の固定小数点。
+static int32 *
+blurhash_grid_bases(uint pixels, uint gn, uint comp)
+{
+	int32 *bases = malloc(sizeof(int32) * gn * comp);
+	if (bases == NULL) {
+		return NULL;
+	}
+
+	float step = (gn > 1) ? (float)(pixels - 1) / (gn - 1) : 0;
+	float scale = M_PI / pixels;
+	for (uint g = 0; g < gn; g++) {
+		float x = g * step;
+		for (uint c = 0; c < comp; c++) {
+			float base = cos(scale * x * c);
+			bases[g * comp + c] = (int32)lround(base * (1U << BASE_SHIFT));
+		}
+	}
+	return bases;
+}
+
+// gw x gh の RGB グリッド src (リニアの VALUE_SHIFT 固定小数点) を
+// img の大きさに直線補間して sRGB にする。
+// グリッドの両端が出力の両端のピクセルに対応する。
+static void
+blurhash_upscale(struct image *img, const int32 *src, uint gw, uint gh)
+{
+	const uint width  = img->width;
+	const uint height = img->height;
+	uint16 xpos[width];
+	uint16 xfrac[width];
+	int32 tmp[gw * 3];
+
+	// 出力の X 座標に対応するグリッドの位置 (整数部と 1/256 単位の端数)。
+	for (uint x = 0; x < width; x++) {
+		uint pos = (width > 1) ? x * (gw - 1) * 256 / (width - 1) : 0;
+		xpos[x]  = pos >> 8;
+		xfrac[x] = pos & 0xff;
+	}
+
+	uint8 *d = img->buf;
+	for (uint y = 0; y < height; y++) {
+		uint pos = (height > 1) ? y * (gh - 1) * 256 / (height - 1) : 0;
+		uint gy = pos >> 8;
+		uint fy = pos & 0xff;
+		const int32 *s0 = &src[gy * gw * 3];
+		const int32 *s1 = (fy != 0) ? s0 + gw * 3 : s0;
+
+		// 縦方向を補間した1行。値は 256 倍。
+		for (uint i = 0; i < gw * 3; i++) {
+			tmp[i] = s0[i] * (int32)(256 - fy) + s1[i] * (int32)fy;
+		}
+
+		for (uint x = 0; x < width; x++) {
+			const int32 *t0 = &tmp[xpos[x] * 3];
+			const int32 *t1 = (xfrac[x] != 0) ? t0 + 3 : t0;
+			int64 fx = xfrac[x];
+			for (uint i = 0; i < 3; i++) {
+				int64 c = t0[i] * (256 - fx) + t1[i] * fx + 32768;
+				*d++ = linear2srgb_fixed(c >> 16);
+			}
+		}
 	}
-	return img;
 }
 
 // src の pos から len バイトをデコードする。
@@ -252,6 +501,8 @@ srgb2linear(int ival)
 	}
 }
 
+// リニアから sRGB への変換。
+// 厳密版用なので表を使わずに計算する。
 static uint
 linear2srgb(float val)
 {
@@ -262,8 +513,28 @@ linear2srgb(float val)
 		return 255;
 	}
 
-	int idx = (int)(val * L2SRGBSIZE);
-	return table_L2SRGB[idx];
+	float v;
+	if (val < 0.0031308f) {
+		v = val * 12.92f;
+	} else {
+		v = 1.055f * powf(val, 1 / 2.4f) - 0.055f;
+	}
+	return (uint)lroundf(v * 255);
+}
+
+// リニアから sRGB への変換の VALUE_SHIFT 固定小数点版。
+// こちらは L2SRGBSIZE 段の表を引く。
+static inline uint
+linear2srgb_fixed(int32 val)
+{
+	if (val <= 0) {
+		return 0;
+	}
+	if (val >= (1 << VALUE_SHIFT)) {
+		return 255;
+	}
+
+	return table_L2SRGB[val >> (VALUE_SHIFT - L2SRGBBITS)];
 }
 
 static float *
@@ -185,7 +185,7 @@ image_bmp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 # if defined(USE_LIBJPEG)
 		return image_jpeg_read(fp, hint, diag);
 # else
-		return image_stb_read(fp, hint, diag);
+		return image_read_fp(fp, image_stb_read, hint, diag);
 # endif
 #endif
 
@@ -193,9 +193,9 @@ image_bmp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	 case BI_PNG:
 		// 以降が PNG 生データ。
 # if defined(USE_LIBPNG)
-		return image_png_read(fp, hint, diag);
+		return image_read_fp(fp, image_png_read, hint, diag);
 # else
-		return image_stb_read(fp, hint, diag);
+		return image_read_fp(fp, image_stb_read, hint, diag);
 # endif
 #endif
 
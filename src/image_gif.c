@@ -31,10 +31,29 @@
 #include "common.h"
 #include "image_priv.h"
 #include <err.h>
+#include <string.h>
 #include <gif_lib.h>
 
-static struct image *image_gif_static(GifFileType *, int, const struct diag *);
-static struct image *image_gif_multi(GifFileType *, int, const struct diag *);
+// 1フレームの最大ピクセル数。
+// 壊れたファイルで巨大なメモリを確保しないための上限。
+#define GIF_MAX_FRAME_PIXELS	(8192U * 8192U)
+
+static void gcb_init(GraphicsControlBlock *);
+static bool gif_read_extension(GifFileType *, GraphicsControlBlock *);
+static bool gif_read_raster(GifFileType *, GifByteType *);
+static bool gif_has_next_frame(GifFileType *);
+static void gif_clip(const struct image *, const GifImageDesc *,
+	uint *, uint *);
+static struct image *gif_create_canvas(const GifFileType *);
+static void gif_make_palette(const ColorMapObject *, uint16 *);
+static struct image *image_gif_static(const GifFileType *,
+	const GifImageDesc *, const ColorMapObject *, const GifByteType *);
+static void gif_draw(struct image *, const GifImageDesc *,
+	const ColorMapObject *, const GifByteType *, int);
+static void gif_copy_rect(struct image *, const GifImageDesc *, uint16 *,
+	bool);
+static void gif_dispose(struct image *, const GifImageDesc *,
+	const ColorMapObject *, const GraphicsControlBlock *, const uint16 *);
 static int gif_read(GifFileType *, GifByteType *, int);
 static const char *disposal2str(int);
 
@@ -61,17 +80,27 @@ image_gif_match(FILE *fp, const struct diag *diag)
 	return true;
 }
 
+// 指定のページ (フレーム) を取り出す。
+// DGifSlurp() だと全フレームを展開してしまうので、レコード単位で読み進め、
+// 目的のフレームまでだけを合成して、そこで読み込みをやめる。
 struct image *
 image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 {
 	GifFileType *gif;
-	const GifImageDesc *desc;
 	GraphicsControlBlock gcb;
+	struct image *canvas;
 	struct image *img;
+	GifByteType *bits;
+	uint16 *saved;
 	int errcode;
-	int transparent_color;
+	int page;
+	int frame;
 
+	canvas = NULL;
 	img = NULL;
+	bits = NULL;
+	saved = NULL;
+	page = hint->page;
 
 	// コールバックを指定してオープン。
 	gif = DGifOpen(fp, gif_read, &errcode);
@@ -80,172 +109,399 @@ image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		return NULL;
 	}
 
-	// 展開。
-	errcode = DGifSlurp(gif);
-	if (errcode != GIF_OK) {
-		warnx("%s: DGifSlurp failed: %s", __func__, GifErrorString(gif->Error));
-		goto done;
-	}
+	Debug(diag, "%s: screen=(%u,%u) bgcolor=%d global_colormap=%s", __func__,
+		gif->SWidth, gif->SHeight, gif->SBackGroundColor,
+		(gif->SColorMap ? "yes" : "no"));
+
+	gcb_init(&gcb);
+	for (frame = 0; ; ) {
+		GifRecordType type;
 
-	int page = hint->page;
-
-	if (diag_get_level(diag) >= 1) {
-		diag_print(diag, "%s: frame_count=%u bgcolor=%d global_colormap=%s",
-			__func__, gif->ImageCount, gif->SBackGroundColor,
-			(gif->SColorMap ? "yes" : "no"));
-		for (uint i = 0; i < gif->ImageCount; i++) {
-			DGifSavedExtensionToGCB(gif, i, &gcb);
-			desc = &gif->SavedImages[i].ImageDesc;
-			diag_print(diag, "%c[%2u] (%u,%u)-(%ux%u) "
-				"disposal=%s cmap=%s trans=%d delay=%u[msec]",
-				(i == page ? '*' : ' '), i,
-				desc->Left, desc->Top, desc->Width, desc->Height,
-				disposal2str(gcb.DisposalMode),
-				(desc->ColorMap != NULL ? "yes" : "no"),
-				gcb.TransparentColor,
-				gcb.DelayTime * 10);
+		if (DGifGetRecordType(gif, &type) == GIF_ERROR) {
+			warnx("%s: DGifGetRecordType failed: %s", __func__,
+				GifErrorString(gif->Error));
+			goto done;
+		}
+		if (type == TERMINATE_RECORD_TYPE) {
+			// 戻っても仕方ないので終了する?
+			errx(1, "%s: No page found: %d", __func__, page);
+		}
+		if (type == EXTENSION_RECORD_TYPE) {
+			// GCB は次のフレームに適用される。
+			if (gif_read_extension(gif, &gcb) == false) {
+				warnx("%s: Reading extension failed: %s", __func__,
+					GifErrorString(gif->Error));
+				goto done;
+			}
+			continue;
+		}
+		if (type != IMAGE_DESC_RECORD_TYPE) {
+			continue;
 		}
-	}
-	if (page >= gif->ImageCount) {
-		// 戻っても仕方ないので終了する?
-		errx(1, "%s: No page found: %d", __func__, page);
-	}
 
-	// このページの透過色を取り出す。使用してなければ -1。
-	DGifSavedExtensionToGCB(gif, page, &gcb);
-	transparent_color = gcb.TransparentColor;
+		if (DGifGetImageDesc(gif) == GIF_ERROR) {
+			warnx("%s: DGifGetImageDesc failed: %s", __func__,
+				GifErrorString(gif->Error));
+			goto done;
+		}
+		const GifImageDesc *desc = &gif->Image;
+		const ColorMapObject *cmap = desc->ColorMap ?: gif->SColorMap;
+		if (cmap == NULL) {
+			warnx("%s: No colormap", __func__);
+			goto done;
+		}
+		Debug(diag, "%c[%2u] (%u,%u)-(%ux%u) "
+			"disposal=%s cmap=%s trans=%d delay=%u[msec]%s",
+			(frame == page ? '*' : ' '), frame,
+			desc->Left, desc->Top, desc->Width, desc->Height,
+			disposal2str(gcb.DisposalMode),
+			(desc->ColorMap != NULL ? "yes" : "no"),
+			gcb.TransparentColor,
+			gcb.DelayTime * 10,
+			(desc->Interlace ? " interlace" : ""));
+
+		// フレームは論理画面に収まるはず。
+		// Width * Height は int だと溢れるので 64ビットで計算する。
+		uint64 npixels = (uint64)desc->Width * (uint64)desc->Height;
+		if (desc->Width > gif->SWidth || desc->Height > gif->SHeight ||
+		    npixels > GIF_MAX_FRAME_PIXELS)
+		{
+			warnx("%s: Frame size (%ux%u) too large for screen (%ux%u)",
+				__func__, desc->Width, desc->Height,
+				gif->SWidth, gif->SHeight);
+			goto done;
+		}
+		size_t framesize = MAX((size_t)npixels, 1);
 
-	if (gif->ImageCount == 1 || transparent_color < 0) {
-		img = image_gif_static(gif, page, diag);
-	} else {
-		img = image_gif_multi(gif, page, diag);
+		// このフレームのカラーコードを展開する。
+		GifByteType *newbits = realloc(bits, framesize);
+		if (newbits == NULL) {
+			warn("%s: realloc failed", __func__);
+			goto done;
+		}
+		bits = newbits;
+		if (gif_read_raster(gif, bits) == false) {
+			warnx("%s: DGifGetLine failed: %s", __func__,
+				GifErrorString(gif->Error));
+			goto done;
+		}
+
+		if (frame == page) {
+			// 1ページだけの構成か、複数ページ構成でも指定のページに
+			// 透過色がない場合は、このページ単体で済む。
+			// 1ページだけかどうかは次のフレームがあるかで判断する
+			// (次のフレームの展開はしない)。
+			int transparent_color = gcb.TransparentColor;
+			if (transparent_color < 0 ||
+				(frame == 0 && gif_has_next_frame(gif) == false))
+			{
+				img = image_gif_static(gif, desc, cmap, bits);
+			} else {
+				if (canvas == NULL) {
+					canvas = gif_create_canvas(gif);
+					if (canvas == NULL) {
+						goto done;
+					}
+				}
+				gif_draw(canvas, desc, cmap, bits, transparent_color);
+				img = canvas;
+				canvas = NULL;
+			}
+			break;
+		}
+
+		// 目的のページより前のフレームは合成していく。
+		if (canvas == NULL) {
+			canvas = gif_create_canvas(gif);
+			if (canvas == NULL) {
+				goto done;
+			}
+		}
+		if (gcb.DisposalMode == DISPOSE_PREVIOUS) {
+			// 描画前の矩形を覚えておく。
+			uint16 *newsaved = realloc(saved, framesize * sizeof(uint16));
+			if (newsaved == NULL) {
+				warn("%s: realloc failed", __func__);
+				goto done;
+			}
+			saved = newsaved;
+			gif_copy_rect(canvas, desc, saved, false);
+		}
+		gif_draw(canvas, desc, cmap, bits, gcb.TransparentColor);
+		gif_dispose(canvas, desc, cmap, &gcb, saved);
+
+		frame++;
+		gcb_init(&gcb);
 	}
 
  done:
+	free(bits);
+	free(saved);
+	image_free(canvas);
 	DGifCloseFile(gif, &errcode);
 	return img;
 }
 
-// GIF 画像が1ページだけの構成か、
-// 複数ページ構成であっても指定のページに透過色がない場合。
-static struct image *
-image_gif_static(GifFileType *gif, int page, const struct diag *diag)
+// gcb を GCB がない場合の値で初期化する。
+static void
+gcb_init(GraphicsControlBlock *gcb)
 {
-	struct image *img;
-	const SavedImage *src;
-	const GifImageDesc *desc;
-	const ColorMapObject *cmap;
+	memset(gcb, 0, sizeof(*gcb));
+	gcb->DisposalMode = DISPOSAL_UNSPECIFIED;
+	gcb->TransparentColor = NO_TRANSPARENT_COLOR;
+}
 
-	img = image_create(gif->SWidth, gif->SHeight, IMAGE_FMT_RGB24);
-	if (img == NULL) {
-		warn("%s: image_create failed", __func__);
-		return NULL;
+// 拡張ブロックを読み込む。GCB なら gcb に取り出す。
+// 失敗すれば false を返す。
+static bool
+gif_read_extension(GifFileType *gif, GraphicsControlBlock *gcb)
+{
+	GifByteType *ext;
+	int code;
+
+	if (DGifGetExtension(gif, &code, &ext) == GIF_ERROR) {
+		return false;
 	}
+	if (code == GRAPHICS_EXT_FUNC_CODE && ext != NULL) {
+		// ext[0] が長さ。
+		DGifExtensionToGCB(ext[0], ext + 1, gcb);
+	}
+	while (ext != NULL) {
+		if (DGifGetExtensionNext(gif, &ext) == GIF_ERROR) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	// カラーマップを取り出す。
-	src = &gif->SavedImages[page];
-	desc = &src->ImageDesc;
-	cmap = desc->ColorMap ?: gif->SColorMap;
-
-	// RasterBits[] に width x height のカラーコードが並んでいる。
-	const GifByteType *s = src->RasterBits;
-	uint32 stride = image_get_stride(img);
-
-	for (uint y = 0; y < desc->Height; y++) {
-		uint8 *d = &img->buf[(desc->Top + y) * stride + desc->Left * 3];
-		for (uint x = 0; x < desc->Width; x++) {
-			uint cc = *s++;
-			GifColorType rgb = cmap->Colors[cc];
-			*d++ = rgb.Red;
-			*d++ = rgb.Green;
-			*d++ = rgb.Blue;
+// 現在のフレーム (gif->Image) のカラーコードを bits に展開する。
+// インターレースならここで並べ直す。
+static bool
+gif_read_raster(GifFileType *gif, GifByteType *bits)
+{
+	static const uint8 offsets[] = { 0, 4, 2, 1 };
+	static const uint8 jumps[]   = { 8, 8, 4, 2 };
+	const GifImageDesc *desc = &gif->Image;
+	uint width = desc->Width;
+	uint height = desc->Height;
+
+	if (desc->Interlace) {
+		for (uint pass = 0; pass < countof(offsets); pass++) {
+			for (uint y = offsets[pass]; y < height; y += jumps[pass]) {
+				if (DGifGetLine(gif, bits + y * width, width) == GIF_ERROR) {
+					return false;
+				}
+			}
+		}
+	} else {
+		for (uint y = 0; y < height; y++) {
+			if (DGifGetLine(gif, bits + y * width, width) == GIF_ERROR) {
+				return false;
+			}
 		}
 	}
+	return true;
+}
 
-	return img;
+// 次のフレームがあれば true を返す。拡張ブロックは読み飛ばす。
+// 次のフレームの中身は読まない。
+static bool
+gif_has_next_frame(GifFileType *gif)
+{
+	GraphicsControlBlock gcb;
+
+	for (;;) {
+		GifRecordType type;
+
+		if (DGifGetRecordType(gif, &type) == GIF_ERROR) {
+			return false;
+		}
+		switch (type) {
+		 case IMAGE_DESC_RECORD_TYPE:
+			return true;
+		 case EXTENSION_RECORD_TYPE:
+			if (gif_read_extension(gif, &gcb) == false) {
+				return false;
+			}
+			break;
+		 case TERMINATE_RECORD_TYPE:
+			return false;
+		 default:
+			break;
+		}
+	}
 }
 
-// GIF 画像が複数ページで構成されているか、
-// あるいは透過色が指定されている場合。
-static struct image *
-image_gif_multi(GifFileType *gif, int target_page, const struct diag *diag)
+// desc の矩形のうちスクリーンに収まる部分の幅と高さを返す。
+static void
+gif_clip(const struct image *img, const GifImageDesc *desc,
+	uint *widthp, uint *heightp)
 {
-	struct image *img;
-	const SavedImage *src;
-	const GifImageDesc *desc;
-	const ColorMapObject *cmap;
+	uint left = desc->Left;
+	uint top  = desc->Top;
 
-	img = image_create(gif->SWidth, gif->SHeight, IMAGE_FMT_ARGB32);
+	*widthp  = (left < img->width)  ? MIN((uint)desc->Width,  img->width  - left) : 0;
+	*heightp = (top  < img->height) ? MIN((uint)desc->Height, img->height - top)  : 0;
+}
+
+// 合成用のキャンバスを (内部形式で) 作る。初期状態は全域透明。
+static struct image *
+gif_create_canvas(const GifFileType *gif)
+{
+	struct image *img = image_create(gif->SWidth, gif->SHeight,
+		IMAGE_FMT_ARGB16);
 	if (img == NULL) {
 		warn("%s: image_create failed", __func__);
 		return NULL;
 	}
+	uint16 *d = (uint16 *)img->buf;
+	for (uint i = 0, end = img->width * img->height; i < end; i++) {
+		*d++ = 0x8000;
+	}
+	img->has_alpha = true;
+	return img;
+}
 
-	for (uint page = 0; page <= target_page; page++) {
-		GraphicsControlBlock gcb;
+// カラーマップ cmap を内部形式のパレット pal[256] に変換する。
+// カラーマップにないカラーコードは 0 番の色にしておく。
+static void
+gif_make_palette(const ColorMapObject *cmap, uint16 *pal)
+{
+	uint count = MIN(cmap->ColorCount, 256);
 
-		DGifSavedExtensionToGCB(gif, page, &gcb);
-		int transparent_color = gcb.TransparentColor;
+	for (uint i = 0; i < count; i++) {
+		GifColorType rgb = cmap->Colors[i];
+		pal[i] = RGB888_to_ARGB16(rgb.Red, rgb.Green, rgb.Blue);
+	}
+	for (uint i = count; i < 256; i++) {
+		pal[i] = pal[0];
+	}
+}
+
+// 1ページだけの構成か、
+// 複数ページ構成であっても指定のページに透過色がない場合。
+// desc, cmap, bits のフレームだけから (内部形式で) 画像を作る。
+static struct image *
+image_gif_static(const GifFileType *gif, const GifImageDesc *desc,
+	const ColorMapObject *cmap, const GifByteType *bits)
+{
+	struct image *img;
+	uint16 pal[256];
+	uint width;
+	uint height;
 
-		// カラーマップを取得。
-		src = &gif->SavedImages[page];
-		desc = &src->ImageDesc;
-		cmap = desc->ColorMap ?: gif->SColorMap;
+	img = image_create(gif->SWidth, gif->SHeight, IMAGE_FMT_ARGB16);
+	if (img == NULL) {
+		warn("%s: image_create failed", __func__);
+		return NULL;
+	}
+	memset(img->buf, 0, image_get_stride(img) * img->height);
+	gif_make_palette(cmap, pal);
+
+	// bits[] に desc->Width x desc->Height のカラーコードが並んでいる。
+	gif_clip(img, desc, &width, &height);
+	for (uint y = 0; y < height; y++) {
+		const GifByteType *s = &bits[y * desc->Width];
+		uint16 *d = (uint16 *)img->buf + (desc->Top + y) * img->width
+			+ desc->Left;
+		for (uint x = 0; x < width; x++) {
+			*d++ = pal[*s++];
+		}
+	}
 
-		uint left   = desc->Left;
-		uint top    = desc->Top;
-		uint width  = desc->Width;
-		uint height = desc->Height;
+	return img;
+}
 
-		uint32 stride = image_get_stride(img);
-		const GifByteType *s = src->RasterBits;
-		for (uint y = 0; y < height; y++) {
-			uint8 *d = &img->buf[(top + y) * stride + left * 4];
-			for (uint x = 0; x < width; x++) {
-				uint cc = *s++;
-				if (cc != transparent_color) {
-					GifColorType rgb = cmap->Colors[cc];
-					*d++ = rgb.Red;
-					*d++ = rgb.Green;
-					*d++ = rgb.Blue;
-					*d++ = 0xff;
-				} else {
-					d += 4;
-				}
+// キャンバス img に desc, cmap, bits のフレームを重ねる。
+// transparent_color の画素は下の画素を残す。
+static void
+gif_draw(struct image *img, const GifImageDesc *desc,
+	const ColorMapObject *cmap, const GifByteType *bits, int transparent_color)
+{
+	uint16 pal[256];
+	uint width;
+	uint height;
+
+	gif_make_palette(cmap, pal);
+	gif_clip(img, desc, &width, &height);
+	for (uint y = 0; y < height; y++) {
+		const GifByteType *s = &bits[y * desc->Width];
+		uint16 *d = (uint16 *)img->buf + (desc->Top + y) * img->width
+			+ desc->Left;
+		for (uint x = 0; x < width; x++) {
+			int cc = *s++;
+			if (cc != transparent_color) {
+				*d = pal[cc];
 			}
+			d++;
 		}
+	}
+}
 
-		if (page == target_page) {
-			break;
+// キャンバス img の desc の矩形と buf との間でコピーする。
+// restore が false なら img から buf へ、true なら buf から img へ。
+static void
+gif_copy_rect(struct image *img, const GifImageDesc *desc, uint16 *buf,
+	bool restore)
+{
+	uint width;
+	uint height;
+
+	gif_clip(img, desc, &width, &height);
+	for (uint y = 0; y < height; y++) {
+		uint16 *p = (uint16 *)img->buf + (desc->Top + y) * img->width
+			+ desc->Left;
+		uint16 *q = &buf[y * width];
+		if (restore) {
+			memcpy(p, q, width * sizeof(uint16));
+		} else {
+			memcpy(q, p, width * sizeof(uint16));
 		}
+	}
+}
 
-		switch (gcb.DisposalMode) {
-		 case DISPOSE_BACKGROUND:	// この矩形を背景色で塗る。
-		 {
-			// 背景色で塗るとなっているが、
-			// このページの透過色で塗らないと思った動作にならない。どうして?
+// 描画し終えたフレームを gcb の Disposal Mode に従って処分する。
+// saved は DISPOSE_PREVIOUS の時の描画前の矩形。
+static void
+gif_dispose(struct image *img, const GifImageDesc *desc,
+	const ColorMapObject *cmap, const GraphicsControlBlock *gcb,
+	const uint16 *saved)
+{
+	uint width;
+	uint height;
+
+	gif_clip(img, desc, &width, &height);
+	switch (gcb->DisposalMode) {
+	 case DISPOSE_BACKGROUND:	// この矩形を背景色で塗る。
+	 {
+		// 背景色で塗るとなっているが、
+		// このページの透過色で塗らないと思った動作にならない。どうして?
+		int transparent_color = gcb->TransparentColor;
+		uint16 v = 0;
+		if (0 <= transparent_color && transparent_color < cmap->ColorCount) {
 			GifColorType rgb = cmap->Colors[transparent_color];
-			for (uint y = 0; y < height; y++) {
-				uint8 *d = &img->buf[(top + y) * stride + left * 4];
-				for (uint x = 0; x < width; x++) {
-					*d++ = rgb.Red;
-					*d++ = rgb.Green;
-					*d++ = rgb.Blue;
-					*d++ = 0;
-				}
+			v = RGB888_to_ARGB16(rgb.Red, rgb.Green, rgb.Blue);
+		}
+		v |= 0x8000;
+		for (uint y = 0; y < height; y++) {
+			uint16 *d = (uint16 *)img->buf + (desc->Top + y) * img->width
+				+ desc->Left;
+			for (uint x = 0; x < width; x++) {
+				*d++ = v;
 			}
-			break;
-		 }
-
-		 default:
-		 case DISPOSAL_UNSPECIFIED:
-		 case DISPOSE_DO_NOT:		// 何もしない
-		 case DISPOSE_PREVIOUS:		// 前のフレームに戻す (未対応)
-			break;
 		}
-	}
+		break;
+	 }
 
-	return img;
+	 case DISPOSE_PREVIOUS:		// 前のフレームに戻す
+		gif_copy_rect(img, desc, UNCONST(saved), true);
+		break;
+
+	 default:
+	 case DISPOSAL_UNSPECIFIED:
+	 case DISPOSE_DO_NOT:		// 何もしない
+		break;
+	}
 }
 
 static int
@@ -369,9 +369,9 @@ ico_read_png(FILE *fp, const struct icodir *dir, const struct diag *diag)
 	const image_read_hint *hint = NULL;
 
 #if defined(USE_LIBPNG)
-	return image_png_read(fp, hint, diag);
+	return image_read_fp(fp, image_png_read, hint, diag);
 #elif defined(USE_STB_IMAGE)
-	return image_stb_read(fp, hint, diag);
+	return image_read_fp(fp, image_stb_read, hint, diag);
 #else
 	return NULL;
 #endif
@@ -73,16 +73,18 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 {
 	volatile struct jpeg_decompress_struct jinfo;
 	struct my_jpeg_error_mgr jerr;
+	volatile struct image_scaler sc;
 	volatile struct image *img;
-	uint8 *lineptr;
 	uint width;
 	uint height;
-	uint stride;
+	uint dst_width;
+	uint dst_height;
 	uint color_space;
 	int scale;
 
 	memset(UNVOLATILE(&jinfo), 0, sizeof(jinfo));
 	memset(&jerr, 0, sizeof(jerr));
+	memset(UNVOLATILE(&sc), 0, sizeof(sc));
 	img = NULL;
 
 	jinfo.err = jpeg_std_error(&jerr.mgr);
@@ -91,8 +93,6 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	// libjpeg 内でエラーが起きたら大域ジャンプで戻ってくる…。
 	if (setjmp(jerr.jmp)) {
 		warnx("libjpeg: %s", my_msgbuf);
-		free(UNVOLATILE(img));
-		img = NULL;
 		goto done;
 	}
 
@@ -174,53 +174,51 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	width  = jinfo.output_width;
 	height = jinfo.output_height;
 
-	img = image_create(width, height, IMAGE_FMT_RGB24);
-	if (img == NULL) {
-		warn("%s: image_create failed", __func__);
+	// libjpeg での縮小は 1/2^n 単位なので、残りは行シンクで縮小する。
+	image_get_read_size(width, height, hint, &dst_width, &dst_height);
+	if (image_scaler_init(UNVOLATILE(&sc), width, height, IMAGE_FMT_RGB24,
+			dst_width, dst_height) == false) {
+		warn("%s: image_scaler_init failed", __func__);
 		goto done;
 	}
-	stride = image_get_stride(UNVOLATILE(img));
 
 	// データの読み込み。
-	lineptr = img->buf;
-	switch (jinfo.out_color_space) {
-	 default:	// とりあえず適当なところへ落ちておく。
-	 case JCS_RGB:
-		// 直接 RGB で読み出せる。
+	// CMYK でも足りるだけ確保しておく。
+	{
+		uint8 rowbuf[width * 4];
+		uint8 *lineptr = rowbuf;
 		for (uint y = 0; y < height; y++) {
 			jpeg_read_scanlines(UNVOLATILE(&jinfo), &lineptr, 1);
-			lineptr += stride;
-		}
-		break;
 
-	 case JCS_CMYK:
-	 {
-		// 一旦 CMYK で取り出して変換する。
-		uint8 cmykbuf[width * 4];
-		for (uint y = 0; y < height; y++) {
-			uint8 *bufp = cmykbuf;
-			jpeg_read_scanlines(UNVOLATILE(&jinfo), &bufp, 1);
-			// CMYK -> RGB 変換。本来(?)の式は
-			//  R = (255 - C) * (255 - K) / 255
-			//  G = (255 - M) * (255 - K) / 255
-			//  B = (255 - Y) * (255 - K) / 255
-			// だが libjpeg の返す CMYK は反転済みらしい…。issue#53
-			for (uint x = 0; x < width; x++) {
-				uint C = *bufp++;
-				uint M = *bufp++;
-				uint Y = *bufp++;
-				uint K = *bufp++;
-				*lineptr++ = (C * K + 127) / 255;
-				*lineptr++ = (M * K + 127) / 255;
-				*lineptr++ = (Y * K + 127) / 255;
+			if (jinfo.out_color_space == JCS_CMYK) {
+				// CMYK -> RGB 変換。本来(?)の式は
+				//  R = (255 - C) * (255 - K) / 255
+				//  G = (255 - M) * (255 - K) / 255
+				//  B = (255 - Y) * (255 - K) / 255
+				// だが libjpeg の返す CMYK は反転済みらしい…。issue#53
+				// 読み出し位置より後ろには書き込まないのでその場で変換できる。
+				const uint8 *s = rowbuf;
+				uint8 *d = rowbuf;
+				for (uint x = 0; x < width; x++) {
+					uint C = *s++;
+					uint M = *s++;
+					uint Y = *s++;
+					uint K = *s++;
+					*d++ = (C * K + 127) / 255;
+					*d++ = (M * K + 127) / 255;
+					*d++ = (Y * K + 127) / 255;
+				}
 			}
+			// それ以外は RGB で読み出している。
+
+			image_scaler_put(UNVOLATILE(&sc), rowbuf);
 		}
-		break;
-	 }
 	}
 
 	jpeg_finish_decompress(UNVOLATILE(&jinfo));
+	img = image_scaler_finish(UNVOLATILE(&sc));
  done:
+	image_scaler_cleanup(UNVOLATILE(&sc));
 	jpeg_destroy_decompress(UNVOLATILE(&jinfo));
 	return UNVOLATILE(img);
 }
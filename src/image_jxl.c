@@ -34,8 +34,18 @@
 #include <string.h>
 #include <jxl/decode.h>
 #include <jxl/encode.h>
+#if defined(HAVE_LIBJXL_THREADS)
+#include <jxl/thread_parallel_runner.h>
+#endif
 #include <jxl/version.h>
 
+#if defined(HAVE_LIBJXL_THREADS)
+// この画素数以上の画像はスレッドで並列にデコードする。
+#define JXL_PARALLEL_PIXELS	(512 * 512)
+
+static bool jxl_peek_basic_info(const uint8 *, size_t, JxlBasicInfo *);
+#endif
+static uint jxl_target_ratio(const JxlBasicInfo *, const image_read_hint *);
 static const char *primaries2str(JxlPrimaries);
 static const char *transfer_function2str(JxlTransferFunction);
 static const char *status2str(JxlDecoderStatus);
@@ -60,23 +70,31 @@ image_jxl_match(FILE *fp, const struct diag *diag)
 }
 
 struct image *
-image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
+image_jxl_read(struct pstream *ps, const image_read_hint *hint,
+	const struct diag *diag)
 {
 	struct image *img = NULL;
-	uint8 *buf;
-	const size_t bufsize = IMAGE_BUFSIZE;
+#if defined(HAVE_LIBJXL_THREADS)
+	void *runner = NULL;
+#endif
+	struct bslice slice;		// デコーダに渡しているスライス
+	uint8 *carry = NULL;		// 未消費分と次のスライスを連結したもの
+	const uint8 *input = NULL;	// デコーダに渡している入力
+	size_t inputlen = 0;
 	JxlBasicInfo info;
 	bool success = false;
 	size_t readbytes = 0;
 	bool is_progressive = !hint->no_progressive;
+	uint target_ratio = 1;
 
-	buf = malloc(bufsize);
-	if (buf == NULL) {
-		warnx("%s: malloc(%zu) failed", __func__, bufsize);
-		return NULL;
-	}
+	memset(&slice, 0, sizeof(slice));
+	memset(&info, 0, sizeof(info));
 
 	JxlDecoder *dec = JxlDecoderCreate(NULL);
+	if (dec == NULL) {
+		warnx("%s: JxlDecoderCreate failed", __func__);
+		return NULL;
+	}
 	JxlDecoderSubscribeEvents(dec,
 		JXL_DEC_BASIC_INFO |
 		JXL_DEC_COLOR_ENCODING |
@@ -86,7 +104,38 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	JxlDecoderSetProgressiveDetail(dec,
 		(JxlProgressiveDetail)kPasses);
 
-	memset(&info, 0, sizeof(info));
+	// 最初のスライスを読んでおく。
+	// libjxl_threads があれば大きな画像はスレッドで並列にデコードしたいが、
+	// 並列ランナーはデコード開始前にしか設定できないので、先にこの
+	// スライスだけで画像サイズを調べる (ここで分からなければ並列化はしない)。
+	int r = pstream_read_slice(ps, &slice, UINT32_MAX);
+	if (r <= 0) {
+		if (r < 0) {
+			warn("%s: pstream_read_slice failed", __func__);
+		}
+		goto done;
+	}
+	readbytes = r;
+	input = slice.ptr;
+	inputlen = slice.len;
+#if defined(HAVE_LIBJXL_THREADS)
+	if (jxl_peek_basic_info(input, inputlen, &info) &&
+		(uint64)info.xsize * info.ysize >= JXL_PARALLEL_PIXELS)
+	{
+		size_t threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+		runner = JxlThreadParallelRunnerCreate(NULL, threads);
+		if (runner != NULL) {
+			Debug(diag, "%s: Use parallel runner with %zu threads", __func__,
+				threads);
+			JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner);
+		}
+	}
+#endif
+	if (JxlDecoderSetInput(dec, input, inputlen) == JXL_DEC_ERROR) {
+		warnx("%s: JxlDecoderSetInput failed", __func__);
+		goto done;
+	}
+
 	for (;;) {
 		// 処理を進める。
 		JxlDecoderStatus status = JxlDecoderProcessInput(dec);
@@ -96,13 +145,16 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		}
 
 		if (status == JXL_DEC_NEED_MORE_INPUT) {
-			JxlDecoderReleaseInput(dec);
-			Trace(diag, "%s: %s", __func__, status2str(status));
+			// 未消費分は次回の入力の先頭に付けて渡し直す必要がある。
+			size_t remain = JxlDecoderReleaseInput(dec);
+			Trace(diag, "%s: %s remain=%zu", __func__, status2str(status),
+				remain);
 
 			// 読み込み。
-			size_t n = fread(buf, 1, bufsize, fp);
-			if (ferror(fp)) {
-				warn("%s: fread failed", __func__);
+			struct bslice next;
+			int n = pstream_read_slice(ps, &next, UINT32_MAX);
+			if (n < 0) {
+				warn("%s: pstream_read_slice failed", __func__);
 				break;
 			}
 			if (n == 0) {
@@ -110,8 +162,33 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			}
 			readbytes += n;
 
+			if (remain == 0) {
+				// 通常はスライスをそのまま渡せる。
+				bslice_release(&slice);
+				free(carry);
+				carry = NULL;
+				slice = next;
+				input = slice.ptr;
+				inputlen = slice.len;
+			} else {
+				uint8 *newcarry = malloc(remain + n);
+				if (newcarry == NULL) {
+					warn("%s: malloc(%zu) failed", __func__, remain + n);
+					bslice_release(&next);
+					break;
+				}
+				memcpy(newcarry, input + inputlen - remain, remain);
+				memcpy(newcarry + remain, next.ptr, n);
+				bslice_release(&next);
+				bslice_release(&slice);
+				free(carry);
+				carry = newcarry;
+				input = carry;
+				inputlen = remain + n;
+			}
+
 			// 入力バッファをセット。
-			status = JxlDecoderSetInput(dec, buf, n);
+			status = JxlDecoderSetInput(dec, input, inputlen);
 			if (status == JXL_DEC_ERROR) {
 				warnx("%s: JxlDecoderSetInput failed", __func__);
 				break;
@@ -131,6 +208,16 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			Debug(diag, "%s: have_preview=%u have_animation=%u", __func__,
 				info.have_preview,
 				info.have_animation);
+
+			// 出力サイズに足りる縮小率 (1/n) のところまでデコードできれば
+			// そこで打ち切る。
+			if (is_progressive) {
+				target_ratio = jxl_target_ratio(&info, hint);
+				Debug(diag, "%s: target_ratio=1/%u", __func__, target_ratio);
+				if (target_ratio == 1) {
+					is_progressive = false;
+				}
+			}
 			continue;
 		}
 
@@ -174,17 +261,6 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 
 			JxlDecoderSetImageOutBuffer(dec, &jxlfmt, img->buf,
 				xsize * ysize * jxlfmt.num_channels);
-
-			if (is_progressive) {
-				uint hint_w = hint->width == 0 ? xsize : hint->width;
-				uint hint_h = hint->height == 0 ? ysize : hint->height;
-				uint k = xsize / hint_w * ysize / hint_h;
-				Debug(diag, "%s: k=%u", __func__, k);
-				if (k < 7) {
-					is_progressive = false;
-				}
-			}
-
 			continue;
 		}
 
@@ -195,12 +271,16 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		}
 
 		if (status == JXL_DEC_FRAME_PROGRESSION) {
-			Trace(diag, "%s: %s %zu bytes read", __func__,
+			size_t ratio = JxlDecoderGetIntendedDownsamplingRatio(dec);
+			Trace(diag, "%s: %s ratio=1/%zu %zu bytes read", __func__,
 				status2str(status),
+				ratio,
 				readbytes);
 
-			if (is_progressive) {
-				Debug(diag, "%s: use progressive", __func__);
+			// 必要な解像度に達したら残りは読まずに終わる。
+			if (is_progressive && ratio <= target_ratio) {
+				Debug(diag, "%s: use progressive (1/%zu) at %zu bytes",
+					__func__, ratio, readbytes);
 				JxlDecoderFlushImage(dec);
 				success = true;
 				break;
@@ -218,9 +298,16 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		}
 	}
 
+ done:
 	// どちらにしてもリソースを解放。
 	JxlDecoderDestroy(dec);
-	free(buf);
+#if defined(HAVE_LIBJXL_THREADS)
+	if (runner != NULL) {
+		JxlThreadParallelRunnerDestroy(runner);
+	}
+#endif
+	bslice_release(&slice);
+	free(carry);
 
 	if (!success) {
 		image_free(img);
@@ -229,6 +316,59 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	return img;
 }
 
+#if defined(HAVE_LIBJXL_THREADS)
+// buf (長さ len) だけから画像の基本情報を取得できれば info に書き込んで
+// true を返す。データが足りなければ false を返す。
+static bool
+jxl_peek_basic_info(const uint8 *buf, size_t len, JxlBasicInfo *info)
+{
+	bool rv = false;
+
+	JxlDecoder *dec = JxlDecoderCreate(NULL);
+	if (dec == NULL) {
+		return false;
+	}
+	JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO);
+	if (JxlDecoderSetInput(dec, buf, len) == JXL_DEC_SUCCESS &&
+		JxlDecoderProcessInput(dec) == JXL_DEC_BASIC_INFO)
+	{
+		JxlDecoderGetBasicInfo(dec, info);
+		rv = true;
+	}
+	JxlDecoderDestroy(dec);
+	return rv;
+}
+#endif
+
+// hint の出力サイズを満たす最小の縮小率 n (1/n) を返す。
+// JXL のプログレッシブデコードでは 1/8 (DC), 1/4, 1/2, 1/1 の順に
+// 得られるので、そのうちのどれか。
+static uint
+jxl_target_ratio(const JxlBasicInfo *info, const image_read_hint *hint)
+{
+	uint width = info->xsize;
+	uint height = info->ysize;
+	uint pref_width;
+	uint pref_height;
+	uint ratio;
+
+	if (hint->width == 0 && hint->height == 0) {
+		return 1;
+	}
+	image_get_preferred_size(width, height,
+		hint->axis, hint->width, hint->height,
+		&pref_width, &pref_height);
+
+	for (ratio = 1; ratio < 8; ratio *= 2) {
+		if (width / (ratio * 2) < pref_width ||
+			height / (ratio * 2) < pref_height)
+		{
+			break;
+		}
+	}
+	return ratio;
+}
+
 static const char *
 primaries2str(JxlPrimaries val)
 {
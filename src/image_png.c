@@ -30,8 +30,17 @@
 
 #include "common.h"
 #include "image_priv.h"
+#include <string.h>
 #include <png.h>
 
+// pstream からの読み込み用。
+struct png_source {
+	struct pstream *ps;
+	struct bslice slice;	// 読みかけのスライス
+};
+
+static int png_find_pass(uint, uint, uint, uint);
+static void png_read_cb(png_structp, png_bytep, png_size_t);
 static const char *colortype2str(int type);
 
 bool
@@ -54,8 +63,11 @@ image_png_match(FILE *fp, const struct diag *diag)
 }
 
 struct image *
-image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
+image_png_read(struct pstream *ps, const image_read_hint *hint,
+	const struct diag *diag)
 {
+	volatile struct png_source src;
+	volatile struct image_scaler sc;
 	volatile png_structp png;
 	volatile png_infop info;
 	png_uint_32 width;
@@ -66,12 +78,20 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	int compression_type;
 	int filter_type;
 	int channels;
-	uint stride;
+	uint dst_width;
+	uint dst_height;
+	volatile uint8 *row;
 	volatile uint8 **lines;
+	volatile struct image *fullimg;
 	volatile struct image *img;
 
+	row = NULL;
 	lines = NULL;
+	fullimg = NULL;
 	img = NULL;
+	memset(UNVOLATILE(&src), 0, sizeof(src));
+	memset(UNVOLATILE(&sc), 0, sizeof(sc));
+	src.ps = ps;
 
 	png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
 		NULL, NULL, NULL);
@@ -86,12 +106,10 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 
 	// libpng 内のエラーからは大域ジャンプで戻ってくるらしい…
 	if (setjmp(png_jmpbuf(png))) {
-		image_free(UNVOLATILE(img));
-		img = NULL;
 		goto done;
 	}
 
-	png_init_io(png, fp);
+	png_set_read_fn(png, UNVOLATILE(&src), png_read_cb);
 
 	// ヘッダを読み込む。
 	png_read_info(png, info);
@@ -129,6 +147,23 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 		png_set_strip_16(png);
 	}
 
+	// 出力サイズを決める。拡大はしない (必要なら後段に任せる)。
+	image_get_read_size(width, height, hint, &dst_width, &dst_height);
+
+	// インターレース画像なら、出力サイズの2倍を満たす最初のパスだけで足りる。
+	// パスは元画像を間引いたものなので、ちょうどの大きさだと細い線などが
+	// 欠けてしまう。2倍あれば縮小時の平均でほぼ補える。
+	// 足りるパスがないか、最後までデコードする場合は全体を展開する。
+	int target_pass = -1;
+	if (interlace_type == PNG_INTERLACE_ADAM7) {
+		if (hint->no_progressive == false) {
+			target_pass = png_find_pass(width, height, dst_width, dst_height);
+		}
+		if (target_pass < 0) {
+			png_set_interlace_handling(png);
+		}
+	}
+
 	// 状態を更新してからチャンネル数を取得。bitdepth は 8 のはず?
 	png_read_update_info(png, info);
 	color_type = png_get_color_type(png, info);
@@ -138,36 +173,134 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	Debug(diag, "%s: Filt colortype=%s bitdepth=%d",
 		__func__, colortype2str(color_type), bitdepth);
 
-	// スキャンラインメモリのポインタ配列。
-	lines = malloc(sizeof(char *) * height);
-	if (lines == NULL) {
-		goto done;
-	}
-
 	uint fmt;
 	if (channels == 3) {
 		fmt = IMAGE_FMT_RGB24;
 	} else {
 		fmt = IMAGE_FMT_ARGB32;
 	}
-	img = image_create(width, height, fmt);
-	if (img == NULL) {
-		goto done;
-	}
 
-	stride = image_get_stride(UNVOLATILE(img));
-	for (int y = 0; y < height; y++) {
-		lines[y] = img->buf + y * stride;
+	if (interlace_type == PNG_INTERLACE_ADAM7 && target_pass < 0) {
+		// 全体を展開してから縮小する。
+		fullimg = image_create(width, height, fmt);
+		if (fullimg == NULL) {
+			goto done;
+		}
+		// スキャンラインメモリのポインタ配列。
+		lines = malloc(sizeof(char *) * height);
+		if (lines == NULL) {
+			goto done;
+		}
+		uint stride = image_get_stride(UNVOLATILE(fullimg));
+		for (int y = 0; y < height; y++) {
+			lines[y] = fullimg->buf + y * stride;
+		}
+		png_read_image(png, UNVOLATILE(lines));
+		png_read_end(png, info);
+
+		if (image_scaler_init(UNVOLATILE(&sc), width, height, fmt,
+				dst_width, dst_height) == false) {
+			goto done;
+		}
+		for (int y = 0; y < height; y++) {
+			image_scaler_put(UNVOLATILE(&sc), UNVOLATILE(lines[y]));
+		}
+	} else {
+		// 1ラスターずつ読み込みながら縮小する。
+		row = malloc(png_get_rowbytes(png, info));
+		if (row == NULL) {
+			goto done;
+		}
+
+		if (target_pass < 0) {
+			if (image_scaler_init(UNVOLATILE(&sc), width, height, fmt,
+					dst_width, dst_height) == false) {
+				goto done;
+			}
+			for (int y = 0; y < height; y++) {
+				png_read_row(png, UNVOLATILE(row), NULL);
+				image_scaler_put(UNVOLATILE(&sc), UNVOLATILE(row));
+			}
+			png_read_end(png, info);
+		} else {
+			// パスごとの縮小画像が順に並んでいるので、目的のパスより
+			// 前は読み捨て、目的のパスを読んだらそこで終わる。
+			uint pass_width = PNG_PASS_COLS(width, target_pass);
+			uint pass_height = PNG_PASS_ROWS(height, target_pass);
+			Debug(diag, "%s: Use pass %d (%u, %u)", __func__,
+				target_pass + 1, pass_width, pass_height);
+			for (int pass = 0; pass < target_pass; pass++) {
+				if (PNG_PASS_COLS(width, pass) == 0) {
+					continue;
+				}
+				uint rows = PNG_PASS_ROWS(height, pass);
+				for (uint y = 0; y < rows; y++) {
+					png_read_row(png, UNVOLATILE(row), NULL);
+				}
+			}
+			if (image_scaler_init(UNVOLATILE(&sc), pass_width, pass_height,
+					fmt, dst_width, dst_height) == false) {
+				goto done;
+			}
+			for (uint y = 0; y < pass_height; y++) {
+				png_read_row(png, UNVOLATILE(row), NULL);
+				image_scaler_put(UNVOLATILE(&sc), UNVOLATILE(row));
+			}
+		}
 	}
+	img = image_scaler_finish(UNVOLATILE(&sc));
 
-	png_read_image(png, UNVOLATILE(lines));
-	png_read_end(png, info);
  done:
+	image_scaler_cleanup(UNVOLATILE(&sc));
+	image_free(UNVOLATILE(fullimg));
+	bslice_release(UNVOLATILE(&src.slice));
+	free(UNVOLATILE(row));
 	free(lines);
 	png_destroy_read_struct(UNVOLATILE(&png), UNVOLATILE(&info), NULL);
 	return UNVOLATILE(img);
 }
 
+// Adam7 の7つのパスのうち、単体で dst_width x dst_height の縦横2倍以上の
+// 大きさを持つ最初のパス (0 から始まる) を返す。
+// 最後のパスでも高さは半分なので、見付からなければ -1 を返す。
+static int
+png_find_pass(uint width, uint height, uint dst_width, uint dst_height)
+{
+	for (int pass = 0; pass < PNG_INTERLACE_ADAM7_PASSES; pass++) {
+		if (PNG_PASS_COLS(width, pass) >= dst_width * 2 &&
+			PNG_PASS_ROWS(height, pass) >= dst_height * 2)
+		{
+			return pass;
+		}
+	}
+	return -1;
+}
+
+// libpng からの読み込み要求。
+// libpng は要求したバイト数が揃わなければエラーとするので揃うまで読む。
+// libpng 側のバッファへのコピーは避けられないが、それ以外はスライスの
+// まま扱う。
+static void
+png_read_cb(png_structp png, png_bytep dst, png_size_t length)
+{
+	struct png_source *src = png_get_io_ptr(png);
+
+	while (length > 0) {
+		if (src->slice.len == 0) {
+			bslice_release(&src->slice);
+			int n = pstream_read_slice(src->ps, &src->slice, IMAGE_BUFSIZE);
+			if (n <= 0) {
+				png_error(png, n < 0 ? "Read error" : "Unexpected EOF");
+			}
+		}
+		uint len = MIN(src->slice.len, length);
+		memcpy(dst, src->slice.ptr, len);
+		bslice_advance(&src->slice, len);
+		dst += len;
+		length -= len;
+	}
+}
+
 // PNG の color type のデバッグ表示用。
 static const char *
 colortype2str(int type)
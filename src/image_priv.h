@@ -72,37 +72,80 @@
 #define USE_LIBWEBP
 #endif
 
+typedef bool (*image_match_t)(FILE *, const struct diag *);
+typedef struct image *(*image_read_t)(FILE *, const image_read_hint *,
+	const struct diag *);
+// メモリ上のデータを受け付けるローダは pstream から直接
+// (pstream_read_slice() で) 読み込む。
+typedef struct image *(*image_read_ps_t)(struct pstream *,
+	const image_read_hint *, const struct diag *);
+
+// 行シンク。
+// ローダから入力ラスターを1本ずつ受け取りながら、内部形式 (ARGB16) に
+// 変換 (必要なら同時に縮小) した画像を作る。
+// 全体を RGB24/ARGB32 で展開してから image_convert_to16() するのに比べて
+// メモリは出力画像分で足り、画像全体をもう一度なめる必要もない。
+struct image_scaler {
+	struct image *img;	// 出力画像 (ARGB16)
+
+	uint srcwidth;		// 入力の幅
+	uint srcheight;		// 入力の高さ
+	uint srcfmt;		// 入力ラスターの形式 (RGB24 か ARGB32)
+	uint srcy;			// 次に受け取る入力ラスター
+	uint dsty;			// 書き出し中の出力ラスター
+	uint rows;			// acc に溜まっている入力ラスター数
+
+	uint *xmap;			// 入力の X 座標に対応する出力の X 座標
+	uint *xcount;		// 出力1ピクセルに入る入力の (横方向の) ピクセル数
+	uint64 *acc;		// 出力1ラスター分の累積 (1ピクセルが R,G,B,A の順)
+};
+
 // image.c
 extern struct image *image_create(uint, uint, uint);
+extern struct image *image_read_fp(FILE *, image_read_ps_t,
+	const image_read_hint *, const struct diag *);
+extern bool image_get_read_size(uint, uint, const image_read_hint *,
+	uint *, uint *);
+extern bool image_scaler_init(struct image_scaler *, uint, uint, uint,
+	uint, uint);
+extern void image_scaler_put(struct image_scaler *, const uint8 *);
+extern struct image *image_scaler_finish(struct image_scaler *);
+extern void image_scaler_cleanup(struct image_scaler *);
 
-// image_*.c
-typedef bool (*image_match_t)(FILE *, const struct diag *);
-typedef struct image *(*image_read_t)(FILE *, const image_read_hint *,
+// image_blurhash.c
+extern struct image *image_blurhash_read_exact(FILE *, int, int,
 	const struct diag *);
+
+// image_*.c
 #define IMAGE_HANDLER(name)	\
 	extern bool image_##name##_match(FILE *, const struct diag *);	\
 	extern struct image *image_##name##_read(FILE *,	\
 		const image_read_hint *, const struct diag *)
+#define IMAGE_HANDLER_PS(name)	\
+	extern bool image_##name##_match(FILE *, const struct diag *);	\
+	extern struct image *image_##name##_read(struct pstream *,	\
+		const image_read_hint *, const struct diag *)
 
 IMAGE_HANDLER(bmp);
 IMAGE_HANDLER(gif);
 IMAGE_HANDLER(ico);
 IMAGE_HANDLER(jpeg);
-IMAGE_HANDLER(jxl);
+IMAGE_HANDLER_PS(jxl);
 IMAGE_HANDLER(mag);
-IMAGE_HANDLER(png);
+IMAGE_HANDLER_PS(png);
 IMAGE_HANDLER(pnm1);
 IMAGE_HANDLER(pnm2);
 IMAGE_HANDLER(pnm3);
 IMAGE_HANDLER(pnm4);
 IMAGE_HANDLER(pnm5);
 IMAGE_HANDLER(pnm6);
-IMAGE_HANDLER(stb);
+IMAGE_HANDLER_PS(stb);
 IMAGE_HANDLER(tiff);
-IMAGE_HANDLER(webp);
+IMAGE_HANDLER_PS(webp);
 IMAGE_HANDLER(ypic);
 
 #undef IMAGE_HANDLER
+#undef IMAGE_HANDLER_PS
 
 // R5,G5,B5 を内部形式に変換。
 static inline uint16
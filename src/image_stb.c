@@ -74,6 +74,17 @@ _Pragma("clang diagnostic pop")
 _Pragma("GCC diagnostic pop")
 #endif
 
+// pstream からの読み込み用。
+struct stb_source {
+	struct pstream *ps;
+	struct bslice slice;	// 読みかけのスライス
+	bool eof;
+};
+
+static int  stb_read_cb(void *, char *, int);
+static void stb_skip_cb(void *, int);
+static int  stb_eof_cb(void *);
+
 bool
 image_stb_match(FILE *fp, const struct diag *diag)
 {
@@ -87,38 +98,132 @@ image_stb_match(FILE *fp, const struct diag *diag)
 }
 
 struct image *
-image_stb_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
+image_stb_read(struct pstream *ps, const image_read_hint *hint,
+	const struct diag *diag)
 {
+	static const stbi_io_callbacks cb = {
+		.read = stb_read_cb,
+		.skip = stb_skip_cb,
+		.eof  = stb_eof_cb,
+	};
+	struct stb_source src;
+	struct image_scaler sc;
 	struct image *img;
 	stbi_uc *data;
+	uint8 *rowbuf;
 	int width;
 	int height;
 	int nch;
 	uint fmt;
+	uint dst_width;
+	uint dst_height;
 
-	// A があれば ARGB で、なければ RGB で読み込む。
-	if (stbi_info_from_file(fp, &width, &height, &nch) == 0) {
-		return NULL;
-	}
-	if (nch != 3 && nch != 4) {
-		nch = 3;
-	}
-	data = stbi_load_from_file(fp, &width, &height, &nch, nch);
+	memset(&src, 0, sizeof(src));
+	src.ps = ps;
+
+	// 元のチャンネル数のまま読み込み、A があれば ARGB で、
+	// なければ RGB にする。
+	data = stbi_load_from_callbacks(&cb, &src, &width, &height, &nch, 0);
+	bslice_release(&src.slice);
 	if (data == NULL) {
 		return NULL;
 	}
 
-	if (nch == 3) {
-		fmt = IMAGE_FMT_RGB24;
-	} else {
+	if (nch == 4) {
 		fmt = IMAGE_FMT_ARGB32;
+	} else {
+		fmt = IMAGE_FMT_RGB24;
 	}
 
-	img = image_create(width, height, fmt);
-	if (img != NULL) {
-		memcpy(img->buf, data, width * height * nch);
+	// 1ラスターずつ行シンクに渡す。
+	img = NULL;
+	rowbuf = NULL;
+	image_get_read_size(width, height, hint, &dst_width, &dst_height);
+	if (image_scaler_init(&sc, width, height, fmt, dst_width, dst_height)
+		== false)
+	{
+		goto done;
 	}
+	if (nch == 3 || nch == 4) {
+		for (uint y = 0; y < height; y++) {
+			image_scaler_put(&sc, data + y * width * nch);
+		}
+	} else {
+		// グレースケール (と A) は RGB に展開する。A は捨てる。
+		rowbuf = malloc(width * 3);
+		if (rowbuf == NULL) {
+			goto done;
+		}
+		for (uint y = 0; y < height; y++) {
+			const stbi_uc *s = data + y * width * nch;
+			uint8 *d = rowbuf;
+			for (uint x = 0; x < width; x++) {
+				d[0] = d[1] = d[2] = s[0];
+				s += nch;
+				d += 3;
+			}
+			image_scaler_put(&sc, rowbuf);
+		}
+	}
+	img = image_scaler_finish(&sc);
 
+ done:
+	image_scaler_cleanup(&sc);
+	free(rowbuf);
 	stbi_image_free(data);
 	return img;
 }
+
+// stb_image からの読み込み要求。
+static int
+stb_read_cb(void *arg, char *dst, int size)
+{
+	struct stb_source *src = arg;
+	int total = 0;
+
+	while (total < size) {
+		if (src->slice.len == 0) {
+			bslice_release(&src->slice);
+			int n = pstream_read_slice(src->ps, &src->slice, IMAGE_BUFSIZE);
+			if (n <= 0) {
+				src->eof = true;
+				break;
+			}
+		}
+		uint len = MIN(src->slice.len, size - total);
+		memcpy(dst + total, src->slice.ptr, len);
+		bslice_advance(&src->slice, len);
+		total += len;
+	}
+	return total;
+}
+
+// stb_image からの読み飛ばし要求。
+// 負数 (巻き戻し) は出来ないので無視する。
+static void
+stb_skip_cb(void *arg, int n)
+{
+	struct stb_source *src = arg;
+
+	while (n > 0) {
+		if (src->slice.len == 0) {
+			bslice_release(&src->slice);
+			if (pstream_read_slice(src->ps, &src->slice, IMAGE_BUFSIZE) <= 0) {
+				src->eof = true;
+				break;
+			}
+		}
+		uint len = MIN(src->slice.len, n);
+		bslice_advance(&src->slice, len);
+		n -= len;
+	}
+}
+
+// stb_image からの EOF 問い合わせ。
+static int
+stb_eof_cb(void *arg)
+{
+	const struct stb_source *src = arg;
+
+	return src->eof;
+}
@@ -33,6 +33,7 @@
 #include "common.h"
 #include "image_priv.h"
 #include <err.h>
+#include <string.h>
 #include <tiffio.h>
 
 static tmsize_t tiff_read(thandle_t, void *, tmsize_t);
@@ -41,6 +42,11 @@ static toff_t   tiff_seek(thandle_t, toff_t, int);
 static int      tiff_close(thandle_t);
 static toff_t   tiff_size(thandle_t);
 static void     tiff_null_error_handler(const char *, const char *, va_list);
+static void tiff_select_level(TIFF *, uint, uint, const struct diag *);
+static bool tiff_read_strips(TIFF *, struct image_scaler *, uint, uint,
+	const struct diag *);
+static bool tiff_read_tiles(TIFF *, struct image_scaler *, uint, uint,
+	const struct diag *);
 static const char *photometric2str(uint16_t);
 
 bool
@@ -72,15 +78,20 @@ image_tiff_match(FILE *fp, const struct diag *diag)
 }
 
 struct image *
-image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
+image_tiff_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 {
 	TIFF *tiff;
+	struct image_scaler sc;
 	struct image *img;
+	uint dst_width;
+	uint dst_height;
 	uint32_t width;
 	uint32_t height;
 	uint16_t bits_per_sample;
 	uint16_t samples_per_pixel;
 	uint16_t photo_metric;
+	uint16_t planar_config;
+	bool ok;
 
 	tiff = TIFFClientOpen("<input>", "r", fp,
 		tiff_read,
@@ -93,17 +104,41 @@ image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 		warn("%s: TIFFClientOpen failed", __func__);
 		return NULL;
 	}
+	img = NULL;
+	memset(&sc, 0, sizeof(sc));
 
+	// 出力サイズは元画像 (最初の IFD) の大きさから決める。
+	// 縮小版があれば、それを満たす一番小さいものから読み込む。
 	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
 	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+	if (image_get_read_size(width, height, hint, &dst_width, &dst_height)) {
+		tiff_select_level(tiff, dst_width, dst_height, diag);
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+	}
+
 	TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
 	TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
 	TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photo_metric);
-	Debug(diag, "%s: PhotoMetric=%s BitsPerSample=%u SamplesPerPixel=%u",
-		__func__, photometric2str(photo_metric),
-		bits_per_sample, samples_per_pixel);
+	TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar_config);
+	Debug(diag, "%s: %ux%u%s PhotoMetric=%s BitsPerSample=%u "
+		"SamplesPerPixel=%u", __func__,
+		width, height, (TIFFIsTiled(tiff) ? " tiled" : ""),
+		photometric2str(photo_metric), bits_per_sample, samples_per_pixel);
+	if (planar_config != PLANARCONFIG_CONTIG) {
+		warnx("%s: PlanarConfig=%u not supported", __func__, planar_config);
+		goto done;
+	}
+	// 行シンクにはスキャンラインをそのまま渡すので、
+	// 8ビットの RGB か RGBA でなければならない。
+	if (bits_per_sample != 8 ||
+	    (samples_per_pixel != 3 && samples_per_pixel != 4))
+	{
+		warnx("%s: BitsPerSample=%u SamplesPerPixel=%u not supported",
+			__func__, bits_per_sample, samples_per_pixel);
+		goto done;
+	}
 
-	// 雑。
 	uint fmt;
 	if (samples_per_pixel == 4) {
 		fmt = IMAGE_FMT_ARGB32;
@@ -111,23 +146,199 @@ image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 		fmt = IMAGE_FMT_RGB24;
 	}
 
-	img = image_create(width, height, fmt);
-	if (img == NULL) {
+	// ストリップかタイルごとに展開して、1ラスターずつ行シンクに渡す。
+	if (image_scaler_init(&sc, width, height, fmt, dst_width, dst_height)
+		== false)
+	{
+		warn("%s: image_scaler_init failed", __func__);
 		goto done;
 	}
-
-	uint8_t *d = img->buf;
-	uint32_t stride = image_get_stride(img);
-	for (uint y = 0; y < height; y++) {
-		TIFFReadScanline(tiff, d, y, samples_per_pixel);
-		d += stride;
+	if (TIFFIsTiled(tiff)) {
+		ok = tiff_read_tiles(tiff, &sc, width, height, diag);
+	} else {
+		ok = tiff_read_strips(tiff, &sc, width, height, diag);
+	}
+	if (ok) {
+		img = image_scaler_finish(&sc);
 	}
 
  done:
+	image_scaler_cleanup(&sc);
 	TIFFClose(tiff);
 	return img;
 }
 
+// 最初の IFD の縮小版 (SubIFD か、縮小版とマークされた後続の IFD) の
+// うち、dst_width x dst_height 以上で一番小さいものを現在の IFD にする。
+// 該当するものがなければ最初の IFD のまま。
+static void
+tiff_select_level(TIFF *tiff, uint dst_width, uint dst_height,
+	const struct diag *diag)
+{
+	uint32_t width;
+	uint32_t height;
+	uint16_t nsubifd;
+	uint64_t *subifd;
+	uint64_t *offsets = NULL;
+	uint64_t best_offset = 0;
+	uint64 best_size;
+	uint n = 0;
+
+	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+	best_size = (uint64)width * height;
+
+	// SubIFD の配列は IFD を移動すると無効になるのでコピーしておく。
+	if (TIFFGetField(tiff, TIFFTAG_SUBIFD, &nsubifd, &subifd) && nsubifd > 0) {
+		offsets = malloc(sizeof(uint64_t) * nsubifd);
+		if (offsets == NULL) {
+			return;
+		}
+		memcpy(offsets, subifd, sizeof(uint64_t) * nsubifd);
+	} else {
+		nsubifd = 0;
+	}
+
+	// 後続の IFD から先に調べる。
+	// 縮小版とマークされていない IFD は別の画像 (ページ) なので対象外。
+	while (TIFFReadDirectory(tiff)) {
+		uint32_t subfiletype;
+		if (TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfiletype) == 0 ||
+			(subfiletype & FILETYPE_REDUCEDIMAGE) == 0)
+		{
+			continue;
+		}
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+		Trace(diag, "%s: IFD %ux%u", __func__, width, height);
+		n++;
+		if (width >= dst_width && height >= dst_height &&
+			(uint64)width * height < best_size)
+		{
+			best_offset = TIFFCurrentDirOffset(tiff);
+			best_size = (uint64)width * height;
+		}
+	}
+
+	for (uint i = 0; i < nsubifd; i++) {
+		if (TIFFSetSubDirectory(tiff, offsets[i]) == 0) {
+			continue;
+		}
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+		Trace(diag, "%s: SubIFD %ux%u", __func__, width, height);
+		n++;
+		if (width >= dst_width && height >= dst_height &&
+			(uint64)width * height < best_size)
+		{
+			best_offset = offsets[i];
+			best_size = (uint64)width * height;
+		}
+	}
+	free(offsets);
+
+	if (best_offset != 0 && TIFFSetSubDirectory(tiff, best_offset)) {
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+		Debug(diag, "%s: use reduced image %ux%u (of %u levels)",
+			__func__, width, height, n);
+	} else {
+		TIFFSetDirectory(tiff, 0);
+	}
+}
+
+// ストリップ形式の画像をストリップ単位で読み込んで sc に渡す。
+static bool
+tiff_read_strips(TIFF *tiff, struct image_scaler *sc, uint width, uint height,
+	const struct diag *diag)
+{
+	uint32_t rows_per_strip;
+	uint8_t *buf;
+	bool rv = false;
+
+	TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+	rows_per_strip = MIN(rows_per_strip, height);
+	uint rowsize = TIFFScanlineSize(tiff);
+	uint stripsize = TIFFStripSize(tiff);
+
+	// 1ラスターは行シンクが読む大きさ (幅 x 3 か 4 バイト) ちょうど。
+	buf = malloc(stripsize);
+	if (buf == NULL) {
+		warn("%s: malloc failed", __func__);
+		return false;
+	}
+
+	for (uint y = 0, strip = 0; y < height; y += rows_per_strip, strip++) {
+		uint rows = MIN(rows_per_strip, height - y);
+		if (TIFFReadEncodedStrip(tiff, strip, buf, rows * rowsize) < 0) {
+			warnx("%s: TIFFReadEncodedStrip failed at y=%u", __func__, y);
+			goto done;
+		}
+		for (uint i = 0; i < rows; i++) {
+			image_scaler_put(sc, buf + i * rowsize);
+		}
+	}
+	rv = true;
+
+ done:
+	free(buf);
+	return rv;
+}
+
+// タイル形式の画像をタイル1段ずつ読み込んで sc に渡す。
+// 保持するのは全幅 x タイルの高さ分だけ。
+static bool
+tiff_read_tiles(TIFF *tiff, struct image_scaler *sc, uint width, uint height,
+	const struct diag *diag)
+{
+	uint32_t tile_width;
+	uint32_t tile_height;
+	uint8_t *tilebuf;
+	uint8_t *band;
+	bool rv = false;
+
+	TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tile_width);
+	TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tile_height);
+	uint rowsize = TIFFScanlineSize(tiff);
+	uint tilerowsize = TIFFTileRowSize(tiff);
+	Debug(diag, "%s: tile %ux%u", __func__, tile_width, tile_height);
+
+	// 1ラスターは行シンクが読む大きさ (幅 x 3 か 4 バイト) ちょうど。
+	tilebuf = malloc(TIFFTileSize(tiff));
+	band = malloc(rowsize * tile_height);
+	if (tilebuf == NULL || band == NULL) {
+		warn("%s: malloc failed", __func__);
+		goto done;
+	}
+
+	for (uint y = 0; y < height; y += tile_height) {
+		uint rows = MIN(tile_height, height - y);
+
+		// 1段分のタイルを並べる。右端のタイルは画像からはみ出た分を捨てる。
+		for (uint x = 0, off = 0; x < width; x += tile_width) {
+			if (TIFFReadTile(tiff, tilebuf, x, y, 0, 0) < 0) {
+				warnx("%s: TIFFReadTile failed at (%u,%u)", __func__, x, y);
+				goto done;
+			}
+			uint len = MIN(tilerowsize, rowsize - off);
+			for (uint i = 0; i < rows; i++) {
+				memcpy(band + i * rowsize + off, tilebuf + i * tilerowsize, len);
+			}
+			off += tilerowsize;
+		}
+
+		for (uint i = 0; i < rows; i++) {
+			image_scaler_put(sc, band + i * rowsize);
+		}
+	}
+	rv = true;
+
+ done:
+	free(tilebuf);
+	free(band);
+	return rv;
+}
+
 // コールバック
 
 static tmsize_t
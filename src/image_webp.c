@@ -49,9 +49,15 @@ _Pragma("clang diagnostic pop")
 _Pragma("GCC diagnostic pop")
 #endif
 
-static bool read_all(uint8 **, size_t *, FILE *, uint32, const struct diag *);
-static bool image_webp_loadinc(struct image *, FILE *, WebPIDecoder *,
-	const struct diag *);
+static bool read_all(const uint8 **, size_t *, uint8 **, struct pstream *,
+	uint32, const struct diag *);
+static void set_scaling(WebPDecoderConfig *, const image_read_hint *,
+	uint *, uint *, const struct diag *);
+static void set_output(WebPDecoderConfig *, struct image *, WEBP_CSP_MODE);
+static bool decode_rgba(struct image *, const uint8 *, size_t,
+	WebPDecoderConfig *, const struct diag *);
+static bool image_webp_loadinc(struct image *, struct pstream *, int,
+	WebPIDecoder *, const struct diag *);
 
 bool
 image_webp_match(FILE *fp, const struct diag *diag)
@@ -73,42 +79,60 @@ image_webp_match(FILE *fp, const struct diag *diag)
 }
 
 struct image *
-image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
+image_webp_read(struct pstream *ps, const image_read_hint *hint,
+	const struct diag *diag)
 {
+	struct bslice head;
 	uint8 *filebuf = NULL;
-	size_t filecap = 0;
-	size_t filelen = 0;
+	const uint8 *data = NULL;
+	size_t datalen = 0;
 	struct image *img = NULL;
 	WebPDecoderConfig config;
 	VP8StatusCode r;
-	size_t n;
 	bool success;
 
 	success = false;
+	memset(&head, 0, sizeof(head));
 
 	WebPInitDecoderConfig(&config);
 	config.options.no_fancy_upsampling = 1;
 
 	// まず Features を取得できる分だけ読み込む。
+	// data, datalen がここまでに読み込んだ先頭からの連続領域。
+	// ほとんどの場合は最初のスライスに収まるのでそれをそのまま使い、
+	// 収まらなかった時だけ filebuf に連結する。
 	r = VP8_STATUS_BITSTREAM_ERROR;
 	do {
-		size_t newcap = filecap + 64;
-		uint8 *newbuf = realloc(filebuf, newcap);
-		if (newbuf == NULL) {
-			warn("%s: realloc(%zu) failed", __func__, newcap);
-			goto abort;
+		struct bslice slice;
+		int n = pstream_read_slice(ps, &slice, UINT32_MAX);
+		if (n <= 0) {
+			break;
 		}
-		filebuf = newbuf;
-		filecap = newcap;
 
-		n = fread(filebuf + filelen, 1, filecap - filelen, fp);
-		if (n == 0) {
-			break;
+		if (data == NULL) {
+			head = slice;
+			data = head.ptr;
+			datalen = head.len;
+		} else {
+			uint8 *newbuf = realloc(filebuf, datalen + n);
+			if (newbuf == NULL) {
+				warn("%s: realloc(%zu) failed", __func__, datalen + n);
+				bslice_release(&slice);
+				goto abort;
+			}
+			if (filebuf == NULL) {
+				memcpy(newbuf, head.ptr, head.len);
+				bslice_release(&head);
+			}
+			filebuf = newbuf;
+			memcpy(filebuf + datalen, slice.ptr, n);
+			bslice_release(&slice);
+			data = filebuf;
+			datalen += n;
 		}
-		filelen += n;
 
 		// Feature を取得。
-		r = WebPGetFeatures(filebuf, filelen, &config.input);
+		r = WebPGetFeatures(data, datalen, &config.input);
 	} while (r == VP8_STATUS_NOT_ENOUGH_DATA);
 
 	if (r == VP8_STATUS_BITSTREAM_ERROR) {
@@ -123,10 +147,10 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 
 	// ファイルサイズを取得。
 	// +4バイト目から4バイトが 8バイト目以降のファイルサイズ(LE)。
-	uint filesize = (uint)(filebuf[4]
-				| (filebuf[5] << 8)
-				| (filebuf[6] << 16)
-				| (filebuf[7] << 24));
+	uint filesize = (uint)(data[4]
+				| (data[5] << 8)
+				| (data[6] << 16)
+				| (data[7] << 24));
 	filesize += 8;
 
 	uint width = config.input.width;
@@ -161,25 +185,25 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		WebPDemuxer *demux = NULL;
 		WebPAnimDecoder *dec = NULL;
 		WebPAnimDecoderOptions opt;
-		WebPData data;
+		WebPData webpdata;
+		WebPIterator iter;
 		uint8 *outbuf;
 		int timestamp;
 
-		img = image_create(width, height, IMAGE_FMT_ARGB32);
-
 		// ファイル全体を読み込む。
-		if (read_all(&filebuf, &filelen, fp, filesize, diag) == false) {
+		if (read_all(&data, &datalen, &filebuf, ps, filesize, diag) == false)
+		{
 			warnx("%s: read_all failed", __func__);
 			goto abort_anime;
 		}
 
 		WebPAnimDecoderOptionsInit(&opt);
 		opt.color_mode = MODE_RGBA;
-		data.bytes = filebuf;
-		data.size = filelen;
+		webpdata.bytes = data;
+		webpdata.size = datalen;
 
 		// ページ数(フレーム数)を取得。
-		demux = WebPDemux(&data);
+		demux = WebPDemux(&webpdata);
 		if (demux == NULL) {
 			warnx("%s: WebPDemux() failed", __func__);
 			goto abort_anime;
@@ -191,7 +215,33 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			errx(1, "%s: No page found: %u", __func__, hint->page);
 		}
 
-		dec = WebPAnimDecoderNew(&data, &opt);
+		// 先頭フレームがキャンバス全域を覆っていれば、先頭ページは
+		// そのフレーム単体なので、合成せずに (縮小しながら) デコードできる。
+		if (hint->page == 0 && WebPDemuxGetFrame(demux, 1, &iter)) {
+			bool whole = (iter.x_offset == 0 && iter.y_offset == 0 &&
+				iter.width == (int)width && iter.height == (int)height);
+			if (whole) {
+				Debug(diag, "%s: decode the first frame directly", __func__);
+				set_scaling(&config, hint, &width, &height, diag);
+				img = image_create(width, height, IMAGE_FMT_ARGB32);
+				if (img) {
+					success = decode_rgba(img,
+						iter.fragment.bytes, iter.fragment.size, &config, diag);
+				}
+			}
+			WebPDemuxReleaseIterator(&iter);
+			if (whole) {
+				goto abort_anime;
+			}
+		}
+
+		// それ以外はフレームを合成するので元の大きさのまま。
+		img = image_create(width, height, IMAGE_FMT_ARGB32);
+		if (img == NULL) {
+			goto abort_anime;
+		}
+
+		dec = WebPAnimDecoderNew(&webpdata, &opt);
 		if (dec == NULL) {
 			warnx("%s: WebpAnimDecoderNew() failed", __func__);
 			goto abort_anime;
@@ -220,58 +270,38 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			WebPAnimDecoderDelete(dec);
 		}
 
-	} else if (config.input.has_alpha) {
-		// アルファチャンネルがあるとインクリメンタル処理できないっぽい?
-		Debug(diag, "%s: use RGBA decoder", __func__);
-
-		img = image_create(width, height, IMAGE_FMT_ARGB32);
-
-		// ファイル全体を読み込む。
-		if (read_all(&filebuf, &filelen, fp, filesize, diag) == false) {
-			warnx("%s: read_all failed", __func__);
-			goto abort;
-		}
-
-		// RGBA 出力バッファを用意。
-		uint outstride = width * 4;
-		uint outbufsize = outstride * height;
-
-		// RGBA で出力。
-		config.output.colorspace = MODE_RGBA;
-		config.output.u.RGBA.size = outbufsize;
-		config.output.u.RGBA.stride = outstride;
-		int status = WebPDecode(filebuf, filelen, &config);
-		if (status != VP8_STATUS_OK) {
-			warnx("%s: WebpDecode() failed", __func__);
-			goto abort_alpha;
-		}
-
-		memcpy(img->buf, config.output.u.RGBA.rgba, outbufsize);
-		success = true;
- abort_alpha:
-		WebPFreeDecBuffer(&config.output);
-
 	} else {
 		// インクリメンタル処理が出来る。
-		Debug(diag, "%s: use incremental RGB decoder", __func__);
-
-		img = image_create(width, height, IMAGE_FMT_RGB24);
+		// アルファチャンネルがあれば RGBA で、なければ RGB で出力する。
+		// ファイル全体を読み込むのを待たずに、届いた分からデコードする。
+		bool has_alpha = config.input.has_alpha;
+		Debug(diag, "%s: use incremental %s decoder", __func__,
+			(has_alpha ? "RGBA" : "RGB"));
+
+		set_scaling(&config, hint, &width, &height, diag);
+		img = image_create(width, height,
+			(has_alpha ? IMAGE_FMT_ARGB32 : IMAGE_FMT_RGB24));
+		if (img == NULL) {
+			goto abort;
+		}
 
-		WebPIDecoder *idec = WebPINewDecoder(NULL);
+		// img に直接デコードさせる。
+		set_output(&config, img, (has_alpha ? MODE_RGBA : MODE_RGB));
+		WebPIDecoder *idec = WebPIDecode(NULL, 0, &config);
 		if (idec == NULL) {
-			warnx("%s: WebPINewDecoder() failed", __func__);
+			warnx("%s: WebPIDecode() failed", __func__);
 			goto abort_inc;
 		}
 
 		// 読み込み済みの部分だけ先に処理。
 		// 全域読み終えていたら 0、そうでなければ SUSPENDED になるはず。
-		int status = WebPIAppend(idec, filebuf, filelen);
+		int status = WebPIAppend(idec, data, datalen);
 		if (status != 0 && status != VP8_STATUS_SUSPENDED) {
 			warnx("%s: WebPIAppend(first) failed: %d", __func__, status);
 			goto abort_inc;
 		}
 
-		success = image_webp_loadinc(img, fp, idec, diag);
+		success = image_webp_loadinc(img, ps, status, idec, diag);
  abort_inc:
 		if (idec) {
 			WebPIDelete(idec);
@@ -279,6 +309,7 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	}
 
  abort:
+	bslice_release(&head);
 	free(filebuf);
 	if (success == false) {
 		image_free(img);
@@ -287,97 +318,133 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	return img;
 }
 
-// *buf から始まる長さ *buflen (長さは 0 ではないかも知れない) のバッファを
-// newsize にリサイズし、そこに fp から読み込んで追加する。
-// 成功すれば、buf と buflen を更新し true を返す。
+// 先頭から読み込み済みの *datap (長さ *datalenp) に続けて、ファイル全体
+// newsize バイトを連続領域に読み込む。
+// 読み込み済みの部分で足りていればそのまま (コピーせずに) 使う。
+// 足りなければ *filebufp を newsize に確保し直し、そこに連結する。
+// 成功すれば、*datap と *datalenp を更新し true を返す。
 // 失敗すれば、デバッグログを表示し false を返す。
 static bool
-read_all(uint8 **bufp, size_t *buflenp, FILE *fp, uint32 newsize,
-	const struct diag *diag)
+read_all(const uint8 **datap, size_t *datalenp, uint8 **filebufp,
+	struct pstream *ps, uint32 newsize, const struct diag *diag)
 {
-	uint8 *buf = *bufp;
-	size_t len = *buflenp;
-	size_t pos = len;
+	size_t pos = *datalenp;
 
-	uint8 *newbuf = realloc(buf, newsize);
+	if (pos >= newsize) {
+		*datalenp = newsize;
+		return true;
+	}
+
+	uint8 *newbuf = realloc(*filebufp, newsize);
 	if (newbuf == NULL) {
 		Debug(diag, "%s: realloc(%u) failed", __func__, newsize);
 		return false;
 	}
-	buf = newbuf;
-	len = newsize;
+	if (*filebufp == NULL) {
+		// まだスライスを直接使っていたのでここでコピーする。
+		memcpy(newbuf, *datap, pos);
+	}
 	// 更新出来たこの時点でもう書き戻しておくほうがいい。
-	*bufp = buf;
-	*buflenp = len;
-
-	while (pos < newsize) {
-		size_t n = fread(buf + pos, 1, len - pos, fp);
-		if (n == 0) {
-			Debug(diag, "%s: fread: Unexpected EOF", __func__);
-			return false;
-		}
-		pos += n;
+	*filebufp = newbuf;
+	*datap = newbuf;
+
+	int n = pstream_read(ps, newbuf + pos, newsize - pos);
+	if (n < 0) {
+		Debug(diag, "%s: pstream_read failed: %s", __func__, strerrno());
+		*datalenp = pos;
+		return false;
+	}
+	*datalenp = pos + n;
+	if (pos + n < newsize) {
+		Debug(diag, "%s: Unexpected EOF", __func__);
+		return false;
 	}
 
 	return true;
 }
 
-// インクリメンタル処理が出来る場合。
+// hint に大きさの指定があって元画像より小さければ、デコーダで縮小する
+// よう config に設定する。libwebp はデコードしながら縮小できるので、
+// 元の大きさの画像を作ってから縮小するより速くてメモリも少ない。
+// 拡大はしない (必要なら後段に任せる)。
+// *widthp, *heightp は元画像の大きさを渡し、出力される大きさが返る。
+static void
+set_scaling(WebPDecoderConfig *config, const image_read_hint *hint,
+	uint *widthp, uint *heightp, const struct diag *diag)
+{
+	uint width = *widthp;
+	uint height = *heightp;
+	uint pref_width;
+	uint pref_height;
+
+	if (image_get_read_size(width, height, hint,
+			&pref_width, &pref_height) == false) {
+		return;
+	}
+
+	config->options.use_scaling = 1;
+	config->options.scaled_width = pref_width;
+	config->options.scaled_height = pref_height;
+	Debug(diag, "%s: OrigSize=(%u, %u) scaled=(%u, %u)", __func__,
+		width, height, pref_width, pref_height);
+
+	*widthp = pref_width;
+	*heightp = pref_height;
+}
+
+// デコーダが img->buf に colorspace で直接書き込むよう config に設定する。
+// image はパディングがないので1ラスター分はストライドでいい。
+static void
+set_output(WebPDecoderConfig *config, struct image *img,
+	WEBP_CSP_MODE colorspace)
+{
+	uint stride = image_get_stride(img);
+
+	config->output.colorspace = colorspace;
+	config->output.is_external_memory = 1;
+	config->output.u.RGBA.rgba = img->buf;
+	config->output.u.RGBA.stride = stride;
+	config->output.u.RGBA.size = stride * img->height;
+}
+
+// data (長さ datalen) を img に RGBA でデコードする。
+// アニメーションのフレーム単体をデコードする時に使う。
 static bool
-image_webp_loadinc(struct image *img, FILE *fp, WebPIDecoder *idec,
-	const struct diag *diag)
+decode_rgba(struct image *img, const uint8 *data, size_t datalen,
+	WebPDecoderConfig *config, const struct diag *diag)
 {
-	uint8 *buf;
-	int status;
-	int srcstride;
-	const uint8 *s;
-	uint8 *d;
-	bool rv;
-
-	rv = false;
-
-	const size_t bufsize = IMAGE_BUFSIZE;
-	buf = malloc(bufsize);
-	if (buf == NULL) {
-		warn("%s: malloc(%zu) failed", __func__, bufsize);
+	set_output(config, img, MODE_RGBA);
+	int status = WebPDecode(data, datalen, config);
+	if (status != VP8_STATUS_OK) {
+		warnx("%s: WebpDecode() failed: %d", __func__, status);
 		return false;
 	}
+	return true;
+}
 
-	// もう全部読めてるかも知れないので status の初期値は _OK。
-	status = VP8_STATUS_OK;
-	do {
-		size_t n = fread(buf, 1, bufsize, fp);
-		if (n == 0) {
+// インクリメンタル処理。RGB でも RGBA でも同じ。
+// WebPIAppend() は入力をデコーダ内にコピーするので、スライスのまま渡す。
+// デコード結果は set_output() で指定した img に直接書き込まれる。
+// status は読み込み済みの部分を渡した WebPIAppend() の戻り値。
+static bool
+image_webp_loadinc(struct image *img, struct pstream *ps, int status,
+	WebPIDecoder *idec, const struct diag *diag)
+{
+	// SUSPENDED のまま入力が終わったら途中で切れている。
+	while (status == VP8_STATUS_SUSPENDED) {
+		struct bslice slice;
+		int n = pstream_read_slice(ps, &slice, UINT32_MAX);
+		if (n <= 0) {
 			break;
 		}
-		status = WebPIAppend(idec, buf, n);
-	} while (status == VP8_STATUS_SUSPENDED);
+		status = WebPIAppend(idec, slice.ptr, slice.len);
+		bslice_release(&slice);
+	}
 
 	if (status != VP8_STATUS_OK) {
 		warnx("%s: Decode failed by %d", __func__, status);
-		goto done;
-	}
-
-	// RGB バッファを取得。
-	s = WebPIDecGetRGB(idec, NULL, NULL, NULL, &srcstride);
-	if (s == NULL) {
-		warnx("%s: WebPIDecGetRGB() failed", __func__);
-		goto done;
-	}
-
-	// そのままコピー出来る。
-	// image はパディングがないので1ラスター分はストライドでいい。
-	uint dststride = image_get_stride(img);
-	uint height = img->height;
-	d = img->buf;
-	for (uint y = 0; y < height; y++) {
-		memcpy(d, s, dststride);
-		s += srcstride;
-		d += dststride;
+		return false;
 	}
 
-	rv = true;
- done:
-	free(buf);
-	return rv;
+	return true;
 }
@@ -0,0 +1,742 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2023-2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// MFM (本文中のマークアップ) の整形
+//
+
+#include "sayaka.h"
+#include <string.h>
+
+struct context;
+
+static void kwtrie_init(void);
+static uint kwtrie_match(const unichar *, uint *);
+static int  tagset_match(const struct tagset *, const unichar *, uint *);
+static void state_push(struct context *, uint);
+static bool state_pop(struct context *);
+static void state_enter(struct context *, uint);
+static void state_leave(struct context *, uint);
+static const char *mfm_style_begin(uint);
+static const char *mfm_style_end(uint);
+
+enum {
+	S_NONE = 0,
+	S_RAWTEXT,		// 地のテキスト
+	S_PLAIN,		// <plain>〜</plain> 内
+	S_BACKTICK1,	// `〜` 内
+	S_BACKTICK3,	// ```〜``` 内
+	S_MENTION,		// @mention、色を変える
+	S_URL,			// URL、色を変える
+	S_RUBY1,		// ルビの本文1
+	S_RUBY2,		// ルビの本文2
+	S_UNSUPP_MFM,	// 未サポートの MFM コンテンツ内
+};
+
+struct context {
+	ustring *dst;
+
+	// states[] はスタックで [0] が底。[state_top] がトップ。
+	uint8 states[128];	// 上限は適当。
+	int state_top;
+
+	// URL 中の丸括弧。
+	int paren_in_url;
+};
+
+static inline uint
+state_get(const struct context *ctx)
+{
+	return ctx->states[ctx->state_top];
+}
+
+// 文字種。ASCII の範囲のみ。
+// 記号をどれだけ含むかだけが違う。
+// Mention 1文字目は   "_" + Alnum
+// Mention 2文字目以降 "_" + Alnum + "@.-"
+// URL は              "_" + Alnum + "@.-" +
+//  RFC3986の集合、ただしここでは '%' も含む、'(' ')' は別処理なので除く。
+#define CC_MENT1	(0x01)
+#define CC_MENT2	(0x02)
+#define CC_URL		(0x04)
+#define CC_KEYWORD	(0x08)	// キーワードの先頭になりうる文字
+#define CC_M1	(CC_MENT1 | CC_MENT2 | CC_URL)
+#define CC_M2	(CC_MENT2 | CC_URL)
+static const uint8 chartype[0x80] = {
+	['!'] = CC_URL,
+	['#'] = CC_URL,
+	['$'] = CC_URL | CC_KEYWORD,
+	['%'] = CC_URL,
+	['&'] = CC_URL,
+	['\''] = CC_URL,
+	['*'] = CC_URL,
+	['+'] = CC_URL,
+	[','] = CC_URL,
+	['-'] = CC_M2,
+	['.'] = CC_M2,
+	['/'] = CC_URL,
+	['0' ... '9'] = CC_M1,
+	[':'] = CC_URL,
+	[';'] = CC_URL,
+	['<'] = CC_KEYWORD,
+	['='] = CC_URL,
+	['?'] = CC_URL,
+	['@'] = CC_M2,
+	['A' ... 'Z'] = CC_M1,
+	['['] = CC_URL,
+	[']'] = CC_URL,
+	['_'] = CC_M1,
+	['`'] = CC_KEYWORD,
+	['a' ... 'g'] = CC_M1,
+	['h'] = CC_M1 | CC_KEYWORD,
+	['i' ... 'z'] = CC_M1,
+	['~'] = CC_URL,
+};
+#undef CC_M1
+#undef CC_M2
+
+static inline bool
+is_chartype(unichar c, uint type)
+{
+	return (c < countof(chartype) && (chartype[c] & type) != 0);
+}
+
+// 本文中のキーワード。
+enum {
+	KW_NONE = 0,
+	KW_PLAIN_BEGIN,		// "<plain>"
+	KW_PLAIN_END,		// "</plain>"
+	KW_MFM_BEGIN,		// "$[" (未サポートの MFM)
+	KW_MFM_RUBY,		// "$[ruby "
+	KW_BACKTICK1,		// "`"
+	KW_BACKTICK3,		// "```"
+	KW_URL,				// "http://", "https://"
+};
+
+static const struct {
+	const char *str;
+	uint8 token;
+} keywords[] = {
+	{ "<plain>",	KW_PLAIN_BEGIN },
+	{ "</plain>",	KW_PLAIN_END },
+	{ "$[",			KW_MFM_BEGIN },
+	{ "$[ruby ",	KW_MFM_RUBY },
+	{ "`",			KW_BACKTICK1 },
+	{ "```",		KW_BACKTICK3 },
+	{ "http://",	KW_URL },
+	{ "https://",	KW_URL },
+};
+
+// キーワードのトライ木。[0] が根。
+// child は最初の子、next は次の兄弟のインデックスで、0 なら終端。
+struct kwtrie_node {
+	char ch;
+	uint8 token;
+	uint8 child;
+	uint8 next;
+};
+static struct kwtrie_node kwtrie[64];
+static uint kwtrie_count;
+
+// 装飾の開始/終了シーケンスを返す関数。
+// mfm_set_style() で設定する。設定されていなければ装飾しない。
+static const char *(*style_begin_func)(uint);
+static const char *(*style_end_func)(uint);
+
+// 装飾の開始/終了シーケンスを返す関数を設定する。
+void
+mfm_set_style(const char *(*begin)(uint), const char *(*end)(uint))
+{
+	style_begin_func = begin;
+	style_end_func = end;
+}
+
+static const char *
+mfm_style_begin(uint style)
+{
+	return (style_begin_func) ? style_begin_func(style) : "";
+}
+
+static const char *
+mfm_style_end(uint style)
+{
+	return (style_end_func) ? style_end_func(style) : "";
+}
+
+// キーワードのトライ木を作成する。
+// 初回に一度だけ作成する。
+static void
+kwtrie_init(void)
+{
+	if (kwtrie_count != 0) {
+		return;
+	}
+	kwtrie_count = 1;
+
+	for (uint i = 0; i < countof(keywords); i++) {
+		const char *str = keywords[i].str;
+		uint node = 0;
+		for (; *str; str++) {
+			uint child;
+			for (child = kwtrie[node].child; child != 0;
+				child = kwtrie[child].next)
+			{
+				if (kwtrie[child].ch == *str) {
+					break;
+				}
+			}
+			if (child == 0) {
+				assert(kwtrie_count < countof(kwtrie));
+				child = kwtrie_count++;
+				kwtrie[child].ch = *str;
+				kwtrie[child].next = kwtrie[node].child;
+				kwtrie[node].child = child;
+			}
+			node = child;
+		}
+		kwtrie[node].token = keywords[i].token;
+	}
+}
+
+// s から始まる最長のキーワードを探してそのトークンを返す。
+// *lenp にはキーワードの長さを書き戻す。
+// キーワードでなければ KW_NONE を返す。
+static uint
+kwtrie_match(const unichar *s, uint *lenp)
+{
+	uint node = 0;
+	uint token = KW_NONE;
+	uint len = 0;
+
+	// s は '\0' 終端している。
+	for (uint i = 0; s[i] != 0 && s[i] < 0x80; i++) {
+		uint child;
+		for (child = kwtrie[node].child; child != 0;
+			child = kwtrie[child].next)
+		{
+			if (kwtrie[child].ch == s[i]) {
+				break;
+			}
+		}
+		if (child == 0) {
+			break;
+		}
+		node = child;
+		if (kwtrie[node].token != KW_NONE) {
+			token = kwtrie[node].token;
+			len = i + 1;
+		}
+	}
+
+	*lenp = len;
+	return token;
+}
+
+// タグの集合。ノートごとに作成する。
+// 小文字にしたタグ文字列を pool に連続して置き、それを指すハッシュ表を作る。
+struct tagset_entry {
+	uint32 hash;
+	uint16 len;		// タグの文字数
+	int16 index;	// "tags" 配列でのインデックス。-1 なら空き
+	uint offset;	// pool 内の位置
+};
+
+struct tagset {
+	struct tagset_entry *table;
+	uint tablesize;		// 2 のべき乗
+	uint maxlen;		// 一番長いタグの文字数
+	bool *has_len;		// [0..maxlen] の長さのタグがあれば true
+	unichar *pool;
+};
+
+#define TAG_HASH_INIT	(2166136261U)
+#define TAG_HASH(h, c)	(((h) ^ (c)) * 16777619U)
+
+static inline unichar
+unichar_tolower(unichar c)
+{
+	if ('A' <= c && c <= 'Z') {
+		c += 0x20;
+	}
+	return c;
+}
+
+// ノート inote の "tags" からタグ集合を作成する。
+// タグがなければ NULL を返す。
+struct tagset *
+mfm_tagset_create(const struct json *js, int inote, const struct diag *diag)
+{
+
+	int itags = json_obj_find(js, inote, "tags");
+	if (itags < 0 || json_is_array(js, itags) == false) {
+		return NULL;
+	}
+	uint tagcount = json_get_size(js, itags);
+	if (tagcount == 0) {
+		return NULL;
+	}
+
+	struct tagset *set = calloc(1, sizeof(*set));
+	if (set == NULL) {
+		return NULL;
+	}
+	set->tablesize = 4;
+	while (set->tablesize < tagcount * 2) {
+		set->tablesize *= 2;
+	}
+	set->table = malloc(set->tablesize * sizeof(set->table[0]));
+	// UTF-8 のバイト数より文字数が増えることはない。
+	uint poolsize = 0;
+	JSON_ARRAY_FOR(itag, js, itags) {
+		if (json_is_str(js, itag)) {
+			poolsize += strlen(json_get_cstr(js, itag));
+		}
+	}
+	set->pool = malloc((poolsize + 1) * sizeof(unichar));
+	if (set->table == NULL || set->pool == NULL) {
+		goto abort;
+	}
+	for (uint i = 0; i < set->tablesize; i++) {
+		set->table[i].index = -1;
+	}
+
+	uint offset = 0;
+	JSON_ARRAY_FOR(itag, js, itags) {
+		if (json_is_str(js, itag) == false) {
+			continue;
+		}
+		// pool には '\0' 終端なしで詰めていく。
+		ustring *utag = ustring_from_utf8(json_get_cstr(js, itag));
+		if (utag == NULL) {
+			continue;
+		}
+		uint len = ustring_len(utag);
+		const unichar *u = ustring_get(utag);
+		uint32 hash = TAG_HASH_INIT;
+		for (uint i = 0; i < len; i++) {
+			unichar c = unichar_tolower(u[i]);
+			set->pool[offset + i] = c;
+			hash = TAG_HASH(hash, c);
+		}
+		ustring_free(utag);
+		Trace(diag, "tags[%d] len=%u hash=%08x", i_, len, hash);
+
+		// 同じタグが複数あれば先に出てきたほうを優先する。
+		uint mask = set->tablesize - 1;
+		uint h;
+		for (h = hash & mask; set->table[h].index >= 0; h = (h + 1) & mask) {
+			const struct tagset_entry *e = &set->table[h];
+			if (e->hash == hash && e->len == len &&
+				memcmp(&set->pool[e->offset], &set->pool[offset],
+					len * sizeof(unichar)) == 0)
+			{
+				break;
+			}
+		}
+		if (set->table[h].index < 0) {
+			set->table[h].hash = hash;
+			set->table[h].len = len;
+			set->table[h].index = i_;
+			set->table[h].offset = offset;
+			offset += len;
+			if (len > set->maxlen) {
+				set->maxlen = len;
+			}
+		}
+	}
+
+	set->has_len = calloc(set->maxlen + 1, sizeof(bool));
+	if (set->has_len == NULL) {
+		goto abort;
+	}
+	for (uint i = 0; i < set->tablesize; i++) {
+		if (set->table[i].index >= 0) {
+			set->has_len[set->table[i].len] = true;
+		}
+	}
+	return set;
+
+ abort:
+	mfm_tagset_destroy(set);
+	return NULL;
+}
+
+void
+mfm_tagset_destroy(struct tagset *set)
+{
+	if (set) {
+		free(set->table);
+		free(set->has_len);
+		free(set->pool);
+		free(set);
+	}
+}
+
+// s から始まる文字列の先頭が大文字小文字を無視していずれかのタグと
+// 一致すれば、そのタグの長さを *lenp に書き戻してインデックスを返す。
+// 複数のタグと一致する場合は "tags" 配列で先に出てくるほうを返す。
+// 一致しなければ -1 を返す。
+static int
+tagset_match(const struct tagset *set, const unichar *s, uint *lenp)
+{
+	if (set == NULL) {
+		return -1;
+	}
+
+	uint mask = set->tablesize - 1;
+	uint32 hash = TAG_HASH_INIT;
+	int found = -1;
+	for (uint len = 0; ; len++) {
+		if (set->has_len[len]) {
+			uint h;
+			for (h = hash & mask; set->table[h].index >= 0; h = (h + 1) & mask)
+			{
+				const struct tagset_entry *e = &set->table[h];
+				if (e->hash != hash || e->len != len) {
+					continue;
+				}
+				uint i;
+				for (i = 0; i < len; i++) {
+					if (set->pool[e->offset + i] != unichar_tolower(s[i])) {
+						break;
+					}
+				}
+				if (i == len) {
+					if (found < 0 || e->index < found) {
+						found = e->index;
+						*lenp = len;
+					}
+					break;
+				}
+			}
+		}
+
+		// s は '\0' 終端している。
+		if (len >= set->maxlen || s[len] == 0) {
+			break;
+		}
+		hash = TAG_HASH(hash, unichar_tolower(s[len]));
+	}
+
+	return found;
+}
+
+// 本文/名前を表示用に整形。
+// tags はこのノートのタグ集合 (なければ NULL)。
+// is_username なら名前欄として扱う。
+ustring *
+mfm_display_text(const char *text, const struct tagset *tags,
+	bool is_username, const struct diag *diag)
+{
+	kwtrie_init();
+
+	ustring *src = ustring_from_utf8(text);
+	ustring *dst = ustring_alloc(strlen(text));
+
+	if (__predict_false(diag_get_level(diag) >= 2)) {
+		ustring_dump(src, "display_text src");
+	}
+
+	struct context ctx0;
+	struct context *ctx = &ctx0;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->dst = dst;
+	ctx->states[0] = S_RAWTEXT;
+	state_enter(ctx, ctx->states[0]);
+
+	const unichar *srcarray = ustring_get(src);
+	for (uint pos = 0, posend = ustring_len(src); pos < posend; ) {
+		unichar c = srcarray[pos];
+		uint kwlen;
+
+		switch (state_get(ctx)) {
+		 case S_RAWTEXT:
+		 rawtext:
+			if (is_chartype(c, CC_KEYWORD)) {
+				switch (kwtrie_match(&srcarray[pos], &kwlen)) {
+				 case KW_PLAIN_BEGIN:
+					pos += kwlen;
+					state_push(ctx, S_PLAIN);
+					continue;
+
+				 case KW_MFM_RUBY:
+				 {
+					// $[ruby 漢字 かんじ]
+					// タグ名の区切りは空白(SP)のみらしい。
+					// 空白が連続しているかも知れないのでスキップ。
+					uint s = pos + kwlen;
+					for (; srcarray[s] == ' '; s++)
+						;
+					pos = s;
+					// ここから本文1
+					state_push(ctx, S_RUBY1);
+					continue;
+				 }
+
+				 case KW_MFM_BEGIN:
+					// 知らないタグなら、タグを無視してコンテンツのみ表示。
+					for (uint s = pos + kwlen; s < posend; s++) {
+						if (srcarray[s] == ' ') {
+							// 空白の次から ']' の手前までがコンテンツ。
+							pos = s + 1;
+							state_push(ctx, S_UNSUPP_MFM);
+							goto continue_;	// 一つ上の for へ。
+						}
+					}
+					// 知らないタグのまま EOL ならタグではない。
+					break;
+
+				 case KW_BACKTICK1:
+					pos += kwlen;
+					state_push(ctx, S_BACKTICK1);
+					continue;
+
+				 case KW_BACKTICK3:
+					pos += kwlen;
+					state_push(ctx, S_BACKTICK3);
+					continue;
+
+				 case KW_URL:
+					// ユーザ名欄ならこれ以降のマークアップは整形しない。
+					if (is_username == false) {
+						state_push(ctx, S_URL);
+						continue;
+					}
+					break;
+
+				 default:
+					break;
+				}
+			} else if (is_username) {
+				// ユーザ名欄ならこれ以降のマークアップは整形しない。
+				break;
+			} else if (c == '@') {
+				// '@' の直前が ment2 でなく(?)、直後が ment1 ならメンション。
+				unichar pc = ustring_at(src, pos - 1);
+				unichar nc = srcarray[pos + 1];
+				if (is_chartype(pc, CC_MENT2) == false &&
+					is_chartype(nc, CC_MENT1))
+				{
+					state_push(ctx, S_MENTION);
+					continue;
+				}
+			} else if (c == '#') {
+				// タグはこの時点で範囲(長さ)が分かるのでステート分岐不要。
+				uint len;
+				int i = tagset_match(tags, &srcarray[pos + 1], &len);
+				if (i >= 0) {
+					// 一致したらタグ。'#' 文字自身も含めてコピーする。
+					ustring_append_ascii(dst, mfm_style_begin(STYLE_TAG));
+					ustring_append_unichar(dst, c);
+					pos++;
+					uint end = pos + len;
+					Trace(diag, "tag[%d] found at pos=%u len=%u end=%u",
+						i, pos, len, end);
+					for (; pos < end; pos++) {
+						ustring_append_unichar(dst, srcarray[pos]);
+					}
+					ustring_append_ascii(dst, mfm_style_end(STYLE_TAG));
+					continue;
+				}
+			}
+			break;
+
+		 case S_UNSUPP_MFM:
+			// MFM コンテンツ内は閉じ括弧以外は RAWTEXT と同じ処理を通す。
+			if (c == ']') {
+				pos++;
+				state_pop(ctx);
+				continue;
+			}
+			goto rawtext;
+
+		 case S_RUBY1:
+			// ルビ1は ' ' が来たら終了。
+			if (c == ' ') {
+				pos++;
+				state_pop(ctx);
+				state_push(ctx, S_RUBY2);
+				ustring_append_unichar(dst, '(');
+				continue;
+			}
+			goto rawtext;
+
+		 case S_RUBY2:
+			// ルビ2 は ']' が来たら終了。
+			if (c == ']') {
+				ustring_append_unichar(dst, ')');
+				pos++;
+				state_pop(ctx);
+				continue;
+			}
+			goto rawtext;
+
+		 case S_PLAIN:
+			// <plain> 内なら "</plain>" が来たら終了。
+			if (c == '<' &&
+				kwtrie_match(&srcarray[pos], &kwlen) == KW_PLAIN_END)
+			{
+				pos += kwlen;
+				state_pop(ctx);
+				continue;
+			}
+			break;
+
+		 case S_BACKTICK1:
+			// `〜` 内なら '`' が来たら終了。
+			if (c == '`') {
+				pos++;
+				state_pop(ctx);
+				continue;
+			}
+			break;
+
+		 case S_BACKTICK3:
+			// ```〜``` なら "```" が来たら終了。
+			if (c == '`' &&
+				kwtrie_match(&srcarray[pos], &kwlen) == KW_BACKTICK3)
+			{
+				pos += kwlen;
+				state_pop(ctx);
+				continue;
+			}
+			break;
+
+		 case S_MENTION:
+			// メンション内なら ment2 以外の文字が来たら終了。
+			if (is_chartype(c, CC_MENT2) == false) {
+				state_pop(ctx);
+				continue;
+			}
+			break;
+
+		 case S_URL:
+			// 括弧 "(",")" は URL に使えるが、URL 前から始まってる括弧の
+			// 閉じ括弧との区別はヒューリスティックにしか解決できないらしい。
+			// "(http://foo/a)bc" なら http://foo/a が URL。
+			// "http://foo/a(b)c" なら http://foo/a(b)c が URL。
+			// 正気か?
+			if (is_chartype(c, CC_URL)) {
+				// FALLTHROUGH
+			} else if (c == '(') {
+				ctx->paren_in_url++;
+			} else if (c == ')' && ctx->paren_in_url > 0) {
+				ctx->paren_in_url--;
+			} else {
+				state_pop(ctx);
+				continue;
+			}
+			break;
+
+		 default:
+			printf("unknown state=%u\n", state_get(ctx));
+			continue;
+		}
+
+		// どれでもなければここに落ちてきて1文字出力。
+		ustring_append_unichar(dst, c);
+		pos++;
+
+	 continue_:;
+	}
+
+	while (state_pop(ctx))
+		;
+
+	ustring_free(src);
+
+	if (__predict_false(diag_get_level(diag) >= 2)) {
+		ustring_dump(dst, "dst");
+	}
+	return dst;
+}
+
+static void
+state_push(struct context *ctx, uint new_state)
+{
+	uint old_state = state_get(ctx);
+	state_leave(ctx, old_state);
+	state_enter(ctx, new_state);
+	assert(ctx->state_top < sizeof(ctx->states) - 2);
+	ctx->states[++ctx->state_top] = new_state;
+}
+
+static bool
+state_pop(struct context *ctx)
+{
+	uint old_state = state_get(ctx);
+	state_leave(ctx, old_state);
+
+	ctx->state_top--;
+	if (ctx->state_top >= 0) {
+		uint new_state = ctx->states[ctx->state_top];
+		state_enter(ctx, new_state);
+		return true;
+	} else {
+		return false;
+	}
+}
+
+// ステート(装飾範囲)を開始する。
+static void
+state_enter(struct context *ctx, uint state)
+{
+	const char *style = NULL;
+	switch (state) {
+	 case S_MENTION:
+		style = mfm_style_begin(STYLE_USERID);
+		break;
+	 case S_URL:
+		style = mfm_style_begin(STYLE_URL);
+		ctx->paren_in_url = 0;
+		break;
+	 default:
+		break;
+	}
+	if (style) {
+		ustring_append_ascii(ctx->dst, style);
+	}
+}
+
+// ステート(装飾範囲)を終了する。
+static void
+state_leave(struct context *ctx, uint state)
+{
+	const char *style = NULL;
+	switch (state) {
+	 case S_MENTION:
+		style = mfm_style_end(STYLE_USERID);
+		break;
+	 case S_URL:
+		style = mfm_style_end(STYLE_URL);
+		break;
+	 default:
+		break;
+	}
+	if (style) {
+		ustring_append_ascii(ctx->dst, style);
+	}
+}
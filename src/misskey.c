@@ -31,11 +31,14 @@
 #include "sayaka.h"
 #include "ngword.h"
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 // ユーザ名。毎回このセットが必要なので。
 typedef struct misskey_user_ {
@@ -44,41 +47,163 @@ typedef struct misskey_user_ {
 	string *instance;	// "instance/name"、インスタンス名 (なければ NULL)
 } misskey_user;
 
-struct context;
+// 最近表示したノートのキャッシュ。
+// 同じノートがホームと main の両方から来たり、何度もリノートされたりして
+// 繰り返し流れてくるので、ノート ID をキーに NG 判定の結果と整形済みの
+// 名前行、本文を覚えておいて使い回す。
+// ノート ID はサーバごとに独立しているので、キーには接続先サーバも含める。
+// 時刻、リノート数、リアクション数、投票は変わっていくので毎回作る。
+// 中身はメッセージをまたいで使うのでアリーナではなくヒープに置く。
+#define NOTECACHE_SIZE	(256)
+struct notecache {
+	string *key;		// "<サーバ> <ノート ID>"。NULL なら未使用
+	uint32 hash;		// key のハッシュ値
+	uint64 lastuse;		// 最後に使った時の notecache_clock
+	int ngid;			// NG ワードのインデックス。NG でなければ -1
+	misskey_user *user;
+	ustring *headline;	// 名前行
+	ustring *textline;	// 本文。NG なら NULL
+};
+
+// ストリームの接続元ごとの接続状態。
+struct misskey_conn {
+	const struct misskey_source *src;
+	string *url;
+	char label[64];		// 表示用の "<host>/<channel>"
+	struct wsclient *ws;	// 接続中でなければ NULL
+	int fd;				// イベントループに登録中の fd。なければ -1
+	uint ping_id;		// キープアライブのタイマー ID
+	uint connect_id;	// 再接続の期限のタイマー ID
+	int retry_count;	// -1 は初回。0 は EOF による正常リトライ
+};
+// 再接続がこの間に完了しなければ失敗にする [msec]。
+#define MISSKEY_CONNECT_MSEC	(30 * 1000)
+// この間何も受信しなければキープアライブの PING を送る [msec]。
+#define MISSKEY_PING_MSEC	(30 * 1000)
+// 録画中は受信がなくてもこの間隔で書き出しを確認する [msec]。
+#define MISSKEY_RECORD_FLUSH_MSEC	(1000)
+
+// 並列再生でワーカーから親に送る1メッセージ分の出力の先頭。
+// この後ろに len バイトの出力が続く。
+struct play_frame {
+	uint64 ts;			// 受信時刻 (UNIX 時刻の usec)。不明なら 0
+	uint32 len;			// 出力のバイト数
+};
+#define PLAY_BUFSIZE	(64 * 1024)
+
+// 1メッセージで先読みする画像。
+#define MISSKEY_PREFETCH_MAX	(32)
+struct misskey_prefetch {
+	uint num;
+	int idx[MISSKEY_PREFETCH_MAX];	// image_prefetch_add() の番号
+};
+
+// ストリームで受信して、画像の先読みが揃うのを待っているメッセージ。
+// 受信した順に表示する。
+struct misskey_pending {
+	struct misskey_pending *next;
+	string *msg;			// メッセージ (ヒープに置く)
+	const char *label;		// 接続元ラベル
+	const char *server;		// 接続先サーバ
+	struct misskey_prefetch prefetch;
+};
+
 
 static bool misskey_init(void);
-static bool misskey_stream(struct wsclient *, bool);
+static void misskey_conn_init(struct misskey_conn *,
+	const struct misskey_source *);
+static bool misskey_conn_open(struct misskey_conn *);
+static bool misskey_conn_connected(struct misskey_conn *, int);
+static void misskey_conn_connect_cb(struct evloop *, int, uint, void *);
+static void misskey_conn_timeout_cb(struct evloop *, void *);
+static void misskey_conn_close(struct misskey_conn *, bool);
+static void misskey_conn_retry_cb(struct evloop *, void *);
+static bool misskey_stream_subscribe(struct wsclient *, uint);
+static void misskey_stream_fd_cb(struct evloop *, int, uint, void *);
+static void misskey_stream_ping_cb(struct evloop *, void *);
 static void misskey_recv_cb(const string *);
+static void misskey_pending_add(const string *);
+static void misskey_pending_flush(void);
+static void misskey_pending_cb(struct evloop *, void *);
+static void misskey_prefetch_done_cb(void);
+static void misskey_prefetch_message(const string *, struct misskey_prefetch *);
+static void misskey_prefetch_note(const struct json *, int,
+	struct misskey_prefetch *);
+static void misskey_prefetch_add(struct misskey_prefetch *,
+	const char *, const char *);
+static bool misskey_prefetch_ready(const struct misskey_prefetch *);
+static void misskey_prefetch_release(struct misskey_prefetch *);
+static void misskey_record_flush_cb(struct evloop *, void *);
+static void misskey_record_close(void);
+static struct playback *misskey_play_open(const char *);
+static void misskey_play_sequential(const char *);
+static void misskey_play_parallel(const char *, uint);
+static void misskey_play_worker(const char *, uint, uint, int)
+	__attribute__((__noreturn__));
+static int  misskey_play_readfull(int, void *, uint);
+static bool misskey_play_writefull(int, const void *, uint);
+static uint64 misskey_play_time(const string *, uint64);
+static uint64 misskey_play_wait(uint64);
+static uint64 misskey_play_createdat(const string *);
 static void misskey_message(string *);
+static void misskey_message_main(string *);
 static int  misskey_show_note(const struct json *, int);
 static int  misskey_show_announcement(const struct json *, int);
 static int  misskey_show_notification(const struct json *, int);
+static void misskey_prefetch_images(const struct json *, int, const string *,
+	int, struct misskey_prefetch *);
+static bool misskey_has_sensitive(const struct json *, int);
+static const char *misskey_icon_source(const struct json *, int,
+	const string *, char *, uint);
 static void misskey_show_icon(const struct json *, int, const string *);
+static const char *misskey_photo_source(const struct json *, int,
+	char *, uint, uint *, uint *, bool *, const char **);
 static bool misskey_show_photo(const struct json *, int, int);
 static void misskey_print_filetype(const struct json *, int, const char *);
 static void make_cache_filename(char *, uint, const char *);
-static ustring *misskey_display_text(const struct json *, int, const char *);
-static ustring *misskey_display_name(const struct json *, int, const char *);
-static ustring *misskey_display_text_common(const struct json *, int,
-	const char *, bool);
-static void state_push(struct context *, uint);
-static bool state_pop(struct context *);
-static void state_enter(struct context *, uint);
-static void state_leave(struct context *, uint);
-static bool unichar_submatch(const unichar *, const char *);
-static int  unichar_ncasecmp(const unichar *, const unichar *);
+static ustring *misskey_display_text(const struct tagset *, const char *);
+static ustring *misskey_display_name(const char *);
 static string *misskey_format_poll(const struct json *, int);
 static string *misskey_format_time(const struct json *, int);
 static string *misskey_format_renote_count(const struct json *, int);
 static string *misskey_format_reaction_count(const struct json *, int);
 static ustring *misskey_format_renote_owner(const struct json *, int);
 static misskey_user *misskey_get_user(const struct json *, int);
+static string *misskey_get_userid(const struct json *, int);
+static misskey_user *misskey_dup_user(const misskey_user *);
 static void misskey_free_user(misskey_user *);
+static void notecache_make_key(char *, size_t, const char *);
+static struct notecache *notecache_lookup(const char *);
+static struct notecache *notecache_insert(const char *, int,
+	const misskey_user *, const ustring *, const ustring *);
+static void notecache_cleanup(void);
 static int misskey_ngword_match_text(const string *, const misskey_user *);
 static int misskey_show_ng(int, const struct json *, int, const misskey_user *);
 
 static struct json *global_js;
 
+// 録画中ならその書き出し先。
+static struct recorder *recorder;
+
+// 1メッセージの処理中に使う string/ustring の確保先。
+static struct arena *msg_arena;
+
+static struct evloop *stream_loop;
+static struct misskey_conn *conns;
+static uint nconns;
+// 表示中のノートの接続元ラベル。接続元が1つなら NULL。
+static const char *source_label;
+// 表示中のノートの接続先サーバ。再生時は NULL。
+static const char *source_server;
+// 表示待ちのメッセージ。
+static struct misskey_pending *pending_head;
+static struct misskey_pending **pending_tail = &pending_head;
+static uint pending_timer_id;
+
+static struct notecache notecache[NOTECACHE_SIZE];
+static uint64 notecache_clock;
+static uint64 notecache_hit;
+
 // サーバ接続とローカル再生との共通の初期化。
 static bool
 misskey_init(void)
@@ -87,6 +212,10 @@ misskey_init(void)
 	if (global_js == NULL) {
 		return false;
 	}
+	msg_arena = arena_create(16 * 1024);
+	if (msg_arena == NULL) {
+		return false;
+	}
 
 	return true;
 }
@@ -95,162 +224,787 @@ static void
 misskey_cleanup(void)
 {
 	json_destroy(global_js);
+	arena_destroy(msg_arena);
+	notecache_cleanup();
 }
 
 void
 cmd_misskey_play(const char *infile)
 {
-	string *s;
-	FILE *fp;
+	uint jobs;
 
 	misskey_init();
 
-	if (infile == NULL) {
-		fp = stdin;
+	jobs = opt_play_jobs;
+	if (jobs == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = (ncpu > 0) ? ncpu : 1;
+	}
+	if (jobs > 1 && infile == NULL) {
+		// 各ワーカーがそれぞれファイルを開くので、標準入力では出来ない。
+		warnx("--play-jobs is ignored when playing from stdin");
+		jobs = 1;
+	}
+
+	if (jobs > 1) {
+		misskey_play_parallel(infile, jobs);
 	} else {
-		fp = fopen(infile, "r");
-		if (fp == NULL) {
-			err(1, "%s", infile);
+		misskey_play_sequential(infile);
+	}
+
+	misskey_cleanup();
+}
+
+// 再生用に infile を開く。
+// --play-start が指定されていれば、最初のメッセージの受信時刻から
+// その時間が経った位置まで進めておく。
+// 失敗すればメッセージを表示して NULL を返す。
+static struct playback *
+misskey_play_open(const char *infile)
+{
+	struct playback *pb;
+	string *s;
+	uint64 ts;
+
+	pb = playback_open(infile);
+	if (pb == NULL || opt_play_start == 0) {
+		return pb;
+	}
+
+	s = playback_read(pb, &ts);
+	if (s == NULL) {
+		// 空ファイル。
+		return pb;
+	}
+	string_free(s);
+	// 受信時刻がない (JSONL 形式) か、シーク出来なければエラー。
+	if (ts == 0 || playback_seek(pb, ts + opt_play_start) == false) {
+		warnx("--play-start: %s: Not a seekable compressed recording",
+			infile ? infile : "stdin");
+		playback_close(pb);
+		return NULL;
+	}
+	return pb;
+}
+
+// 再生を1つずつ順に行う。
+static void
+misskey_play_sequential(const char *infile)
+{
+	struct playback *pb;
+	string *s;
+	uint64 ts;
+
+	pb = misskey_play_open(infile);
+	if (pb == NULL) {
+		exit(1);
+	}
+
+	if (opt_bench) {
+		if (bench_start() == false) {
+			exit(1);
 		}
 	}
 
-	while ((s = string_fgets(fp)) != NULL) {
+	while ((s = playback_read(pb, &ts)) != NULL) {
+		uint64 arrival = misskey_play_wait(misskey_play_time(s, ts));
 		misskey_message(s);
 		string_free(s);
+		if (__predict_false(bench_enabled)) {
+			bench_message(arrival);
+		}
 	}
 
-	if (infile != NULL) {
-		fclose(fp);
+	bench_report();
+	playback_close(pb);
+}
+
+// 再生を jobs 個のワーカープロセスで並列に行う。
+// ワーカー i はそれぞれ自分でファイルを開いて全メッセージを読み、
+// 先頭から数えて jobs で割った余りが i のメッセージだけを処理して、
+// その出力 (と受信時刻) をパイプで親に送る。
+// 親はワーカーを順番に巡って出力を受け取り、元の順序で標準出力に書き出す。
+// ワーカーはパイプが詰まるまで先行して処理を進めておくことになる。
+//
+// 処理中の状態 (アリーナ、JSON パーサ、ノートキャッシュ、画像処理等) は
+// ほぼすべてグローバルで出力も直接 stdout に書いているため、スレッドでは
+// なくプロセスで分ける。ノートキャッシュはワーカーごとに持つことになるが、
+// キャッシュは表示内容を変えないので出力は1つずつ処理した時と同じになる。
+static void
+misskey_play_parallel(const char *infile, uint jobs)
+{
+	struct playback *pb;
+	struct play_frame frame;
+	int *fds;
+	pid_t *pids;
+	char *buf;
+	uint64 i;
+	uint n;
+
+	// ファイルが開けるかどうかだけ先に調べておく。
+	pb = misskey_play_open(infile);
+	if (pb == NULL) {
+		exit(1);
+	}
+	playback_close(pb);
+
+	fds = calloc(jobs, sizeof(fds[0]));
+	pids = calloc(jobs, sizeof(pids[0]));
+	buf = malloc(PLAY_BUFSIZE);
+	if (fds == NULL || pids == NULL || buf == NULL) {
+		err(1, "%s", __func__);
+	}
+
+	if (opt_bench) {
+		if (bench_start() == false) {
+			exit(1);
+		}
 	}
 
+	// 親の stdout のバッファに残っているものをワーカーに引き継がない。
+	fflush(NULL);
+	for (n = 0; n < jobs; n++) {
+		int fd[2];
+		if (pipe(fd) < 0) {
+			err(1, "%s: pipe", __func__);
+		}
+		pids[n] = fork();
+		if (pids[n] < 0) {
+			err(1, "%s: fork", __func__);
+		}
+		if (pids[n] == 0) {
+			// 先に作ったワーカーへのパイプは不要。
+			for (uint j = 0; j < n; j++) {
+				close(fds[j]);
+			}
+			close(fd[0]);
+			misskey_play_worker(infile, n, jobs, fd[1]);
+		}
+		close(fd[1]);
+		fds[n] = fd[0];
+	}
+
+	for (i = 0; ; i++) {
+		int fd = fds[i % jobs];
+		int r = misskey_play_readfull(fd, &frame, sizeof(frame));
+		if (r <= 0) {
+			// 0 なら (このワーカーの担当分が終わったので) 全部終わり。
+			if (r < 0) {
+				warnx("%s: worker %u: unexpected end", __func__,
+					(uint)(i % jobs));
+			}
+			break;
+		}
+
+		uint64 arrival = misskey_play_wait(frame.ts);
+
+		// SIXEL の途中で中断されることもあるので、出力中は in_sixel を
+		// 立てておく (SIXEL 以外の途中で CAN を出しても害はない)。
+		uint32 len = frame.len;
+		while (len > 0) {
+			uint32 chunk = MIN(len, PLAY_BUFSIZE);
+			if (misskey_play_readfull(fd, buf, chunk) <= 0) {
+				errx(1, "%s: worker %u: short read", __func__,
+					(uint)(i % jobs));
+			}
+			in_sixel = true;
+			fwrite(buf, 1, chunk, stdout);
+			in_sixel = false;
+			len -= chunk;
+		}
+		fflush(stdout);
+
+		if (__predict_false(bench_enabled)) {
+			bench_message(arrival);
+		}
+	}
+
+	for (n = 0; n < jobs; n++) {
+		int status;
+
+		close(fds[n]);
+		if (waitpid(pids[n], &status, 0) < 0) {
+			warn("%s: waitpid", __func__);
+		} else if (WIFSIGNALED(status)) {
+			warnx("worker %u: killed by signal %d", n, WTERMSIG(status));
+		} else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			warnx("worker %u: exit status %d", n, WEXITSTATUS(status));
+		}
+	}
+
+	bench_report();
+
+	free(buf);
+	free(pids);
+	free(fds);
+}
+
+// 並列再生のワーカープロセス。
+// 担当のメッセージを処理して、出力をフレームにして wfd に書き出す。
+// 出力は標準出力を一時ファイルに差し替えて受け、1メッセージごとに
+// 読み出して巻き戻す。
+static void
+misskey_play_worker(const char *infile, uint id, uint jobs, int wfd)
+{
+	struct playback *pb;
+	struct play_frame frame;
+	string *s;
+	uint64 ts;
+	uint64 i;
+	char *buf;
+	FILE *tmp;
+	int rv = 1;
+
+	memset(&frame, 0, sizeof(frame));
+
+	// 表示はしないので端末サイズの変更は親だけが追う。
+	// 中断も親に任せる (親が終わればパイプへの書き込みが失敗して終わる)。
+	signal(SIGWINCH, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	bench_enabled = false;
+
+	buf = malloc(PLAY_BUFSIZE);
+	tmp = tmpfile();
+	if (buf == NULL || tmp == NULL) {
+		warn("%s", __func__);
+		_exit(1);
+	}
+	if (dup2(fileno(tmp), STDOUT_FILENO) < 0) {
+		warn("%s: dup2", __func__);
+		_exit(1);
+	}
+	fclose(tmp);
+
+	pb = misskey_play_open(infile);
+	if (pb == NULL) {
+		_exit(1);
+	}
+
+	for (i = 0; (s = playback_read(pb, &ts)) != NULL; i++) {
+		if (i % jobs != id) {
+			string_free(s);
+			continue;
+		}
+
+		frame.ts = misskey_play_time(s, ts);
+		misskey_message(s);
+		string_free(s);
+
+		// 今回の出力を取り出して巻き戻す。
+		fflush(stdout);
+		off_t len = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		if (len < 0 || len > UINT32_MAX) {
+			warn("%s: lseek", __func__);
+			goto done;
+		}
+		frame.len = len;
+		if (misskey_play_writefull(wfd, &frame, sizeof(frame)) == false) {
+			goto done;
+		}
+		for (off_t off = 0; off < len; ) {
+			ssize_t n = pread(STDOUT_FILENO, buf,
+				MIN(len - off, PLAY_BUFSIZE), off);
+			if (n <= 0) {
+				warn("%s: pread", __func__);
+				goto done;
+			}
+			if (misskey_play_writefull(wfd, buf, n) == false) {
+				goto done;
+			}
+			off += n;
+		}
+		lseek(STDOUT_FILENO, 0, SEEK_SET);
+	}
+	rv = 0;
+
+ done:
+	// exit() だと親の atexit 処理まで走ってしまうので _exit() で終わる。
+	playback_close(pb);
+	close(wfd);
+	free(buf);
 	misskey_cleanup();
+	_exit(rv);
 }
 
-// token はトークン文字列を指定。トークンなしなら NULL を指定する。
-void
-cmd_misskey_stream(const char *server, bool home, const char *token)
+// fd から len バイトを読み込む。
+// 全部読めれば 1、最初から EOF なら 0、途中で EOF やエラーなら -1 を返す。
+static int
+misskey_play_readfull(int fd, void *dst, uint len)
 {
-	const struct diag *diag = diag_net;
-	string *url;
+	char *p = dst;
+	uint done = 0;
+
+	while (done < len) {
+		ssize_t n = read(fd, p + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return (done == 0) ? 0 : -1;
+		}
+		done += n;
+	}
+	return 1;
+}
+
+// fd に len バイトを書き出す。
+// 全部書ければ true を返す。
+static bool
+misskey_play_writefull(int fd, const void *src, uint len)
+{
+	const char *p = src;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// 親が先に終了した場合も含むので表示はしない。
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+// メッセージ msg の再生タイミングに使う時刻を返す。
+// ts は msg の受信時刻 (UNIX 時刻の usec)。
+// JSONL 形式には受信時刻がない (ts が 0) ので投稿時刻で代用する。
+// どちらも分からなければ 0 を返す。
+static uint64
+misskey_play_time(const string *msg, uint64 ts)
+{
+	if (ts == 0 && opt_play_speed > 0) {
+		ts = misskey_play_createdat(msg);
+	}
+	return ts;
+}
+
+// 再生時に受信間隔を再現するため、メッセージの到着予定時刻まで待つ。
+// ts はメッセージの受信時刻 (UNIX 時刻の usec)。不明なら 0。
+// 到着 (予定) 時刻を CLOCK_MONOTONIC の usec で返す。
+// 処理が遅れて予定時刻を過ぎていれば待たずに予定時刻を返すので、
+// 遅延には遅れた分も含まれる。
+static uint64
+misskey_play_wait(uint64 ts)
+{
+	static uint64 base_ts;		// 最初のメッセージの受信時刻
+	static uint64 base_mono;	// 最初のメッセージを再生した時刻
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64 mono = timespec_to_usec(&now);
+	if (opt_play_speed <= 0 || ts == 0) {
+		return mono;
+	}
+
+	if (base_ts == 0) {
+		base_ts = ts;
+		base_mono = mono;
+		return mono;
+	}
+	if (ts < base_ts) {
+		return mono;
+	}
+
+	uint64 target = base_mono + (uint64)((ts - base_ts) / opt_play_speed);
+	if (target > mono) {
+		uint stage = bench_enter(BENCH_WAIT);
+		uint64 wait = target - mono;
+		struct timespec req;
+		req.tv_sec  = wait / 1000000;
+		req.tv_nsec = (wait % 1000000) * 1000;
+		while (nanosleep(&req, &req) < 0 && errno == EINTR)
+			;
+		bench_leave(stage);
+	}
+	return target;
+}
+
+// msg から最初の "createdAt" (ノートならノートの投稿時刻) を探して
+// UNIX 時刻の usec で返す。見付からなければ 0 を返す。
+// 再生のタイミング用なので JSON はパースせず文字列で探す。
+static uint64
+misskey_play_createdat(const string *msg)
+{
+	static const char key[] = "\"createdAt\":\"";
+
+	const char *p = strstr(string_get(msg), key);
+	if (p == NULL) {
+		return 0;
+	}
+	time_t t = decode_isotime(p + sizeof(key) - 1);
+	if (t == 0) {
+		return 0;
+	}
+	return (uint64)t * 1000000;
+}
 
+// sources の各接続元に接続して、受信したノートを届いた順に表示する。
+// 接続元は nsources 個 (1 以上)。
+void
+cmd_misskey_stream(const struct misskey_source *sources, uint nsources)
+{
 	misskey_init();
 
-	url = string_init();
-	string_append_printf(url, "wss://%s/streaming", server);
-	if (token) {
-		string_append_printf(url, "?i=%s", token);
+	if (opt_record_file) {
+		recorder = recorder_open(opt_record_file, opt_record_format);
+		if (recorder == NULL) {
+			exit(1);
+		}
+		// SIGINT でも exit() で終わるので、そこで残りを書き出す。
+		atexit(misskey_record_close);
+	}
+
+	stream_loop = evloop_create(diag_net);
+	if (stream_loop == NULL) {
+		warn("%s: evloop_create failed", __func__);
+		goto done;
+	}
+	if (recorder) {
+		if (evloop_add_timer(stream_loop, MISSKEY_RECORD_FLUSH_MSEC,
+				MISSKEY_RECORD_FLUSH_MSEC, misskey_record_flush_cb, NULL) == 0)
+		{
+			warn("%s: evloop_add_timer failed", __func__);
+			goto done;
+		}
+	}
+	// 画像は受信時に同じループで先読みを始めて、揃ったら表示する。
+	image_prefetch_init(stream_loop, misskey_prefetch_done_cb);
+
+	nconns = nsources;
+	conns = calloc(nconns, sizeof(conns[0]));
+	if (conns == NULL) {
+		warn("%s: calloc failed", __func__);
+		goto done;
+	}
+	for (uint i = 0; i < nconns; i++) {
+		misskey_conn_init(&conns[i], &sources[i]);
 	}
 
 	printf("Ready...");
+	if (nconns > 1) {
+		printf("\n");
+	}
 	fflush(stdout);
 
-	static const uint16 retry_wait[] = {
-		1, 3, 10, 30, 60, 180, 600, 1800
-	};
-	// -1 は初回。0 は EOF による正常リトライ。
-	int retry_count = -1;
-	for (;;) {
-		enum {
-			CLOSED,	// 接続後、正常に EOF になった -> 再接続
-			RETRY,	// reconnect できなかった -> 再接続
-			ERROR,	// エラー -> 中止
-		} status;
-
-		if (retry_count > 0) {
-			time_t now;
-			struct tm tm;
-			char timebuf[16];
-
-			time(&now);
-			localtime_r(&now, &tm);
-			strftime(timebuf, sizeof(timebuf), "%T", &tm);
-			printf("%s Retrying...", timebuf);
-			fflush(stdout);
+	// 初回の接続。どれか一つでも失敗すればそれはエラー。再試行しない。
+	for (uint i = 0; i < nconns; i++) {
+		if (misskey_conn_open(&conns[i]) == false) {
+			goto done;
 		}
+	}
 
-		struct wsclient *ws = wsclient_create(diag);
-		if (ws == NULL) {
-			warn("%s: wsclient_create failed", __func__);
+	// あとはイベントループで受信。
+	// 切断された接続元は、その接続元だけ時間をおいて再接続する。
+	for (;;) {
+		if (evloop_run_once(stream_loop, -1) < 0) {
+			warn("%s: evloop_run_once failed", __func__);
 			break;
 		}
+		netstat_check_request();
+	}
 
-		wsclient_init(ws, misskey_recv_cb);
-
-		// 応答コード 101 が成功。
-		int code = wsclient_connect(ws, string_get(url), &netopt_main);
-		if (code != 101) {
-			if (code == -2) {
-				warnx("SSL not compiled");
-			} else if (code < 0) {
-				warn("%s: connection failed", server);
-			} else if (code == 0) {
-				warnx("%s: connection failed: EOF?", server);
-			} else {
-				warnx("%s: connection failed: HTTP %u", server, code);
-			}
-			if (retry_count < 0) {
-				// 初回接続でエラーなら、それはエラー。再試行しない。
-				status = ERROR;
-			} else {
-				// 接続実績はあるが、今回の接続がエラーになったら再試行。
-				status = RETRY;
-			}
-			goto done;
+ done:
+	misskey_record_close();
+	while (pending_head) {
+		struct misskey_pending *pm = pending_head;
+		pending_head = pm->next;
+		misskey_prefetch_release(&pm->prefetch);
+		string_free(pm->msg);
+		free(pm);
+	}
+	pending_tail = &pending_head;
+	image_prefetch_init(NULL, NULL);
+	if (conns) {
+		for (uint i = 0; i < nconns; i++) {
+			struct misskey_conn *conn = &conns[i];
+			wsclient_destroy(conn->ws);
+			string_free(conn->url);
 		}
+		free(conns);
+		conns = NULL;
+	}
+	evloop_destroy(stream_loop);
+	stream_loop = NULL;
+	misskey_cleanup();
+}
+
+// 接続元 src の接続状態 conn を初期化する。
+static void
+misskey_conn_init(struct misskey_conn *conn, const struct misskey_source *src)
+{
+	static const char * const channame[] = {
+		[MISSKEY_CHANNEL_LOCAL]	= "ltl",
+		[MISSKEY_CHANNEL_HOME]	= "htl",
+		[MISSKEY_CHANNEL_MAIN]	= "main",
+	};
+	const char *server = src->server;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->src = src;
+	conn->fd = -1;
+	conn->retry_count = -1;
+
+	conn->url = string_init();
+	if (strstr(server, "://")) {
+		// ws://127.0.0.1:8080 のようにスキームから指定されていればそれを使う
+		// (主に mockserver 用)。
+		string_append_printf(conn->url, "%s/streaming", server);
+	} else {
+		string_append_printf(conn->url, "wss://%s/streaming", server);
+	}
+	if (src->token) {
+		string_append_printf(conn->url, "?i=%s", src->token);
+	}
+
+	// ラベルは "<host>/<channel>"。スキームは省く。
+	const char *host = strstr(server, "://");
+	host = (host) ? host + 3 : server;
+	snprintf(conn->label, sizeof(conn->label), "%s/%s",
+		host, channame[src->channel]);
+}
+
+// conn を接続してイベントループに登録する。
+// 初回の接続に失敗した場合は false を返す。
+// 再接続に失敗した場合は再接続を予約して true を返す。
+// 再接続は他の接続元や画像の取得を止めないよう、イベントループ上で進める。
+static bool
+misskey_conn_open(struct misskey_conn *conn)
+{
+	const struct diag *diag = diag_net;
+
+	if (conn->retry_count > 0) {
+		time_t now;
+		struct tm tm;
+		char timebuf[16];
 
-		// 接続成功。
-		// 初回とリトライ時に表示。EOF 後の再接続では表示しない。
-		if (retry_count != 0) {
-			printf("Connected\n");
+		time(&now);
+		localtime_r(&now, &tm);
+		strftime(timebuf, sizeof(timebuf), "%T", &tm);
+		if (nconns > 1) {
+			// 接続を待つ間に他の接続元の表示が挟まるので改行しておく。
+			printf("%s %s: Retrying...\n", timebuf, conn->label);
+		} else {
+			printf("%s Retrying...", timebuf);
 		}
-		retry_count = 0;
+		fflush(stdout);
+	}
+
+	conn->ws = wsclient_create(diag);
+	if (conn->ws == NULL) {
+		warn("%s: wsclient_create failed", __func__);
+		return false;
+	}
+	wsclient_init(conn->ws, misskey_recv_cb);
+
+	if (conn->retry_count < 0) {
+		// 初回はまだイベントループを回していないので、ここで待つ。
+		int code = wsclient_connect(conn->ws, string_get(conn->url),
+			&netopt_main);
+		return misskey_conn_connected(conn, code);
+	}
+
+	int code = wsclient_connect_async(conn->ws, string_get(conn->url),
+		&netopt_main);
+	if (code != 1) {
+		return misskey_conn_connected(conn, code);
+	}
+
+	// 接続処理中。
+	conn->fd = wsclient_get_fd(conn->ws);
+	conn->connect_id = evloop_add_timer(stream_loop, MISSKEY_CONNECT_MSEC, 0,
+		misskey_conn_timeout_cb, conn);
+	if (conn->connect_id == 0 ||
+		evloop_add_fd(stream_loop, conn->fd, wsclient_get_want(conn->ws),
+			misskey_conn_connect_cb, conn) == false)
+	{
+		warn("%s: evloop setup failed", __func__);
+		misskey_conn_close(conn, false);
+	}
+	return true;
+}
 
-		// メイン処理。
-		if (misskey_stream(ws, home) == true) {
-			status = CLOSED;
+// conn の接続処理が終わった。code は wsclient_connect() の戻り値。
+// 戻り値は misskey_conn_open() と同じ。
+static bool
+misskey_conn_connected(struct misskey_conn *conn, int code)
+{
+	const char *server = conn->src->server;
+
+	// 応答コード 101 が成功。
+	if (code != 101) {
+		if (code == -2) {
+			warnx("SSL not compiled");
+		} else if (code < 0) {
+			warn("%s: connection failed", server);
+		} else if (code == 0) {
+			warnx("%s: connection failed: EOF?", server);
 		} else {
-			status = RETRY;
+			warnx("%s: connection failed: HTTP %u", server, code);
+		}
+		if (conn->retry_count < 0) {
+			// 初回接続でエラーなら、それはエラー。
+			return false;
 		}
+		// 接続実績はあるが、今回の接続がエラーになったら再試行。
+		misskey_conn_close(conn, false);
+		return true;
+	}
 
- done:
-		wsclient_destroy(ws);
-		if (status == ERROR) {
-			// エラーなら終了。メッセージは表示済み。
-			break;
+	// 接続成功。
+	// 初回とリトライ時に表示。EOF 後の再接続では表示しない。
+	if (conn->retry_count != 0) {
+		if (nconns > 1) {
+			printf("%s: ", conn->label);
 		}
-		if (status == RETRY) {
-			retry_count++;
-			if (retry_count / 2 >= countof(retry_wait)) {
-				retry_count--;
-			}
+		printf("Connected\n");
+	}
+	conn->retry_count = 0;
+
+	if (misskey_stream_subscribe(conn->ws, conn->src->channel) == false) {
+		misskey_conn_close(conn, false);
+		return true;
+	}
+
+	// メッセージが出来ると misskey_recv_cb() が呼ばれる。
+	// 一定時間何も受信しなければキープアライブの PING を送る
+	// (以降も受信するまで同じ間隔で送る)。
+	conn->fd = wsclient_get_fd(conn->ws);
+	conn->ping_id = evloop_add_timer(stream_loop,
+		MISSKEY_PING_MSEC, MISSKEY_PING_MSEC, misskey_stream_ping_cb, conn->ws);
+	if (conn->ping_id == 0 ||
+		evloop_add_fd(stream_loop, conn->fd, EV_READ,
+			misskey_stream_fd_cb, conn) == false)
+	{
+		warn("%s: evloop setup failed", __func__);
+		misskey_conn_close(conn, false);
+	}
+	return true;
+}
+
+// conn の接続を閉じて、時間をおいて再接続するよう予約する。
+// 相手からの Connection Close なら eof を true にする。
+// それ以外 (エラー) なら再接続までの間隔を徐々に延ばしていく。
+static void
+misskey_conn_close(struct misskey_conn *conn, bool eof)
+{
+	static const uint16 retry_wait[] = {
+		1, 3, 10, 30, 60, 180, 600, 1800
+	};
+
+	if (conn->fd >= 0) {
+		evloop_del_fd(stream_loop, conn->fd);
+		conn->fd = -1;
+	}
+	if (conn->ping_id != 0) {
+		evloop_del_timer(stream_loop, conn->ping_id);
+		conn->ping_id = 0;
+	}
+	if (conn->connect_id != 0) {
+		evloop_del_timer(stream_loop, conn->connect_id);
+		conn->connect_id = 0;
+	}
+	wsclient_destroy(conn->ws);
+	conn->ws = NULL;
+
+	if (eof == false) {
+		conn->retry_count++;
+		if (conn->retry_count / 2 >= countof(retry_wait)) {
+			conn->retry_count--;
 		}
-		sleep(retry_wait[retry_count / 2]);
 	}
+	uint msec = retry_wait[conn->retry_count / 2] * 1000;
+	if (evloop_add_timer(stream_loop, msec, 0,
+			misskey_conn_retry_cb, conn) == 0)
+	{
+		warn("%s: evloop_add_timer failed", __func__);
+	}
+}
 
-	misskey_cleanup();
-	string_free(url);
+// 再接続の時間になった。
+static void
+misskey_conn_retry_cb(struct evloop *loop, void *arg)
+{
+	struct misskey_conn *conn = (struct misskey_conn *)arg;
+	misskey_conn_open(conn);
+}
+
+// 再接続処理中のソケットの準備ができた。
+static void
+misskey_conn_connect_cb(struct evloop *loop, int fd, uint revents, void *arg)
+{
+	struct misskey_conn *conn = (struct misskey_conn *)arg;
+
+	int code = wsclient_connect_step(conn->ws);
+	if (code == 1) {
+		uint want = wsclient_get_want(conn->ws);
+		int newfd = wsclient_get_fd(conn->ws);
+		if (newfd == fd) {
+			evloop_set_fd(loop, fd, want);
+			return;
+		}
+		// 次のアドレスを試していればソケットが変わっている。
+		evloop_del_fd(loop, fd);
+		conn->fd = newfd;
+		if (evloop_add_fd(loop, newfd, want,
+				misskey_conn_connect_cb, conn) == false)
+		{
+			warn("%s: evloop_add_fd failed", __func__);
+			misskey_conn_close(conn, false);
+		}
+		return;
+	}
+
+	// 接続処理用の登録を外して、あとは同期で接続した時と同じ。
+	evloop_del_fd(loop, conn->fd);
+	conn->fd = -1;
+	evloop_del_timer(loop, conn->connect_id);
+	conn->connect_id = 0;
+	misskey_conn_connected(conn, code);
 }
 
-// Misskey Streaming の接続後メインループ。定期的に切れるようだ。
-// 相手からの Connection Close なら true を返す。
-// エラー (おそらく復旧不可能)なら false を返す。
+// 再接続が期限までに完了しなかった。
+static void
+misskey_conn_timeout_cb(struct evloop *loop, void *arg)
+{
+	struct misskey_conn *conn = (struct misskey_conn *)arg;
+
+	// 1回きりのタイマーなのでもう削除されている。
+	conn->connect_id = 0;
+
+	warnx("%s: connection timed out", conn->src->server);
+	misskey_conn_close(conn, false);
+}
+
+// Misskey Streaming の接続後、channel を購読するコマンドを送る。
+// 失敗すれば false を返す。
 static bool
-misskey_stream(struct wsclient *ws, bool home)
+misskey_stream_subscribe(struct wsclient *ws, uint channel)
 {
 	char cmd[128];
 
-	// コマンド送信。
-	snprintf(cmd, sizeof(cmd), "{\"type\":\"connect\",\"body\":{"
-		"\"channel\":\"%s\",\"id\":\"%s-sayaka%08x\"}}",
-		home ? "homeTimeline" : "localTimeline",
-		home ? "htl" : "ltl",
-		rnd_get32());
-	if (wsclient_send_text(ws, cmd) < 0) {
-		warn("%s: Sending command failed", __func__);
-		return false;
+	// タイムライン。
+	if (channel == MISSKEY_CHANNEL_LOCAL || channel == MISSKEY_CHANNEL_HOME) {
+		bool home = (channel == MISSKEY_CHANNEL_HOME);
+		snprintf(cmd, sizeof(cmd), "{\"type\":\"connect\",\"body\":{"
+			"\"channel\":\"%s\",\"id\":\"%s-sayaka%08x\"}}",
+			home ? "homeTimeline" : "localTimeline",
+			home ? "htl" : "ltl",
+			rnd_get32());
+		if (wsclient_send_text(ws, cmd) < 0) {
+			warn("%s: Sending command failed", __func__);
+			return false;
+		}
 	}
 
-	if (home) {
+	// 通知。ホームタイムラインならこれも購読する。
+	if (channel == MISSKEY_CHANNEL_HOME || channel == MISSKEY_CHANNEL_MAIN) {
 		snprintf(cmd, sizeof(cmd), "{\"type\":\"connect\",\"body\":{"
 			"\"channel\":\"%s\",\"id\":\"%s-sayaka%08x\"}}",
 			"main", "main", rnd_get32());
@@ -260,21 +1014,53 @@ misskey_stream(struct wsclient *ws, bool home)
 		}
 	}
 
-	// あとは受信。メッセージが出来ると misskey_recv_cb() が呼ばれる。
+	return true;
+}
+
+// ストリームのソケットが読み込み可能になった。
+// Misskey Streaming は定期的に切れるようなので、切れたら再接続する。
+static void
+misskey_stream_fd_cb(struct evloop *loop, int fd, uint revents, void *arg)
+{
+	struct misskey_conn *conn = (struct misskey_conn *)arg;
+
+	// 何か受信したのでキープアライブのタイマーを仕掛け直す。
+	evloop_del_timer(loop, conn->ping_id);
+	conn->ping_id = evloop_add_timer(loop, MISSKEY_PING_MSEC, MISSKEY_PING_MSEC,
+		misskey_stream_ping_cb, conn->ws);
+
+	// 複数の接続元を混ぜて表示する時は、どこから来たかを示す。
+	source_label = (nconns > 1) ? conn->label : NULL;
+	source_server = conn->src->server;
+
+	// 受信できるものがなくなるまで処理する。
 	for (;;) {
-		int r = wsclient_process(ws);
+		int r = wsclient_process(conn->ws);
 		if (__predict_false(r <= 0)) {
 			if (r < 0) {
+				if (errno == EAGAIN) {
+					evloop_set_fd(loop, fd, wsclient_get_want(conn->ws));
+					break;
+				}
 				warn("%s: wsclient_process failed", __func__);
-				break;
+				misskey_conn_close(conn, false);
 			} else {
 				// EOF
-				return true;
+				misskey_conn_close(conn, true);
 			}
+			break;
 		}
 	}
+	source_label = NULL;
+	source_server = NULL;
+}
 
-	return false;
+// 一定時間何も受信しなかった。
+static void
+misskey_stream_ping_cb(struct evloop *loop, void *arg)
+{
+	struct wsclient *ws = (struct wsclient *)arg;
+	wsclient_send_ping(ws);
 }
 
 // サーバから1メッセージ (以上?)を受信したコールバック。
@@ -282,25 +1068,258 @@ static void
 misskey_recv_cb(const string *msg)
 {
 	// 録画。
-	if (__predict_false(opt_record_file)) {
-		FILE *fp = fopen(opt_record_file, "a");
-		if (fp) {
-			fputs(string_get(msg), fp);
-			fputc('\n', fp);
-			fclose(fp);
+	if (__predict_false(recorder)) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		recorder_write(recorder, msg, timespec_to_usec(&now));
+	}
+
+	// 表示中に WebSocket を止めないよう、画像の先読みが揃うまでは
+	// 表示待ちにしておく。
+	misskey_pending_add(msg);
+	misskey_pending_flush();
+}
+
+// 受信したメッセージ msg を表示待ちに加えて、画像の先読みを始める。
+static void
+misskey_pending_add(const string *msg)
+{
+	struct misskey_pending *pm = calloc(1, sizeof(*pm));
+	if (pm == NULL) {
+		warn("%s: calloc failed", __func__);
+		return;
+	}
+	// 表示するまで持っておくのでヒープに置く。
+	struct arena *prev = arena_set_current(NULL);
+	pm->msg = string_dup(msg);
+	arena_set_current(prev);
+	if (pm->msg == NULL) {
+		warn("%s: string_dup failed", __func__);
+		free(pm);
+		return;
+	}
+	pm->label = source_label;
+	pm->server = source_server;
+
+	misskey_prefetch_message(pm->msg, &pm->prefetch);
+
+	*pending_tail = pm;
+	pending_tail = &pm->next;
+}
+
+// 表示待ちのメッセージを、先頭から画像が揃ったところまで表示する。
+static void
+misskey_pending_flush(void)
+{
+	const char *saved_label = source_label;
+	const char *saved_server = source_server;
+
+	while (pending_head && misskey_prefetch_ready(&pending_head->prefetch)) {
+		struct misskey_pending *pm = pending_head;
+		pending_head = pm->next;
+		if (pending_head == NULL) {
+			pending_tail = &pending_head;
 		}
+
+		source_label = pm->label;
+		source_server = pm->server;
+		misskey_message(pm->msg);
+		misskey_prefetch_release(&pm->prefetch);
+		string_free(pm->msg);
+		free(pm);
 	}
+	source_label = saved_label;
+	source_server = saved_server;
+}
 
-	misskey_message(UNCONST(msg));
+static void
+misskey_pending_cb(struct evloop *loop, void *arg)
+{
+	// 1回きりのタイマーなのでもう削除されている。
+	pending_timer_id = 0;
+	misskey_pending_flush();
+}
+
+// 画像の先読みが1つ完了した。
+// 取得処理のコールバックの中なので、表示はタイマーで次に回す。
+static void
+misskey_prefetch_done_cb(void)
+{
+	if (pending_timer_id == 0) {
+		pending_timer_id = evloop_add_timer(stream_loop, 0, 0,
+			misskey_pending_cb, NULL);
+	}
+}
+
+// メッセージ msg で表示するノートの画像の先読みを始め、mp に加える。
+static void
+misskey_prefetch_message(const string *msg, struct misskey_prefetch *mp)
+{
+	struct json *js = global_js;
+
+	if (opt_show_image == false) {
+		return;
+	}
+
+	// json_parse() は文字列を書き換えるので複製に対して行う。
+	struct arena *prev = arena_set_current(msg_arena);
+	string *tmp = string_dup(msg);
+	if (json_parse(js, tmp) < 0) {
+		goto done;
+	}
+
+	// 構造は misskey_message_main() を参照。
+	// 画像を表示するのはノートと、リアクション通知のノート。
+	const char *type = json_obj_find_cstr(js, 0, "type");
+	int ibody = json_obj_find_obj(js, 0, "body");
+	if (type == NULL || strcmp(type, "channel") != 0 || ibody < 0) {
+		goto done;
+	}
+	type = json_obj_find_cstr(js, ibody, "type");
+	int inote = json_obj_find_obj(js, ibody, "body");
+	if (type == NULL || inote < 0) {
+		goto done;
+	}
+	if (strcmp(type, "notification") == 0) {
+		const char *ntype = json_obj_find_cstr(js, inote, "type");
+		if (ntype == NULL || strcmp(ntype, "reaction") != 0) {
+			goto done;
+		}
+		inote = json_obj_find_obj(js, inote, "note");
+	} else if (strcmp(type, "note") != 0) {
+		goto done;
+	}
+	if (inote >= 0) {
+		misskey_prefetch_note(js, inote, mp);
+	}
+
+ done:
+	arena_set_current(prev);
+	arena_reset(msg_arena);
+}
+
+// ノート inote で表示する画像の先読みを始め、mp に加える。
+// どの画像を表示するかは misskey_show_note() と同じ判断をする。
+static void
+misskey_prefetch_note(const struct json *js, int inote,
+	struct misskey_prefetch *mp)
+{
+	const char *c_text = json_obj_find_cstr(js, inote, "text");
+	int icw = json_obj_find(js, inote, "cw");
+	if (icw >= 0 && json_is_str(js, icw) == false) {
+		icw = -1;
+	}
+	int ifiles = json_obj_find(js, inote, "files");
+	if (ifiles >= 0) {
+		if (json_is_array(js, ifiles) == false || json_get_size(js, ifiles) < 1)
+		{
+			ifiles = -1;
+		}
+	}
+	int irenote = json_obj_find_obj(js, inote, "renote");
+
+	if (c_text == NULL && icw < 0 && ifiles < 0 && irenote >= 0) {
+		// リノート。
+		misskey_prefetch_note(js, irenote, mp);
+		return;
+	}
+	if (opt_nsfw == NSFW_HIDE && misskey_has_sensitive(js, ifiles)) {
+		return;
+	}
+
+	int iuser = json_obj_find_obj(js, inote, "user");
+	if (iuser >= 0) {
+		string *userid = misskey_get_userid(js, iuser);
+		misskey_prefetch_images(js, iuser, userid,
+			(icw < 0 || opt_show_cw) ? ifiles : -1, mp);
+		string_free(userid);
+	}
+
+	// 引用先。
+	if (irenote >= 0) {
+		misskey_prefetch_note(js, irenote, mp);
+	}
+}
+
+// img_url の先読みを始めて mp に加える。
+static void
+misskey_prefetch_add(struct misskey_prefetch *mp,
+	const char *img_file, const char *img_url)
+{
+	if (mp->num < countof(mp->idx)) {
+		int idx = image_prefetch_add(img_file, img_url);
+		if (idx >= 0) {
+			mp->idx[mp->num++] = idx;
+		}
+	}
+}
+
+// mp の先読みがすべて完了していれば true を返す。
+static bool
+misskey_prefetch_ready(const struct misskey_prefetch *mp)
+{
+	for (uint i = 0; i < mp->num; i++) {
+		if (image_prefetch_done(mp->idx[i]) == false) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// mp の先読みを解放する。
+static void
+misskey_prefetch_release(struct misskey_prefetch *mp)
+{
+	for (uint i = 0; i < mp->num; i++) {
+		image_prefetch_release(mp->idx[i]);
+	}
+	mp->num = 0;
+}
+
+// 録画の定期的な書き出し。
+static void
+misskey_record_flush_cb(struct evloop *loop, void *arg)
+{
+	struct timespec now;
+
+	if (recorder) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		recorder_flush(recorder, timespec_to_usec(&now));
+	}
+}
+
+// 録画を終了する。
+static void
+misskey_record_close(void)
+{
+	recorder_close(recorder);
+	recorder = NULL;
 }
 
 // 1メッセージの処理。ここからストリーミングとローカル再生共通。
+// 処理中に作る string/ustring はすべて msg_arena から確保し、
+// 終わったらまとめて捨てる。
 static void
 misskey_message(string *jsonstr)
+{
+	netstat_check_request();
+
+	uint stage = bench_enter(BENCH_FORMAT);
+	struct arena *prev = arena_set_current(msg_arena);
+	misskey_message_main(jsonstr);
+	arena_set_current(prev);
+	arena_reset(msg_arena);
+	bench_leave(stage);
+}
+
+static void
+misskey_message_main(string *jsonstr)
 {
 	struct json *js = global_js;
 
+	uint stage = bench_enter(BENCH_JSON);
 	int n = json_parse(js, jsonstr);
+	bench_leave(stage);
 	if (__predict_false(n < 0)) {
 		warnx("%s: json_parse failed: %d", __func__, n);
 		return;
@@ -492,22 +1511,41 @@ misskey_show_note(const struct json *js, int inote)
 
 	// --nsfw=hide なら、添付ファイルに isSensitive が一つでも含まれていれば
 	// このノート自体を表示しない。
-	if (opt_nsfw == NSFW_HIDE) {
-		bool has_sensitive = false;
-		if (ifiles >= 0) {
-			JSON_ARRAY_FOR(ifile, js, ifiles) {
-				has_sensitive |= json_obj_find_bool(js, ifile, "isSensitive");
-			}
-		}
-		if (has_sensitive) {
-			return -1;
+	if (opt_nsfw == NSFW_HIDE && misskey_has_sensitive(js, ifiles)) {
+		return -1;
+	}
+
+	int iuser = json_obj_find_obj(js, inote, "user");
+	misskey_user *user;
+	ustring *headline;
+	ustring *textline;
+	string *text = NULL;
+	string *cw = NULL;
+	int ngid;
+	struct misskey_prefetch prefetch;
+
+	prefetch.num = 0;
+
+	// 最近表示したノートなら整形済みのものを使う。
+	const char *c_id = json_obj_find_cstr(js, inote, "id");
+	struct notecache *nc = notecache_lookup(c_id);
+	bool cached = (nc != NULL);
+	if (cached) {
+		Trace(diag_format, "%s: notecache hit %s", __func__, c_id);
+		user = nc->user;
+		headline = nc->headline;
+		textline = nc->textline;
+		ngid = nc->ngid;
+		if (ngid >= 0) {
+			crlf = misskey_show_ng(ngid, js, inote, user);
+			return 1;
 		}
+		goto show;
 	}
 
 	// 1行目は名前、アカウント名など。
-	int iuser = json_obj_find_obj(js, inote, "user");
-	misskey_user *user = misskey_get_user(js, inote);
-	ustring *headline = ustring_alloc(64);
+	user = misskey_get_user(js, inote);
+	headline = ustring_alloc(64);
 	// 名前欄は MFM とかが使えるので本文同様にパース。
 	ustring_append_ustring_style(headline, user->name, STYLE_USERNAME);
 	ustring_append_unichar(headline, ' ');
@@ -532,7 +1570,6 @@ misskey_show_note(const struct json *js, int inote)
 	// 都合がいいのでそのままにしておく (JSON パーサがテキストをデコードして
 	// いた場合にはこっちを再エスケープするはずだった)。
 
-	string *text = NULL;
 	if (c_text) {
 		text = json_unescape(c_text);
 	}
@@ -542,12 +1579,9 @@ misskey_show_note(const struct json *js, int inote)
 
 	// "cw":null は CW なし、"cw":"" は前置きなしの [CW]、で意味が違う。
 	// 文字列かどうかはチェック済み。
-	string *cw;
 	if (icw >= 0) {
 		const char *c_cw = json_get_cstr(js, icw);
 		cw = json_unescape(c_cw);
-	} else {
-		cw = NULL;
 	}
 
 	// cw, text のままだと条件が複雑なので、top と bottom ということにする。
@@ -563,23 +1597,23 @@ misskey_show_note(const struct json *js, int inote)
 	}
 
 	// 本文の NG ワード判定。
-	int ngid = misskey_ngword_match_text(top, user);
+	ngid = misskey_ngword_match_text(top, user);
+	if (ngid < 0 && bottom) {
+		ngid = misskey_ngword_match_text(bottom, user);
+	}
 	if (ngid >= 0) {
+		notecache_insert(c_id, ngid, user, headline, NULL);
 		crlf = misskey_show_ng(ngid, js, inote, user);
 		goto ng_abort;
 	}
-	if (bottom) {
-		ngid = misskey_ngword_match_text(bottom, user);
-		if (ngid >= 0) {
-			crlf = misskey_show_ng(ngid, js, inote, user);
-			goto ng_abort;
-		}
-	}
 	// XXX 表示が始まる前に投票文の NG ワードも判定しないといけない。
 
-	ustring *textline = ustring_alloc(256);
+	textline = ustring_alloc(256);
 
-	ustring *utop = misskey_display_text(js, inote, string_get(top));
+	// タグはこのノートの本文で共通なので一度だけ用意する。
+	struct tagset *tags = mfm_tagset_create(js, inote, diag_format);
+
+	ustring *utop = misskey_display_text(tags, string_get(top));
 	ustring_append(textline, utop);
 	ustring_free(utop);
 	if (cw) {
@@ -589,10 +1623,22 @@ misskey_show_note(const struct json *js, int inote)
 		}
 	}
 	if (bottom) {
-		ustring *ubtm = misskey_display_text(js, inote, string_get(bottom));
+		ustring *ubtm = misskey_display_text(tags, string_get(bottom));
 		ustring_append(textline, ubtm);
 		ustring_free(ubtm);
 	}
+	mfm_tagset_destroy(tags);
+
+	notecache_insert(c_id, -1, user, headline, textline);
+
+ show:
+	// 表示する画像を先に並行して取得しておく。
+	// ストリームでは受信時に先読みを始めて、揃ってから表示している。
+	if (stream_loop == NULL) {
+		misskey_prefetch_images(js, iuser, user->id,
+			(icw < 0 || opt_show_cw) ? ifiles : -1, &prefetch);
+		image_prefetch_run(prefetch.idx, prefetch.num);
+	}
 
 	misskey_show_icon(js, iuser, user->id);
 
@@ -602,7 +1648,7 @@ misskey_show_note(const struct json *js, int inote)
 	printf("\n");
 
 	// これらは本文付随なので CW 以降を表示する時だけ表示する。
-	if (cw == NULL || opt_show_cw) {
+	if (icw < 0 || opt_show_cw) {
 		// picture
 		image_count = 0;
 		image_next_cols = 0;
@@ -633,6 +1679,9 @@ misskey_show_note(const struct json *js, int inote)
 		}
 	}
 
+	// 使わなかった先読みがあれば捨てる (引用先は引用先で先読みする)。
+	misskey_prefetch_release(&prefetch);
+
 	// 引用部分。
 	// 引用先の非表示状態はこれより親に伝搬しない。
 	if (irenote >= 0) {
@@ -650,6 +1699,10 @@ misskey_show_note(const struct json *js, int inote)
 	ustring_append_ascii_style(footline, string_get(time), STYLE_TIME);
 	ustring_append_ascii_style(footline, string_get(rnmsg), STYLE_RENOTE);
 	ustring_append_ascii_style(footline, string_get(reactmsg), STYLE_REACTION);
+	if (source_label && indent_depth == 0) {
+		ustring_append_unichar(footline, ' ');
+		ustring_append_ascii_style(footline, source_label, STYLE_TIME);
+	}
 
 	iprint(footline);
 	printf("\n");
@@ -659,6 +1712,9 @@ misskey_show_note(const struct json *js, int inote)
 	string_free(time);
 	string_free(rnmsg);
 	string_free(reactmsg);
+	if (cached) {
+		return 1;
+	}
 	ustring_free(textline);
  ng_abort:
 	string_free(cw);
@@ -869,6 +1925,77 @@ misskey_show_notification(const struct json *js, int ibody)
 	return 0;
 }
 
+// このノートで表示する画像 (アイコンと ifiles の添付画像) のうち
+// キャッシュにないものの先読みを始めて mp に加える。
+static void
+misskey_prefetch_images(const struct json *js, int iuser, const string *userid,
+	int ifiles, struct misskey_prefetch *mp)
+{
+	char img_file[PATH_MAX];
+	char urlbuf[256];
+	const char *img_url;
+
+	if (opt_show_image == false) {
+		return;
+	}
+
+	img_url = misskey_icon_source(js, iuser, userid,
+		img_file, sizeof(img_file));
+	if (img_url) {
+		misskey_prefetch_add(mp, img_file, img_url);
+	}
+
+	if (ifiles >= 0) {
+		JSON_ARRAY_FOR(ifile, js, ifiles) {
+			uint width;
+			uint height;
+			bool shade;
+			const char *filetype_msg;
+			img_url = misskey_photo_source(js, ifile, urlbuf, sizeof(urlbuf),
+				&width, &height, &shade, &filetype_msg);
+			if (img_url == NULL) {
+				continue;
+			}
+			make_cache_filename(img_file, sizeof(img_file), img_url);
+			misskey_prefetch_add(mp, img_file, img_url);
+		}
+	}
+}
+
+// 添付ファイル ifiles に isSensitive なものが一つでもあれば true を返す。
+static bool
+misskey_has_sensitive(const struct json *js, int ifiles)
+{
+	if (ifiles >= 0) {
+		JSON_ARRAY_FOR(ifile, js, ifiles) {
+			if (json_obj_find_bool(js, ifile, "isSensitive")) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// アイコン画像の URL を返し、そのキャッシュファイル名を filename に
+// 格納する。画像のアイコンを表示しない場合は NULL を返す。
+static const char *
+misskey_icon_source(const struct json *js, int iuser, const string *userid,
+	char *filename, uint bufsize)
+{
+	const char *avatar_url = json_obj_find_cstr(js, iuser, "avatarUrl");
+	if (avatar_url == NULL || userid == NULL || opt_force_blurhash) {
+		return NULL;
+	}
+
+	// URL の FNV1 ハッシュをキャッシュのキーにする。
+	// Misskey の画像 URL は長いのと URL がネストした構造を
+	// しているので単純に一部を切り出して使う方法は無理。
+	snprintf(filename, bufsize, "icon-%s-%u-%s-%08x",
+		colorname, fontheight,
+		string_get(userid), hash_fnv1a(avatar_url));
+	return avatar_url;
+}
+
 // アイコン表示。
 static void
 misskey_show_icon(const struct json *js, int iuser, const string *userid)
@@ -891,14 +2018,9 @@ misskey_show_icon(const struct json *js, int iuser, const string *userid)
 	bool shown = false;
 	if (__predict_true(opt_show_image)) {
 		char filename[PATH_MAX];
-		const char *avatar_url = json_obj_find_cstr(js, iuser, "avatarUrl");
-		if (avatar_url && userid && !opt_force_blurhash) {
-			// URL の FNV1 ハッシュをキャッシュのキーにする。
-			// Misskey の画像 URL は長いのと URL がネストした構造を
-			// しているので単純に一部を切り出して使う方法は無理。
-			snprintf(filename, sizeof(filename), "icon-%s-%u-%s-%08x",
-				colorname, fontheight,
-				string_get(userid), hash_fnv1a(avatar_url));
+		const char *avatar_url = misskey_icon_source(js, iuser, userid,
+			filename, sizeof(filename));
+		if (avatar_url) {
 			shown = show_image(filename, avatar_url, iconsize, iconsize,
 				false, -1);
 		}
@@ -971,56 +2093,10 @@ misskey_show_photo(const struct json *js, int ifile, int index)
 	bool shown = false;
 
 	if (opt_show_image) {
-		bool isSensitive = json_obj_find_bool(js, ifile, "isSensitive");
-		if ((!isSensitive || opt_nsfw == NSFW_SHOW) && !opt_force_blurhash) {
-			// 元画像を表示。thumbnailUrl を使う。
-			img_url = json_obj_find_cstr(js, ifile, "thumbnailUrl");
-			if (img_url == NULL || img_url[0] == '\0') {
-				// なければ、ファイルタイプだけでも表示しとく?
-				goto next;
-			}
-			width  = imagesize;
-			height = imagesize;
-		} else {
-			// Blurhash を表示。
-			const char *blurhash = json_obj_find_cstr(js, ifile, "blurhash");
-			if (blurhash == NULL || blurhash[0] == '\0' ||
-				opt_nsfw == NSFW_ALT)
-			{
-				// 画像でないなど Blurhash がない、あるいは --nsfw=alt なら、
-				// ファイルタイプだけでも表示しておくか。
-				filetype_msg = " [NSFW]";
-				goto next;
-			}
-			int iproperties = json_obj_find_obj(js, ifile, "properties");
-			if (iproperties >= 0) {
-				width  = json_obj_find_int(js, iproperties, "width");
-				height = json_obj_find_int(js, iproperties, "height");
-
-				// 原寸のアスペクト比を維持したまま長辺が imagesize になる
-				// ようにする。
-				// image_reduct() には入力画像サイズとしてこのサイズを、
-				// 出力画像サイズも同じサイズを指定することで等倍で動作させる。
-				if (width > height) {
-					height = height * imagesize / width;
-					width = imagesize;
-				} else {
-					width = width * imagesize / height;
-					height = imagesize;
-				}
-			}
-			if (width < 1) {
-				width = imagesize;
-			}
-			if (height < 1) {
-				height = imagesize;
-			}
-			snprintf(urlbuf, sizeof(urlbuf), "blurhash://%s", blurhash);
-			img_url = urlbuf;
-
-			if (isSensitive && opt_nsfw != NSFW_SHOW) {
-				shade = true;
-			}
+		img_url = misskey_photo_source(js, ifile, urlbuf, sizeof(urlbuf),
+			&width, &height, &shade, &filetype_msg);
+		if (img_url == NULL) {
+			goto next;
 		}
 		make_cache_filename(img_file, sizeof(img_file), img_url);
 		shown = show_image(img_file, img_url, width, height, shade, index);
@@ -1033,6 +2109,80 @@ misskey_show_photo(const struct json *js, int ifile, int index)
 	return shown;
 }
 
+// 添付ファイル ifile の表示に使う画像の URL を返す。
+// Blurhash なら "blurhash://..." の形式で urlbuf に作成する。
+// 表示サイズを *widthp, *heightp に、暗くするかどうかを *shadep に格納する。
+// 画像を表示しない場合は NULL を返し、ファイルタイプに付け加える
+// メッセージを *filetype_msgp に格納する。
+static const char *
+misskey_photo_source(const struct json *js, int ifile,
+	char *urlbuf, uint bufsize, uint *widthp, uint *heightp, bool *shadep,
+	const char **filetype_msgp)
+{
+	const char *img_url;
+	uint width = 0;
+	uint height = 0;
+
+	*shadep = false;
+	*filetype_msgp = "";
+
+	bool isSensitive = json_obj_find_bool(js, ifile, "isSensitive");
+	if ((!isSensitive || opt_nsfw == NSFW_SHOW) && !opt_force_blurhash) {
+		// 元画像を表示。thumbnailUrl を使う。
+		img_url = json_obj_find_cstr(js, ifile, "thumbnailUrl");
+		if (img_url == NULL || img_url[0] == '\0') {
+			// なければ、ファイルタイプだけでも表示しとく?
+			return NULL;
+		}
+		width  = imagesize;
+		height = imagesize;
+	} else {
+		// Blurhash を表示。
+		const char *blurhash = json_obj_find_cstr(js, ifile, "blurhash");
+		if (blurhash == NULL || blurhash[0] == '\0' ||
+			opt_nsfw == NSFW_ALT)
+		{
+			// 画像でないなど Blurhash がない、あるいは --nsfw=alt なら、
+			// ファイルタイプだけでも表示しておくか。
+			*filetype_msgp = " [NSFW]";
+			return NULL;
+		}
+		int iproperties = json_obj_find_obj(js, ifile, "properties");
+		if (iproperties >= 0) {
+			width  = json_obj_find_int(js, iproperties, "width");
+			height = json_obj_find_int(js, iproperties, "height");
+
+			// 原寸のアスペクト比を維持したまま長辺が imagesize になる
+			// ようにする。
+			// image_reduct() には入力画像サイズとしてこのサイズを、
+			// 出力画像サイズも同じサイズを指定することで等倍で動作させる。
+			if (width > height) {
+				height = height * imagesize / width;
+				width = imagesize;
+			} else {
+				width = width * imagesize / height;
+				height = imagesize;
+			}
+		}
+		if (width < 1) {
+			width = imagesize;
+		}
+		if (height < 1) {
+			height = imagesize;
+		}
+		snprintf(urlbuf, bufsize, "blurhash://%s", blurhash);
+		img_url = urlbuf;
+
+		if (isSensitive && opt_nsfw != NSFW_SHOW) {
+			*shadep = true;
+		}
+	}
+
+	*widthp = width;
+	*heightp = height;
+	return img_url;
+}
+
 // 改行してファイルタイプだけを出力する。
 static void
 misskey_print_filetype(const struct json *js, int ifile, const char *msg)
@@ -1084,436 +2234,18 @@ make_cache_filename(char *filename, uint bufsize, const char *url)
 	}
 }
 
-enum {
-	S_NONE = 0,
-	S_RAWTEXT,		// 地のテキスト
-	S_PLAIN,		// <plain>〜</plain> 内
-	S_BACKTICK1,	// `〜` 内
-	S_BACKTICK3,	// ```〜``` 内
-	S_MENTION,		// @mention、色を変える
-	S_URL,			// URL、色を変える
-	S_RUBY1,		// ルビの本文1
-	S_RUBY2,		// ルビの本文2
-	S_UNSUPP_MFM,	// 未サポートの MFM コンテンツ内
-};
-
-struct context {
-	ustring *dst;
-
-	// states[] はスタックで [0] が底。[state_top] がトップ。
-	uint8 states[128];	// 上限は適当。
-	int state_top;
-
-	// URL 中の丸括弧。
-	int paren_in_url;
-};
-
-static inline uint
-state_get(const struct context *ctx)
-{
-	return ctx->states[ctx->state_top];
-}
-
 // 本文を表示用に整形。
 static ustring *
-misskey_display_text(const struct json *js, int inote, const char *text)
+misskey_display_text(const struct tagset *tags, const char *text)
 {
-	return misskey_display_text_common(js, inote, text, false);
+	return mfm_display_text(text, tags, false, diag_format);
 }
 
 // 名前を表示用に整形。
 static ustring *
-misskey_display_name(const struct json *js, int inote, const char *name)
-{
-	return misskey_display_text_common(js, inote, name, true);
-}
-
-// 本文/名前を表示用に整形。
-static ustring *
-misskey_display_text_common(const struct json *js, int inote, const char *text,
-	bool is_username)
-{
-	const struct diag *diag = diag_format;
-	ustring *src = ustring_from_utf8(text);
-	ustring *dst = ustring_alloc(strlen(text));
-
-	if (__predict_false(diag_get_level(diag) >= 2)) {
-		ustring_dump(src, "display_text src");
-	}
-
-	// 記号をどれだけ含むかだけが違う。
-	// Mention 1文字目は   "_" + Alnum
-	// Mention 2文字目以降 "_" + Alnum + "@.-"
-	// URL は              "_" + Alnum + "@.-" +
-	//  RFC3986の集合、ただしここでは '%' も含む、'(' ')' は別処理なので除く。
-	static const char urlchars[] =
-		"!#$%&'*+,/:;=?[]~"
-		"@.-"
-		"_0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-	#define ment2chars (urlchars + 16)
-	#define ment1chars (urlchars + 16 + 3)
-
-	// タグを集めて小文字にしておく。
-	ustring **tags = NULL;
-	uint tagcount = 0;
-	int itags = json_obj_find(js, inote, "tags");
-	if (itags >= 0 && json_is_array(js, itags)) {
-		tagcount = json_get_size(js, itags);
-		if (tagcount > 0) {
-			tags = calloc(tagcount, sizeof(ustring *));
-			JSON_ARRAY_FOR(itag, js, itags) {
-				if (json_is_str(js, itag)) {
-					const char *tag = json_get_cstr(js, itag);
-					ustring *utag = ustring_from_utf8(tag);
-					ustring_tolower_inplace(utag);
-					tags[i_] = utag;
-				}
-			}
-		}
-	}
-	if (diag_get_level(diag) >= 2) {
-		diag_print(diag, "tagcount=%u", tagcount);
-		for (uint i = 0; i < tagcount; i++) {
-			printf("tags[%u] ", i);
-			if (tags[i]) {
-				string *s = ustring_to_utf8(tags[i]);
-				printf("|%s|\n", string_get(s));
-				string_free(s);
-			} else {
-				printf("null\n");
-			}
-		}
-	}
-
-	struct context ctx0;
-	struct context *ctx = &ctx0;
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->dst = dst;
-	ctx->states[0] = S_RAWTEXT;
-	state_enter(ctx, ctx->states[0]);
-
-	const unichar *srcarray = ustring_get(src);
-	for (uint pos = 0, posend = ustring_len(src); pos < posend; ) {
-		unichar c = srcarray[pos];
-
-		switch (state_get(ctx)) {
-		 case S_RAWTEXT:
-		 rawtext:
-			if (c == '<') {
-				if (unichar_submatch(&srcarray[pos + 1], "plain>")) {
-					pos += 7;
-					state_push(ctx, S_PLAIN);
-					continue;
-				}
-			} else if (c == '$' && ustring_at(src, pos + 1) == '[') {
-				// MFM タグ開始。
-				int s = pos + 2;
-
-				// タグ名の区切りは空白(SP)のみらしい。
-				if (unichar_submatch(&srcarray[s], "ruby ")) {
-					// $[ruby 漢字 かんじ]
-					s += 5;
-
-					// 空白が連続しているかも知れないのでスキップ。
-					for (; ustring_at(src, s) == ' '; s++)
-						;
-					pos = s;
-					// ここから本文1
-					state_push(ctx, S_RUBY1);
-					continue;
-				} else {
-					// 知らないタグなら、タグを無視してコンテンツのみ表示。
-					for (; s < posend; s++) {
-						if (srcarray[s] == ' ') {
-							// 空白の次から ']' の手前までがコンテンツ。
-							pos = s + 1;
-							state_push(ctx, S_UNSUPP_MFM);
-							goto continue_;	// 一つ上の for へ。
-						}
-					}
-					// 知らないタグのまま EOL ならタグではない。
-				}
-			} else if (c == '`') {
-				if (unichar_submatch(&srcarray[pos + 1], "``")) {
-					pos += 3;
-					state_push(ctx, S_BACKTICK3);
-				} else {
-					pos++;
-					state_push(ctx, S_BACKTICK1);
-				}
-				continue;
-			} else if (is_username) {
-				// ユーザ名欄ならこれ以降のマークアップは整形しない。
-				break;
-			} else if (c == '@') {
-				// '@' の直前が ment2 でなく(?)、直後が ment1 ならメンション。
-				unichar pc = ustring_at(src, pos - 1);
-				unichar nc = ustring_at(src, pos + 1);
-				bool prev_is_ment2 =
-					(pc != 0 && pc < 0x80 && strchr(ment2chars, pc) != NULL);
-				bool next_is_ment1 =
-					(nc != 0 && nc < 0x80 && strchr(ment1chars, nc) != NULL);
-				if (prev_is_ment2 == false && next_is_ment1 == true) {
-					state_push(ctx, S_MENTION);
-					continue;
-				}
-			} else if (c == '#') {
-				// タグはこの時点で範囲(長さ)が分かるのでステート分岐不要。
-				int i = 0;
-				for (; i < tagcount; i++) {
-					const unichar *utag = tags[i] ? ustring_get(tags[i]) : NULL;
-					if (unichar_ncasecmp(&srcarray[pos + 1], utag) == 0) {
-						break;
-					}
-				}
-				if (i != tagcount) {
-					// 一致したらタグ。'#' 文字自身も含めてコピーする。
-					ustring_append_ascii(dst, style_begin(STYLE_TAG));
-					ustring_append_unichar(dst, c);
-					pos++;
-					uint len = ustring_len(tags[i]);
-					// tags は正規化によって何が起きてるか分からないので、
-					// posend のほうを信じる。
-					uint end = MIN(pos + len, (int)posend);
-					Trace(diag, "tag[%d] found at pos=%u len=%u end=%u",
-						i, pos, len, end);
-					for (; pos < end; pos++) {
-						ustring_append_unichar(dst, srcarray[pos]);
-					}
-					ustring_append_ascii(dst, style_end(STYLE_TAG));
-					continue;
-				}
-			} else if (c == 'h' &&
-				(unichar_submatch(&srcarray[pos], "https://") ||
-				 unichar_submatch(&srcarray[pos], "http://")))
-			{
-				// URL
-				state_push(ctx, S_URL);
-				continue;
-			}
-			break;
-
-		 case S_UNSUPP_MFM:
-			// MFM コンテンツ内は閉じ括弧以外は RAWTEXT と同じ処理を通す。
-			if (c == ']') {
-				pos++;
-				state_pop(ctx);
-				continue;
-			}
-			goto rawtext;
-
-		 case S_RUBY1:
-			// ルビ1は ' ' が来たら終了。
-			if (c == ' ') {
-				pos++;
-				state_pop(ctx);
-				state_push(ctx, S_RUBY2);
-				ustring_append_unichar(dst, '(');
-				continue;
-			}
-			goto rawtext;
-
-		 case S_RUBY2:
-			// ルビ2 は ']' が来たら終了。
-			if (c == ']') {
-				ustring_append_unichar(dst, ')');
-				pos++;
-				state_pop(ctx);
-				continue;
-			}
-			goto rawtext;
-
-		 case S_PLAIN:
-			// <plain> 内なら "</plain>" が来たら終了。
-			if (c == '<' && unichar_submatch(&srcarray[pos + 1], "/plain>")) {
-				pos += 8;
-				state_pop(ctx);
-				continue;
-			}
-			break;
-
-		 case S_BACKTICK1:
-			// `〜` 内なら '`' が来たら終了。
-			if (c == '`') {
-				pos++;
-				state_pop(ctx);
-				continue;
-			}
-			break;
-
-		 case S_BACKTICK3:
-			// ```〜``` なら "```" が来たら終了。
-			if (c == '`' && unichar_submatch(&srcarray[pos + 1], "``")) {
-				pos += 3;
-				state_pop(ctx);
-				continue;
-			}
-			break;
-
-		 case S_MENTION:
-			// メンション内なら ment2 以外の文字が来たら終了。
-			if (strchr(ment2chars, c) == NULL) {
-				state_pop(ctx);
-				continue;
-			}
-			break;
-
-		 case S_URL:
-			// 括弧 "(",")" は URL に使えるが、URL 前から始まってる括弧の
-			// 閉じ括弧との区別はヒューリスティックにしか解決できないらしい。
-			// "(http://foo/a)bc" なら http://foo/a が URL。
-			// "http://foo/a(b)c" なら http://foo/a(b)c が URL。
-			// 正気か?
-			if (strchr(urlchars, c)) {
-				// FALLTHROUGH
-			} else if (c == '(') {
-				ctx->paren_in_url++;
-			} else if (c == ')' && ctx->paren_in_url > 0) {
-				ctx->paren_in_url--;
-			} else {
-				state_pop(ctx);
-				continue;
-			}
-			break;
-
-		 default:
-			printf("unknown state=%u\n", state_get(ctx));
-			continue;
-		}
-
-		// どれでもなければここに落ちてきて1文字出力。
-		ustring_append_unichar(dst, c);
-		pos++;
-
-	 continue_:;
-	}
-
-	while (state_pop(ctx))
-		;
-
-	for (uint i = 0; i < tagcount; i++) {
-		ustring_free(tags[i]);
-	}
-	free(tags);
-	ustring_free(src);
-
-	if (__predict_false(diag_get_level(diag) >= 2)) {
-		ustring_dump(dst, "dst");
-	}
-	return dst;
-}
-
-static void
-state_push(struct context *ctx, uint new_state)
-{
-	uint old_state = state_get(ctx);
-	state_leave(ctx, old_state);
-	state_enter(ctx, new_state);
-	assert(ctx->state_top < sizeof(ctx->states) - 2);
-	ctx->states[++ctx->state_top] = new_state;
-}
-
-static bool
-state_pop(struct context *ctx)
-{
-	uint old_state = state_get(ctx);
-	state_leave(ctx, old_state);
-
-	ctx->state_top--;
-	if (ctx->state_top >= 0) {
-		uint new_state = ctx->states[ctx->state_top];
-		state_enter(ctx, new_state);
-		return true;
-	} else {
-		return false;
-	}
-}
-
-// ステート(装飾範囲)を開始する。
-static void
-state_enter(struct context *ctx, uint state)
-{
-	const char *style = NULL;
-	switch (state) {
-	 case S_MENTION:
-		style = style_begin(STYLE_USERID);
-		break;
-	 case S_URL:
-		style = style_begin(STYLE_URL);
-		ctx->paren_in_url = 0;
-		break;
-	 default:
-		break;
-	}
-	if (style) {
-		ustring_append_ascii(ctx->dst, style);
-	}
-}
-
-// ステート(装飾範囲)を終了する。
-static void
-state_leave(struct context *ctx, uint state)
-{
-	const char *style = NULL;
-	switch (state) {
-	 case S_MENTION:
-		style = style_end(STYLE_USERID);
-		break;
-	 case S_URL:
-		style = style_end(STYLE_URL);
-		break;
-	 default:
-		break;
-	}
-	if (style) {
-		ustring_append_ascii(ctx->dst, style);
-	}
-}
-
-// ustring (の中身の配列) u 以降が key と部分一致すれば true を返す。
-static bool
-unichar_submatch(const unichar *u, const char *key)
-{
-	for (uint i = 0; key[i]; i++) {
-		if (u[i] == '\0') {
-			return false;
-		}
-		if (u[i] != key[i]) {
-			return false;
-		}
-	}
-	return true;
-}
-
-// ustring (の中身の配列) u1 以降が u2 の長さ分だけ大文字小文字を無視して
-// 一致すれば 0 を返す。一致しなければ大小を返すはずだがそこは適当。
-// 便宜上 u2 は NULL も受け付ける (tags[] が NULL の可能性が一応あるので)。
-static int
-unichar_ncasecmp(const unichar *u1, const unichar *u2)
+misskey_display_name(const char *name)
 {
-	assert(u1);
-
-	if (u2 == NULL) {
-		return 1;
-	}
-
-	for (uint i = 0; u2[i]; i++) {
-		if (u1[i] == '\0') {
-			return 1;
-		}
-		unichar c1 = u1[i];
-		unichar c2 = u2[i];
-		if ('A' <= c1 && c1 <= 'Z') {
-			c1 += 0x20;
-		}
-		if ('A' <= c2 && c2 <= 'Z') {
-			c2 += 0x20;
-		}
-		if (c1 != c2) {
-			return 1;
-		}
-	}
-	return 0;
+	return mfm_display_text(name, NULL, true, diag_format);
 }
 
 // 投票を表示用に整形して返す。
@@ -1652,33 +2384,28 @@ misskey_get_user(const struct json *js, int inote)
 		return NULL;
 	}
 	user->name = ustring_init();
-	user->id   = string_init();
 
 	int iuser = json_obj_find_obj(js, inote, "user");
-	if (iuser >= 0) {
+	if (iuser < 0) {
+		user->id = string_init();
+	} else {
 		const char *c_name     = json_obj_find_cstr(js, iuser, "name");
 		const char *c_username = json_obj_find_cstr(js, iuser, "username");
-		const char *c_host     = json_obj_find_cstr(js, iuser, "host");
 
 		// ユーザ名 は name だが、空なら username を使う仕様のようだ。
 		if (c_name && c_name[0] != '\0') {
 			// XXX テキスト中に制御文字が含まれてたらとかはまた後で考える。
 			string *tmp = json_unescape(c_name);
-			ustring *name = misskey_display_name(js, inote, string_get(tmp));
+			ustring *name = misskey_display_name(string_get(tmp));
 			ustring_append(user->name, name);
+			ustring_free(name);
 			string_free(tmp);
 		} else {
 			// こっちは ID っぽいやつなのでおかしな文字はいないはず。
 			ustring_append_ascii(user->name, c_username);
 		}
 
-		// @アカウント名 [ @外部ホスト名 ]
-		string_append_char(user->id, '@');
-		string_append_cstr(user->id, c_username);
-		if (c_host) {
-			string_append_char(user->id, '@');
-			string_append_cstr(user->id, c_host);
-		}
+		user->id = misskey_get_userid(js, iuser);
 
 		// インスタンス名
 		int iinstance = json_obj_find_obj(js, iuser, "instance");
@@ -1693,6 +2420,41 @@ misskey_get_user(const struct json *js, int inote)
 	return user;
 }
 
+// ユーザ iuser のアカウント名 "@アカウント名[@外部ホスト名]" を返す。
+static string *
+misskey_get_userid(const struct json *js, int iuser)
+{
+	const char *c_username = json_obj_find_cstr(js, iuser, "username");
+	const char *c_host     = json_obj_find_cstr(js, iuser, "host");
+
+	string *id = string_init();
+	string_append_char(id, '@');
+	string_append_cstr(id, c_username);
+	if (c_host) {
+		string_append_char(id, '@');
+		string_append_cstr(id, c_host);
+	}
+	return id;
+}
+
+// user の複製を返す。
+// 複製は現在の確保先に作られる。
+static misskey_user *
+misskey_dup_user(const misskey_user *user)
+{
+	misskey_user *dup = calloc(1, sizeof(*dup));
+	if (dup == NULL) {
+		return NULL;
+	}
+	dup->name = ustring_init();
+	ustring_append(dup->name, user->name);
+	dup->id = string_dup(user->id);
+	if (user->instance) {
+		dup->instance = string_dup(user->instance);
+	}
+	return dup;
+}
+
 static void
 misskey_free_user(misskey_user *user)
 {
@@ -1700,43 +2462,115 @@ misskey_free_user(misskey_user *user)
 		ustring_free(user->name);
 		string_free(user->id);
 		string_free(user->instance);
+		free(user);
 	}
 }
 
-// text を NG ワード集と比較する。
-// マッチすれば NG ワードのインデックスを返す。
-// マッチしなければ -1 を返す。
-static int
-misskey_ngword_match_text(const string *text, const misskey_user *user)
+// 表示中のサーバのノート ID id からキャッシュのキーを buf に作る。
+static void
+notecache_make_key(char *buf, size_t bufsize, const char *id)
 {
-	int i;
+	snprintf(buf, bufsize, "%s %s", (source_server ?: ""), id);
+}
 
-	for (i = 0; i < ngwords->count; i++) {
-		struct ngword *ng = &ngwords->item[i];
+// ノート ID が id のキャッシュがあれば返す。なければ NULL を返す。
+static struct notecache *
+notecache_lookup(const char *id)
+{
+	char key[512];
 
-		// ユーザ指定がなければ、常に判定に進む。
-		// ユーザ指定があれば、ユーザが一致した時だけ判定に進む。
-		if (ng->ng_user && string_equal(ng->ng_user, user->id) == false) {
-			continue;
+	if (id == NULL) {
+		return NULL;
+	}
+
+	notecache_make_key(key, sizeof(key), id);
+	uint32 hash = hash_fnv1a(key);
+	for (uint i = 0; i < countof(notecache); i++) {
+		struct notecache *nc = &notecache[i];
+		if (nc->key && nc->hash == hash && string_equal_cstr(nc->key, key)) {
+			nc->lastuse = ++notecache_clock;
+			notecache_hit++;
+			return nc;
 		}
+	}
+	return NULL;
+}
 
-		switch (ng->ng_type) {
-		 case NG_TEXT:	// 単純一致
-			if (strstr(string_get(text), string_get(ng->ng_text))) {
-				return i;
-			}
-			break;
-		 case NG_REGEX:	// 正規表現
-			if (regexec(&ng->ng_regex, string_get(text), 0, NULL, 0) == 0) {
-				return i;
-			}
-			break;
-		 default:
-			break;
+// ノート ID が id のノートの表示内容をキャッシュに登録する。
+// 空きがなければ一番長く使っていないものを追い出す。
+// 登録したエントリを返す。登録しなければ NULL を返す。
+static struct notecache *
+notecache_insert(const char *id, int ngid, const misskey_user *user,
+	const ustring *headline, const ustring *textline)
+{
+	char key[512];
+
+	if (id == NULL) {
+		return NULL;
+	}
+	notecache_make_key(key, sizeof(key), id);
+
+	struct notecache *nc = &notecache[0];
+	for (uint i = 1; i < countof(notecache); i++) {
+		if (notecache[i].lastuse < nc->lastuse) {
+			nc = &notecache[i];
 		}
 	}
+	if (nc->key) {
+		Trace(diag_format, "%s: evict %s", __func__, string_get(nc->key));
+		string_free(nc->key);
+		misskey_free_user(nc->user);
+		ustring_free(nc->headline);
+		ustring_free(nc->textline);
+	}
+	memset(nc, 0, sizeof(*nc));
+
+	// メッセージをまたいで持つのでヒープに置く。
+	struct arena *prev = arena_set_current(NULL);
+	nc->key = string_from_cstr(key);
+	nc->hash = hash_fnv1a(key);
+	nc->lastuse = ++notecache_clock;
+	nc->ngid = ngid;
+	nc->user = misskey_dup_user(user);
+	nc->headline = ustring_init();
+	ustring_append(nc->headline, headline);
+	if (textline) {
+		nc->textline = ustring_init();
+		ustring_append(nc->textline, textline);
+	}
+	arena_set_current(prev);
+
+	return nc;
+}
 
-	return -1;
+static void
+notecache_cleanup(void)
+{
+	Debug(diag_format, "notecache: %" PRIu64 " hits / %" PRIu64 " notes",
+		notecache_hit, notecache_clock);
+
+	for (uint i = 0; i < countof(notecache); i++) {
+		struct notecache *nc = &notecache[i];
+		if (nc->key) {
+			string_free(nc->key);
+			misskey_free_user(nc->user);
+			ustring_free(nc->headline);
+			ustring_free(nc->textline);
+		}
+	}
+	memset(notecache, 0, sizeof(notecache));
+}
+
+// text を NG ワード集と比較する。
+// マッチすれば NG ワードのインデックスを返す。
+// マッチしなければ -1 を返す。
+static int
+misskey_ngword_match_text(const string *text, const misskey_user *user)
+{
+	uint stage = bench_enter(BENCH_NG);
+	int ngid = ngword_match(ngwords, text, user->id);
+	bench_leave(stage);
+	return ngid;
 }
 
 // NG 用の表示を行う。
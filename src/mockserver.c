@@ -0,0 +1,849 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// ネットワークなしで動作確認するための Misskey/メディアサーバの代役
+//
+
+// 127.0.0.1 で待ち受けて、接続ごとに fork して1リクエストだけ処理する。
+// - WebSocket への Upgrade 要求なら --stream のファイル (--play と同じ
+//   JSONL か録画形式) を1メッセージずつテキストフレームで送る。
+//   クライアントからのフレームは読み捨てる (Close と Ping には応答する)。
+// - それ以外の GET なら --media のディレクトリ以下のファイルを返す。
+//   --rewrite を指定すると、ストリーム中の "https://" をこのサーバの
+//   "http://127.0.0.1:<port>/" に書き換えて送るので、
+//   https://host/path の画像は <media>/host/path から返すことになる。
+//
+// 計測や試験用に、応答前の遅延、帯域制限、chunked 転送、一定間隔での
+// 接続失敗を指定できる。失敗させる接続は何番目かで決めるので再現性がある。
+//
+// 例:
+//  % ./mockserver --stream=notes.rec --media=media --rewrite &
+//  % ./sayaka -s ws://127.0.0.1:8080
+
+#include "sayaka.h"
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if defined(HAVE_OPENSSL)
+#include <openssl/evp.h>
+#endif
+
+// 接続失敗のさせ方。
+enum {
+	FAIL_CLOSE,		// 何も返さずに切断する
+	FAIL_ERROR,		// 503 を返す
+	FAIL_TRUNCATE,	// 応答本体 (WebSocket なら最初のフレーム) の途中で切断する
+};
+
+// 1接続分の状態。
+struct conn {
+	int fd;
+	uint seq;			// 何番目の接続か (1 から)
+	bool fail;			// この接続を失敗させるか
+
+	// 帯域制限用。
+	uint64 start;		// 最初に書き込んだ時刻 [usec]
+	uint64 sent;		// 書き込んだバイト数
+};
+
+#define REQ_BUFSIZE	(8192)
+
+static void usage(void) __attribute__((__noreturn__));
+static void serve(int, uint);
+static void serve_ws(struct conn *, const char *);
+static void serve_media(struct conn *, const char *);
+static bool send_status(struct conn *, uint, const char *);
+static string *stream_rewrite(const string *);
+static bool ws_send_frame(struct conn *, uint8, const void *, uint, bool);
+static bool ws_drain(struct conn *, int);
+static bool conn_write(struct conn *, const void *, uint);
+static bool conn_printf(struct conn *, const char *, ...)
+	__attribute__((__format__(__printf__, 2, 3)));
+static const char *find_header(const char *, const char *, uint *);
+static string *ws_accept_key(const char *, uint);
+static uint64 now_usec(void);
+static void sleep_usec(uint64);
+
+static struct diag *diag;
+static uint opt_port;
+static const char *opt_stream;
+static const char *opt_media;
+static bool opt_rewrite;
+static bool opt_loop;
+static double opt_speed;		// 0 なら受信時刻を使わない
+static uint opt_interval;		// メッセージ間隔 [msec]
+static uint opt_latency;		// 応答前の遅延 [msec]
+static uint opt_bandwidth;		// 帯域 [bytes/sec]。0 なら無制限
+static uint opt_chunked;		// chunked 転送のチャンクサイズ。0 ならしない
+static uint opt_fail_every;		// この数ごとに接続を失敗させる。0 ならしない
+static uint opt_fail_mode;
+
+enum {
+	OPT__start = 0x7f,
+	OPT_bandwidth,
+	OPT_chunked,
+	OPT_fail_every,
+	OPT_fail_mode,
+	OPT_interval,
+	OPT_latency,
+	OPT_loop,
+	OPT_media,
+	OPT_rewrite,
+	OPT_speed,
+	OPT_stream,
+};
+
+static const struct option longopts[] = {
+	{ "bandwidth",		required_argument,	NULL,	OPT_bandwidth },
+	{ "chunked",		optional_argument,	NULL,	OPT_chunked },
+	{ "debug",			required_argument,	NULL,	'd' },
+	{ "fail-every",		required_argument,	NULL,	OPT_fail_every },
+	{ "fail-mode",		required_argument,	NULL,	OPT_fail_mode },
+	{ "interval",		required_argument,	NULL,	OPT_interval },
+	{ "latency",		required_argument,	NULL,	OPT_latency },
+	{ "loop",			no_argument,		NULL,	OPT_loop },
+	{ "media",			required_argument,	NULL,	OPT_media },
+	{ "port",			required_argument,	NULL,	'p' },
+	{ "rewrite",		no_argument,		NULL,	OPT_rewrite },
+	{ "speed",			required_argument,	NULL,	OPT_speed },
+	{ "stream",			required_argument,	NULL,	OPT_stream },
+	{ NULL },
+};
+
+// 数値引数を取得する。不正なら終了する。
+#define GET_UINT_ARG(var, name)	\
+	 {	\
+		var = stou32def(optarg, -1, NULL);	\
+		if ((int)var < 0)	\
+			errx(1, "--%s %s: invalid number", name, optarg);	\
+		break;	\
+	 }
+
+int
+main(int ac, char *av[])
+{
+	struct sockaddr_in sin;
+	uint seq;
+	int ls;
+	int c;
+
+	diag = diag_alloc();
+	diag_set_timestamp(diag, true);
+	opt_port = 8080;
+	opt_fail_mode = FAIL_CLOSE;
+
+	while ((c = getopt_long(ac, av, "d:p:", longopts, NULL)) != -1) {
+		switch (c) {
+		 case 'd':
+		 {
+			int lv = stou32def(optarg, -1, NULL);
+			if (lv < 0) {
+				errx(1, "invalid debug level: %s", optarg);
+			}
+			diag_set_level(diag, lv);
+			break;
+		 }
+
+		 case 'p':
+			opt_port = stou32def(optarg, 0, NULL);
+			if (opt_port == 0 || opt_port > 65535) {
+				errx(1, "--port %s: invalid port", optarg);
+			}
+			break;
+
+		 case OPT_bandwidth:
+			GET_UINT_ARG(opt_bandwidth, "bandwidth");
+
+		 case OPT_chunked:
+			if (optarg == NULL) {
+				opt_chunked = 4096;
+			} else {
+				opt_chunked = stou32def(optarg, 0, NULL);
+				if (opt_chunked == 0 || (int)opt_chunked < 0) {
+					errx(1, "--chunked %s: invalid size", optarg);
+				}
+			}
+			break;
+
+		 case OPT_fail_every:
+			GET_UINT_ARG(opt_fail_every, "fail-every");
+
+		 case OPT_fail_mode:
+			if (strcmp(optarg, "close") == 0) {
+				opt_fail_mode = FAIL_CLOSE;
+			} else if (strcmp(optarg, "error") == 0) {
+				opt_fail_mode = FAIL_ERROR;
+			} else if (strcmp(optarg, "truncate") == 0) {
+				opt_fail_mode = FAIL_TRUNCATE;
+			} else {
+				errx(1, "--fail-mode %s: invalid mode", optarg);
+			}
+			break;
+
+		 case OPT_interval:
+			GET_UINT_ARG(opt_interval, "interval");
+
+		 case OPT_latency:
+			GET_UINT_ARG(opt_latency, "latency");
+
+		 case OPT_loop:
+			opt_loop = true;
+			break;
+
+		 case OPT_media:
+			opt_media = optarg;
+			break;
+
+		 case OPT_rewrite:
+			opt_rewrite = true;
+			break;
+
+		 case OPT_speed:
+		 {
+			char *end;
+			opt_speed = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || opt_speed < 0) {
+				errx(1, "--speed %s: invalid speed", optarg);
+			}
+			break;
+		 }
+
+		 case OPT_stream:
+			opt_stream = optarg;
+			break;
+
+		 default:
+			usage();
+		}
+	}
+	if (optind != ac) {
+		usage();
+	}
+	if (opt_stream == NULL && opt_media == NULL) {
+		usage();
+	}
+
+	// 子プロセスは勝手に回収させる。
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	if (ls < 0) {
+		err(1, "socket");
+	}
+	int on = 1;
+	setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(opt_port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(ls, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		err(1, "bind: port %u", opt_port);
+	}
+	if (listen(ls, 16) < 0) {
+		err(1, "listen");
+	}
+	Debug(diag, "listening on 127.0.0.1:%u", opt_port);
+
+	for (seq = 1; ; seq++) {
+		int fd = accept(ls, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				seq--;
+				continue;
+			}
+			err(1, "accept");
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			warn("fork");
+		} else if (pid == 0) {
+			close(ls);
+			serve(fd, seq);
+			_exit(0);
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("usage: %s [<options>] --stream=<file> | --media=<dir>\n",
+		getprogname());
+	printf(
+"  --stream=<file>     : Serve <file> (JSONL or recording) over ws://\n"
+"  --speed=<x>         : Reproduce recorded intervals at <x> times speed\n"
+"  --interval=<msec>   : Interval between messages (default:0)\n"
+"  --loop              : Replay the stream from the beginning endlessly\n"
+"  --media=<dir>       : Serve files under <dir> over http://\n"
+"  --rewrite           : Rewrite https:// in the stream to this server\n"
+"  --latency=<msec>    : Delay before each response (default:0)\n"
+"  --bandwidth=<bytes> : Limit sending rate to <bytes>/sec (default:0)\n"
+"  --chunked[=<size>]  : Send media with chunked encoding (default:4096)\n"
+"  --fail-every=<n>    : Fail every <n>-th connection\n"
+"  --fail-mode=<mode>  : close, error or truncate (default:close)\n"
+"  -d,--debug=<0-3>    : Set debug level\n"
+"  -p,--port=<port>    : Listen port on 127.0.0.1 (default:8080)\n"
+	);
+	exit(0);
+}
+
+// 1接続を処理する (子プロセス)。
+static void
+serve(int fd, uint seq)
+{
+	struct conn conn;
+	char req[REQ_BUFSIZE];
+	uint reqlen = 0;
+	char *end;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.fd = fd;
+	conn.seq = seq;
+	conn.fail = (opt_fail_every > 0 && seq % opt_fail_every == 0);
+
+	// リクエストヘッダを空行まで読む。
+	for (;;) {
+		if (reqlen >= sizeof(req) - 1) {
+			Debug(diag, "#%u: request header too long", seq);
+			return;
+		}
+		ssize_t n = read(fd, req + reqlen, sizeof(req) - 1 - reqlen);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			Debug(diag, "#%u: read: %s", seq, strerrno());
+			return;
+		}
+		if (n == 0) {
+			Debug(diag, "#%u: EOF while reading request", seq);
+			return;
+		}
+		reqlen += n;
+		req[reqlen] = '\0';
+		if ((end = strstr(req, "\r\n\r\n")) != NULL) {
+			break;
+		}
+	}
+	end[2] = '\0';
+
+	// 1行目は "GET <path> HTTP/1.1"。
+	char *eol = strstr(req, "\r\n");
+	*eol = '\0';
+	const char *headers = eol + 2;
+	Debug(diag, "#%u: %s", seq, req);
+	if (strncmp(req, "GET ", 4) != 0) {
+		send_status(&conn, 405, "Method Not Allowed");
+		return;
+	}
+	char *path = req + 4;
+	char *sp = strchr(path, ' ');
+	if (sp) {
+		*sp = '\0';
+	}
+
+	if (opt_latency > 0) {
+		sleep_usec((uint64)opt_latency * 1000);
+	}
+
+	if (conn.fail) {
+		Debug(diag, "#%u: fail (mode %u)", seq, opt_fail_mode);
+		if (opt_fail_mode == FAIL_CLOSE) {
+			return;
+		}
+		if (opt_fail_mode == FAIL_ERROR) {
+			send_status(&conn, 503, "Service Unavailable");
+			return;
+		}
+	}
+
+	uint vlen;
+	const char *upgrade = find_header(headers, "Upgrade", &vlen);
+	if (upgrade && vlen == 9 && strncasecmp(upgrade, "websocket", 9) == 0) {
+		if (opt_stream == NULL) {
+			send_status(&conn, 404, "Not Found");
+			return;
+		}
+		const char *key = find_header(headers, "Sec-WebSocket-Key", &vlen);
+		if (key == NULL) {
+			send_status(&conn, 400, "Bad Request");
+			return;
+		}
+		string *accept = ws_accept_key(key, vlen);
+		conn_printf(&conn,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n");
+		if (accept) {
+			conn_printf(&conn, "Sec-WebSocket-Accept: %s\r\n",
+				string_get(accept));
+			string_free(accept);
+		}
+		conn_printf(&conn, "\r\n");
+		serve_ws(&conn, path);
+	} else {
+		if (opt_media == NULL) {
+			send_status(&conn, 404, "Not Found");
+			return;
+		}
+		serve_media(&conn, path);
+	}
+}
+
+// WebSocket でストリームを送る。
+static void
+serve_ws(struct conn *conn, const char *path)
+{
+	struct playback *pb;
+	string *msg;
+	uint64 ts;
+	uint64 base_ts = 0;
+	uint64 base_time = 0;
+	uint64 next = now_usec();
+	uint count = 0;
+
+	pb = playback_open(opt_stream);
+	if (pb == NULL) {
+		return;
+	}
+
+	Debug(diag, "#%u: streaming %s to %s", conn->seq, opt_stream, path);
+	for (;;) {
+		msg = playback_read(pb, &ts);
+		if (msg == NULL) {
+			if (opt_loop == false || count == 0) {
+				break;
+			}
+			// 先頭から送り直す。
+			playback_close(pb);
+			pb = playback_open(opt_stream);
+			if (pb == NULL) {
+				return;
+			}
+			base_ts = 0;
+			continue;
+		}
+
+		// 送信時刻を決める。
+		// 受信時刻のある録画で --speed 指定があればその間隔を再現し、
+		// そうでなければ --interval 間隔。
+		uint64 now = now_usec();
+		if (opt_speed > 0 && ts != 0) {
+			if (base_ts == 0 || ts < base_ts) {
+				base_ts = ts;
+				base_time = now;
+			}
+			next = base_time + (uint64)((ts - base_ts) / opt_speed);
+		} else if (count > 0) {
+			next += (uint64)opt_interval * 1000;
+		}
+
+		// 待つ間もクライアントからのフレームは処理する。
+		while (now < next) {
+			if (ws_drain(conn, (next - now + 999) / 1000) == false) {
+				string_free(msg);
+				goto done;
+			}
+			now = now_usec();
+		}
+		if (ws_drain(conn, 0) == false) {
+			string_free(msg);
+			goto done;
+		}
+
+		bool ok;
+		if (opt_rewrite) {
+			string *s = stream_rewrite(msg);
+			ok = ws_send_frame(conn, 0x1, string_get(s), string_len(s),
+				conn->fail);
+			string_free(s);
+		} else {
+			ok = ws_send_frame(conn, 0x1, string_get(msg), string_len(msg),
+				conn->fail);
+		}
+		string_free(msg);
+		if (ok == false || conn->fail) {
+			goto done;
+		}
+		count++;
+	}
+
+	// 全部送ったら Close を送って終わる。
+	ws_send_frame(conn, 0x8, NULL, 0, false);
+ done:
+	Debug(diag, "#%u: sent %u messages", conn->seq, count);
+	playback_close(pb);
+}
+
+// メディアファイルを返す。
+static void
+serve_media(struct conn *conn, const char *path)
+{
+	char filename[PATH_MAX];
+	char buf[4096];
+	struct stat st;
+	FILE *fp;
+
+	// クエリは無視する。上には行かせない。
+	uint pathlen = strcspn(path, "?#");
+	if (path[0] != '/' || strstr(path, "..")) {
+		send_status(conn, 400, "Bad Request");
+		return;
+	}
+	snprintf(filename, sizeof(filename), "%s%.*s", opt_media,
+		(int)pathlen, path);
+
+	fp = fopen(filename, "r");
+	if (fp == NULL || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode)) {
+		Debug(diag, "#%u: %s: not found", conn->seq, filename);
+		send_status(conn, 404, "Not Found");
+		if (fp) {
+			fclose(fp);
+		}
+		return;
+	}
+
+	uint64 size = st.st_size;
+	if (conn->fail) {
+		// FAIL_TRUNCATE。長さは正しく伝えて途中で切る。
+		size /= 2;
+	}
+
+	conn_printf(conn, "HTTP/1.1 200 OK\r\n");
+	if (opt_chunked) {
+		conn_printf(conn, "Transfer-Encoding: chunked\r\n");
+	} else {
+		conn_printf(conn, "Content-Length: %ju\r\n", (uintmax_t)st.st_size);
+	}
+	conn_printf(conn, "Connection: close\r\n\r\n");
+
+	uint bufsize = opt_chunked ? MIN(opt_chunked, sizeof(buf)) : sizeof(buf);
+	uint64 sent = 0;
+	while (sent < size) {
+		uint len = fread(buf, 1, MIN(bufsize, size - sent), fp);
+		if (len == 0) {
+			break;
+		}
+		if (opt_chunked) {
+			if (conn_printf(conn, "%x\r\n", len) == false ||
+			    conn_write(conn, buf, len) == false ||
+			    conn_write(conn, "\r\n", 2) == false) {
+				break;
+			}
+		} else {
+			if (conn_write(conn, buf, len) == false) {
+				break;
+			}
+		}
+		sent += len;
+	}
+	if (opt_chunked && conn->fail == false) {
+		conn_write(conn, "0\r\n\r\n", 5);
+	}
+	Debug(diag, "#%u: %s: sent %ju bytes%s", conn->seq, filename,
+		(uintmax_t)sent, conn->fail ? " (truncated)" : "");
+	fclose(fp);
+}
+
+// 本体なしの応答を返す。
+static bool
+send_status(struct conn *conn, uint code, const char *msg)
+{
+	Debug(diag, "#%u: %u %s", conn->seq, code, msg);
+	return conn_printf(conn,
+		"HTTP/1.1 %u %s\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n", code, msg);
+}
+
+// ストリームのメッセージ中の "https:// をこのサーバの "http:// に
+// 書き換えたものを返す。
+// JSON 中ではスラッシュが "\/" とエスケープされていることもあるので
+// 両方を対象にする。
+static string *
+stream_rewrite(const string *msg)
+{
+	static const struct {
+		const char *from;
+		const char *to;
+	} table[] = {
+		{ "\"https://",		"\"http://127.0.0.1:%u/" },
+		{ "\"https:\\/\\/",	"\"http:\\/\\/127.0.0.1:%u\\/" },
+	};
+	string *dst = string_alloc(string_len(msg) + 256);
+	const char *s = string_get(msg);
+
+	while (*s) {
+		uint i;
+		for (i = 0; i < countof(table); i++) {
+			uint len = strlen(table[i].from);
+			if (strncmp(s, table[i].from, len) == 0) {
+				string_append_printf(dst, table[i].to, opt_port);
+				s += len;
+				break;
+			}
+		}
+		if (i == countof(table)) {
+			string_append_char(dst, *s++);
+		}
+	}
+	return dst;
+}
+
+// WebSocket フレームを1つ送る (サーバからなのでマスクはしない)。
+// truncate なら途中までで止めて false を返す。
+static bool
+ws_send_frame(struct conn *conn, uint8 opcode, const void *data, uint len,
+	bool truncate)
+{
+	uint8 hdr[10];
+	uint hdrlen;
+
+	hdr[0] = 0x80 | opcode;
+	if (len < 126) {
+		hdr[1] = len;
+		hdrlen = 2;
+	} else if (len < 65536) {
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		hdrlen = 4;
+	} else {
+		hdr[1] = 127;
+		for (uint i = 0; i < 8; i++) {
+			hdr[2 + i] = (uint64)len >> ((7 - i) * 8);
+		}
+		hdrlen = 10;
+	}
+
+	if (conn_write(conn, hdr, hdrlen) == false) {
+		return false;
+	}
+	if (truncate) {
+		conn_write(conn, data, len / 2);
+		return false;
+	}
+	return conn_write(conn, data, len);
+}
+
+// クライアントからのフレームを最大 timeout [msec] 待って処理する。
+// 相手が切断したか Close を送ってきたら false を返す。
+// sayaka が送ってくるのは接続時のコマンドと Close、Pong くらいなので、
+// 1回の read に1フレームが収まっている前提で雑に処理する。
+static bool
+ws_drain(struct conn *conn, int timeout)
+{
+	struct pollfd pfd;
+	uint8 buf[4096];
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0) {
+		return true;
+	}
+
+	ssize_t n = read(conn->fd, buf, sizeof(buf));
+	if (n <= 0) {
+		Debug(diag, "#%u: client closed", conn->seq);
+		return false;
+	}
+	if (n < 2) {
+		return true;
+	}
+
+	uint8 opcode = buf[0] & 0x0f;
+	uint len = buf[1] & 0x7f;
+	uint pos = 2;
+	if (len == 126) {
+		len = (n >= 4) ? (buf[2] << 8) | buf[3] : 0;
+		pos = 4;
+	} else if (len == 127) {
+		// こんな大きいのは来ないので中身は見ない。
+		return true;
+	}
+	const uint8 *mask = NULL;
+	if ((buf[1] & 0x80)) {
+		mask = &buf[pos];
+		pos += 4;
+	}
+	if (pos + len > (uint)n) {
+		return true;
+	}
+	uint8 *payload = &buf[pos];
+	if (mask) {
+		for (uint i = 0; i < len; i++) {
+			payload[i] ^= mask[i % 4];
+		}
+	}
+	Trace(diag, "#%u: recv opcode=%u len=%u", conn->seq, opcode, len);
+
+	if (opcode == 0x8) {
+		ws_send_frame(conn, 0x8, NULL, 0, false);
+		return false;
+	}
+	if (opcode == 0x9) {
+		return ws_send_frame(conn, 0xa, payload, len, false);
+	}
+	return true;
+}
+
+// len バイトを書き出す。帯域制限があればそれに合わせて待つ。
+// 全部書ければ true を返す。
+static bool
+conn_write(struct conn *conn, const void *src, uint len)
+{
+	const char *p = src;
+
+	if (conn->start == 0) {
+		conn->start = now_usec();
+	}
+
+	while (len > 0) {
+		uint n = len;
+		if (opt_bandwidth > 0) {
+			// 10msec 分ずつ書いて、予定の時刻まで待つ。
+			uint slice = MAX(opt_bandwidth / 100, 1);
+			n = MIN(n, slice);
+			uint64 due = conn->start + conn->sent * 1000000 / opt_bandwidth;
+			uint64 now = now_usec();
+			if (due > now) {
+				sleep_usec(due - now);
+			}
+		}
+		ssize_t r = write(conn->fd, p, n);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			Debug(diag, "#%u: write: %s", conn->seq, strerrno());
+			return false;
+		}
+		p += r;
+		len -= r;
+		conn->sent += r;
+	}
+	return true;
+}
+
+static bool
+conn_printf(struct conn *conn, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	return conn_write(conn, buf, MIN(len, sizeof(buf) - 1));
+}
+
+// ヘッダ群 headers から name ヘッダを探して値の先頭を返す。
+// 値の長さを *lenp に返す。見付からなければ NULL を返す。
+static const char *
+find_header(const char *headers, const char *name, uint *lenp)
+{
+	uint namelen = strlen(name);
+	const char *p = headers;
+
+	while (*p) {
+		const char *eol = strstr(p, "\r\n");
+		if (eol == NULL) {
+			break;
+		}
+		if (strncasecmp(p, name, namelen) == 0 && p[namelen] == ':') {
+			const char *v = p + namelen + 1;
+			while (*v == ' ' || *v == '\t') {
+				v++;
+			}
+			*lenp = eol - v;
+			return v;
+		}
+		p = eol + 2;
+	}
+	return NULL;
+}
+
+// Sec-WebSocket-Key から Sec-WebSocket-Accept の値を作って返す。
+// SHA-1 が使えなければ NULL を返す (sayaka は検証していないので困らない)。
+static string *
+ws_accept_key(const char *key, uint keylen)
+{
+#if defined(HAVE_OPENSSL)
+	static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	uint8 hash[EVP_MAX_MD_SIZE];
+	uint hashlen = sizeof(hash);
+	EVP_MD_CTX *ctx;
+
+	ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+	EVP_DigestUpdate(ctx, key, keylen);
+	EVP_DigestUpdate(ctx, guid, sizeof(guid) - 1);
+	EVP_DigestFinal_ex(ctx, hash, &hashlen);
+	EVP_MD_CTX_free(ctx);
+
+	return base64_encode(hash, hashlen);
+#else
+	return NULL;
+#endif
+}
+
+static uint64
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_usec(&ts);
+}
+
+static void
+sleep_usec(uint64 usec)
+{
+	struct timespec req;
+
+	req.tv_sec  = usec / 1000000;
+	req.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&req, &req) < 0 && errno == EINTR)
+		;
+}
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -45,52 +46,89 @@
 #include <openssl/ssl.h>
 #endif
 
+// 受信バッファのブロックサイズ。
+#define NET_BLOCKSIZE	(IMAGE_BUFSIZE)
+
+// 接続処理の状態。
+enum {
+	NET_CSTATE_NONE = 0,
+	NET_CSTATE_TCP,			// TCP 接続中
+	NET_CSTATE_TLS,			// TLS ハンドシェイク中
+	NET_CSTATE_DONE,		// 接続完了
+};
+
 struct net;
 struct net {
-	int (*f_connect)(struct net *, const char *, const char *,
-		const struct net_opt *);
 	int (*f_read)(struct net *, void *, int);
 	int (*f_write)(struct net *, const void *, int);
 	void (*f_shutdown_half)(struct net *);
 	void (*f_close)(struct net *);
 
-	// f_connect() が確保したリソースを解放する。
+	// 接続時に確保したリソースを解放する。
 	// net 自体はここではなく呼び出し元の net_destroy() が解放する。
 	void (*f_cleanup)(struct net *);
 
 	int sock;
+	bool tls;				// TLS なら true
+	bool nonblock;			// ソケットがノンブロッキングなら true
 #if defined(HAVE_OPENSSL)
 	SSL_CTX *ctx;
 	SSL *ssl;
 #endif
 
+	// 接続処理。
+	// net_connect_async() で開始して net_connect_step() で進める。
+	// TCP の接続中は ai が試行中のアドレスを指す。
+	uint cstate;
+	struct addrinfo *ailist;
+	struct addrinfo *ai;
+	struct timespec start;	// 接続開始時刻 (ログ用)
+
+	// 段階ごとの所要時間と転送量の計測。
+	// 接続後の段階 (TTFB 以降) は httpclient が記録する。
+	struct netstat_req stat;
+
+	// ノンブロッキングで読み書きが EAGAIN になった時、
+	// 次に待つべきイベント (EV_READ か EV_WRITE)。
+	// TLS だと読み込み中でも EV_WRITE を待つことがある。
+	uint want;
+
 	const struct diag *diag;
 
-	// 行単位受信用の受信バッファ。
+	// 受信バッファ。
+	// 行単位受信 (net_gets) とスライス受信 (net_read_slice) はここに
+	// 受信して、rblock->data[rpos..rlen) が未読。
 	// バッファにあればこちらから優先して読み出す。
-	// バッファが空で行単位受信でない場合はここを経由しなくてよい。
-	uint buflen;			// バッファの有効長
-	uint bufpos;			// 現在位置
-	char buf[1024];
+	// バッファが空で net_read() の場合はここを経由しなくてよい。
+	struct bblock *rblock;
+	uint rpos;				// 現在位置
+	uint rlen;				// バッファの有効長
+
+	// net_gets() が EAGAIN で中断した時の受信途中の行。
+	string *line;
 };
 
 static void sock_cleanup(struct net *);
-static int  sock_connect(struct net *, const char *, const char *,
-	const struct net_opt *);
 static int  sock_read(struct net *, void *, int);
 static int  sock_write(struct net *, const void *, int);
 static void sock_shutdown_half(struct net *);
 static void sock_close(struct net *);
 #if defined(HAVE_OPENSSL)
 static void tls_cleanup(struct net *);
-static int  tls_connect(struct net *, const char *, const char *,
-	const struct net_opt *);
+static int  tls_setup(struct net *, const char *, const struct net_opt *);
+static int  tls_handshake(struct net *);
+static void tls_print_connected(struct net *, uint32);
 static int  tls_read(struct net *, void *, int);
 static int  tls_write(struct net *, const void *, int);
 static void tls_shutdown_half(struct net *);
 static void tls_close(struct net *);
 #endif
-static int  socket_connect(const char *, const char *, const struct net_opt *);
+static int  net_fill(struct net *);
+static int  net_wait(struct net *, uint, int);
+static int  socket_connect_start(struct net *, const char *, const char *,
+	const struct net_opt *);
+static int  socket_connect_next(struct net *);
+static int  socket_connect_check(struct net *);
 static int  socket_setblock(int, bool);
 
 //
@@ -301,6 +339,11 @@ net_destroy(struct net *net)
 		if (net->f_cleanup) {
 			net->f_cleanup(net);
 		}
+		if (net->ailist) {
+			freeaddrinfo(net->ailist);
+		}
+		bblock_unref(net->rblock);
+		string_free(net->line);
 		free(net);
 	}
 }
@@ -310,10 +353,67 @@ net_destroy(struct net *net)
 // 失敗すれば (おそらく) errno をセットして -1 を返す
 // (OpenSSL は返さないかも知れないが)。
 // SSL 接続なのに SSL ライブラリが有効でない時は -2 を返す。
+// 接続後のソケットはブロッキングモード。
 int
 net_connect(struct net *net,
 	const char *scheme, const char *host, const char *serv,
 	const struct net_opt *opt)
+{
+	struct timespec now;
+	uint64 end_msec = 0;
+
+	assert(net);
+
+	if (opt->timeout_msec != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		end_msec = timespec_to_msec(&now) + opt->timeout_msec;
+	}
+
+	int r = net_connect_async(net, scheme, host, serv, opt);
+	while (r == 1) {
+		// タイムアウトは従来通り TCP の接続までに適用する。
+		int timeout = -1;
+		if (end_msec != 0 && net->cstate == NET_CSTATE_TCP) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint64 now_msec = timespec_to_msec(&now);
+			if (now_msec >= end_msec) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			timeout = end_msec - now_msec;
+		}
+		if (net_wait(net, net->want, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		r = net_connect_step(net);
+	}
+	if (r < 0) {
+		return r;
+	}
+
+	// ブロッキングに戻す。
+	if (socket_setblock(net->sock, true) < 0) {
+		return -1;
+	}
+	net->nonblock = false;
+	return 0;
+}
+
+// scheme://host:serv/ へのノンブロッキングでの接続を開始する。
+// 接続できれば 0 を返す。
+// 接続処理中なら 1 を返すので、net_get_fd() のソケットで
+// net_get_want() のイベントを待ってから net_connect_step() を呼ぶこと。
+// 失敗すれば errno をセットして -1 を返す。
+// SSL 接続なのに SSL ライブラリが有効でない時は -2 を返す。
+// 名前解決 (getaddrinfo) はここでブロックする。
+// 接続後のソケットはノンブロッキングのまま。
+int
+net_connect_async(struct net *net,
+	const char *scheme, const char *host, const char *serv,
+	const struct net_opt *opt)
 {
 	assert(net);
 
@@ -332,18 +432,21 @@ net_connect(struct net *net,
 		strcmp(scheme, "wss") == 0)
 	{
 #if defined(HAVE_OPENSSL)
-		net->f_connect = tls_connect;
+		net->tls       = true;
 		net->f_read    = tls_read;
 		net->f_write   = tls_write;
 		net->f_shutdown_half = tls_shutdown_half;
 		net->f_close   = tls_close;
 		net->f_cleanup = tls_cleanup;
+
+		if (tls_setup(net, host, opt) < 0) {
+			return -1;
+		}
 #else
 		Debug(net->diag, "%s: SSL library not compiled", __func__);
 		return -2;
 #endif
 	} else {
-		net->f_connect = sock_connect;
 		net->f_read    = sock_read;
 		net->f_write   = sock_write;
 		net->f_shutdown_half = sock_shutdown_half;
@@ -351,14 +454,92 @@ net_connect(struct net *net,
 		net->f_cleanup = sock_cleanup;
 	}
 
-	// f_connect() は接続出来たら Debug レベルで "Connected"
-	// (と SSL 等の追加情報) を表示する。
-	return net->f_connect(net, host, serv, opt);
+	clock_gettime(CLOCK_MONOTONIC, &net->start);
+	netstat_begin(&net->stat);
+	if (socket_connect_start(net, host, serv, opt) < 0) {
+		Debug(net->diag, "%s: %s:%s failed: %s", __func__,
+			host, serv, strerrno());
+		return -1;
+	}
+	return net_connect_step(net);
+}
+
+// 接続処理を進める。
+// 戻り値は net_connect_async() と同じ。
+// 接続できたら Debug レベルで "Connected" (と TLS 等の追加情報) を表示する。
+int
+net_connect_step(struct net *net)
+{
+	const struct diag *diag = net->diag;
+	int r;
+
+	switch (net->cstate) {
+	 case NET_CSTATE_TCP:
+		r = socket_connect_check(net);
+		if (r != 0) {
+			return r;
+		}
+		netstat_mark(&net->stat, NETSTAT_CONNECT);
+		freeaddrinfo(net->ailist);
+		net->ailist = NULL;
+		net->ai = NULL;
+#if defined(HAVE_OPENSSL)
+		if (net->tls) {
+			if (SSL_set_fd(net->ssl, net->sock) == 0) {
+				ERR_print_errors_fp(stderr);
+				errno = EIO;
+				return -1;
+			}
+			net->cstate = NET_CSTATE_TLS;
+			goto tls;
+		}
+#endif
+		net->cstate = NET_CSTATE_DONE;
+		break;
+
+#if defined(HAVE_OPENSSL)
+	 case NET_CSTATE_TLS:
+	 tls:
+		r = tls_handshake(net);
+		if (r != 0) {
+			return r;
+		}
+		netstat_mark(&net->stat, NETSTAT_TLS);
+		net->cstate = NET_CSTATE_DONE;
+		break;
+#endif
+
+	 case NET_CSTATE_DONE:
+		return 0;
+
+	 default:
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	// 接続できたらログ。
+	if (__predict_false(diag_get_level(diag) >= 1)) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		uint32 msec = timespec_to_msec(&end) - timespec_to_msec(&net->start);
+#if defined(HAVE_OPENSSL)
+		if (net->tls) {
+			tls_print_connected(net, msec);
+		} else
+#endif
+		{
+			diag_print(diag, "Connected (%u msec)", msec);
+		}
+	}
+	net->want = EV_READ;
+	return 0;
 }
 
 // 1行受信して返す。
 // EOF に到達したらそこまでに受信した文字列を返す (行頭で EOF なら "")。
 // エラーが起きれば errno をセットして NULL を返す。
+// ノンブロッキングで EAGAIN なら受信途中の行を保持しておき、
+// 次回の呼び出しでその続きから受信する。
 string *
 net_gets(struct net *net)
 {
@@ -366,15 +547,24 @@ net_gets(struct net *net)
 	const struct diag *diag = net->diag;
 
 	Verbose(diag, "%s: begin", __func__);
-	string *s = string_init();
+	string *s = net->line;
+	if (s) {
+		net->line = NULL;
+	} else {
+		s = string_init();
+	}
 
 	for (;;) {
 		// バッファが空なら受信。
-		if (net->bufpos == net->buflen) {
-			int n = net_read(net, net->buf, sizeof(net->buf));
-			Verbose(diag, "%s: net_read=%d", __func__, n);
+		if (net->rpos == net->rlen) {
+			int n = net_fill(net);
+			Verbose(diag, "%s: net_fill=%d", __func__, n);
 			if (n < 0) {
-				Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
+				if (errno == EAGAIN) {
+					net->line = s;
+					return NULL;
+				}
+				Debug(diag, "%s: net_fill failed: %s", __func__, strerrno());
 				string_free(s);
 				return NULL;
 			}
@@ -382,25 +572,24 @@ net_gets(struct net *net)
 				// EOF
 				return s;
 			}
-			net->bufpos = 0;
-			net->buflen = n;
 		}
 
 		// バッファから改行を探す。
+		const uint8 *buf = net->rblock->data;
 		uint pos;
 		bool lf_found = false;
-		for (pos = net->bufpos; pos < net->buflen; pos++) {
-			if (net->buf[pos] == '\n') {
+		for (pos = net->rpos; pos < net->rlen; pos++) {
+			if (buf[pos] == '\n') {
 				pos++;
 				lf_found = true;
 				break;
 			}
 		}
-		uint copylen = pos - net->bufpos;
-		string_append_mem(s, net->buf + net->bufpos, copylen);
-		net->bufpos += copylen;
+		uint copylen = pos - net->rpos;
+		string_append_mem(s, buf + net->rpos, copylen);
+		net->rpos += copylen;
 		Verbose(diag, "%s: copied=%u, pos=%u/len=%u%s", __func__,
-			copylen, net->bufpos, net->buflen,
+			copylen, net->rpos, net->rlen,
 			(lf_found ? " lf_found" : ""));
 		if (lf_found) {
 			return s;
@@ -416,27 +605,102 @@ net_read(struct net *net, void *dst, uint dstsize)
 	const struct diag *diag = net->diag;
 
 	// バッファにあれば先に使い切る。
-	if (net->bufpos != net->buflen) {
-		uint copylen = MIN(net->buflen - net->bufpos, dstsize);
-		memcpy(dst, net->buf + net->bufpos, copylen);
-		net->bufpos += copylen;
+	if (net->rpos != net->rlen) {
+		uint copylen = MIN(net->rlen - net->rpos, dstsize);
+		memcpy(dst, net->rblock->data + net->rpos, copylen);
+		net->rpos += copylen;
 		Verbose(diag, "%s: copied=%u, pos=%u/len=%u", __func__,
-			copylen, net->bufpos, net->buflen);
+			copylen, net->rpos, net->rlen);
 		return copylen;
 	}
 
 	int n = net->f_read(net, dst, dstsize);
+	if (n > 0) {
+		net->stat.recv += n;
+	}
 	return n;
 }
 
+// 最大 maxlen バイトを受信して、受信バッファを指すスライスを sp に返す。
+// 受信したデータはコピーせず、sp はバッファの参照を持つので
+// 使い終わったら bslice_release() すること。
+// 受信したバイト数を返す。EOF なら 0 を返す (sp は空)。
+// エラーが起きれば errno をセットして -1 を返す (sp は空)。
 int
-net_write(struct net *net, const void *src, uint srcsize)
+net_read_slice(struct net *net, struct bslice *sp, uint maxlen)
 {
 	assert(net);
-	int n = net->f_write(net, src, srcsize);
+
+	if (net->rpos == net->rlen) {
+		int n = net_fill(net);
+		if (n <= 0) {
+			sp->block = NULL;
+			sp->ptr = NULL;
+			sp->len = 0;
+			return n;
+		}
+	}
+
+	uint len = MIN(net->rlen - net->rpos, maxlen);
+	bslice_set(sp, net->rblock, net->rblock->data + net->rpos, len);
+	net->rpos += len;
+	return len;
+}
+
+// 空になった受信バッファに受信する。
+// 受信したバイト数を返す。EOF なら 0、エラーなら -1 を返す。
+static int
+net_fill(struct net *net)
+{
+	uint space = bblock_prepare(&net->rblock, &net->rlen, NET_BLOCKSIZE);
+	if (space == 0) {
+		return -1;
+	}
+	net->rpos = net->rlen;
+
+	int n = net->f_read(net, net->rblock->data + net->rlen, space);
+	if (n > 0) {
+		net->rlen += n;
+		net->stat.recv += n;
+	}
 	return n;
 }
 
+// src から srcsize バイトを送信する。
+// ノンブロッキングのソケットでも全部送信し終わるまで待つ
+// (送るのはリクエストヘッダや WebSocket の短いフレームくらいなので)。
+int
+net_write(struct net *net, const void *src, uint srcsize)
+{
+	assert(net);
+
+	if (net->nonblock == false) {
+		int n = net->f_write(net, src, srcsize);
+		if (n > 0) {
+			net->stat.sent += n;
+		}
+		return n;
+	}
+
+	const uint8 *s = src;
+	uint written = 0;
+	while (written < srcsize) {
+		int n = net->f_write(net, s + written, srcsize - written);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				if (net_wait(net, net->want, -1) < 0 && errno != EINTR) {
+					return -1;
+				}
+				continue;
+			}
+			return -1;
+		}
+		written += n;
+	}
+	net->stat.sent += written;
+	return written;
+}
+
 // 送信方向を shutdown する。
 void
 net_shutdown_half(struct net *net)
@@ -460,32 +724,70 @@ net_get_fd(const struct net *net)
 	return net->sock;
 }
 
+// 直前の受信か接続処理が EAGAIN (か処理中) になった時に
+// 待つべきイベント (EV_READ か EV_WRITE) を返す。
+uint
+net_get_want(const struct net *net)
+{
+	assert(net);
+	return net->want ?: EV_READ;
+}
 
-//
-// 生ソケット
-//
+// このコネクションの計測値を返す。
+struct netstat_req *
+net_get_stat(struct net *net)
+{
+	assert(net);
+	return &net->stat;
+}
 
-static int
-sock_connect(struct net *net, const char *host, const char *serv,
-	const struct net_opt *opt)
+// 接続済みのソケットをノンブロッキングモードにする。
+// 以降 net_gets()、net_read()、net_read_slice() は受信するものがなければ
+// errno を EAGAIN にしてエラーを返す。
+// 成功すれば 0、失敗すれば errno をセットして -1 を返す。
+int
+net_set_nonblock(struct net *net)
 {
-	struct timespec start, end;
+	assert(net);
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	net->sock = socket_connect(host, serv, opt);
-	if (net->sock < 0) {
+	if (socket_setblock(net->sock, false) < 0) {
 		return -1;
 	}
-	clock_gettime(CLOCK_MONOTONIC, &end);
-	uint32 msec = timespec_to_msec(&end) - timespec_to_msec(&start);
-	Debug(net->diag, "Connected (%u msec)", msec);
+	net->nonblock = true;
 	return 0;
 }
 
+// ソケットで events を最大 timeout [msec] 待つ。timeout が -1 なら無制限。
+// イベントが起きれば 1、タイムアウトなら 0 を返す。
+// エラーなら errno をセットして -1 を返す。
+static int
+net_wait(struct net *net, uint events, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = net->sock;
+	pfd.events = 0;
+	if ((events & EV_READ)) {
+		pfd.events |= POLLIN;
+	}
+	if ((events & EV_WRITE)) {
+		pfd.events |= POLLOUT;
+	}
+	return poll(&pfd, 1, timeout);
+}
+
+
+//
+// 生ソケット
+//
+
 static int
 sock_read(struct net *net, void *dst, int dstsize)
 {
 	int n = read(net->sock, dst, dstsize);
+	if (n < 0 && errno == EAGAIN) {
+		net->want = EV_READ;
+	}
 	return n;
 }
 
@@ -493,6 +795,9 @@ static int
 sock_write(struct net *net, const void *src, int srcsize)
 {
 	int n = write(net->sock, src, srcsize);
+	if (n < 0 && errno == EAGAIN) {
+		net->want = EV_WRITE;
+	}
 	return n;
 }
 
@@ -523,13 +828,12 @@ sock_cleanup(struct net *net)
 // TLS
 //
 
+// 接続前の準備。SSL コンテキストを作成して SNI を設定する。
 // 失敗すると errno をセットして -1 を返す仕様だが、
 // OpenSSL のライブラリが何を返すかいまいち分からない。orz
 static int
-tls_connect(struct net *net, const char *host, const char *serv,
-	const struct net_opt *opt)
+tls_setup(struct net *net, const char *host, const struct net_opt *opt)
 {
-	struct timespec start, end;
 	const struct diag *diag = net->diag;
 	int r;
 
@@ -546,7 +850,8 @@ tls_connect(struct net *net, const char *host, const char *serv,
 		return -1;
 	}
 
-	// SSL_read/write() の WANT_READ/WRITE を向こうで処理してもらう。
+	// ブロッキングの時は SSL_read/write() の WANT_READ/WRITE を
+	// 向こうで処理してもらう。ノンブロッキングなら効果はない。
 	SSL_CTX_set_mode(net->ctx, SSL_MODE_AUTO_RETRY);
 
 	if (opt->use_rsa_only) {
@@ -567,59 +872,66 @@ tls_connect(struct net *net, const char *host, const char *serv,
 		return -1;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
-
-	net->sock = socket_connect(host, serv, opt);
-	if (net->sock == -1) {
-		Debug(diag, "%s: %s:%s failed: %s", __func__, host, serv, strerrno());
-		return -1;
-	}
-
-	r = SSL_set_fd(net->ssl, net->sock);
-	if (r == 0) {
-		ERR_print_errors_fp(stderr);
-		return -1;
-	}
-
 	r = SSL_set_tlsext_host_name(net->ssl, UNCONST(host));
 	if (r != 1) {
 		ERR_print_errors_fp(stderr);
 		return -1;
 	}
 
-	if (SSL_connect(net->ssl) < 1) {
-		Debug(diag, "%s: SSL_connect failed", __func__);
-		return -1;
-	}
-
-	// 接続できたらログ。
-	if (__predict_false(diag_get_level(diag) >= 1)) {
-		clock_gettime(CLOCK_MONOTONIC, &end);
+	return 0;
+}
 
-		SSL_SESSION *sess = SSL_get_session(net->ssl);
-		int ssl_version = SSL_SESSION_get_protocol_version(sess);
-		char verbuf[16];
-		const char *ver;
-		switch (ssl_version) {
-		 case SSL3_VERSION:		ver = "SSLv3";		break;
-		 case TLS1_VERSION:		ver = "TLSv1.0";	break;
-		 case TLS1_1_VERSION:	ver = "TLSv1.1";	break;
-		 case TLS1_2_VERSION:	ver = "TLSv1.2";	break;
-		 case TLS1_3_VERSION:	ver = "TLSv1.3";	break;
-		 default:
-			snprintf(verbuf, sizeof(verbuf), "0x%04x", ssl_version);
-			ver = verbuf;
-			break;
-		}
+// ハンドシェイクを進める。
+// 完了すれば 0、途中なら net->want をセットして 1 を返す。
+// 失敗すれば errno をセットして -1 を返す。
+static int
+tls_handshake(struct net *net)
+{
+	int r = SSL_connect(net->ssl);
+	if (r == 1) {
+		return 0;
+	}
 
-		const SSL_CIPHER *ssl_cipher = SSL_SESSION_get0_cipher(sess);
-		const char *cipher_name = SSL_CIPHER_get_name(ssl_cipher);
+	int error = SSL_get_error(net->ssl, r);
+	if (error == SSL_ERROR_WANT_READ) {
+		net->want = EV_READ;
+		return 1;
+	}
+	if (error == SSL_ERROR_WANT_WRITE) {
+		net->want = EV_WRITE;
+		return 1;
+	}
+	Debug(net->diag, "%s: SSL_connect failed: SSL_error=%d", __func__, error);
+	if (error != SSL_ERROR_SYSCALL) {
+		errno = EIO;
+	}
+	return -1;
+}
 
-		uint32 msec = timespec_to_msec(&end) - timespec_to_msec(&start);
-		diag_print(diag, "Connected %s %s (%u msec)", ver, cipher_name, msec);
+// 接続できたことを TLS のバージョンなどと一緒に表示する。
+static void
+tls_print_connected(struct net *net, uint32 msec)
+{
+	SSL_SESSION *sess = SSL_get_session(net->ssl);
+	int ssl_version = SSL_SESSION_get_protocol_version(sess);
+	char verbuf[16];
+	const char *ver;
+	switch (ssl_version) {
+	 case SSL3_VERSION:		ver = "SSLv3";		break;
+	 case TLS1_VERSION:		ver = "TLSv1.0";	break;
+	 case TLS1_1_VERSION:	ver = "TLSv1.1";	break;
+	 case TLS1_2_VERSION:	ver = "TLSv1.2";	break;
+	 case TLS1_3_VERSION:	ver = "TLSv1.3";	break;
+	 default:
+		snprintf(verbuf, sizeof(verbuf), "0x%04x", ssl_version);
+		ver = verbuf;
+		break;
 	}
 
-	return 0;
+	const SSL_CIPHER *ssl_cipher = SSL_SESSION_get0_cipher(sess);
+	const char *cipher_name = SSL_CIPHER_get_name(ssl_cipher);
+
+	diag_print(net->diag, "Connected %s %s (%u msec)", ver, cipher_name, msec);
 }
 
 static int
@@ -637,6 +949,18 @@ tls_read(struct net *net, void *dst, int dstsize)
 			r = 0;
 			goto done;
 		}
+		// ノンブロッキングならここに来る。
+		// 読み込み中でも書き込みを待つことがある (逆も)。
+		if (error == SSL_ERROR_WANT_READ) {
+			net->want = EV_READ;
+			errno = EAGAIN;
+			return -1;
+		}
+		if (error == SSL_ERROR_WANT_WRITE) {
+			net->want = EV_WRITE;
+			errno = EAGAIN;
+			return -1;
+		}
 		Verbose(diag, "%s r=%zd, SSL_error=%d errno=%d", __func__,
 			r, error, errno);
 		if (error != SSL_ERROR_SYSCALL) {
@@ -665,6 +989,18 @@ tls_write(struct net *net, const void *src, int srcsize)
 			r = 0;
 			goto done;
 		}
+		// ノンブロッキングならここに来る。
+		// 読み込み中でも書き込みを待つことがある (逆も)。
+		if (error == SSL_ERROR_WANT_READ) {
+			net->want = EV_READ;
+			errno = EAGAIN;
+			return -1;
+		}
+		if (error == SSL_ERROR_WANT_WRITE) {
+			net->want = EV_WRITE;
+			errno = EAGAIN;
+			return -1;
+		}
 		Verbose(diag, "%s r=%zd, SSL_error=%d errno=%d", __func__,
 			r, error, errno);
 		if (error != SSL_ERROR_SYSCALL) {
@@ -714,31 +1050,16 @@ tls_cleanup(struct net *net)
 
 
 // 下請け。
-// hostname:servname に TCP で接続しそのソケットを返す。
-// 失敗すれば errno をセットして -1 を返す。
+// hostname:servname への TCP での接続を開始する。
+// 開始できれば 0 を返す (接続できたかどうかは socket_connect_check() で
+// 調べる)。失敗すれば errno をセットして -1 を返す。
 static int
-socket_connect(const char *hostname, const char *servname,
-	const struct net_opt *opt)
+socket_connect_start(struct net *net, const char *hostname,
+	const char *servname, const struct net_opt *opt)
 {
-	struct timeval tv;
-	struct timeval *tvp;
-	struct timespec now;
 	struct addrinfo hints;
-	struct addrinfo *ai;
-	struct addrinfo *ailist;
-	uint64 end_usec = 0;
-	fd_set wfds;
-	int fd;
 	int r;
 
-	if (__predict_false(opt->timeout_msec == 0)) {
-		tvp = NULL;
-	} else {
-		tvp = &tv;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		end_usec = timespec_to_usec(&now) + (opt->timeout_msec * 1000);
-	}
-
 	memset(&hints, 0, sizeof(hints));
 	switch (opt->address_family) {
 	 case 4:
@@ -754,78 +1075,102 @@ socket_connect(const char *hostname, const char *servname,
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
 
-	if (getaddrinfo(hostname, servname, &hints, &ailist) != 0) {
+	r = getaddrinfo(hostname, servname, &hints, &net->ailist);
+	if (r != 0) {
+		Debug(net->diag, "%s: %s", __func__, gai_strerror(r));
+		net->ailist = NULL;
+		errno = EHOSTUNREACH;
 		return -1;
 	}
+	netstat_mark(&net->stat, NETSTAT_DNS);
 
-	fd = -1;
-	for (ai = ailist; ai != NULL; ai = ai->ai_next) {
-		int val;
-		socklen_t vallen = sizeof(val);
+	net->cstate = NET_CSTATE_TCP;
+	net->ai = NULL;
+	return socket_connect_next(net);
+}
+
+// 下請け。
+// 次のアドレスへの接続を開始する。
+// 開始できれば 0、もう試すアドレスがなければ errno をセットして -1 を返す。
+static int
+socket_connect_next(struct net *net)
+{
+	struct addrinfo *ai;
+	int error = ECONNREFUSED;
+	int fd;
+
+	if (net->sock >= 0) {
+		close(net->sock);
+		net->sock = -1;
+	}
 
+	ai = net->ai ? net->ai->ai_next : net->ailist;
+	for (; ai != NULL; ai = ai->ai_next) {
 		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (fd < 0) {
+			error = errno;
 			continue;
 		}
 
 		// ここでノンブロックに設定。
 		if (socket_setblock(fd, false) < 0) {
-			goto abort_continue;
+			error = errno;
+			close(fd);
+			continue;
 		}
 
 		// ノンブロッキングなので connect() は EINPROGRESS を返す。
-		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
-			break;
-		}
-		if (errno != EINPROGRESS) {
-			goto abort_continue;
+		// すぐ接続できた場合もあるがそれは socket_connect_check() で分かる。
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+			errno == EINPROGRESS)
+		{
+			net->ai = ai;
+			net->sock = fd;
+			net->nonblock = true;
+			net->want = EV_WRITE;
+			return 0;
 		}
+		error = errno;
+		close(fd);
+	}
 
-		if (tvp != NULL) {
-			clock_gettime(CLOCK_MONOTONIC, &now);
-			uint64 now_usec = timespec_to_usec(&now);
-			if (now_usec >= end_usec) {
-				errno = ETIMEDOUT;
-				return -1;
-			}
-			uint64 timeout_usec = end_usec - now_usec;
-			tv.tv_sec  = timeout_usec / 1000000;
-			tv.tv_usec = timeout_usec % 1000000;
-		}
-		FD_ZERO(&wfds);
-		FD_SET(fd, &wfds);
-		r = select(fd + 1, NULL, &wfds, NULL, tvp);
-		if (r <= 0) {
-			goto abort_continue;
+	net->ai = NULL;
+	errno = error;
+	return -1;
+}
+
+// 下請け。
+// TCP の接続が完了したか調べる。
+// 接続できていれば 0、まだなら 1 を返す。
+// 接続に失敗して次のアドレスもなければ errno をセットして -1 を返す。
+static int
+socket_connect_check(struct net *net)
+{
+	for (;;) {
+		struct pollfd pfd;
+		int val;
+		socklen_t vallen = sizeof(val);
+
+		pfd.fd = net->sock;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) == 0) {
+			net->want = EV_WRITE;
+			return 1;
 		}
 
 		val = -1;
-		getsockopt(fd, SOL_SOCKET, SO_ERROR, &val, &vallen);
-		if (val != 0) {
-			goto abort_continue;
+		getsockopt(net->sock, SOL_SOCKET, SO_ERROR, &val, &vallen);
+		if (val == 0) {
+			return 0;
 		}
+		Trace(net->diag, "%s: %s", __func__, strerror(val));
 
-		// ここまで来れば接続成功。
-		break;
-
- abort_continue:
-		close(fd);
-		fd = -1;
-	}
-	freeaddrinfo(ailist);
-
-	// 一応。
-	if (fd < 0) {
-		return -1;
-	}
-
-	// ブロッキングに戻す。
-	if (socket_setblock(fd, true) < 0) {
-		close(fd);
-		return -1;
+		// このアドレスはダメだったので次。
+		if (socket_connect_next(net) < 0) {
+			errno = val;
+			return -1;
+		}
 	}
-
-	return fd;
 }
 
 // 下請け。
@@ -0,0 +1,244 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// ネットワーク転送の計測
+//
+
+// 1リクエストごとに、名前解決、TCP 接続、TLS ハンドシェイク、
+// 最初の応答まで (TTFB)、本文の受信、の各段階の所要時間と転送量を
+// struct netstat_req に記録し (net.c と httpclient.c が行う)、
+// 終わったらホストごとに段階別のヒストグラムに積算する。
+// ヒストグラムの区間は 1msec から倍々で 16k msec まで (とそれ以上)。
+
+#include "common.h"
+#include <string.h>
+#include <time.h>
+
+#define NETSTAT_HOST_MAX	(32)	// 最後の1つはあふれた分をまとめる
+#define NETSTAT_NBUCKET		(16)
+
+struct netstat_host {
+	char name[64];			// 空なら未使用
+	uint count;				// リクエスト数
+	uint64 sent;			// 送信バイト数
+	uint64 recv;			// 受信バイト数
+	uint ncount[NETSTAT_MAX];		// 段階ごとの計測数
+	uint64 total[NETSTAT_MAX];		// 段階ごとの積算時間 [usec]
+	uint32 max[NETSTAT_MAX];		// 段階ごとの最大時間 [usec]
+	uint32 hist[NETSTAT_MAX][NETSTAT_NBUCKET];
+};
+
+static const char * const phase_names[NETSTAT_MAX] = {
+	"dns",
+	"connect",
+	"tls",
+	"ttfb",
+	"body",
+};
+
+static struct netstat_host hosts[NETSTAT_HOST_MAX];
+
+static struct netstat_host *netstat_find(const char *);
+static uint netstat_bucket(uint32);
+
+static inline uint64
+netstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_usec(&ts);
+}
+
+// req の計測を開始する。
+void
+netstat_begin(struct netstat_req *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->mark = netstat_now();
+}
+
+// 段階 phase が終わったことを記録する。
+// 前回の記録 (か開始) からの経過時間がその段階の所要時間になる。
+void
+netstat_mark(struct netstat_req *req, uint phase)
+{
+	assert(phase < NETSTAT_MAX);
+
+	if (req->mark == 0) {
+		return;
+	}
+	uint64 now = netstat_now();
+	req->usec[phase] += MIN(now - req->mark, UINT32_MAX);
+	req->done |= 1U << phase;
+	req->mark = now;
+}
+
+// 終わったリクエスト req をホスト host の統計に加える。
+// diag のレベルが 1 以上ならこのリクエストの内訳を表示する。
+void
+netstat_record(const struct diag *diag, const char *host,
+	const struct netstat_req *req)
+{
+	if (req->mark == 0) {
+		return;
+	}
+
+	if (__predict_false(diag_get_level(diag) >= 1)) {
+		char buf[128];
+		uint len = 0;
+		for (uint i = 0; i < NETSTAT_MAX; i++) {
+			if ((req->done & (1U << i))) {
+				len += snprintf(buf + len, sizeof(buf) - len, " %s=%.1f",
+					phase_names[i], (double)req->usec[i] / 1000);
+				if (len >= sizeof(buf)) {
+					break;
+				}
+			}
+		}
+		diag_print(diag, "netstat: %s%s msec, sent=%" PRIu64 " recv=%" PRIu64,
+			host, buf, req->sent, req->recv);
+	}
+
+	struct netstat_host *h = netstat_find(host);
+	h->count++;
+	h->sent += req->sent;
+	h->recv += req->recv;
+	for (uint i = 0; i < NETSTAT_MAX; i++) {
+		if ((req->done & (1U << i))) {
+			uint32 usec = req->usec[i];
+			h->ncount[i]++;
+			h->total[i] += usec;
+			h->max[i] = MAX(h->max[i], usec);
+			h->hist[i][netstat_bucket(usec)]++;
+		}
+	}
+}
+
+// host の統計を返す。なければ作る。
+// 一杯ならあふれた分をまとめる最後の1つを返す。
+static struct netstat_host *
+netstat_find(const char *host)
+{
+	uint i;
+
+	for (i = 0; i < NETSTAT_HOST_MAX - 1; i++) {
+		struct netstat_host *h = &hosts[i];
+		if (h->name[0] == '\0') {
+			strlcpy(h->name, host, sizeof(h->name));
+			return h;
+		}
+		if (strcmp(h->name, host) == 0) {
+			return h;
+		}
+	}
+	struct netstat_host *h = &hosts[i];
+	if (h->name[0] == '\0') {
+		strlcpy(h->name, "(others)", sizeof(h->name));
+	}
+	return h;
+}
+
+// usec の入るヒストグラムの区間を返す。
+// 区間 i は 2^i msec 未満 (最後の区間は上限なし)。
+static uint
+netstat_bucket(uint32 usec)
+{
+	uint i;
+	uint32 limit = 1000;
+
+	for (i = 0; i < NETSTAT_NBUCKET - 1; i++) {
+		if (usec < limit) {
+			break;
+		}
+		limit *= 2;
+	}
+	return i;
+}
+
+// ホスト host の段階 phase のヒストグラムの区間 bucket の度数を返す。
+// (主にテスト用)
+uint
+netstat_get_hist(const char *host, uint phase, uint bucket)
+{
+	assert(phase < NETSTAT_MAX);
+	assert(bucket < NETSTAT_NBUCKET);
+
+	for (uint i = 0; i < NETSTAT_HOST_MAX; i++) {
+		const struct netstat_host *h = &hosts[i];
+		if (strcmp(h->name, host) == 0) {
+			return h->hist[phase][bucket];
+		}
+	}
+	return 0;
+}
+
+// 統計をすべて消去する。
+void
+netstat_clear(void)
+{
+	memset(hosts, 0, sizeof(hosts));
+}
+
+// 統計を fp に表示する。
+void
+netstat_dump(FILE *fp)
+{
+	static const char * const bucket_names[NETSTAT_NBUCKET] = {
+		"1", "2", "4", "8", "16", "32", "64", "128",
+		"256", "512", "1k", "2k", "4k", "8k", "16k", "inf",
+	};
+
+	for (uint i = 0; i < NETSTAT_HOST_MAX; i++) {
+		const struct netstat_host *h = &hosts[i];
+		if (h->name[0] == '\0') {
+			break;
+		}
+		fprintf(fp, "netstat: %s: %u requests, sent %" PRIu64
+			" bytes, recv %" PRIu64 " bytes\n",
+			h->name, h->count, h->sent, h->recv);
+
+		fprintf(fp, "  %-7s %7s %7s", "msec<", "avg", "max");
+		for (uint b = 0; b < NETSTAT_NBUCKET; b++) {
+			fprintf(fp, " %4s", bucket_names[b]);
+		}
+		fprintf(fp, "\n");
+		for (uint p = 0; p < NETSTAT_MAX; p++) {
+			if (h->ncount[p] == 0) {
+				continue;
+			}
+			fprintf(fp, "  %-7s %7.1f %7.1f", phase_names[p],
+				(double)h->total[p] / h->ncount[p] / 1000,
+				(double)h->max[p] / 1000);
+			for (uint b = 0; b < NETSTAT_NBUCKET; b++) {
+				fprintf(fp, " %4u", h->hist[p][b]);
+			}
+			fprintf(fp, "\n");
+		}
+	}
+	fflush(fp);
+}
@@ -34,6 +34,46 @@
 #include <errno.h>
 #include <string.h>
 
+// NG ワード用の Aho-Corasick オートマトン。
+// 全 NG_TEXT と NG_REGEX の必須リテラルをバイト列として1つのトライに
+// まとめて失敗リンクを張っておき、本文を1回なめるだけで出現するものを
+// 全部拾う。
+struct ngword_ac_node {
+	uint32 child;		// 最初の子ノード。なければ 0
+	uint32 sibling;		// 次の兄弟ノード。なければ 0
+	uint32 fail;		// 失敗リンク
+	uint32 dict;		// 失敗リンクを辿って最初に出力を持つノード。なければ 0
+	int32 out;			// ここで終わるルールの最小のインデックス。なければ -1
+	uint8 ch;			// 親からこのノードへ遷移する文字
+};
+
+struct ngword_ac {
+	struct ngword_ac_node *node;	// [0] がルート
+	uint nodecount;
+
+	// 同じノードで終わる次のルールのインデックス。なければ -1。
+	// ノードの out から辿るとインデックスの昇順になっている。
+	int32 *next_out;
+
+	// ルートからの遷移は頻度が高いので直引きする。0 ならルートのまま。
+	uint32 root[256];
+};
+
+static struct ngword_ac *ngword_ac_create(const struct ngwords *);
+static void ngword_ac_destroy(struct ngword_ac *);
+static uint32 ngword_ac_step(const struct ngword_ac *, uint32, uint8);
+static void ngword_ac_output(const struct ngwords *, uint32, uint,
+	uint *, uint32 *);
+static uint ngword_ac_match(const struct ngwords *, const char *, uint,
+	uint32 *);
+static const string *ngword_ac_pattern(const struct ngword *);
+static bool ngword_index_create(struct ngwords *);
+static void ngword_index_dump(const struct ngwords *, const struct diag *);
+static uint ngword_user_lookup(const struct ngwords *, const string *);
+static bool ngword_user_match(const struct ngword *, uint);
+static string *ngword_regex_literal(const char *);
+static const char *ngword_regex_skip(const char *);
+
 // NG ワードファイルを読み込んで内部構造にして返す。
 // エラーなら NULL を返す。
 // ファイルがない、ファイルが空、JSON の配列が空、は 0 個のエントリで正常。
@@ -111,13 +151,12 @@ ngword_read_file(const char *filename, const struct diag *diag)
 	}
 
 	// 要素数が決まったのでここでメモリを確保。
-	dict = malloc(sizeof(struct ngwords) + sizeof(struct ngword) * ncount);
+	// エラー時に ngword_destroy() で解放できるよう全体をゼロで埋めておく。
+	dict = calloc(1, sizeof(struct ngwords) + sizeof(struct ngword) * ncount);
 	if (dict == NULL) {
-		warnx("%s: malloc failed", __func__);
+		warnx("%s: calloc failed", __func__);
 		goto done;
 	}
-	dict->count = ncount;
-	memset(&dict->item[0], 0, sizeof(struct ngword) * ncount);
 
 	// エントリを読み込む。
 	i = 0;
@@ -169,8 +208,13 @@ ngword_read_file(const char *filename, const struct diag *diag)
 					filename, srcidx, ctext);
 				string_free(text);
 				string_free(user);
+				dict->count = i;
 				goto error;
 			}
+			ng->ng_literal = ngword_regex_literal(ctext);
+			Trace(diag, "%s[%u]: regex \"%s\" literal \"%s\"",
+				filename, srcidx, ctext,
+				ng->ng_literal ? string_get(ng->ng_literal) : "");
 			break;
 		 }
 		 default:
@@ -207,6 +251,19 @@ ngword_read_file(const char *filename, const struct diag *diag)
 
 		i++;
 	}
+	dict->count = i;
+
+	if (ngword_index_create(dict) == false) {
+		warnx("%s: ngword_index_create failed", __func__);
+		goto error;
+	}
+	ngword_index_dump(dict, diag);
+
+	dict->ac = ngword_ac_create(dict);
+	if (dict->ac == NULL) {
+		warnx("%s: ngword_ac_create failed", __func__);
+		goto error;
+	}
 
  done:
 	json_destroy(js);
@@ -215,7 +272,7 @@ ngword_read_file(const char *filename, const struct diag *diag)
 
  error:
 	// エラー終了する。
-	free(dict);
+	ngword_destroy(dict);
 	dict = NULL;
 	goto done;
 
@@ -238,8 +295,574 @@ ngword_destroy(struct ngwords *dict)
 			struct ngword *ng = &dict->item[i];
 			string_free(ng->ng_text);
 			regfree(&ng->ng_regex);
+			string_free(ng->ng_literal);
 			string_free(ng->ng_user);
 		}
+		ngword_ac_destroy(dict->ac);
+		for (uint i = 0; i < dict->usercount; i++) {
+			free(dict->users[i].regex);
+		}
+		free(dict->users);
+		free(dict->bucket);
 		free(dict);
 	}
 }
+
+// dict の NG_TEXT から Aho-Corasick オートマトンを作成して返す。
+// 作成出来なければ NULL を返す。
+static struct ngword_ac *
+ngword_ac_create(const struct ngwords *dict)
+{
+	struct ngword_ac *ac;
+	struct ngword_ac_node *node;
+	uint32 *queue;
+	uint total;
+	uint i;
+
+	// ノード数はパターンの総バイト数 + 1 (ルート) を超えない。
+	total = 1;
+	for (i = 0; i < dict->count; i++) {
+		const string *pat = ngword_ac_pattern(&dict->item[i]);
+		if (pat) {
+			total += string_len(pat);
+		}
+	}
+
+	ac = calloc(1, sizeof(*ac));
+	if (ac == NULL) {
+		return NULL;
+	}
+	ac->node = calloc(total, sizeof(ac->node[0]));
+	ac->next_out = malloc((dict->count + 1) * sizeof(ac->next_out[0]));
+	queue = malloc(total * sizeof(queue[0]));
+	if (ac->node == NULL || ac->next_out == NULL || queue == NULL) {
+		free(queue);
+		ngword_ac_destroy(ac);
+		return NULL;
+	}
+	node = ac->node;
+	node[0].out = -1;
+	ac->nodecount = 1;
+
+	// トライを作る。
+	// 後ろから登録すると各ノードの出力リストがインデックスの昇順になる。
+	for (i = dict->count; i-- > 0; ) {
+		const string *pat = ngword_ac_pattern(&dict->item[i]);
+		if (pat == NULL) {
+			continue;
+		}
+
+		const uint8 *p = (const uint8 *)string_get(pat);
+		uint32 n = 0;
+		for (; *p != '\0'; p++) {
+			uint32 c;
+			for (c = node[n].child; c != 0; c = node[c].sibling) {
+				if (node[c].ch == *p) {
+					break;
+				}
+			}
+			if (c == 0) {
+				c = ac->nodecount++;
+				node[c].ch = *p;
+				node[c].out = -1;
+				node[c].sibling = node[n].child;
+				node[n].child = c;
+			}
+			n = c;
+		}
+		ac->next_out[i] = node[n].out;
+		node[n].out = i;
+	}
+
+	// ルート直下は表にしておく。
+	for (uint32 c = node[0].child; c != 0; c = node[c].sibling) {
+		ac->root[node[c].ch] = c;
+	}
+
+	// 幅優先で失敗リンクを張る。
+	// 親の失敗リンクは先に決まっているので、そこから同じ文字で遷移した先が
+	// この子の失敗リンクになる。
+	uint head = 0;
+	uint tail = 0;
+	for (uint32 c = node[0].child; c != 0; c = node[c].sibling) {
+		queue[tail++] = c;
+	}
+	while (head < tail) {
+		uint32 n = queue[head++];
+		for (uint32 c = node[n].child; c != 0; c = node[c].sibling) {
+			uint32 f = ngword_ac_step(ac, node[n].fail, node[c].ch);
+			node[c].fail = f;
+			// ルートの出力 (空文字列) は別扱いなのでここには含めない。
+			node[c].dict = (f != 0 && node[f].out >= 0) ? f : node[f].dict;
+			queue[tail++] = c;
+		}
+	}
+	free(queue);
+
+	return ac;
+}
+
+static void
+ngword_ac_destroy(struct ngword_ac *ac)
+{
+	if (ac) {
+		free(ac->node);
+		free(ac->next_out);
+		free(ac);
+	}
+}
+
+// ng をオートマトンに登録する時のパターンを返す。
+// 登録しないものなら NULL を返す。
+static const string *
+ngword_ac_pattern(const struct ngword *ng)
+{
+	switch (ng->ng_type) {
+	 case NG_TEXT:
+		return ng->ng_text;
+	 case NG_REGEX:
+		return ng->ng_literal;
+	 default:
+		return NULL;
+	}
+}
+
+// ノード n から文字 ch で遷移した先のノードを返す。
+static inline uint32
+ngword_ac_step(const struct ngword_ac *ac, uint32 n, uint8 ch)
+{
+	const struct ngword_ac_node *node = ac->node;
+
+	while (n != 0) {
+		for (uint32 c = node[n].child; c != 0; c = node[c].sibling) {
+			if (node[c].ch == ch) {
+				return c;
+			}
+		}
+		n = node[n].fail;
+	}
+	return ac->root[ch];
+}
+
+// ノード o で終わるルールのうち、user に適用されるもので *bestp より
+// 小さいインデックスの NG_TEXT があれば *bestp を更新する。
+// それより手前の NG_REGEX はリテラルが出現したことを hit に記録する。
+static inline void
+ngword_ac_output(const struct ngwords *dict, uint32 o, uint userid,
+	uint *bestp, uint32 *hit)
+{
+	const struct ngword_ac *ac = dict->ac;
+
+	for (int32 r = ac->node[o].out; r >= 0 && (uint)r < *bestp;
+	     r = ac->next_out[r])
+	{
+		const struct ngword *ng = &dict->item[r];
+		if (ngword_user_match(ng, userid) == false) {
+			continue;
+		}
+		if (ng->ng_type == NG_TEXT) {
+			*bestp = r;
+			break;
+		}
+		hit[r / 32] |= 1U << (r % 32);
+	}
+}
+
+// text に出現する NG_TEXT のうちユーザ userid に適用されるものの最小の
+// インデックスを返す。なければ dict->count を返す。
+// また、それより手前でリテラルが出現した NG_REGEX を hit に記録する。
+static uint
+ngword_ac_match(const struct ngwords *dict, const char *text, uint userid,
+	uint32 *hit)
+{
+	const struct ngword_ac *ac = dict->ac;
+	const struct ngword_ac_node *node = ac->node;
+	uint best = dict->count;
+
+	// 空文字列の NG_TEXT はどこにでも一致する。
+	ngword_ac_output(dict, 0, userid, &best, hit);
+
+	const uint8 *p = (const uint8 *)text;
+	uint32 n = 0;
+	for (; *p != '\0'; p++) {
+		n = ngword_ac_step(ac, n, *p);
+		uint32 o = (node[n].out >= 0) ? n : node[n].dict;
+		for (; o != 0; o = node[o].dict) {
+			ngword_ac_output(dict, o, userid, &best, hit);
+		}
+	}
+
+	return best;
+}
+
+// ng が索引 userid のユーザに適用されるなら true を返す。
+static inline bool
+ngword_user_match(const struct ngword *ng, uint userid)
+{
+	// ユーザ指定がなければ、常に判定に進む。
+	// ユーザ指定があれば、ユーザが一致した時だけ判定に進む。
+	return (ng->ng_userid == 0 || ng->ng_userid == userid);
+}
+
+// ルールをユーザ指定ごとに分けた索引を作る。
+// 作成出来なければ false を返す。
+static bool
+ngword_index_create(struct ngwords *dict)
+{
+	struct ngword_user *users;
+	uint i;
+
+	// ユーザの種類はルール数 + 1 ([0] の分) を超えない。
+	users = calloc(dict->count + 1, sizeof(users[0]));
+	if (users == NULL) {
+		return false;
+	}
+	dict->users = users;
+	dict->usercount = 1;
+
+	dict->bucketsize = 16;
+	while (dict->bucketsize < dict->count) {
+		dict->bucketsize *= 2;
+	}
+	dict->bucket = calloc(dict->bucketsize, sizeof(dict->bucket[0]));
+	if (dict->bucket == NULL) {
+		return false;
+	}
+
+	// ユーザを登録して、ユーザごとのルール数を数える。
+	for (i = 0; i < dict->count; i++) {
+		struct ngword *ng = &dict->item[i];
+		uint id = 0;
+		if (ng->ng_user) {
+			id = ngword_user_lookup(dict, ng->ng_user);
+			if (id == 0) {
+				id = dict->usercount++;
+				users[id].user = ng->ng_user;
+				users[id].hash = hash_fnv1a(string_get(ng->ng_user));
+				uint b = users[id].hash & (dict->bucketsize - 1);
+				users[id].next = dict->bucket[b];
+				dict->bucket[b] = id;
+			}
+		}
+		ng->ng_userid = id;
+		users[id].rulecount++;
+		if (ng->ng_type == NG_REGEX) {
+			users[id].regexcount++;
+		}
+	}
+
+	// ユーザごとの NG_REGEX の一覧を作る。
+	for (i = 0; i < dict->usercount; i++) {
+		if (users[i].regexcount != 0) {
+			users[i].regex = malloc(users[i].regexcount * sizeof(uint));
+			if (users[i].regex == NULL) {
+				return false;
+			}
+			users[i].regexcount = 0;
+		}
+	}
+	for (i = 0; i < dict->count; i++) {
+		const struct ngword *ng = &dict->item[i];
+		if (ng->ng_type == NG_REGEX) {
+			struct ngword_user *u = &users[ng->ng_userid];
+			u->regex[u->regexcount++] = i;
+		}
+	}
+
+	return true;
+}
+
+// 索引の統計を表示する。
+static void
+ngword_index_dump(const struct ngwords *dict, const struct diag *diag)
+{
+	const struct ngword_user *users = dict->users;
+	uint used = 0;
+	uint maxusers = 0;
+	uint maxrules = 0;
+
+	Debug(diag, "ngword: %u rules, %u global (%u regex), %u users",
+		dict->count, users[0].rulecount, users[0].regexcount,
+		dict->usercount - 1);
+
+	for (uint b = 0; b < dict->bucketsize; b++) {
+		uint nusers = 0;
+		uint nrules = 0;
+		for (uint id = dict->bucket[b]; id != 0; id = users[id].next) {
+			nusers++;
+			nrules += users[id].rulecount;
+		}
+		if (nusers == 0) {
+			continue;
+		}
+		used++;
+		maxusers = MAX(maxusers, nusers);
+		maxrules = MAX(maxrules, nrules);
+		Trace(diag, "ngword: bucket[%u] %u users, %u rules", b, nusers, nrules);
+	}
+	Debug(diag, "ngword: %u/%u buckets used, "
+		"max %u users/bucket, max %u rules/bucket",
+		used, dict->bucketsize, maxusers, maxrules);
+}
+
+// アカウント名 user の索引を返す。
+// 索引にない (ユーザ指定のルールがない) ユーザなら 0 を返す。
+static uint
+ngword_user_lookup(const struct ngwords *dict, const string *user)
+{
+	if (__predict_false(dict->bucketsize == 0)) {
+		return 0;
+	}
+
+	uint32 hash = hash_fnv1a(string_get(user));
+	uint id = dict->bucket[hash & (dict->bucketsize - 1)];
+	for (; id != 0; id = dict->users[id].next) {
+		const struct ngword_user *u = &dict->users[id];
+		if (u->hash == hash && string_equal(u->user, user)) {
+			return id;
+		}
+	}
+	return 0;
+}
+
+// text を NG ワード集 dict と比較する。
+// user は発言者のアカウント名 ('@' も含む)。
+// 一致する NG ワードがあれば、そのうち最初のもののインデックスを返す。
+// 一致しなければ -1 を返す。
+int
+ngword_match(const struct ngwords *dict, const string *text,
+	const string *user)
+{
+	const char *ctext = string_get(text);
+	uint32 hit[howmany(dict->count, 32) + 1];
+	uint limit;
+
+	if (__predict_false(dict->count == 0)) {
+		return -1;
+	}
+
+	// このユーザが対象のルールは、全員対象のものとこのユーザ指定のもの。
+	uint userid = ngword_user_lookup(dict, user);
+
+	// NG_TEXT と正規表現のリテラルはまとめて一度に調べる。
+	memset(hit, 0, sizeof(hit));
+	limit = ngword_ac_match(dict, ctext, userid, hit);
+
+	// 正規表現は全員対象のものとこのユーザ指定のものを合わせて
+	// インデックス順に、NG_TEXT で見付かったものより前だけ調べる。
+	// リテラルを持つものはそれが出現していなければ一致しようがない。
+	const struct ngword_user *g = &dict->users[0];
+	const struct ngword_user *u = &dict->users[userid];
+	uint gi = 0;
+	uint ui = (userid != 0) ? 0 : u->regexcount;
+	for (;;) {
+		uint i;
+		if (gi < g->regexcount &&
+		    (ui >= u->regexcount || g->regex[gi] < u->regex[ui]))
+		{
+			i = g->regex[gi++];
+		} else if (ui < u->regexcount) {
+			i = u->regex[ui++];
+		} else {
+			break;
+		}
+		if (i >= limit) {
+			break;
+		}
+
+		const struct ngword *ng = &dict->item[i];
+		if (ng->ng_literal && (hit[i / 32] & (1U << (i % 32))) == 0) {
+			continue;
+		}
+		if (regexec(&ng->ng_regex, ctext, 0, NULL, 0) == 0) {
+			return i;
+		}
+	}
+
+	return (limit < dict->count) ? (int)limit : -1;
+}
+
+// ERE の正規表現 re に一致する文字列に必ず含まれるリテラル部分文字列の
+// うち最長のものを返す。なければ NULL を返す。
+// 厳密に解析するわけではなく、分からないものはリテラルなしの側に倒す。
+static string *
+ngword_regex_literal(const char *re)
+{
+	string *best = NULL;
+	string *run = string_init();
+	const char *p = re;
+
+	while (*p != '\0') {
+		const char *atom = NULL;	// リテラルならその先頭
+		uint atomlen = 0;
+
+		switch (*p) {
+		 case '|':
+			// トップレベルの選択があれば必須な部分はない。
+			string_free(best);
+			best = NULL;
+			goto done;
+
+		 case '\\':
+			// 特殊文字のエスケープだけリテラル。
+			// \< や \w などの GNU 拡張やその他はリテラルではない。
+			if (p[1] != '\0' && strchr(".[]()*+?{}|^$\\/-", p[1])) {
+				atom = p + 1;
+				atomlen = 1;
+				p += 2;
+			} else {
+				p += (p[1] != '\0') ? 2 : 1;
+			}
+			break;
+
+		 case '[':
+		 case '(':
+			p = ngword_regex_skip(p);
+			break;
+
+		 case '.':
+		 case '^':
+		 case '$':
+		 case '*':
+		 case '+':
+		 case '?':
+		 case '{':
+			// 先頭や量指定子の後ろの量指定子もここに来るが、
+			// 区切りとして扱えば安全側。
+			p++;
+			break;
+
+		 default:
+		 {
+			// マルチバイト文字は量指定子が文字全体にかかる場合と
+			// 最後のバイトにかかる場合とがあるが、どちらでも文字全体を
+			// 単位として扱えば安全側。
+			uint8 c = *p;
+			uint len;
+			if (c < 0xc0) {
+				len = 1;
+			} else if (c < 0xe0) {
+				len = 2;
+			} else if (c < 0xf0) {
+				len = 3;
+			} else {
+				len = 4;
+			}
+			atom = p;
+			for (atomlen = 0; atomlen < len && p[atomlen] != '\0'; atomlen++)
+				;
+			p += atomlen;
+			break;
+		 }
+		}
+
+		// 量指定子を調べる。
+		bool optional = false;
+		bool quantified = false;
+		while (*p == '*' || *p == '+' || *p == '?' || *p == '{') {
+			quantified = true;
+			if (*p == '{') {
+				// {0,} や glibc が受け付ける {,3} のように 0 回を許すもの、
+				// それと解釈できない { は省略可能として扱う。
+				const char *q = p + 1;
+				bool nonzero = false;
+				for (; '0' <= *q && *q <= '9'; q++) {
+					if (*q != '0') {
+						nonzero = true;
+					}
+				}
+				if (nonzero == false) {
+					optional = true;
+				}
+				const char *e = strchr(p, '}');
+				p = e ? e + 1 : p + strlen(p);
+			} else {
+				if (*p != '+') {
+					optional = true;
+				}
+				p++;
+			}
+		}
+
+		if (atom && optional == false) {
+			string_append_mem(run, atom, atomlen);
+		}
+		// リテラル以外、省略可能なもの、繰り返すものの後ろでは
+		// リテラルが途切れる。
+		if (atom == NULL || quantified) {
+			if (best == NULL || string_len(run) > string_len(best)) {
+				string_free(best);
+				best = string_dup(run);
+			}
+			string_clear(run);
+		}
+	}
+	if (best == NULL || string_len(run) > string_len(best)) {
+		string_free(best);
+		best = string_dup(run);
+	}
+
+ done:
+	string_free(run);
+	if (best && string_len(best) == 0) {
+		string_free(best);
+		best = NULL;
+	}
+	return best;
+}
+
+// 正規表現 p の位置から始まるブラケット表現 '[' か、グループ '(' を
+// 読み飛ばして、その次の位置を返す。
+static const char *
+ngword_regex_skip(const char *p)
+{
+	if (*p == '[') {
+		p++;
+		if (*p == '^') {
+			p++;
+		}
+		// 先頭の ']' は文字として扱われる。
+		if (*p == ']') {
+			p++;
+		}
+		while (*p != '\0' && *p != ']') {
+			// [:alpha:] などは中に ']' を含みうる。
+			if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+				char term = p[1];
+				const char *q;
+				for (q = p + 2; *q != '\0'; q++) {
+					if (q[0] == term && q[1] == ']') {
+						break;
+					}
+				}
+				p = (*q != '\0') ? q + 2 : q;
+			} else {
+				p++;
+			}
+		}
+		if (*p == ']') {
+			p++;
+		}
+	} else {
+		// '(' から対応する ')' まで。
+		int depth = 0;
+		while (*p != '\0') {
+			if (*p == '\\') {
+				p += (p[1] != '\0') ? 2 : 1;
+			} else if (*p == '[') {
+				p = ngword_regex_skip(p);
+			} else if (*p == '(') {
+				depth++;
+				p++;
+			} else if (*p == ')') {
+				p++;
+				if (--depth == 0) {
+					break;
+				}
+			} else {
+				p++;
+			}
+		}
+	}
+	return p;
+}
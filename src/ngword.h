@@ -48,18 +48,53 @@ struct ngword {
 	// NG_REGEX ならコンパイルした正規表現。それ以外なら NULL。
 	regex_t ng_regex;
 
+	// NG_REGEX で、一致する文字列に必ず含まれるリテラル部分文字列が
+	// あればそれ。本文にこれがなければ regexec() を省略できる。
+	// なければ (あるいは NG_REGEX 以外なら) NULL。
+	string *ng_literal;
+
 	// ユーザ指定があればユーザ名('@' も含む)。
 	// ユーザ指定がなければ NULL。
 	string *ng_user;
+
+	// ng_user の索引 (ngwords.users[] の添字)。ユーザ指定がなければ 0。
+	uint ng_userid;
+};
+
+// ユーザ指定ごとのルールの索引。
+struct ngword_user {
+	const string *user;	// アカウント名 (いずれかの ng_user を指している)
+	uint32 hash;		// user のハッシュ値
+	uint next;			// 同じバケットの次のエントリ。なければ 0
+	uint rulecount;		// このユーザ指定のルール数
+	uint regexcount;	// そのうち NG_REGEX の数
+	uint *regex;		// NG_REGEX のインデックス (昇順)
 };
 
+struct ngword_ac;
+
 // NG ワード一覧。
 struct ngwords {
+	// NG_TEXT と NG_REGEX のリテラルを全部まとめた Aho-Corasick
+	// オートマトン。
+	struct ngword_ac *ac;
+
+	// ユーザ指定ごとの索引。
+	// [0] はユーザ指定のない (全員に適用する) ルール。
+	struct ngword_user *users;
+	uint usercount;
+
+	// users[] へのハッシュ表。バケットから next で辿る。0 なら終端。
+	uint *bucket;
+	uint bucketsize;
+
 	uint count;
 	struct ngword item[0];	// 実際には count 個の配列。
 };
 
 extern struct ngwords *ngword_read_file(const char *, const struct diag *);
 extern void ngword_destroy(struct ngwords *);
+extern int  ngword_match(const struct ngwords *, const string *,
+	const string *);
 
 #endif // !sayaka_ngword_h
@@ -61,6 +61,11 @@ static void make_esc(char *, const char *);
 static inline void make_indent(char *, int);
 static uint get_eaw_width(unichar c);
 static bool fetch_image(FILE *, const char *, uint, uint, bool);
+static struct prefetch *prefetch_find(const char *);
+static void prefetch_release(struct prefetch *);
+static void prefetch_done(struct httpclient *, int, void *);
+static struct bhcache *bhcache_lookup(const char *, uint, uint, bool);
+static void bhcache_insert(const char *, uint, uint, bool, string *);
 
 uint image_count;				// この列に表示している画像の数
 uint image_next_cols;			// この列で次に表示する画像の位置(桁数)
@@ -75,6 +80,47 @@ bool opt_nocombine;				// Combining Enclosing Keycap を合成しない
 #define S2EBUFSIZE	(16)
 static char style2esc[STYLE_MAX][S2EBUFSIZE];
 
+// 画像の先読み。
+// ノートに含まれるアイコンと添付画像のうちキャッシュにないものを、
+// 表示を始める前にイベントループで同時に取得しておく。
+// fetch_image() は先読みしてあればそれを使う。
+// ストリームでは受信用のイベントループで取得し、表示を待っている
+// 複数のメッセージが同じ画像を参照することがあるので参照数を持つ。
+#define PREFETCH_MAX			(64)
+#define PREFETCH_DEADLINE_MSEC	(30 * 1000)	// 1画像あたりの期限
+struct prefetch {
+	char *url;		// NULL なら空き
+	struct httpclient *http;
+	int code;		// 1 なら取得中。完了すれば done_cb の code
+	int error;		// 失敗した時の errno
+	uint refs;		// 参照数
+};
+static struct prefetch prefetch_list[PREFETCH_MAX];
+static struct evloop *prefetch_loop;
+static bool prefetch_own_loop;		// prefetch_loop を自分で作った
+static void (*prefetch_cb)(void);	// 1つ完了するたびに呼ぶ
+
+// Blurhash から作った SIXEL のメモリキャッシュ。
+// 同じ Blurhash (アイコンの代わりや閲覧注意の画像、リノートなど) は
+// 何度も出てくるので、一度表示したらディスクキャッシュを読むことも
+// 作り直すこともなく、ここから出力する。
+// 色数はプロセス中で変わらないが、一応キーに含めておく。
+// 中身はメッセージをまたいで使うのでアリーナではなくヒープに置く。
+#define BHCACHE_SIZE		(32)
+#define BHCACHE_MAXSIZE		(256 * 1024)	// これより大きい SIXEL は持たない
+struct bhcache {
+	char *url;			// "blurhash://..."。NULL なら未使用
+	uint32 hash;		// url のハッシュ値
+	uint64 lastuse;		// 最後に使った時の bhcache_clock
+	uint width;
+	uint height;
+	ColorMode color;	// imageopt.color
+	bool shade;
+	string *sixel;
+};
+static struct bhcache bhcache[BHCACHE_SIZE];
+static uint64 bhcache_clock;
+
 // 色関係の初期化。
 void
 init_color(void)
@@ -90,6 +136,9 @@ init_color(void)
 	url[0] = '\0';
 	ng[0] = '\0';
 
+	// MFM の整形でも同じ装飾を使う。
+	mfm_set_style(style_begin, style_end);
+
 	if (colormode == 1) {
 		// -c 1 なら一切エスケープシーケンスを使わない。
 		return;
@@ -497,7 +546,10 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 	bool shade, int index)
 {
 	char cache_filename[PATH_MAX];
+	char tmp_filename[PATH_MAX + 16];
 	FILE *fp;
+	struct bhcache *bc = NULL;
+	string *bhsixel = NULL;
 	uint sx_width;
 	uint sx_height;
 	char buf[4096];
@@ -509,21 +561,46 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 
 	snprintf(cache_filename, sizeof(cache_filename),
 		"%s/%s.sixel", cachedir, img_file);
+	tmp_filename[0] = '\0';
 	Debug(diag_image, "cachefile=|%s|", cache_filename);
 	Trace(diag_image, "img_url=|%s|", img_url);
 
-	if (opt_overwrite_cache) {
+	if (strncmp(img_url, "blurhash://", 11) == 0) {
+		bc = bhcache_lookup(img_url, width, height, shade);
+		if (bc == NULL) {
+			// 出力しながら溜めておいて、最後にメモリキャッシュに入れる。
+			struct arena *prev = arena_set_current(NULL);
+			bhsixel = string_init();
+			arena_set_current(prev);
+		}
+	}
+
+	if (bc) {
+		Debug(diag_image, "%s: blurhash memory cache hit", __func__);
+		fp = fmemopen(UNCONST(string_get(bc->sixel)), string_len(bc->sixel),
+			"r");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: fmemopen: %s\n", __func__, strerrno());
+			return false;
+		}
+	} else if (opt_overwrite_cache) {
 		fp = NULL;
 	} else {
 		fp = fopen(cache_filename, "r");
 	}
 	if (fp == NULL) {
 		// キャッシュファイルがないので、画像を取得してキャッシュに保存。
+		// 並列再生では同じ画像のキャッシュを複数のプロセスが同時に作る
+		// ことがあり、作りかけを読まれないよう一時ファイルに書いてから
+		// rename する。
 
-		fp = fopen(cache_filename, "w+");
+		snprintf(tmp_filename, sizeof(tmp_filename), "%s.%u",
+			cache_filename, (uint)getpid());
+		fp = fopen(tmp_filename, "w+");
 		if (fp == NULL) {
 			fprintf(stderr, "%s: cache file '%s': %s\n", __func__,
-				cache_filename, strerrno());
+				tmp_filename, strerrno());
+			string_free(bhsixel);
 			return false;
 		}
 
@@ -536,6 +613,12 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 		}
 
 		fseek(fp, 0, SEEK_SET);
+		if (rename(tmp_filename, cache_filename) < 0) {
+			fprintf(stderr, "%s: rename '%s': %s\n", __func__,
+				cache_filename, strerrno());
+			goto abort;
+		}
+		tmp_filename[0] = '\0';
 	}
 
 	// SIXEL の先頭付近から幅と高さを取得。
@@ -601,14 +684,25 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 
 	// 最初の1回はすでに buf に入っているのでまず出力して、
 	// 次からは順次読みながら最後まで出力。
+	uint stage = bench_enter(BENCH_SIXEL);
 	do {
 		in_sixel = true;
 		fwrite(buf, 1, n, stdout);
 		fflush(stdout);
 		in_sixel = false;
 
+		if (bhsixel) {
+			if (string_len(bhsixel) + n <= BHCACHE_MAXSIZE) {
+				string_append_mem(bhsixel, buf, n);
+			} else {
+				string_free(bhsixel);
+				bhsixel = NULL;
+			}
+		}
+
 		n = fread(buf, 1, sizeof(buf), fp);
 	} while (n > 0);
+	bench_leave(stage);
 
 	if (index < 0) {
 		// アイコンの場合は呼び出し側で実施。
@@ -625,9 +719,19 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 		}
 	}
 
+	if (bhsixel) {
+		bhcache_insert(img_url, width, height, shade, bhsixel);
+		bhsixel = NULL;
+	}
+
 	rv = true;
  abort:
 	fclose(fp);
+	string_free(bhsixel);
+	// 作りかけの一時ファイルは消す。
+	if (tmp_filename[0] != '\0') {
+		unlink(tmp_filename);
+	}
 	// ファイルサイズ 0 なら消す。
 	if (lstat(cache_filename, &st) == 0 && st.st_size == 0) {
 		unlink(cache_filename);
@@ -660,11 +764,13 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	uint dst_width = width;
 	uint dst_height = height;
 
+	uint stage = bench_enter(BENCH_IMAGE);
+
 	if (strncmp(img_url, "blurhash://", 11) == 0) {
 		ifp = fmemopen(UNCONST(&img_url[11]), strlen(img_url) - 11, "r");
 		if (ifp == NULL) {
 			Debug(diag_image, "%s: fmemopen failed: %s", __func__, strerrno());
-			return false;
+			goto abort;
 		}
 
 		srcimg = image_blurhash_read(ifp, dst_width, dst_height, diag_image);
@@ -679,12 +785,22 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	} else if (strncmp(img_url, "http://",  7) == 0 ||
 	           strncmp(img_url, "https://", 8) == 0)
 	{
-		http = httpclient_create(diag_net);
-		if (http == NULL) {
-			Debug(diag_net, "%s: httpclient_create failed", __func__);
-			return false;
+		int code;
+		struct prefetch *pf = prefetch_find(img_url);
+		if (pf && pf->http && pf->code != 1) {
+			// 先読みが完了していればそれを使う。
+			http = pf->http;
+			pf->http = NULL;
+			code = pf->code;
+			errno = pf->error;
+		} else {
+			http = httpclient_create(diag_net);
+			if (http == NULL) {
+				Debug(diag_net, "%s: httpclient_create failed", __func__);
+				goto abort;
+			}
+			code = httpclient_connect(http, img_url, &netopt_image);
 		}
-		int code = httpclient_connect(http, img_url, &netopt_image);
 		if (code != 0) {
 			if (code < 0) {
 				Debug(diag_net, "%s: %s: connection failed: %s",
@@ -696,18 +812,11 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 			}
 			goto abort;
 		}
-		ifp = httpclient_fopen(http);
-		if (ifp == NULL) {
-			Debug(diag_net, "%s: httpclient_fopen failed: %s", __func__,
-				strerrno());
-			goto abort;
-		}
-
-		// ifp からピークストリームを作成。
-		pstream = pstream_init_fp(ifp);
+		// 受信バッファから直接読み込むピークストリームを作成。
+		pstream = httpclient_open_pstream(http);
 		if (pstream == NULL) {
-			Debug(diag_net, "%s: pstream_init_fp failed: %s", __func__,
-				strerrno());
+			Debug(diag_net, "%s: httpclient_open_pstream failed: %s",
+				__func__, strerrno());
 			goto abort;
 		}
 
@@ -751,6 +860,9 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	}
 
 	// 出力。
+	// 画像段階から切り替えるだけなので戻り値 (BENCH_IMAGE) は使わない。
+	// 最後の bench_leave(stage) で呼び出し元の段階に戻る。
+	bench_enter(BENCH_SIXEL);
 	if (image_sixel_write(ofp, dstimg, &localopt, diag_image) == false) {
 		Debug(diag_image, "%s: image_sixel_write failed", __func__);
 		goto abort;
@@ -766,5 +878,223 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 		fclose(ifp);
 	}
 	httpclient_destroy(http);
+	bench_leave(stage);
 	return rv;
 }
+
+// 先読みに loop を使うようにする。
+// 取得が1つ完了するたびに (loop の中から) cb() を呼ぶ。
+// 呼ばなければ image_prefetch_run() で待つための専用のループを作る。
+void
+image_prefetch_init(struct evloop *loop, void (*cb)(void))
+{
+	prefetch_loop = loop;
+	prefetch_cb = cb;
+}
+
+// 画像 img_url を先読みの対象に加えて、取得を開始する。
+// img_file はキャッシュファイル名で、キャッシュがあれば何もしない。
+// 先読みの番号を返す。先読みしない (出来ない) なら -1 を返す。
+// 番号は不要になったら image_prefetch_release() で解放すること。
+int
+image_prefetch_add(const char *img_file, const char *img_url)
+{
+	char cache_filename[PATH_MAX];
+	struct stat st;
+	struct prefetch *pf;
+
+	if (strncmp(img_url, "http://",  7) != 0 &&
+	    strncmp(img_url, "https://", 8) != 0)
+	{
+		return -1;
+	}
+	pf = prefetch_find(img_url);
+	if (pf) {
+		pf->refs++;
+		return pf - prefetch_list;
+	}
+	if (opt_overwrite_cache == false) {
+		snprintf(cache_filename, sizeof(cache_filename),
+			"%s/%s.sixel", cachedir, img_file);
+		if (stat(cache_filename, &st) == 0) {
+			return -1;
+		}
+	}
+
+	pf = NULL;
+	for (uint i = 0; i < countof(prefetch_list); i++) {
+		if (prefetch_list[i].url == NULL) {
+			pf = &prefetch_list[i];
+			break;
+		}
+	}
+	if (pf == NULL) {
+		return -1;
+	}
+
+	if (prefetch_loop == NULL) {
+		prefetch_loop = evloop_create(diag_net);
+		if (prefetch_loop == NULL) {
+			return -1;
+		}
+		prefetch_own_loop = true;
+	}
+
+	pf->url = strdup(img_url);
+	if (pf->url == NULL) {
+		return -1;
+	}
+	pf->http = httpclient_create(diag_net);
+	if (pf->http == NULL) {
+		free(pf->url);
+		pf->url = NULL;
+		return -1;
+	}
+	pf->code = 1;
+	pf->error = 0;
+	pf->refs = 1;
+	int r = httpclient_fetch_async(pf->http, prefetch_loop, img_url,
+		&netopt_image, PREFETCH_DEADLINE_MSEC, prefetch_done, pf);
+	if (r < 0) {
+		// 開始できなかったものはその場で失敗にしておく。
+		pf->code = r;
+		pf->error = errno;
+	}
+	Trace(diag_net, "%s: %s", __func__, img_url);
+	return pf - prefetch_list;
+}
+
+// 先読み idx の取得が終わっていれば (成否によらず) true を返す。
+bool
+image_prefetch_done(int idx)
+{
+	return (prefetch_list[idx].code != 1);
+}
+
+// 先読み idx を解放する。
+void
+image_prefetch_release(int idx)
+{
+	prefetch_release(&prefetch_list[idx]);
+}
+
+// idx[] (n 個) の先読みを全部取得し終えるまで待つ。
+// image_prefetch_init() を呼ばずに専用のループで先読みした時用。
+void
+image_prefetch_run(const int *idx, uint n)
+{
+	if (prefetch_own_loop == false) {
+		return;
+	}
+
+	uint stage = bench_enter(BENCH_IMAGE);
+	for (uint i = 0; i < n; ) {
+		if (image_prefetch_done(idx[i])) {
+			i++;
+			continue;
+		}
+		if (evloop_run_once(prefetch_loop, -1) < 0) {
+			// 取得中のものは fetch_image() が改めて取得する。
+			break;
+		}
+	}
+	bench_leave(stage);
+}
+
+// img_url の先読みのエントリを返す。なければ NULL を返す。
+static struct prefetch *
+prefetch_find(const char *img_url)
+{
+	for (uint i = 0; i < countof(prefetch_list); i++) {
+		struct prefetch *pf = &prefetch_list[i];
+		if (pf->url && strcmp(pf->url, img_url) == 0) {
+			return pf;
+		}
+	}
+	return NULL;
+}
+
+// 先読みのエントリの参照を1つ減らし、なくなれば捨てる。
+static void
+prefetch_release(struct prefetch *pf)
+{
+	assert(pf->refs > 0);
+	if (--pf->refs == 0) {
+		httpclient_destroy(pf->http);
+		free(pf->url);
+		memset(pf, 0, sizeof(*pf));
+	}
+}
+
+// 先読みの完了コールバック。
+static void
+prefetch_done(struct httpclient *http, int code, void *arg)
+{
+	struct prefetch *pf = (struct prefetch *)arg;
+
+	pf->code = code;
+	pf->error = errno;
+	Debug(diag_net, "%s: %s: %s", __func__, pf->url,
+		(code == 0 ? "done" : "failed"));
+	if (prefetch_cb) {
+		prefetch_cb();
+	}
+}
+
+// Blurhash の SIXEL がメモリキャッシュにあれば返す。なければ NULL を返す。
+static struct bhcache *
+bhcache_lookup(const char *img_url, uint width, uint height, bool shade)
+{
+	uint32 hash = hash_fnv1a(img_url);
+	for (uint i = 0; i < countof(bhcache); i++) {
+		struct bhcache *bc = &bhcache[i];
+		if (bc->url &&
+			bc->hash == hash &&
+			bc->width == width &&
+			bc->height == height &&
+			bc->color == imageopt.color &&
+			bc->shade == shade &&
+			strcmp(bc->url, img_url) == 0)
+		{
+			bc->lastuse = ++bhcache_clock;
+			return bc;
+		}
+	}
+	return NULL;
+}
+
+// Blurhash の SIXEL をメモリキャッシュに登録する。sixel の所有権は移る。
+// 空きがなければ一番長く使っていないものを追い出す。
+static void
+bhcache_insert(const char *img_url, uint width, uint height, bool shade,
+	string *sixel)
+{
+	// 複製に失敗したら登録しない (既存のエントリも追い出さない)。
+	char *url = strdup(img_url);
+	if (url == NULL) {
+		Debug(diag_image, "%s: strdup: %s", __func__, strerrno());
+		string_free(sixel);
+		return;
+	}
+
+	struct bhcache *bc = &bhcache[0];
+	for (uint i = 1; i < countof(bhcache); i++) {
+		if (bhcache[i].lastuse < bc->lastuse) {
+			bc = &bhcache[i];
+		}
+	}
+	if (bc->url) {
+		Trace(diag_image, "%s: evict %s", __func__, bc->url);
+		free(bc->url);
+		string_free(bc->sixel);
+	}
+
+	bc->url = url;
+	bc->hash = hash_fnv1a(img_url);
+	bc->width = width;
+	bc->height = height;
+	bc->color = imageopt.color;
+	bc->shade = shade;
+	bc->sixel = sixel;
+	bc->lastuse = ++bhcache_clock;
+}
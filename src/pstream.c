@@ -42,6 +42,12 @@
 // 前半の判定フェーズで使う、seek 可能な内部バッファを持つ FILE* と、
 // 後半の読み込みフェーズで使う、内部バッファに置かず seek 不可能な FILE*
 // という 2段階という変態ストリームを用意する。
+//
+// 入力が httpclient などの場合は受信バッファのスライス (bslice) を
+// そのまま受け取り、ピークバッファもそのスライスを保持するだけでコピーしない。
+// メモリ上のデータを受け付ける画像ローダは pstream_read_slice() で
+// スライスのまま受け取れる。fd/fp の場合も同様にブロックに読み込んで
+// スライスとして扱う。
 
 #include "common.h"
 #include <errno.h>
@@ -64,25 +70,37 @@
 #endif
 
 struct pstream {
-	// 入力となるストリームかディスクリプタ。
-	// ifp != NULL なら ifp が有効。ifp == NULL なら ifd が有効。
-	// いずれも所有しない。
+	// 入力となるスライスの供給元かストリームかディスクリプタ。
+	// src_read != NULL なら src_read が、ifp != NULL なら ifp が有効。
+	// いずれでもなければ ifd が有効。いずれも所有しない。
+	int (*src_read)(void *, struct bslice *, uint);
+	void *src_arg;
 	FILE *ifp;
 	int ifd;
 
 	uint pos;			// 上位レイヤから見た現在位置
 
-	char *peekbuf;		// ピーク用バッファ
-	uint bufsize;		// 確保してあるバッファサイズ
+	// ピーク用バッファ。読み込んだスライスを順に保持する。
+	struct bslice *peek;
+	uint npeek;			// 保持しているスライス数
+	uint peekcap;		// 確保してある peek[] の数
 	uint peeklen;		// ピークバッファに読み込んである長さ
 	bool done;			// EOF に到達した
+
+	// fd/fp から読み込むためのブロック。
+	struct bblock *wblock;
+	uint wpos;			// wblock の書き込み位置
 };
 
+// fd/fp から読み込む時のブロックサイズ。
+#define PSTREAM_BLOCKSIZE	(IMAGE_BUFSIZE)
+
 static struct pstream *pstream_init_common(void);
 static int pstream_peek_cb(void *, char *, int);
 static int pstream_read_cb(void *, char *, int);
 static off_t pstream_seek_cb(void *, off_t, int);
-static ssize_t psread(struct pstream *, void *, size_t);
+static bool pstream_peek_fill(struct pstream *);
+static int psread_slice(struct pstream *, struct bslice *, uint);
 static off_t psseek(struct pstream *, off_t);
 
 static struct pstream *
@@ -92,6 +110,7 @@ pstream_init_common(void)
 	if (ps == NULL) {
 		return NULL;
 	}
+	ps->ifd = -1;
 
 	return ps;
 }
@@ -105,7 +124,6 @@ pstream_init_fd(int fd)
 		return NULL;
 	}
 
-	ps->ifp = NULL;
 	ps->ifd = fd;
 	return ps;
 }
@@ -120,7 +138,24 @@ pstream_init_fp(FILE *ifp)
 	}
 
 	ps->ifp = ifp;
-	ps->ifd = -1;
+	return ps;
+}
+
+// スライスの供給元からストリームコンテキストを作成する。
+// src_read(src_arg, sp, maxlen) は最大 maxlen バイトのスライスを sp に
+// 返し、net_read_slice() と同じ戻り値を返すこと。
+// こちらは供給元のバッファからコピーせずに読み込む。seek は出来ない。
+struct pstream *
+pstream_init_slice(int (*src_read)(void *, struct bslice *, uint),
+	void *src_arg)
+{
+	struct pstream *ps = pstream_init_common();
+	if (ps == NULL) {
+		return NULL;
+	}
+
+	ps->src_read = src_read;
+	ps->src_arg = src_arg;
 	return ps;
 }
 
@@ -130,8 +165,12 @@ void
 pstream_cleanup(struct pstream *ps)
 {
 	if (ps) {
-		free(ps->peekbuf);
-		ps->peekbuf = NULL;
+		for (uint i = 0; i < ps->npeek; i++) {
+			bslice_release(&ps->peek[i]);
+		}
+		free(ps->peek);
+		ps->peek = NULL;
+		bblock_unref(ps->wblock);
 
 		free(ps);
 	}
@@ -175,6 +214,96 @@ pstream_open_for_read(struct pstream *ps)
 	return fp;
 }
 
+// 判定フェーズで、先頭から最大 dstsize バイトを dst にコピーする。
+// FILE* を介さずに先頭のシグネチャを調べるためのもので、現在位置は
+// 変更しない。足りなければ下位ストリームからピークバッファに読み込む。
+// コピーしたバイト数を返す。dstsize に満たないのは EOF の場合のみ。
+// エラーなら errno をセットして -1 を返す。
+int
+pstream_peek(struct pstream *ps, void *dst, uint dstsize)
+{
+	uint8 *d = dst;
+	uint total = 0;
+
+	while (ps->peeklen < dstsize && ps->done == false) {
+		if (pstream_peek_fill(ps) == false) {
+			return -1;
+		}
+	}
+
+	for (uint i = 0; i < ps->npeek && total < dstsize; i++) {
+		const struct bslice *p = &ps->peek[i];
+		uint len = MIN(p->len, dstsize - total);
+		memcpy(d + total, p->ptr, len);
+		total += len;
+	}
+	return total;
+}
+
+// 読み込みフェーズで、現在位置から最大 maxlen バイトを読み込んで、
+// そのデータを指すスライスを sp に返す。
+// ピークバッファ内ならピークバッファのスライスを、そうでなければ
+// 下位ストリームから読み込んだスライスを返す。いずれもコピーはしない。
+// sp は使い終わったら bslice_release() すること。
+// 読み込んだバイト数を返す。EOF なら 0 を返す (sp は空)。
+// エラーなら errno をセットして -1 を返す (sp は空)。
+int
+pstream_read_slice(struct pstream *ps, struct bslice *sp, uint maxlen)
+{
+	DEBUG("called(maxlen=%u) pos=%u peeklen=%u", maxlen, ps->pos, ps->peeklen);
+
+	if (ps->pos < ps->peeklen) {
+		// ピークバッファ内ならピークバッファから切り出す。
+		uint start = 0;
+		for (uint i = 0; i < ps->npeek; i++) {
+			const struct bslice *p = &ps->peek[i];
+			if (ps->pos < start + p->len) {
+				uint off = ps->pos - start;
+				uint len = MIN(p->len - off, maxlen);
+				bslice_set(sp, p->block, p->ptr + off, len);
+				ps->pos += len;
+				DEBUG("from buf: len=%u", len);
+				return len;
+			}
+			start += p->len;
+		}
+		// ここには来ないはず。
+	}
+
+	// ピークバッファ外なら直接リード。
+	int n = psread_slice(ps, sp, maxlen);
+	if (n > 0) {
+		ps->pos += n;
+	}
+	DEBUG("out buf : len=%d", n);
+	return n;
+}
+
+// 読み込みフェーズで、現在位置から最大 dstsize バイトを dst に読み込む。
+// dstsize バイトに満たないのは EOF の場合のみ。
+// 読み込んだバイト数を返す。エラーなら errno をセットして -1 を返す。
+int
+pstream_read(struct pstream *ps, void *dst, uint dstsize)
+{
+	struct bslice slice;
+	uint8 *d = dst;
+	uint total = 0;
+
+	while (total < dstsize) {
+		int n = pstream_read_slice(ps, &slice, dstsize - total);
+		if (n <= 0) {
+			if (n < 0) {
+				return -1;
+			}
+			break;
+		}
+		memcpy(d + total, slice.ptr, n);
+		bslice_release(&slice);
+		total += n;
+	}
+	return total;
+}
+
 // 現在位置から最大 dstsize バイトを読み込んでバッファする。
 static int
 pstream_peek_cb(void *cookie, char *dst, int dstsize)
@@ -191,66 +320,72 @@ pstream_peek_cb(void *cookie, char *dst, int dstsize)
 			return 0;
 		}
 
-		// バッファに空きがなければ拡大。
-		if (ps->peeklen == ps->bufsize) {
-			uint newsize = ps->bufsize + 1024;
-			char *newbuf = realloc(ps->peekbuf, newsize);
-			if (newbuf == NULL) {
-				return -1;
-			}
-			ps->peekbuf = newbuf;
-			ps->bufsize = newsize;
-			DEBUG("realloc %u", newsize);
-		}
-
-		// 前回は peeklen まで読み込んでいるので、続きを読み込む。
-		char *buf = ps->peekbuf + ps->peeklen;
-		size_t len = ps->bufsize - ps->peeklen;
-		ssize_t n = psread(ps, buf, len);
-		if (n < 0) {
+		if (pstream_peek_fill(ps) == false) {
 			return -1;
 		}
-		DEBUG("n = %d", (int)n);
-		ps->peeklen += n;
-
-		// この読み込みで EOF に到達した。
-		if (n == 0) {
-			ps->done = true;
-		}
 	}
 
 	// 内部バッファにある限りは使う。
-	size_t len = MIN(ps->peeklen - ps->pos, dstsize);
-	DEBUG("len = %u from pos=%u", (uint)len, ps->pos);
-	memcpy(dst, ps->peekbuf + ps->pos, len);
-	ps->pos += len;
+	struct bslice slice;
+	int len = pstream_read_slice(ps, &slice, dstsize);
+	DEBUG("len = %d to pos=%u", len, ps->pos);
+	if (len > 0) {
+		memcpy(dst, slice.ptr, len);
+		bslice_release(&slice);
+	}
 	return len;
 }
 
+// 下位ストリームから次のスライスを読み込んでピークバッファに追加する。
+// EOF に到達すれば done を立てる。
+// エラーなら errno をセットして false を返す。
+static bool
+pstream_peek_fill(struct pstream *ps)
+{
+	// 配列に空きがなければ拡大。
+	if (ps->npeek == ps->peekcap) {
+		uint newcap = ps->peekcap + 8;
+		struct bslice *newpeek = realloc(ps->peek, newcap * sizeof(*newpeek));
+		if (newpeek == NULL) {
+			return false;
+		}
+		ps->peek = newpeek;
+		ps->peekcap = newcap;
+		DEBUG("realloc %u", newcap);
+	}
+
+	struct bslice *sp = &ps->peek[ps->npeek];
+	int n = psread_slice(ps, sp, UINT32_MAX);
+	if (n < 0) {
+		return false;
+	}
+	DEBUG("n = %d", n);
+
+	if (n == 0) {
+		// この読み込みで EOF に到達した。
+		ps->done = true;
+	} else {
+		ps->npeek++;
+		ps->peeklen += n;
+	}
+	return true;
+}
+
 // 現在位置から dstsize バイトを読み込む。
 static int
 pstream_read_cb(void *cookie, char *dst, int dstsize)
 {
 	struct pstream *ps = (struct pstream *)cookie;
+	struct bslice slice;
 
 	DEBUG("called(dstsize=%d) pos=%u peeklen=%u",
 		dstsize, ps->pos, ps->peeklen);
 
-	ssize_t len;
-	if (ps->pos < ps->peeklen) {
-		// ピークバッファ内ならピークバッファから読み出す。
-		len = MIN(ps->peeklen - ps->pos, dstsize);
-		DEBUG("from buf: pos=%u len=%d", ps->pos, (int)len);
-		memcpy(dst, ps->peekbuf + ps->pos, len);
-	} else {
-		// ピークバッファ外なら直接リード。
-		len = psread(ps, dst, dstsize);
-		if (len < 0) {
-			return -1;
-		}
-		DEBUG("out buf : pos=%u len=%d", ps->pos, (int)len);
+	int len = pstream_read_slice(ps, &slice, dstsize);
+	if (len > 0) {
+		memcpy(dst, slice.ptr, len);
+		bslice_release(&slice);
 	}
-	ps->pos += len;
 	return len;
 }
 
@@ -311,28 +446,48 @@ pstream_seek_cb(void *cookie, off_t offset, int whence)
 	return newpos;
 }
 
-// pstream に対する read。read(2) 互換。
-static ssize_t
-psread(struct pstream *ps, void *dst, size_t len)
+// pstream の下位ストリームから最大 maxlen バイトを読み込んで、
+// そのデータを指すスライスを sp に返す。
+// 読み込んだバイト数を返す。EOF なら 0 を返す (sp は空)。
+// エラーなら errno をセットして -1 を返す (sp は空)。
+static int
+psread_slice(struct pstream *ps, struct bslice *sp, uint maxlen)
 {
 	ssize_t n;
 
+	if (ps->src_read) {
+		return ps->src_read(ps->src_arg, sp, maxlen);
+	}
+
+	memset(sp, 0, sizeof(*sp));
+
+	uint space = bblock_prepare(&ps->wblock, &ps->wpos, PSTREAM_BLOCKSIZE);
+	if (space == 0) {
+		return -1;
+	}
+	uint8 *dst = ps->wblock->data + ps->wpos;
+	uint len = MIN(space, maxlen);
+
 	if (ps->ifp) {
 		n = fread(dst, 1, len, ps->ifp);
 		if (n == 0) {
 			if (ferror(ps->ifp)) {
-				DEBUG("fread(%zu): %s", len, strerrno());
+				DEBUG("fread(%u): %s", len, strerrno());
 				return -1;
 			}
 		}
 	} else {
 		n = read(ps->ifd, dst, len);
 		if (n < 0) {
-			DEBUG("read(%zu): %s", len, strerrno());
+			DEBUG("read(%u): %s", len, strerrno());
 			return -1;
 		}
 	}
 
+	if (n > 0) {
+		bslice_set(sp, ps->wblock, dst, n);
+		ps->wpos += n;
+	}
 	return n;
 }
 
@@ -344,7 +499,11 @@ psseek(struct pstream *ps, off_t offset)
 {
 	off_t newoff;
 
-	if (ps->ifp) {
+	if (ps->src_read) {
+		// スライスの供給元は seek 出来ない。
+		errno = ESPIPE;
+		return (off_t)-1;
+	} else if (ps->ifp) {
 		if (fseek(ps->ifp, (long)offset, SEEK_SET) < 0) {
 			DEBUG("fseek(%u): %s", (uint)offset, strerrno());
 			return (off_t)-1;
@@ -0,0 +1,747 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 録画と再生
+//
+
+// 録画ファイルの形式は2種類。
+//
+// o JSONL 形式 (従来形式、デフォルト)
+//   受信した JSON を1行1メッセージで並べたもの。
+//
+// o ブロック圧縮形式 (--record-format=deflate)
+//   受信時刻付きのレコードをいくつかまとめて deflate で圧縮したブロックの
+//   並び。途中に定期的にインデックスブロックを挟んで、受信時刻から
+//   シーク出来るようにしてある。
+//
+//   ファイルヘッダ (24 バイト)
+//    +00 "SAYAKARC"	マジック
+//    +08 uint32		バージョン (1)
+//    +0c uint32		予約 (0)
+//    +10 uint64		最後のインデックスブロックのオフセット (なければ 0)
+//
+//   各ブロックはブロックヘッダ (24 バイト) と本体からなる。
+//    +00 uint32		種別 (BLOCK_DATA か BLOCK_INDEX)
+//    +04 uint32		本体のバイト数
+//    +08 uint32		本体の展開後のバイト数
+//    +0c uint32		レコード数 (インデックスならエントリ数)
+//    +10 uint64		先頭レコードの受信時刻 (UNIX 時刻の usec)
+//
+//   データブロックの本体は、以下のレコードの並びを zlib で圧縮したもの。
+//    +00 uint64		受信時刻 (UNIX 時刻の usec)
+//    +08 uint32		JSON のバイト数
+//    +0c				JSON (改行も NUL もなし)
+//
+//   インデックスブロックの本体は無圧縮で、ひとつ前のインデックスブロック
+//   以降に書いたデータブロックの一覧。
+//    +00 uint64		ひとつ前のインデックスブロックのオフセット (なければ 0)
+//    +08 uint64[2]		データブロックのオフセットと先頭の受信時刻、の繰り返し
+//   ファイルヘッダから後ろ向きにたどると全データブロックの位置が分かる。
+//   最後のインデックスより後ろのブロックは順に読んで探す。
+//
+//   数値はすべてリトルエンディアン。
+
+#include "sayaka.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "missing_endian.h"
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#define RECORD_MAGIC		"SAYAKARC"
+#define RECORD_VERSION		(1)
+
+#define BLOCK_DATA			(0x41544144)	// "DATA"
+#define BLOCK_INDEX			(0x58444e49)	// "INDX"
+
+// JSONL 形式はこの間隔でファイルに書き出す。
+#define RECORD_FLUSH_USEC	(1 * 1000 * 1000)
+// 圧縮形式はこの間隔かこの大きさでブロックを閉じて書き出す。
+// (小さすぎると圧縮が効かない)
+#define RECORD_BLOCK_USEC	(10 * 1000 * 1000)
+#define RECORD_BLOCK_SIZE	(64 * 1024)
+// データブロックこれだけごとにインデックスブロックを書く。
+#define RECORD_INDEX_BLOCKS	(64)
+// stdio のバッファサイズ。
+#define RECORD_BUFSIZE		(64 * 1024)
+
+struct record_header {
+	char magic[8];
+	uint32 version;
+	uint32 reserved;
+	uint64 index;
+};
+
+struct record_block {
+	uint32 type;
+	uint32 len;
+	uint32 rawlen;
+	uint32 count;
+	uint64 ts;
+};
+
+struct recorder {
+	FILE *fp;
+	uint format;
+	uint64 last_flush;		// 最後に書き出した時刻
+
+	// ここから圧縮形式のみ。
+	string *raw;			// 圧縮前のレコード
+	uint count;				// raw 中のレコード数
+	uint64 first_ts;		// raw の先頭レコードの受信時刻
+	uint64 last_index;		// 最後に書いたインデックスブロックのオフセット
+	uint nindex;			// 次のインデックスに載せるデータブロック数
+	uint64 index[RECORD_INDEX_BLOCKS * 2];
+	uint8 *zbuf;
+	uint zbufsize;
+};
+
+struct playback {
+	FILE *fp;
+	bool need_close;
+	uint format;
+
+	// ここから圧縮形式のみ。
+	uint8 *raw;				// 展開済みのデータブロック
+	uint rawsize;			// raw の確保サイズ
+	uint rawlen;			// raw の有効バイト数
+	uint pos;				// raw の次に読む位置
+	uint8 *zbuf;
+	uint zbufsize;
+};
+
+#if defined(HAVE_ZLIB)
+static bool recorder_scan(struct recorder *);
+#endif
+static bool recorder_write_block(struct recorder *);
+static bool recorder_write_index(struct recorder *);
+static bool playback_load_block(struct playback *);
+#if defined(HAVE_ZLIB)
+static bool realloc_buf(uint8 **, uint *, uint);
+#endif
+
+// 録画用に filename を開く。
+// format は RECORD_JSONL か RECORD_DEFLATE。
+// 既存のファイルには追記する。
+// 失敗すればメッセージを表示して NULL を返す。
+struct recorder *
+recorder_open(const char *filename, uint format)
+{
+	struct recorder *rec = calloc(1, sizeof(*rec));
+	if (rec == NULL) {
+		warn("%s", __func__);
+		return NULL;
+	}
+	rec->format = format;
+
+	if (format == RECORD_JSONL) {
+		rec->fp = fopen(filename, "a");
+		if (rec->fp == NULL) {
+			warn("%s", filename);
+			goto abort;
+		}
+		setvbuf(rec->fp, NULL, _IOFBF, RECORD_BUFSIZE);
+	} else {
+#if defined(HAVE_ZLIB)
+		// インデックスの位置を書き戻すので追記モードでは開けない。
+		int fd = open(filename, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			warn("%s", filename);
+			goto abort;
+		}
+		rec->fp = fdopen(fd, "r+");
+		if (rec->fp == NULL) {
+			warn("%s", filename);
+			close(fd);
+			goto abort;
+		}
+		// setvbuf() は最初の入出力より前でないといけない。
+		setvbuf(rec->fp, NULL, _IOFBF, RECORD_BUFSIZE);
+		if (recorder_scan(rec) == false) {
+			warnx("%s: Not a compressed recording file", filename);
+			goto abort;
+		}
+		rec->raw = string_alloc(RECORD_BLOCK_SIZE);
+#else
+		warnx("%s: compressed format not compiled", __func__);
+		goto abort;
+#endif
+	}
+
+	return rec;
+
+ abort:
+	if (rec->fp) {
+		fclose(rec->fp);
+	}
+	free(rec);
+	return NULL;
+}
+
+#if defined(HAVE_ZLIB)
+// 圧縮形式の既存ファイルを調べて、追記できるよう末尾に移動する。
+// 空ファイルならファイルヘッダを書く。
+// 末尾が書きかけ (録画中に落ちたとか) なら切り詰める。
+// 圧縮形式のファイルでなければ false を返す。
+static bool
+recorder_scan(struct recorder *rec)
+{
+	struct record_header hdr;
+	struct record_block blk;
+	off_t filesize;
+	off_t pos;
+
+	if (fseeko(rec->fp, 0, SEEK_END) < 0) {
+		return false;
+	}
+	filesize = ftello(rec->fp);
+	if (filesize == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+		hdr.version = htole32(RECORD_VERSION);
+		if (fwrite(&hdr, sizeof(hdr), 1, rec->fp) != 1) {
+			return false;
+		}
+		return true;
+	}
+
+	rewind(rec->fp);
+	if (fread(&hdr, sizeof(hdr), 1, rec->fp) != 1 ||
+		memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0 ||
+		le32toh(hdr.version) != RECORD_VERSION)
+	{
+		return false;
+	}
+
+	// ブロックヘッダだけたどる。
+	pos = sizeof(hdr);
+	while (fread(&blk, sizeof(blk), 1, rec->fp) == 1) {
+		uint32 type = le32toh(blk.type);
+		off_t next = pos + sizeof(blk) + le32toh(blk.len);
+		if ((type != BLOCK_DATA && type != BLOCK_INDEX) || next > filesize) {
+			break;
+		}
+		if (type == BLOCK_DATA) {
+			// 入り切らない分はインデックスに載らないが、
+			// 再生側は順に読んで見付けるので問題ない。
+			if (rec->nindex < RECORD_INDEX_BLOCKS) {
+				rec->index[rec->nindex * 2 + 0] = pos;
+				rec->index[rec->nindex * 2 + 1] = le64toh(blk.ts);
+				rec->nindex++;
+			}
+		} else {
+			rec->last_index = pos;
+			rec->nindex = 0;
+		}
+		pos = next;
+		if (fseeko(rec->fp, pos, SEEK_SET) < 0) {
+			return false;
+		}
+	}
+
+	if (pos < filesize) {
+		warnx("%s: truncate broken block at %jd", __func__, (intmax_t)pos);
+		if (ftruncate(fileno(rec->fp), pos) < 0) {
+			return false;
+		}
+	}
+	if (fseeko(rec->fp, pos, SEEK_SET) < 0) {
+		return false;
+	}
+	return true;
+}
+#endif
+
+// 受信時刻 ts (UNIX 時刻の usec) に受信したメッセージ msg を録画する。
+// 書き出しは一定時間 (か一定量) ごとにまとめて行う。
+// 何も受信しない間の書き出しは recorder_flush() で行う。
+void
+recorder_write(struct recorder *rec, const string *msg, uint64 ts)
+{
+	assert(rec);
+
+	if (rec->format == RECORD_JSONL) {
+		fwrite(string_get(msg), 1, string_len(msg), rec->fp);
+		fputc('\n', rec->fp);
+		recorder_flush(rec, ts);
+		return;
+	}
+
+	if (rec->count == 0) {
+		rec->first_ts = ts;
+	}
+	uint64 ts_le = htole64(ts);
+	uint32 len_le = htole32(string_len(msg));
+	string_append_mem(rec->raw, &ts_le, sizeof(ts_le));
+	string_append_mem(rec->raw, &len_le, sizeof(len_le));
+	string_append_mem(rec->raw, string_get(msg), string_len(msg));
+	rec->count++;
+
+	if (string_len(rec->raw) >= RECORD_BLOCK_SIZE) {
+		recorder_write_block(rec);
+	} else {
+		recorder_flush(rec, ts);
+	}
+}
+
+// 現在時刻 ts (UNIX 時刻の usec) の時点で書き出す時期が来ていれば
+// 溜まっているものを書き出す。
+// 受信がなくても残らないよう、受信とは別に定期的に呼び出すこと。
+void
+recorder_flush(struct recorder *rec, uint64 ts)
+{
+	assert(rec);
+
+	if (rec->format == RECORD_JSONL) {
+		if (ts - rec->last_flush >= RECORD_FLUSH_USEC) {
+			fflush(rec->fp);
+			rec->last_flush = ts;
+		}
+	} else {
+		if (rec->count != 0 && ts - rec->first_ts >= RECORD_BLOCK_USEC) {
+			recorder_write_block(rec);
+		}
+	}
+}
+
+// 溜まっているレコードをデータブロックにして書き出す。
+static bool
+recorder_write_block(struct recorder *rec)
+{
+#if defined(HAVE_ZLIB)
+	struct record_block blk;
+
+	if (rec->count == 0) {
+		return true;
+	}
+
+	uint rawlen = string_len(rec->raw);
+	uLongf zlen = compressBound(rawlen);
+	if (realloc_buf(&rec->zbuf, &rec->zbufsize, zlen) == false) {
+		warn("%s", __func__);
+		return false;
+	}
+	// 受信処理の途中で行うので圧縮率より速度優先。
+	int r = compress2(rec->zbuf, &zlen, (const Bytef *)string_get(rec->raw),
+		rawlen, Z_BEST_SPEED);
+	if (r != Z_OK) {
+		warnx("%s: compress2 failed: %d", __func__, r);
+		return false;
+	}
+
+	off_t pos = ftello(rec->fp);
+	blk.type   = htole32(BLOCK_DATA);
+	blk.len    = htole32(zlen);
+	blk.rawlen = htole32(rawlen);
+	blk.count  = htole32(rec->count);
+	blk.ts     = htole64(rec->first_ts);
+	if (fwrite(&blk, sizeof(blk), 1, rec->fp) != 1 ||
+		fwrite(rec->zbuf, zlen, 1, rec->fp) != 1)
+	{
+		warn("%s", __func__);
+		return false;
+	}
+
+	rec->index[rec->nindex * 2 + 0] = pos;
+	rec->index[rec->nindex * 2 + 1] = rec->first_ts;
+	rec->nindex++;
+	string_clear(rec->raw);
+	rec->count = 0;
+
+	if (rec->nindex >= RECORD_INDEX_BLOCKS) {
+		return recorder_write_index(rec);
+	}
+	fflush(rec->fp);
+	return true;
+#else
+	return false;
+#endif
+}
+
+// インデックスブロックを書き出し、ファイルヘッダからたどれるようにする。
+static bool
+recorder_write_index(struct recorder *rec)
+{
+	struct record_block blk;
+	uint64 prev;
+
+	if (rec->nindex == 0) {
+		return true;
+	}
+
+	off_t pos = ftello(rec->fp);
+	uint len = sizeof(prev) + rec->nindex * 2 * sizeof(rec->index[0]);
+	blk.type   = htole32(BLOCK_INDEX);
+	blk.len    = htole32(len);
+	blk.rawlen = htole32(len);
+	blk.count  = htole32(rec->nindex);
+	blk.ts     = htole64(rec->index[1]);
+	prev = htole64(rec->last_index);
+	for (uint i = 0; i < rec->nindex * 2; i++) {
+		rec->index[i] = htole64(rec->index[i]);
+	}
+	if (fwrite(&blk, sizeof(blk), 1, rec->fp) != 1 ||
+		fwrite(&prev, sizeof(prev), 1, rec->fp) != 1 ||
+		fwrite(rec->index, sizeof(rec->index[0]), rec->nindex * 2, rec->fp)
+			!= rec->nindex * 2)
+	{
+		warn("%s", __func__);
+		return false;
+	}
+	rec->nindex = 0;
+	rec->last_index = pos;
+
+	// 本体が書けてからヘッダを更新する。
+	// pwrite() はファイルオフセットを動かさないので stdio と混ぜてよい。
+	if (fflush(rec->fp) != 0) {
+		warn("%s", __func__);
+		return false;
+	}
+	uint64 index_le = htole64(pos);
+	if (pwrite(fileno(rec->fp), &index_le, sizeof(index_le),
+			offsetof(struct record_header, index)) != sizeof(index_le))
+	{
+		warn("%s", __func__);
+		return false;
+	}
+	return true;
+}
+
+// 残りを書き出して録画を終了する。
+void
+recorder_close(struct recorder *rec)
+{
+	if (rec) {
+		if (rec->format != RECORD_JSONL) {
+			recorder_write_block(rec);
+			recorder_write_index(rec);
+			string_free(rec->raw);
+			free(rec->zbuf);
+		}
+		fclose(rec->fp);
+		free(rec);
+	}
+}
+
+// 再生用に filename を開く。NULL なら標準入力から読む。
+// 形式は自動判別する。
+// 失敗すればメッセージを表示して NULL を返す。
+struct playback *
+playback_open(const char *filename)
+{
+	struct playback *pb = calloc(1, sizeof(*pb));
+	if (pb == NULL) {
+		warn("%s", __func__);
+		return NULL;
+	}
+
+	if (filename == NULL) {
+		pb->fp = stdin;
+		filename = "stdin";
+	} else {
+		pb->fp = fopen(filename, "r");
+		if (pb->fp == NULL) {
+			warn("%s", filename);
+			goto abort;
+		}
+		pb->need_close = true;
+	}
+
+	// JSONL は '{' で始まるはずなので 1文字目だけで区別できる
+	// (標準入力だと何文字も読み戻せないため)。
+	int c = getc(pb->fp);
+	if (c == RECORD_MAGIC[0]) {
+		struct record_header hdr;
+
+		ungetc(c, pb->fp);
+		if (fread(&hdr, sizeof(hdr), 1, pb->fp) != 1 ||
+			memcmp(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic)) != 0 ||
+			le32toh(hdr.version) != RECORD_VERSION)
+		{
+			warnx("%s: Unknown file format", filename);
+			goto abort;
+		}
+#if defined(HAVE_ZLIB)
+		pb->format = RECORD_DEFLATE;
+#else
+		warnx("%s: compressed format not compiled", filename);
+		goto abort;
+#endif
+	} else {
+		if (c != EOF) {
+			ungetc(c, pb->fp);
+		}
+		pb->format = RECORD_JSONL;
+	}
+
+	return pb;
+
+ abort:
+	if (pb->need_close && pb->fp) {
+		fclose(pb->fp);
+	}
+	free(pb);
+	return NULL;
+}
+
+// 次のメッセージを返す。EOF なら NULL を返す。
+// tsp が NULL でなければ受信時刻 (UNIX 時刻の usec) を格納する。
+// JSONL 形式には受信時刻がないので 0 になる。
+string *
+playback_read(struct playback *pb, uint64 *tsp)
+{
+	assert(pb);
+
+	if (pb->format == RECORD_JSONL) {
+		if (tsp) {
+			*tsp = 0;
+		}
+		return string_fgets(pb->fp);
+	}
+
+	while (pb->pos >= pb->rawlen) {
+		if (playback_load_block(pb) == false) {
+			return NULL;
+		}
+	}
+
+	uint64 ts_le;
+	uint32 len_le;
+	if (pb->pos + sizeof(ts_le) + sizeof(len_le) > pb->rawlen) {
+		goto broken;
+	}
+	memcpy(&ts_le, pb->raw + pb->pos, sizeof(ts_le));
+	pb->pos += sizeof(ts_le);
+	memcpy(&len_le, pb->raw + pb->pos, sizeof(len_le));
+	pb->pos += sizeof(len_le);
+	uint32 len = le32toh(len_le);
+	if (len > pb->rawlen - pb->pos) {
+		goto broken;
+	}
+	string *s = string_from_mem(pb->raw + pb->pos, len);
+	pb->pos += len;
+	if (tsp) {
+		*tsp = le64toh(ts_le);
+	}
+	return s;
+
+ broken:
+	warnx("%s: broken record", __func__);
+	pb->pos = pb->rawlen;
+	return NULL;
+}
+
+// 次のデータブロックを読み込んで展開する。
+// インデックスブロックは読み飛ばす。
+// EOF かエラーなら false を返す。
+static bool
+playback_load_block(struct playback *pb)
+{
+#if defined(HAVE_ZLIB)
+	struct record_block blk;
+
+	for (;;) {
+		if (fread(&blk, sizeof(blk), 1, pb->fp) != 1) {
+			return false;
+		}
+		uint32 type = le32toh(blk.type);
+		uint32 len = le32toh(blk.len);
+		if (type == BLOCK_DATA) {
+			break;
+		}
+		if (type != BLOCK_INDEX) {
+			warnx("%s: unknown block type 0x%08x", __func__, type);
+			return false;
+		}
+		// シーク出来ないかもしれないので読み捨てる。
+		if (realloc_buf(&pb->zbuf, &pb->zbufsize, len) == false ||
+			(len != 0 && fread(pb->zbuf, len, 1, pb->fp) != 1))
+		{
+			return false;
+		}
+	}
+
+	uint32 len = le32toh(blk.len);
+	uLongf rawlen = le32toh(blk.rawlen);
+	if (realloc_buf(&pb->zbuf, &pb->zbufsize, len) == false ||
+		realloc_buf(&pb->raw, &pb->rawsize, rawlen) == false)
+	{
+		warn("%s", __func__);
+		return false;
+	}
+	if (fread(pb->zbuf, len, 1, pb->fp) != 1) {
+		warnx("%s: truncated block", __func__);
+		return false;
+	}
+	int r = uncompress(pb->raw, &rawlen, pb->zbuf, len);
+	if (r != Z_OK) {
+		warnx("%s: uncompress failed: %d", __func__, r);
+		return false;
+	}
+	pb->rawlen = rawlen;
+	pb->pos = 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// 受信時刻が ts (UNIX 時刻の usec) 以降である最初のメッセージに移動する。
+// 圧縮形式のシーク可能なファイルでのみ使える。
+// 移動できなければ false を返す。
+bool
+playback_seek(struct playback *pb, uint64 ts)
+{
+	struct record_header hdr;
+	struct record_block blk;
+	off_t start;
+
+	assert(pb);
+
+	if (pb->format != RECORD_DEFLATE) {
+		return false;
+	}
+	if (fseeko(pb->fp, 0, SEEK_SET) < 0 ||
+		fread(&hdr, sizeof(hdr), 1, pb->fp) != 1)
+	{
+		return false;
+	}
+
+	// インデックスを後ろからたどって、先頭時刻が ts 以前である
+	// 最後のデータブロックを探す。
+	start = sizeof(hdr);
+	for (off_t idx = le64toh(hdr.index); idx != 0; ) {
+		uint64 prev;
+		if (fseeko(pb->fp, idx, SEEK_SET) < 0 ||
+			fread(&blk, sizeof(blk), 1, pb->fp) != 1 ||
+			le32toh(blk.type) != BLOCK_INDEX ||
+			fread(&prev, sizeof(prev), 1, pb->fp) != 1)
+		{
+			warnx("%s: broken index at %jd", __func__, (intmax_t)idx);
+			start = sizeof(hdr);
+			break;
+		}
+		uint count = le32toh(blk.count);
+		if (count == 0 || le64toh(blk.ts) > ts) {
+			idx = le64toh(prev);
+			continue;
+		}
+		for (uint i = 0; i < count; i++) {
+			uint64 ent[2];
+			if (fread(ent, sizeof(ent), 1, pb->fp) != 1) {
+				break;
+			}
+			if (le64toh(ent[1]) > ts) {
+				break;
+			}
+			start = le64toh(ent[0]);
+		}
+		break;
+	}
+
+	// そこから (インデックスに載っていない分も含めて) 順にたどる。
+	off_t pos = start;
+	off_t found = start;
+	for (;;) {
+		if (fseeko(pb->fp, pos, SEEK_SET) < 0 ||
+			fread(&blk, sizeof(blk), 1, pb->fp) != 1)
+		{
+			break;
+		}
+		if (le32toh(blk.type) == BLOCK_DATA) {
+			if (le64toh(blk.ts) > ts) {
+				break;
+			}
+			found = pos;
+		}
+		pos += sizeof(blk) + le32toh(blk.len);
+	}
+
+	// ブロック内で ts 以降のレコードまで進める。
+	if (fseeko(pb->fp, found, SEEK_SET) < 0) {
+		return false;
+	}
+	pb->rawlen = 0;
+	pb->pos = 0;
+	for (;;) {
+		while (pb->pos >= pb->rawlen) {
+			if (playback_load_block(pb) == false) {
+				// ts 以降のメッセージはない。
+				return true;
+			}
+		}
+		uint64 ts_le;
+		uint32 len_le;
+		if (pb->pos + sizeof(ts_le) + sizeof(len_le) > pb->rawlen) {
+			return false;
+		}
+		memcpy(&ts_le, pb->raw + pb->pos, sizeof(ts_le));
+		if (le64toh(ts_le) >= ts) {
+			return true;
+		}
+		memcpy(&len_le, pb->raw + pb->pos + sizeof(ts_le), sizeof(len_le));
+		pb->pos += sizeof(ts_le) + sizeof(len_le) + le32toh(len_le);
+	}
+}
+
+// 再生を終了する。
+void
+playback_close(struct playback *pb)
+{
+	if (pb) {
+		if (pb->need_close) {
+			fclose(pb->fp);
+		}
+		free(pb->raw);
+		free(pb->zbuf);
+		free(pb);
+	}
+}
+
+#if defined(HAVE_ZLIB)
+// *bufp (確保サイズ *sizep) を size バイト以上にする。
+static bool
+realloc_buf(uint8 **bufp, uint *sizep, uint size)
+{
+	if (size > *sizep) {
+		uint8 *newbuf = realloc(*bufp, size);
+		if (newbuf == NULL) {
+			return false;
+		}
+		*bufp = newbuf;
+		*sizep = size;
+	}
+	return true;
+}
+#endif
@@ -69,6 +69,9 @@ static void init_screen(void);
 static void init_ngword(void);
 static void invalidate_cache(void);
 static string *get_token(const char *);
+static void add_source(const char *, uint, const char *);
+static void parse_source(const char *);
+static void netstat_summary(void);
 static void signal_handler(int);
 static void sigwinch(bool);
 
@@ -94,6 +97,7 @@ bool in_sixel;						// SIXEL 出力中か。
 struct net_opt netopt_image;		// 画像ダウンロード用ネットワークオプション
 struct net_opt netopt_main;			// メインストリーム用ネットワークオプション
 struct ngwords *ngwords;			// NG ワード集
+bool opt_bench;						// 再生をベンチマークモードで行う
 int opt_bgtheme;					// -1:自動判別 0:Dark 1:Light
 const char *opt_codeset;			// 出力文字コード (NULL なら UTF-8)
 static uint opt_fontwidth;			// --font 指定の幅   (指定なしなら 0)
@@ -101,14 +105,23 @@ static uint opt_fontheight;			// --font 指定の高さ (指定なしなら 0)
 bool opt_force_blurhash;			// 画像はすべて Blurhash から表示する
 uint opt_nsfw;						// NSFW コンテンツの表示方法
 bool opt_overwrite_cache;			// キャッシュファイルを更新する
+uint opt_play_jobs;					// 再生の並列数 (0 なら CPU 数)
+double opt_play_speed;				// 再生速度 (0 なら待たずに再生)
+uint64 opt_play_start;				// 再生開始位置 (先頭からの usec)
 static bool opt_progress;
+// ストリームの接続元。
+static struct misskey_source sources[MISSKEY_SOURCE_MAX];
+static uint nsources;
 const char *opt_record_file;		// 録画ファイル名 (NULL なら録画しない)
+uint opt_record_format;				// 録画ファイルの形式
 bool opt_show_cw;					// CW を表示するか。
 int opt_show_image;					// -1:自動判別 0:出力しない 1:出力する
 uint screen_cols;					// 画面の桁数
+static volatile sig_atomic_t netstat_requested;	// SIGUSR1 を受けた
 
 enum {
 	OPT__start = 0x7f,
+	OPT_bench,
 	OPT_ciphers,
 	OPT_dark,
 	OPT_debug_format,
@@ -135,14 +148,20 @@ enum {
 	OPT_no_image,	// backward compatibility
 	OPT_nsfw,
 	OPT_overwrite_cache,
+	OPT_play_jobs,
+	OPT_play_speed,
+	OPT_play_start,
 	OPT_progress,
+	OPT_record_format,
 	OPT_show_cw,
 	OPT_show_image,
 	OPT_sixel_or,
+	OPT_source,
 	OPT_timeout_image,
 };
 
 static const struct option longopts[] = {
+	{ "bench",			no_argument,		NULL,	OPT_bench },
 	{ "ciphers",		required_argument,	NULL,	OPT_ciphers },
 	{ "color",			required_argument,	NULL,	'c' },
 	{ "dark",			no_argument,		NULL,	OPT_dark },
@@ -173,12 +192,17 @@ static const struct option longopts[] = {
 	{ "nsfw",			required_argument,	NULL,	OPT_nsfw },
 	{ "overwrite-cache",no_argument,		NULL,	OPT_overwrite_cache },
 	{ "play",			required_argument,	NULL,	'p' },
+	{ "play-jobs",		required_argument,	NULL,	OPT_play_jobs },
+	{ "play-speed",		required_argument,	NULL,	OPT_play_speed },
+	{ "play-start",		required_argument,	NULL,	OPT_play_start },
 	{ "progress",		no_argument,		NULL,	OPT_progress },
 	{ "record",			required_argument,	NULL,	'r' },
+	{ "record-format",	required_argument,	NULL,	OPT_record_format },
 	{ "server",			required_argument,	NULL,	's' },
 	{ "show-cw",		no_argument,		NULL,	OPT_show_cw },
 	{ "show-image",		required_argument,	NULL,	OPT_show_image },
 	{ "sixel-or",		no_argument,		NULL,	OPT_sixel_or },
+	{ "source",			required_argument,	NULL,	OPT_source },
 	{ "timeout-image",	required_argument,	NULL,	OPT_timeout_image },
 	{ "token",			required_argument,	NULL,	't' },
 	{ "version",		no_argument,		NULL,	'v' },
@@ -193,6 +217,19 @@ static const struct optmap map_nsfw[] = {
 	{ NULL },
 };
 
+static const struct optmap map_channel[] = {
+	{ "local",		MISSKEY_CHANNEL_LOCAL },
+	{ "home",		MISSKEY_CHANNEL_HOME },
+	{ "main",		MISSKEY_CHANNEL_MAIN },
+	{ NULL },
+};
+
+static const struct optmap map_record_format[] = {
+	{ "jsonl",		RECORD_JSONL },
+	{ "deflate",	RECORD_DEFLATE },
+	{ NULL },
+};
+
 #define SET_DIAG_LEVEL(name)	\
 	 {	\
 		int lv = stou32def(optarg, -1, NULL);	\
@@ -230,7 +267,9 @@ main(int ac, char *av[])
 	opt_fontwidth = 0;
 	opt_fontheight = 0;
 	opt_nsfw = NSFW_BLUR;
+	opt_play_jobs = 1;
 	opt_progress = false;
+	opt_record_format = RECORD_JSONL;
 	opt_show_image = -1;
 	token_file = NULL;
 	server = NULL;
@@ -241,6 +280,10 @@ main(int ac, char *av[])
 
 	while ((c = getopt_long(ac, av, "c:hlp:r:s:t:v", longopts, NULL)) != -1) {
 		switch (c) {
+		 case OPT_bench:
+			opt_bench = true;
+			break;
+
 		 case 'c':
 			// ここは元々色数を指定しているのではなく、色モード指定。
 			// -c 2 は、画像はモノクロで、テキストはボールドのみ飾り付けを行う。
@@ -428,6 +471,36 @@ main(int ac, char *av[])
 			cmd = CMD_PLAY;
 			break;
 
+		 case OPT_play_jobs:
+			opt_play_jobs = stou32def(optarg, -1, NULL);
+			if ((int)opt_play_jobs < 0) {
+				errx(1, "--play-jobs %s: invalid number", optarg);
+			}
+			break;
+
+		 case OPT_play_speed:
+		 {
+			// 1 なら録画時と同じ間隔、2 なら倍速。0 なら待たない。
+			char *end;
+			opt_play_speed = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || opt_play_speed < 0) {
+				errx(1, "--play-speed %s: invalid speed", optarg);
+			}
+			break;
+		 }
+
+		 case OPT_play_start:
+		 {
+			// 最初のメッセージから何秒後のところから再生するか。
+			char *end;
+			double sec = strtod(optarg, &end);
+			if (end == optarg || *end != '\0' || sec < 0) {
+				errx(1, "--play-start %s: invalid seconds", optarg);
+			}
+			opt_play_start = (uint64)(sec * 1000000);
+			break;
+		 }
+
 		 case OPT_progress:
 			opt_progress = true;
 			break;
@@ -436,6 +509,14 @@ main(int ac, char *av[])
 			opt_record_file = optarg;
 			break;
 
+		 case OPT_record_format:
+			opt_record_format = parse_optmap(map_record_format, optarg);
+			if ((int)opt_record_format < 0) {
+				errx(1, "--record-format %s: must be 'jsonl' or 'deflate'",
+					optarg);
+			}
+			break;
+
 		 case 's':
 			server = optarg;
 			break;
@@ -461,6 +542,11 @@ main(int ac, char *av[])
 			imageopt.output_ormode = true;
 			break;
 
+		 case OPT_source:
+			parse_source(optarg);
+			cmd = CMD_STREAM;
+			break;
+
 		 case 't':
 			token_file = optarg;
 			break;
@@ -497,21 +583,23 @@ main(int ac, char *av[])
 	}
 
 	if (cmd == CMD_STREAM || cmd == CMD_PLAY) {
+		// --debug-net なら終了時にネットワークの統計を表示する。
+		if (diag_get_level(diag_net) >= 1) {
+			atexit(netstat_summary);
+		}
+
 		init_ngword();
 		init_screen();
 
 		if (cmd == CMD_STREAM) {
-			if (server == NULL) {
-				errx(1, "server must be specified");
+			// --server (と --home/--local、--token) もあれば接続元に加える。
+			if (server) {
+				add_source(server,
+					is_home ? MISSKEY_CHANNEL_HOME : MISSKEY_CHANNEL_LOCAL,
+					token_file);
 			}
-
-			string *token_str = NULL;
-			const char *token = NULL;
-			if (token_file) {
-				token_str = get_token(token_file);
-				token = string_get(token_str);
-			} else if (is_home) {
-				errx(1, "Home timeline requires your access token");
+			if (nsources == 0) {
+				errx(1, "server must be specified");
 			}
 
 			// 古いキャッシュを削除する。
@@ -519,7 +607,7 @@ main(int ac, char *av[])
 			invalidate_cache();
 			progress("done\n");
 
-			cmd_misskey_stream(server, is_home, token);
+			cmd_misskey_stream(sources, nsources);
 		} else {
 			cmd_misskey_play(playfile);
 		}
@@ -554,6 +642,7 @@ usage(void)
 "  -h,--home           : Home timeline mode (needs --server and --token)\n"
 "  -l,--local          : Local timeline mode (needs --server)\n"
 "  -p,--play=<file|->  : Playback mode\n"
+"  --source=<server>[,<channel>[,<tokenfile>]] : Add a stream source\n"
 " <options>\n"
 "  -s,--server=<host>  : Set misskey server\n"
 "  -t,--token=<file>   : Set misskey access token file\n"
@@ -575,7 +664,11 @@ help_all(void)
 "  -h,--home              : Home timeline mode (needs --server and --token)\n"
 "  -l,--local             : Local timeline mode (needs --server)\n"
 "  -p,--play=<file|->     : Playback mode ('-' means stdin)\n"
+"  --source=<server>[,<channel>[,<tokenfile>]]\n"
+"                         : Add a stream source (can be repeated)\n"
+"     <channel> is one of 'local' (default), 'home' or 'main'\n"
 " <options>\n"
+"  --bench                : Don't output but show statistics (with --play)\n"
 "  -c,--color=<colormode> : Set color mode (default:256)\n"
 "     256      : Fixed 256 colors (MSX SCREEN8 compatible palette)\n"
 "     16       : Fixed ANSI compatible 16 colors\n"
@@ -605,8 +698,17 @@ help_all(void)
 "     alt      : Hide image but display only filetype\n"
 "     hide     : Hide this note itself if the note has NSFW contents\n"
 "  --overwrite-cache      : Don't use cache file and overwrite it by new one\n"
+"  --play-jobs=<n>        : Render ahead in <n> processes with --play\n"
+"                           0 means number of CPUs (default:1)\n"
+"  --play-speed=<x>       : Reproduce recorded intervals at <x> times speed\n"
+"                           0 means no wait (default:0)\n"
+"  --play-start=<sec>     : Start playback <sec> seconds after the first\n"
+"                           message (compressed recording only)\n"
 "  --progress             : Show startup progress (for slow machines)\n"
 "  -r,--record=<file>     : Record JSON to <file>\n"
+"  --record-format=<fmt>  : Record file format (default:jsonl)\n"
+"     jsonl    : One JSON per line\n"
+"     deflate  : Compressed blocks with timestamps and index\n"
 "  -s,--server=<host>     : Set misskey server\n"
 "  --sixel-or             : Output SIXEL by OR-mode\n"
 "  --show-cw              : Open CW(Contents Warning) part\n"
@@ -706,7 +808,7 @@ init_ngword(void)
 	char filename[PATH_MAX];
 
 	snprintf(filename, sizeof(filename), "%s/ngword.json", basedir);
-	ngwords = ngword_read_file(filename, diag_format/*?*/);
+	ngwords = ngword_read_file(filename, diag_json);
 }
 
 // 表示周りの初期化。
@@ -849,6 +951,82 @@ get_token(const char *filename)
 	return token;
 }
 
+// 接続元を追加する。
+// token_file はアクセストークンファイル名。なければ NULL を指定する。
+static void
+add_source(const char *server, uint channel, const char *token_file)
+{
+	if (nsources >= countof(sources)) {
+		errx(1, "Too many sources (max %u)", (uint)countof(sources));
+	}
+
+	struct misskey_source *src = &sources[nsources++];
+	src->server = server;
+	src->channel = channel;
+	src->token = NULL;
+	if (token_file) {
+		// 接続中ずっと使うので解放しない。
+		string *token = get_token(token_file);
+		src->token = string_get(token);
+	} else if (channel == MISSKEY_CHANNEL_HOME) {
+		errx(1, "Home timeline requires your access token");
+	} else if (channel == MISSKEY_CHANNEL_MAIN) {
+		errx(1, "Main channel requires your access token");
+	}
+}
+
+// --source の引数 "<server>[,<channel>[,<tokenfile>]]" を解析して
+// 接続元に追加する。<channel> を省略すると local。
+static void
+parse_source(const char *arg)
+{
+	char *buf = strdup(arg);
+	if (buf == NULL) {
+		err(1, "%s: strdup", __func__);
+	}
+
+	const char *server = buf;
+	const char *token_file = NULL;
+	uint channel = MISSKEY_CHANNEL_LOCAL;
+	char *p = strchr(buf, ',');
+	if (p) {
+		*p++ = '\0';
+		char *q = strchr(p, ',');
+		if (q) {
+			*q++ = '\0';
+			token_file = q;
+		}
+		channel = parse_optmap(map_channel, p);
+		if ((int)channel < 0) {
+			errx(1, "--source %s: channel must be 'local', 'home', or 'main'",
+				arg);
+		}
+	}
+	if (server[0] == '\0') {
+		errx(1, "--source %s: server must be specified", arg);
+	}
+
+	// buf は server が指しているので解放しない。
+	add_source(server, channel, token_file);
+}
+
+// SIGUSR1 で要求されていればネットワークの統計を表示する。
+// シグナルハンドラの中では表示せず、メインループから呼ぶこと。
+void
+netstat_check_request(void)
+{
+	if (__predict_false(netstat_requested)) {
+		netstat_requested = 0;
+		netstat_dump(stderr);
+	}
+}
+
+static void
+netstat_summary(void)
+{
+	netstat_dump(stderr);
+}
+
 static void
 signal_handler(int signo)
 {
@@ -866,6 +1044,10 @@ signal_handler(int signo)
 		sigwinch(false);
 		break;
 
+	 case SIGUSR1:
+		netstat_requested = 1;
+		break;
+
 	 default:
 		warnx("caught signal %d", signo);
 		break;
@@ -66,12 +66,47 @@ struct ustring_ {
 	unichar *buf;	// len == 0 の時 buf を触らないこと。
 	uint len;		// 文字列の長さ ('\0' の位置)
 	uint capacity;	// 確保してあるバイト数
+	struct arena *arena;	// 確保元のアリーナ。ヒープなら NULL
 };
 typedef struct ustring_ ustring;
 
 // eaw_data.c
 extern const uint8 eaw2width_packed[0x8000];
 
+// bench.c
+enum {
+	BENCH_READ = 0,		// 録画ファイルの読み込み
+	BENCH_WAIT,			// 受信間隔の再現のための待ち
+	BENCH_JSON,			// JSON パース
+	BENCH_FORMAT,		// 整形と出力 (以下を除く)
+	BENCH_NG,			// NG ワード判定
+	BENCH_IMAGE,		// 画像の取得、デコード、減色
+	BENCH_SIXEL,		// SIXEL 変換と出力
+	BENCH_MAX,
+};
+extern bool bench_enabled;
+extern bool bench_start(void);
+extern uint bench_switch(uint);
+extern void bench_message(uint64);
+extern void bench_report(void);
+// 処理段階を stage に切り替え、元の段階を返す。
+// 戻す時はその値を bench_leave() に渡す。
+static inline uint
+bench_enter(uint stage)
+{
+	if (__predict_false(bench_enabled)) {
+		return bench_switch(stage);
+	}
+	return 0;
+}
+static inline void
+bench_leave(uint prev)
+{
+	if (__predict_false(bench_enabled)) {
+		bench_switch(prev);
+	}
+}
+
 // json.c
 extern struct json *json_create(const struct diag *);
 extern void json_destroy(struct json *);
@@ -110,8 +145,29 @@ extern const char *json_obj_find_cstr(const struct json *, int, const char *);
 // mathalpha.c
 extern unichar conv_mathalpha(unichar);
 
+// mfm.c
+struct tagset;
+extern struct tagset *mfm_tagset_create(const struct json *, int,
+	const struct diag *);
+extern void mfm_tagset_destroy(struct tagset *);
+extern ustring *mfm_display_text(const char *, const struct tagset *, bool,
+	const struct diag *);
+extern void mfm_set_style(const char *(*)(uint), const char *(*)(uint));
+
 // misskey.c
-extern void cmd_misskey_stream(const char *, bool, const char *);
+enum {
+	MISSKEY_CHANNEL_LOCAL,	// ローカルタイムライン
+	MISSKEY_CHANNEL_HOME,	// ホームタイムラインと通知
+	MISSKEY_CHANNEL_MAIN,	// 通知のみ
+};
+// ストリームの接続元。
+struct misskey_source {
+	const char *server;
+	const char *token;		// アクセストークン文字列。なければ NULL
+	uint channel;
+};
+#define MISSKEY_SOURCE_MAX	(16)
+extern void cmd_misskey_stream(const struct misskey_source *, uint);
 extern void cmd_misskey_play(const char *);
 
 // print.c
@@ -133,6 +189,25 @@ extern void ustring_append_ustring_style(ustring *, const ustring *, uint);
 extern void print_indent(uint);
 extern void iprint(const ustring *);
 extern bool show_image(const char *, const char *, uint, uint, bool, int);
+extern void image_prefetch_init(struct evloop *, void (*)(void));
+extern int  image_prefetch_add(const char *, const char *);
+extern bool image_prefetch_done(int);
+extern void image_prefetch_release(int);
+extern void image_prefetch_run(const int *, uint);
+
+// record.c
+#define RECORD_JSONL	(0)		// 1行1メッセージ (従来形式)
+#define RECORD_DEFLATE	(1)		// ブロック圧縮形式
+struct recorder;
+struct playback;
+extern struct recorder *recorder_open(const char *, uint);
+extern void recorder_write(struct recorder *, const string *, uint64);
+extern void recorder_flush(struct recorder *, uint64);
+extern void recorder_close(struct recorder *);
+extern struct playback *playback_open(const char *);
+extern string *playback_read(struct playback *, uint64 *);
+extern bool playback_seek(struct playback *, uint64);
+extern void playback_close(struct playback *);
 
 // sayaka.c
 extern const char *cachedir;
@@ -152,15 +227,21 @@ extern bool in_sixel;
 extern struct net_opt netopt_image;
 extern struct net_opt netopt_main;
 extern struct ngwords *ngwords;
+extern bool opt_bench;
 extern int opt_bgtheme;
 extern const char *opt_codeset;
 extern bool opt_force_blurhash;
 extern uint opt_nsfw;
 extern bool opt_overwrite_cache;
+extern uint opt_play_jobs;
+extern double opt_play_speed;
+extern uint64 opt_play_start;
 extern const char *opt_record_file;
+extern uint opt_record_format;
 extern bool opt_show_cw;
 extern int  opt_show_image;
 extern uint screen_cols;
+extern void netstat_check_request(void);
 
 // subr.c
 extern uint32 rnd_get32(void);
@@ -209,7 +290,13 @@ extern void wsclient_destroy(struct wsclient *);
 extern void wsclient_init(struct wsclient *, void (*)(const string *));
 extern int  wsclient_connect(struct wsclient *, const char *,
 	const struct net_opt *);
+extern int  wsclient_connect_async(struct wsclient *, const char *,
+	const struct net_opt *);
+extern int  wsclient_connect_step(struct wsclient *);
 extern int  wsclient_process(struct wsclient *);
+extern void wsclient_send_ping(struct wsclient *);
+extern int  wsclient_get_fd(const struct wsclient *);
+extern uint wsclient_get_want(const struct wsclient *);
 extern ssize_t wsclient_send_text(struct wsclient *, const char *);
 
 #endif // !sayaka_harada_h
@@ -469,6 +469,11 @@ main(int ac, char *av[])
 		}
 	}
 
+	// --debug-net なら最後にネットワークの統計を表示する。
+	if (diag_get_level(diag_net) >= 1) {
+		netstat_dump(stderr);
+	}
+
 	return rv;
 }
 
@@ -578,7 +583,6 @@ do_file(const char *infile)
 	struct image *srcimg = NULL;
 	struct image *resimg = NULL;
 	int ifd = -1;
-	FILE *ifp = NULL;
 	const char *infilename;	// 表示用
 	image_read_hint hint;
 	uint dst_width;
@@ -617,9 +621,9 @@ do_file(const char *infile)
 				code, httpclient_get_resmsg(http));
 			goto abort;
 		}
-		ifp = httpclient_fopen(http);
-		if (ifp == NULL) {
-			warn("%s: httpclient_fopen() failed", infilename);
+		pstream = httpclient_open_pstream(http);
+		if (pstream == NULL) {
+			warn("%s: httpclient_open_pstream() failed", infilename);
 			goto abort;
 		}
 	} else {
@@ -631,14 +635,8 @@ do_file(const char *infile)
 		}
 	}
 
-	// ifp or ifd からピークストリームを作成。
-	if (ifp) {
-		pstream = pstream_init_fp(ifp);
-		if (pstream == NULL) {
-			warn("%s: pstream_init_fp() failed", infilename);
-			goto abort;
-		}
-	} else {
+	// ifd からピークストリームを作成。
+	if (pstream == NULL) {
 		pstream = pstream_init_fd(ifd);
 		if (pstream == NULL) {
 			warn("%s: pstream_init_fd() failed", infilename);
@@ -799,9 +797,6 @@ do_file(const char *infile)
 	if (pstream) {
 		pstream_cleanup(pstream);
 	}
-	if (ifp) {
-		fclose(ifp);
-	}
 	if (ifd >= 3) {
 		close(ifd);
 	}
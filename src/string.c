@@ -76,7 +76,8 @@ string_dup(const string *old)
 	if (s == NULL) {
 		return NULL;
 	}
-	memcpy(s->buf, old->buf, len + 1);
+	// old が空なら old->buf は NULL かも知れない。
+	memcpy(s->buf, string_get(old), len + 1);
 	s->len = len;
 	return s;
 }
@@ -94,6 +95,7 @@ string_fgets(FILE *fp)
 	buflen = getline(&buf, &bufsize, fp);
 	if (buflen < 0) {
 		// EOF or error
+		free(buf);
 		return NULL;
 	}
 
@@ -102,9 +104,15 @@ string_fgets(FILE *fp)
 		free(buf);
 		return NULL;
 	}
-	s->buf = buf;
-	s->len = buflen;
-	s->capacity = bufsize;
+	if (s->arena) {
+		// アリーナ上の文字列にヒープのバッファは持たせられない。
+		string_append_mem(s, buf, buflen);
+		free(buf);
+	} else {
+		s->buf = buf;
+		s->len = buflen;
+		s->capacity = bufsize;
+	}
 
 	return s;
 }
@@ -155,10 +163,9 @@ string_equal_cstr(const string *s1, const char *cstr)
 	return (strcmp(string_get(s1), cstr) == 0);
 }
 
-// s を newlen 文字分が追加できるようブロック単位で拡大する。
+// s を newlen 文字分が追加できるよう拡大する。
 #define string_expand(s, newlen)	do {	\
-	uint newcap_ = roundup((s)->len + (newlen) + 1, 256);	\
-	if (__predict_false(string_realloc(s, newcap_) == false)) {	\
+	if (__predict_false(string_reserve(s, newlen) == false)) {	\
 		return;	\
 	}	\
 } while (0)
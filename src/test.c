@@ -25,13 +25,19 @@
  */
 
 #include "sayaka.h"
+#include "image_priv.h"
+#include "ngword.h"
 #include <err.h>
 #include <errno.h>
+#include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #define fail(fmt...)	do {	\
 	printf("%s: ", __func__);	\
@@ -39,6 +45,9 @@
 	printf("\n");	\
 } while(0)
 
+const char progname[] = "test";
+const char progver[]  = "0.0";
+
 static volatile int signaled;
 
 static void
@@ -138,6 +147,447 @@ test_decode_isotime(void)
 	}
 }
 
+static uint evloop_fd_count;
+static uint evloop_oneshot_count;
+static uint evloop_repeat_count;
+
+static void
+test_evloop_fd_cb(struct evloop *loop, int fd, uint revents, void *arg)
+{
+	char c;
+
+	evloop_fd_count++;
+	if ((revents & EV_READ) == 0) {
+		printf("test_evloop: revents=%x\n", revents);
+	}
+	if (read(fd, &c, 1) != 1 || c != 'x') {
+		printf("test_evloop: read failed\n");
+	}
+	// コールバック中に自分を削除できること。
+	evloop_del_fd(loop, fd);
+}
+
+static void
+test_evloop_oneshot_cb(struct evloop *loop, void *arg)
+{
+	evloop_oneshot_count++;
+}
+
+static void
+test_evloop_repeat_cb(struct evloop *loop, void *arg)
+{
+	evloop_repeat_count++;
+}
+
+static void
+test_evloop(void)
+{
+	printf("%s\n", __func__);
+
+	int fds[2];
+	if (pipe(fds) < 0) {
+		err(1, "%s: pipe", __func__);
+	}
+
+	struct diag *diag = diag_alloc();
+	struct evloop *loop = evloop_create(diag);
+	evloop_add_fd(loop, fds[0], EV_READ, test_evloop_fd_cb, NULL);
+	uint oneshot = evloop_add_timer(loop, 20, 0, test_evloop_oneshot_cb, NULL);
+	uint repeat = evloop_add_timer(loop, 5, 5, test_evloop_repeat_cb, NULL);
+	if (oneshot == 0 || repeat == 0 || oneshot == repeat) {
+		fail("timer id: oneshot=%u repeat=%u", oneshot, repeat);
+	}
+
+	// 何も起きていなければ何も呼ばれない。
+	int n = evloop_run_once(loop, 0);
+	if (n != 0) {
+		fail("idle: expects 0 but %d", n);
+	}
+
+	// 読み込み可能になれば呼ばれる。
+	if (write(fds[1], "x", 1) != 1) {
+		err(1, "%s: write", __func__);
+	}
+	evloop_run_once(loop, -1);
+	if (evloop_fd_count != 1) {
+		fail("fd_count expects 1 but %u", evloop_fd_count);
+	}
+	if (evloop_count_fd(loop) != 0) {
+		fail("fd is not deleted");
+	}
+
+	// タイマー。fd がなくてもタイマーまでは待つ。
+	while (evloop_oneshot_count == 0) {
+		if (evloop_run_once(loop, -1) < 0) {
+			fail("evloop_run_once failed: %s", strerrno());
+			break;
+		}
+	}
+	if (evloop_repeat_count < 2) {
+		fail("repeat_count expects >= 2 but %u", evloop_repeat_count);
+	}
+
+	// 削除したタイマーはもう呼ばれない。1回きりのも2回は呼ばれない。
+	evloop_del_timer(loop, repeat);
+	uint prev = evloop_repeat_count;
+	evloop_run_once(loop, 30);
+	if (evloop_repeat_count != prev) {
+		fail("deleted timer is called");
+	}
+	if (evloop_oneshot_count != 1) {
+		fail("oneshot_count expects 1 but %u", evloop_oneshot_count);
+	}
+
+	evloop_destroy(loop);
+	diag_free(diag);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// test_httpclient_arena() のサーバ側。
+// n 回接続を受け付けて、要求されたパスをそのまま本文にして返す。
+static void
+httpclient_arena_server(int ls, uint n)
+{
+	for (uint i = 0; i < n; i++) {
+		char req[1024];
+		uint len = 0;
+
+		int fd = accept(ls, NULL, NULL);
+		if (fd < 0) {
+			_exit(1);
+		}
+		while (len < sizeof(req) - 1) {
+			ssize_t r = read(fd, req + len, sizeof(req) - 1 - len);
+			if (r <= 0) {
+				break;
+			}
+			len += r;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n")) {
+				break;
+			}
+		}
+		req[len] = '\0';
+
+		// "GET <path> HTTP/1.1"
+		char path[256];
+		if (sscanf(req, "GET %255s ", path) != 1) {
+			strlcpy(path, "?", sizeof(path));
+		}
+		char res[512];
+		int reslen = snprintf(res, sizeof(res),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n%s", strlen(path), path);
+		if (write(fd, res, reslen) < 0) {
+			_exit(1);
+		}
+		close(fd);
+	}
+	_exit(0);
+}
+
+static void
+test_httpclient_arena_done(struct httpclient *http, int code, void *arg)
+{
+	int *codep = (int *)arg;
+	*codep = code;
+}
+
+// アリーナを使っている最中に非同期取得を開始して、そのアリーナを
+// リセットしてから取得が進んでも要求が壊れないこと。
+// ストリームではメッセージ処理中に画像の先読みを開始して、
+// メッセージ処理が終わってから (アリーナのリセット後に) 取得する。
+static void
+test_httpclient_arena(void)
+{
+#define NFETCH	(10)
+	printf("%s\n", __func__);
+
+	struct diag *diag = diag_alloc();
+	struct evloop *loop = evloop_create(diag);
+	struct arena *a = arena_create(256);
+	struct httpclient *http[NFETCH];
+	int code[NFETCH];
+	struct net_opt opt;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+
+	net_opt_init(&opt);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int ls = socket(AF_INET, SOCK_STREAM, 0);
+	if (ls < 0 ||
+	    bind(ls, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(ls, NFETCH) < 0 ||
+	    getsockname(ls, (struct sockaddr *)&sin, &sinlen) < 0)
+	{
+		err(1, "%s: socket", __func__);
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		err(1, "%s: fork", __func__);
+	}
+	if (pid == 0) {
+		httpclient_arena_server(ls, NFETCH);
+	}
+	close(ls);
+
+	struct arena *prev = arena_set_current(a);
+	for (uint i = 0; i < NFETCH; i++) {
+		char url[64];
+		snprintf(url, sizeof(url), "http://127.0.0.1:%u/p%u.png",
+			ntohs(sin.sin_port), i);
+		code[i] = 1;
+		http[i] = httpclient_create(diag);
+		if (httpclient_fetch_async(http[i], loop, url, &opt, 5000,
+			test_httpclient_arena_done, &code[i]) < 0)
+		{
+			fail("[%u] httpclient_fetch_async failed", i);
+			code[i] = -1;
+		}
+
+		// メッセージの処理が終わってアリーナが再利用される。
+		arena_reset(a);
+		string *junk = string_init();
+		for (uint j = 0; j < 200; j++) {
+			string_append_char(junk, '#');
+		}
+	}
+	arena_set_current(prev);
+
+	for (;;) {
+		uint pending = 0;
+		for (uint i = 0; i < NFETCH; i++) {
+			pending += (code[i] == 1);
+		}
+		if (pending == 0 || evloop_run_once(loop, 5000) < 0) {
+			break;
+		}
+	}
+
+	for (uint i = 0; i < NFETCH; i++) {
+		char exp[16];
+		snprintf(exp, sizeof(exp), "/p%u.png", i);
+		if (code[i] != 0) {
+			fail("[%u] code=%d", i, code[i]);
+		} else {
+			struct bslice slice;
+			int n = httpclient_read_slice(http[i], &slice, UINT32_MAX);
+			if (n != strlen(exp) || memcmp(slice.ptr, exp, n) != 0) {
+				fail("[%u] expects \"%s\" but \"%.*s\"", i, exp,
+					(n > 0 ? n : 0), (n > 0 ? (const char *)slice.ptr : ""));
+			}
+			if (n > 0) {
+				bslice_release(&slice);
+			}
+		}
+		httpclient_destroy(http[i]);
+	}
+
+	waitpid(pid, NULL, 0);
+	arena_destroy(a);
+	evloop_destroy(loop);
+	diag_free(diag);
+#undef NFETCH
+}
+
+// Blurhash の文字。
+static const char blurhash_chars[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+// Blurhash の高速版が sRGB への変換に使う表の段数。
+#define BLURHASH_L2SRGB_STEPS	(64)
+
+// sRGB 値 ival をリニアにして、高速版の変換表の段単位で返す。
+static double
+blurhash_srgb_to_step(uint ival)
+{
+	double v = (double)ival / 255;
+	double l;
+	if (v < 0.04045) {
+		l = v / 12.92;
+	} else {
+		l = pow((v + 0.055) / 1.055, 2.4);
+	}
+	return l * BLURHASH_L2SRGB_STEPS;
+}
+
+// hash を高速版と厳密版で展開して比較する。
+// 厳密版は sRGB への変換を表を使わずに計算しているので、両者をリニアに
+// 戻して、高速版の変換表の段単位で比べる。
+// 差の最大値を *maxdiff に、平均を戻り値に返す。展開に失敗すれば -1。
+static double
+blurhash_compare(const char *hash, int bw, int bh, double *maxdiff,
+	const struct diag *diag)
+{
+	struct image *fast = NULL;
+	struct image *exact = NULL;
+	FILE *fp;
+	double rv = -1;
+
+	fp = fmemopen(UNCONST(hash), strlen(hash), "r");
+	fast = image_blurhash_read(fp, bw, bh, diag);
+	fclose(fp);
+	fp = fmemopen(UNCONST(hash), strlen(hash), "r");
+	exact = image_blurhash_read_exact(fp, bw, bh, diag);
+	fclose(fp);
+	if (fast == NULL || exact == NULL) {
+		goto done;
+	}
+	if (fast->width != exact->width || fast->height != exact->height) {
+		goto done;
+	}
+
+	uint n = fast->width * fast->height * 3;
+	double sum = 0;
+	*maxdiff = 0;
+	for (uint i = 0; i < n; i++) {
+		double d = fabs(blurhash_srgb_to_step(exact->buf[i]) -
+			blurhash_srgb_to_step(fast->buf[i]));
+		sum += d;
+		*maxdiff = MAX(*maxdiff, d);
+	}
+	rv = sum / n;
+
+ done:
+	image_free(fast);
+	image_free(exact);
+	return rv;
+}
+
+static void
+test_image_blurhash(void)
+{
+	printf("%s\n", __func__);
+
+	struct diag *diag = diag_alloc();
+	char hash9x9[9 * 9 * 2 + 4 + 1];
+	const struct {
+		const char *hash;
+		int bw;
+		int bh;
+		double maxdiff;		// 許容する差の最大値 [段]
+	} table[] = {
+		{ "LEHV6nWB2yk8pyo0adR*.7kCMdnj",	32,		32,		1.5 },
+		{ "LEHV6nWB2yk8pyo0adR*.7kCMdnj",	320,	240,	1.5 },
+		{ "LGF5]+Yk^6#M@-5c,1J5@[or[Q6.",	-20,	-20,	1.5 },
+		{ "LGF5]+Yk^6#M@-5c,1J5@[or[Q6.",	-1,		-1,		1.5 },
+		{ "L6PZfSi_.AyE_3t7t7R**0o#DgR4",	1,		100,	1.5 },
+		{ hash9x9,							64,		64,		1.5 },
+		{ hash9x9,							400,	300,	2.5 },
+	};
+
+	// 9x9 コンポーネントの適当な Blurhash。
+	hash9x9[0] = blurhash_chars[(9 - 1) + (9 - 1) * 9];
+	for (uint i = 1; i < sizeof(hash9x9) - 1; i++) {
+		hash9x9[i] = blurhash_chars[(i * 37) % 83];
+	}
+	hash9x9[sizeof(hash9x9) - 1] = '\0';
+
+	// 高速版は表の段で切り捨てているので、差は平均で半段程度、最大でも
+	// 1段に表と厳密版それぞれの sRGB の丸め (明部で各 0.3 段ほど) を加えた
+	// くらいに収まること。
+	// 9x9 コンポーネントを大きく補間するものは補間の誤差が1段ほど加わる。
+	for (uint i = 0; i < countof(table); i++) {
+		double maxdiff;
+		double avg = blurhash_compare(table[i].hash,
+			table[i].bw, table[i].bh, &maxdiff, diag);
+		if (avg < 0) {
+			fail("[%u]: decode failed", i);
+		} else if (avg > 0.55 || maxdiff > table[i].maxdiff) {
+			fail("[%u]: maxdiff=%.3f avg=%.3f", i, maxdiff, avg);
+		}
+	}
+
+	diag_free(diag);
+}
+
+static void
+test_image_scaler(void)
+{
+	printf("%s\n", __func__);
+
+	struct image_scaler sc;
+	struct image *img;
+	const uint16 *d;
+
+	// RGB24 4x2 を 2x1 に。
+	static const uint8 rgb[2][4 * 3] = {
+		{ 0, 0, 0,   16, 16, 16,   80, 0, 0,   80, 0, 0 },
+		{ 32, 32, 32,   16, 16, 16,   80, 0, 0,   240, 0, 0 },
+	};
+	if (image_scaler_init(&sc, 4, 2, IMAGE_FMT_RGB24, 2, 1) == false) {
+		fail("rgb: init failed");
+		return;
+	}
+	image_scaler_put(&sc, rgb[0]);
+	if (image_scaler_finish(&sc) != NULL) {
+		fail("rgb: incomplete image should fail");
+	}
+	image_scaler_init(&sc, 4, 2, IMAGE_FMT_RGB24, 2, 1);
+	image_scaler_put(&sc, rgb[0]);
+	image_scaler_put(&sc, rgb[1]);
+	img = image_scaler_finish(&sc);
+	if (img == NULL) {
+		fail("rgb: finish failed");
+		return;
+	}
+	d = (const uint16 *)img->buf;
+	if (img->format != IMAGE_FMT_ARGB16 || img->has_alpha) {
+		fail("rgb: format=%u has_alpha=%u", img->format, img->has_alpha);
+	}
+	if (d[0] != RGB888_to_ARGB16(16, 16, 16)) {
+		fail("rgb: [0] expects %04x but %04x",
+			RGB888_to_ARGB16(16, 16, 16), d[0]);
+	}
+	if (d[1] != RGB888_to_ARGB16(120, 0, 0)) {
+		fail("rgb: [1] expects %04x but %04x",
+			RGB888_to_ARGB16(120, 0, 0), d[1]);
+	}
+	image_free(img);
+
+	// ARGB32 は A で重み付けして、A の平均が半分以下なら透明。
+	static const struct {
+		uint8 src[2 * 4];
+		uint8 r, g, b;
+		bool transparent;
+	} table[] = {
+		// 不透明同士は単純平均
+		{ { 0, 0, 0, 255,		80, 160, 240, 255 },	40, 80, 120, false },
+		// 透明なピクセルの色はほぼ混ざらない
+		{ { 255, 0, 0, 255,		0, 0, 255, 0 },			254, 0, 0,	true },
+		{ { 255, 0, 0, 255,		0, 0, 255, 1 },			253, 0, 1,	false },
+		// 全部透明なら色は単純平均
+		{ { 10, 20, 30, 0,		30, 40, 50, 0 },		20, 30, 40,	true },
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		image_scaler_init(&sc, 2, 1, IMAGE_FMT_ARGB32, 1, 1);
+		image_scaler_put(&sc, table[i].src);
+		img = image_scaler_finish(&sc);
+		if (img == NULL) {
+			fail("argb[%u]: finish failed", i);
+			continue;
+		}
+		d = (const uint16 *)img->buf;
+		if (img->has_alpha == false) {
+			fail("argb[%u]: has_alpha expects true", i);
+		}
+		uint16 expected = RGB888_to_ARGB16(table[i].r, table[i].g, table[i].b);
+		if (table[i].transparent) {
+			expected |= 0x8000;
+		}
+		if (d[0] != expected) {
+			fail("argb[%u]: expects %04x but %04x", i, expected, d[0]);
+		}
+		image_free(img);
+	}
+}
+
 static void
 test_json_unescape(void)
 {
@@ -171,6 +621,420 @@ test_json_unescape(void)
 	}
 }
 
+// mfm.c に設定するスタイル。
+// 結果を比較しやすいよう色の代わりに記号を返す。
+static const char *
+test_mfm_style_begin(uint n)
+{
+	switch (n) {
+	 case STYLE_USERID:	return "<u>";
+	 case STYLE_URL:	return "<l>";
+	 case STYLE_TAG:	return "<t>";
+	 default:			return "";
+	}
+}
+
+static const char *
+test_mfm_style_end(uint n)
+{
+	switch (n) {
+	 case STYLE_USERID:	return "</u>";
+	 case STYLE_URL:	return "</l>";
+	 case STYLE_TAG:	return "</t>";
+	 default:			return "";
+	}
+}
+
+static void
+test_mfm_display_text(void)
+{
+	printf("%s\n", __func__);
+
+	mfm_set_style(test_mfm_style_begin, test_mfm_style_end);
+
+	struct diag *diag = diag_alloc();
+	struct json *js = json_create(diag);
+	string *note = string_from_cstr(
+		"{\"tags\":[\"Foo\",\"bazqux\",\"baz\",\"foo\"]}");
+	if (json_parse(js, note) < 0) {
+		fail("json_parse failed");
+		goto done;
+	}
+	struct tagset *tags = mfm_tagset_create(js, 0, diag);
+	if (tags == NULL) {
+		fail("mfm_tagset_create failed");
+		goto done;
+	}
+
+	struct {
+		const char *src;
+		bool is_username;
+		const char *exp;
+	} table[] = {
+		// メンション
+		{ "@user hi",			false,	"<u>@user</u> hi" },
+		{ "@user@host.example",	false,	"<u>@user@host.example</u>" },
+		{ "a@b",				false,	"a@b" },	// 直前が英数字
+		{ "@-x",				false,	"@-x" },	// '-' では始まらない
+		{ "@user~x",			false,	"<u>@user</u>~x" },
+		{ "@userさん",			false,	"<u>@user</u>さん" },
+		// URL
+		{ "http://foo/a b",		false,	"<l>http://foo/a</l> b" },
+		{ "http://foo/a(b)c d",	false,	"<l>http://foo/a(b)c</l> d" },
+		{ "(http://foo/a)bc",	false,	"(<l>http://foo/a</l>)bc" },
+		{ "https://foo/あ",		false,	"<l>https://foo/</l>あ" },
+		// タグ
+		{ "#foo bar",			false,	"<t>#foo</t> bar" },
+		{ "#FOO",				false,	"<t>#FOO</t>" },
+		{ "#bazqux",			false,	"<t>#bazqux</t>" },	// 先に出てくる方
+		{ "#bazz",				false,	"<t>#baz</t>z" },
+		{ "#qux",				false,	"#qux" },
+		// <plain>, `〜`, ```〜``` 内は整形しない
+		{ "<plain>@user #foo</plain> @a",	false,	"@user #foo <u>@a</u>" },
+		{ "`@user`",			false,	"@user" },
+		{ "```http://foo/```",	false,	"http://foo/" },
+		// MFM
+		{ "$[ruby 漢字 かんじ]",	false,	"漢字(かんじ)" },
+		{ "$[ruby  漢字 かんじ]x",	false,	"漢字(かんじ)x" },
+		{ "$[x2 @user]",		false,	"<u>@user</u>" },
+		{ "$[x2",				false,	"$[x2" },	// 閉じずに終端
+		// 名前欄
+		{ "@user #foo",			true,	"@user #foo" },
+		{ "http://foo/",		true,	"http://foo/" },
+		{ "$[ruby 名前 なまえ]",	true,	"名前(なまえ)" },
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		const char *src = table[i].src;
+		const char *exp = table[i].exp;
+
+		ustring *u = mfm_display_text(src, tags, table[i].is_username, diag);
+		string *act = ustring_to_utf8(u);
+		if (strcmp(exp, string_get(act)) != 0) {
+			fail("\"%s\": expects \"%s\" but \"%s\"",
+				src, exp, string_get(act));
+		}
+		string_free(act);
+		ustring_free(u);
+	}
+	mfm_tagset_destroy(tags);
+
+ done:
+	string_free(note);
+	json_destroy(js);
+	diag_free(diag);
+}
+
+// NG ワードファイル本文 body を一時ファイルに書いて読み込む。
+static struct ngwords *
+ngword_read_str(const char *body)
+{
+	char filename[] = "/tmp/sayaka_test.XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd < 0) {
+		err(1, "%s: mkstemp", __func__);
+	}
+	FILE *fp = fdopen(fd, "w");
+	fputs(body, fp);
+	fclose(fp);
+
+	struct diag *diag = diag_alloc();
+	struct ngwords *dict = ngword_read_file(filename, diag);
+	diag_free(diag);
+	unlink(filename);
+	return dict;
+}
+
+static void
+test_netstat(void)
+{
+	printf("%s\n", __func__);
+
+	struct diag *diag = diag_alloc();
+	struct netstat_req req;
+
+	netstat_clear();
+
+	// 区間 i は 2^i msec 未満。
+	static const struct {
+		uint32 usec;
+		uint bucket;
+	} table[] = {
+		{ 0,			0 },
+		{ 999,			0 },
+		{ 1000,			1 },
+		{ 3999,			2 },
+		{ 4000,			3 },
+		{ 16383999,		14 },
+		{ 16384000,		15 },
+		{ UINT32_MAX,	15 },
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		netstat_begin(&req);
+		req.usec[NETSTAT_TTFB] = table[i].usec;
+		req.done = 1U << NETSTAT_TTFB;
+		netstat_record(diag, "a", &req);
+	}
+	uint expected[16];
+	memset(expected, 0, sizeof(expected));
+	for (uint i = 0; i < countof(table); i++) {
+		expected[table[i].bucket]++;
+	}
+	for (uint b = 0; b < countof(expected); b++) {
+		uint actual = netstat_get_hist("a", NETSTAT_TTFB, b);
+		if (actual != expected[b]) {
+			fail("bucket %u expects %u but %u", b, expected[b], actual);
+		}
+	}
+
+	// 計測していない段階は数えない。ホストごとに分かれる。
+	if (netstat_get_hist("a", NETSTAT_BODY, 0) != 0) {
+		fail("unmeasured phase is counted");
+	}
+	netstat_begin(&req);
+	netstat_mark(&req, NETSTAT_DNS);
+	netstat_record(diag, "b", &req);
+	if (netstat_get_hist("b", NETSTAT_DNS, 0) != 1) {
+		fail("host b: dns expects 1");
+	}
+	if (netstat_get_hist("b", NETSTAT_TTFB, 0) != 0) {
+		fail("host b: ttfb expects 0");
+	}
+
+	netstat_clear();
+	diag_free(diag);
+}
+
+static void
+test_ngword_match(void)
+{
+	printf("%s\n", __func__);
+
+	struct ngwords *dict = ngword_read_str("["
+		"{\"type\":\"text\",\"text\":\"hers\"},"				// 0
+		"{\"type\":\"regex\",\"text\":\"^ab+c$\"},"				// 1
+		"{\"type\":\"text\",\"text\":\"she\",\"user\":\"@a\"},"	// 2
+		"{\"type\":\"text\",\"text\":\"he\"},"					// 3
+		"{\"type\":\"text\",\"text\":\"あい\",\"user\":\"@b\"},"	// 4
+		"{\"type\":\"text\",\"text\":\"he\",\"user\":\"@b\"},"	// 5
+		"{\"type\":\"regex\",\"text\":\"x[0-9]\"},"				// 6
+		"{\"type\":\"text\",\"text\":\"いう\"},"				// 7
+		"{\"type\":\"text\",\"text\":\"his\"},"					// 8
+		"{\"type\":\"regex\",\"text\":\"y[0-9]\",\"user\":\"@b\"},"	// 9
+		"{\"type\":\"regex\",\"text\":\"y\",\"user\":\"@c@h\"}"		// 10
+	"]");
+	if (dict == NULL) {
+		fail("ngword_read_file failed");
+		return;
+	}
+
+	struct {
+		const char *text;
+		const char *user;
+		int exp;
+	} table[] = {
+		{ "",				"@a",	-1 },
+		{ "ushers",			"@a",	0 },	// 同時に出現したら小さいほう
+		{ "ushe",			"@a",	2 },	// 2 と 3 が同じ位置で終わる
+		{ "ushe",			"@b",	3 },	// 2 はユーザ違い
+		{ "abbc",			"@a",	1 },
+		{ "abbc he",		"@a",	3 },	// 1 は ^$ なので不一致
+		{ "x1 he",			"@a",	3 },	// 先に一致する 3 が優先
+		{ "x1",				"@a",	6 },
+		{ "あいう",			"@a",	7 },
+		{ "あいう",			"@b",	4 },
+		{ "this",			"@a",	8 },	// his の失敗リンク経由
+		{ "hi",				"@a",	-1 },
+		{ "y1",				"@a",	-1 },
+		{ "y1",				"@b",	9 },	// ユーザ指定の正規表現
+		{ "y1",				"@c@h",	10 },
+		{ "y1",				"@c",	-1 },
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		string *text = string_from_cstr(table[i].text);
+		string *user = string_from_cstr(table[i].user);
+
+		int act = ngword_match(dict, text, user);
+		if (act != table[i].exp) {
+			fail("\"%s\" %s: expects %d but %d",
+				table[i].text, table[i].user, table[i].exp, act);
+		}
+		string_free(text);
+		string_free(user);
+	}
+
+	ngword_destroy(dict);
+
+	// 不正な正規表現を含んでいればエラー。
+	dict = ngword_read_str("["
+		"{\"type\":\"regex\",\"text\":\"^ab+c$\"},"
+		"{\"type\":\"text\",\"text\":\"he\",\"user\":\"@b\"},"
+		"{\"type\":\"regex\",\"text\":\"a(b\"}"
+	"]");
+	if (dict) {
+		fail("invalid regex: expects NULL");
+		ngword_destroy(dict);
+	}
+}
+
+static void
+test_ngword_regex_literal(void)
+{
+	printf("%s\n", __func__);
+
+	struct {
+		const char *re;
+		const char *exp;	// NULL ならリテラルなし
+	} table[] = {
+		{ "abc",			"abc" },
+		{ "^abc$",			"abc" },
+		{ "ab+c",			"ab" },
+		{ "abc?d",			"ab" },
+		{ "ab*cdef",		"cdef" },
+		{ "ab{2}cd",		"ab" },		// 同じ長さなら先のもの
+		{ "ab{0,2}cde",		"cde" },
+		{ "ab{,2}cde",		"cde" },
+		{ "xa{,3}y",		"x" },
+		{ "a.bcd",			"bcd" },
+		{ "a[bc]de",		"de" },
+		{ "x[]a]yz",		"yz" },
+		{ "x[[:alpha:]]yz",	"yz" },
+		{ "(foo|bar)baz",	"baz" },
+		{ "(ab)+cd",		"cd" },
+		{ "foo|bar",		NULL },
+		{ "a\\.b",			"a.b" },
+		{ "a\\<bc",		"bc" },
+		{ "[0-9]+",			NULL },
+		{ ".*",				NULL },
+		{ "あい+う",		"あい" },
+		{ "あい?う",		"あ" },
+	};
+
+	string *body = string_init();
+	string_append_char(body, '[');
+	for (uint i = 0; i < countof(table); i++) {
+		if (i != 0) {
+			string_append_char(body, ',');
+		}
+		string_append_cstr(body, "{\"type\":\"regex\",\"text\":\"");
+		for (const char *p = table[i].re; *p; p++) {
+			if (*p == '\\' || *p == '"') {
+				string_append_char(body, '\\');
+			}
+			string_append_char(body, *p);
+		}
+		string_append_cstr(body, "\"}");
+	}
+	string_append_char(body, ']');
+	struct ngwords *dict = ngword_read_str(string_get(body));
+	string_free(body);
+	if (dict == NULL) {
+		fail("ngword_read_file failed");
+		return;
+	}
+
+	for (uint i = 0; i < countof(table); i++) {
+		const char *exp = table[i].exp;
+		const string *act = dict->item[i].ng_literal;
+		if (exp == NULL) {
+			if (act != NULL) {
+				fail("\"%s\": expects NULL but \"%s\"",
+					table[i].re, string_get(act));
+			}
+		} else if (act == NULL) {
+			fail("\"%s\": expects \"%s\" but NULL", table[i].re, exp);
+		} else if (strcmp(string_get(act), exp) != 0) {
+			fail("\"%s\": expects \"%s\" but \"%s\"",
+				table[i].re, exp, string_get(act));
+		}
+	}
+
+	ngword_destroy(dict);
+}
+
+static void
+test_pstream(void)
+{
+	printf("%s\n", __func__);
+
+	// パイプのバッファに収まる程度で、ブロックはまたぐ長さにする。
+	const uint total = IMAGE_BUFSIZE * 2 + 123;
+	uint8 *src = malloc(total);
+	for (uint i = 0; i < total; i++) {
+		src[i] = (i * 7) ^ (i >> 8);
+	}
+	int fds[2];
+	if (pipe(fds) < 0) {
+		err(1, "%s: pipe", __func__);
+	}
+	if (write(fds[1], src, total) != total) {
+		err(1, "%s: write", __func__);
+	}
+	close(fds[1]);
+
+	struct pstream *ps = pstream_init_fd(fds[0]);
+
+	// 判定フェーズ。先頭を読んでは巻き戻す。
+	FILE *fp = pstream_open_for_peek(ps);
+	for (int round = 0; round < 2; round++) {
+		uint8 buf[16];
+		if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+			fail("round %d: fread failed", round);
+		} else if (memcmp(buf, src, sizeof(buf)) != 0) {
+			fail("round %d: peek data mismatch", round);
+		}
+		fseek(fp, 0, SEEK_SET);
+	}
+	fclose(fp);
+
+	// FILE* を介さないピーク。ブロックをまたいでも読めること。
+	{
+		const uint peeklen = IMAGE_BUFSIZE + 10;
+		uint8 *buf = malloc(peeklen);
+		int r = pstream_peek(ps, buf, peeklen);
+		if (r != peeklen) {
+			fail("pstream_peek expects %u but %d", peeklen, r);
+		} else if (memcmp(buf, src, peeklen) != 0) {
+			fail("pstream_peek data mismatch");
+		}
+		free(buf);
+	}
+
+	// 読み込みフェーズ。スライスで全部読めること。
+	// 先頭はピークバッファのブロックをそのまま指しているはず。
+	struct bslice slice;
+	uint pos = 0;
+	int n;
+	while ((n = pstream_read_slice(ps, &slice, 1000)) > 0) {
+		if (n > 1000 || n != slice.len) {
+			fail("pos=%u: n=%d len=%u", pos, n, slice.len);
+			break;
+		}
+		if (pos == 0 && slice.block->refcnt < 2) {
+			fail("first slice is not shared with the peek buffer");
+		}
+		if (pos + n > total || memcmp(slice.ptr, src + pos, n) != 0) {
+			fail("pos=%u: data mismatch", pos);
+			bslice_release(&slice);
+			break;
+		}
+		pos += n;
+		bslice_release(&slice);
+	}
+	if (n < 0) {
+		fail("pstream_read_slice failed: %s", strerrno());
+	}
+	if (pos != total) {
+		fail("total expects %u but %u", total, pos);
+	}
+	if (slice.block != NULL || slice.len != 0) {
+		fail("slice at EOF is not empty");
+	}
+
+	pstream_cleanup(ps);
+	close(fds[0]);
+	free(src);
+}
+
 static void
 test_putd(void)
 {
@@ -298,6 +1162,355 @@ perf_putd(void)
 	free(data);
 }
 
+// perf_ngword 用のランダムな単語を s に追加する。
+static void
+perf_ngword_word(string *s, uint n)
+{
+	static const char * const syl[] = {
+		"a", "i", "u", "e", "o", "ka", "ki", "ku", "ke", "ko",
+		"あ", "い", "う", "え", "お", "か", "き", "く", "け", "こ",
+	};
+	for (uint i = 0; i < n; i++) {
+		string_append_cstr(s, syl[xorshift() % countof(syl)]);
+	}
+}
+
+// 以前の misskey_ngword_match_text() と同じく、全ルールを順に調べる。
+static int
+perf_ngword_naive(const struct ngwords *dict, const string *text,
+	const string *user)
+{
+	for (uint i = 0; i < dict->count; i++) {
+		const struct ngword *ng = &dict->item[i];
+		if (ng->ng_user && string_equal(ng->ng_user, user) == false) {
+			continue;
+		}
+		if (ng->ng_type == NG_TEXT) {
+			if (strstr(string_get(text), string_get(ng->ng_text))) {
+				return i;
+			}
+		} else if (ng->ng_type == NG_REGEX) {
+			if (regexec(&ng->ng_regex, string_get(text), 0, NULL, 0) == 0) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+static void
+perf_ngword(void)
+{
+	static const int SEC = 2;
+	static const uint NRULES = 300;
+	static const uint NTEXTS = 200;
+	struct timespec start, end;
+	string *texts[NTEXTS];
+	string *user;
+	uint32 count;
+	int sum;
+
+	// 正規表現を NRULES 個。1割はリテラルを持たないもの。
+	string *body = string_init();
+	string_append_char(body, '[');
+	for (uint i = 0; i < NRULES; i++) {
+		string_append_cstr(body, (i == 0) ? "" : ",");
+		string_append_cstr(body, "{\"type\":\"regex\",\"text\":\"");
+		switch (i % 10) {
+		 case 0:
+			string_append_cstr(body, "[a-z]+[0-9]{3}x");
+			break;
+		 case 1:
+		 case 2:
+		 case 3:
+			perf_ngword_word(body, 5);
+			string_append_cstr(body, "[0-9]+");
+			perf_ngword_word(body, 1);
+			break;
+		 case 4:
+		 case 5:
+		 case 6:
+			string_append_char(body, '(');
+			perf_ngword_word(body, 3);
+			string_append_char(body, '|');
+			perf_ngword_word(body, 3);
+			string_append_char(body, ')');
+			perf_ngword_word(body, 4);
+			break;
+		 default:
+			string_append_char(body, '^');
+			perf_ngword_word(body, 4);
+			string_append_cstr(body, ".*");
+			perf_ngword_word(body, 4);
+			break;
+		}
+		string_append_cstr(body, "\"}");
+	}
+	string_append_char(body, ']');
+	struct ngwords *dict = ngword_read_str(string_get(body));
+	string_free(body);
+	if (dict == NULL) {
+		errx(1, "%s: ngword_read_file failed", __func__);
+	}
+
+	// 本文は 100〜300 音節くらい。
+	for (uint i = 0; i < NTEXTS; i++) {
+		texts[i] = string_init();
+		perf_ngword_word(texts[i], 100 + xorshift() % 200);
+	}
+	user = string_from_cstr("@user");
+
+	// 結果が同じことを確認しておく。
+	for (uint i = 0; i < NTEXTS; i++) {
+		int exp = perf_ngword_naive(dict, texts[i], user);
+		int act = ngword_match(dict, texts[i], user);
+		if (exp != act) {
+			fail("texts[%u]: expects %d but %d", i, exp, act);
+		}
+	}
+
+	signal(SIGALRM, signal_handler);
+	for (int pass = 0; pass < 2; pass++) {
+		printf("%s %s ", __func__, (pass == 0) ? "naive" : "ngword_match");
+		fflush(stdout);
+
+		signaled = 0;
+		count = 0;
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		alarm(SEC);
+		while (signaled == 0) {
+			for (uint i = 0; i < NTEXTS; i++) {
+				if (pass == 0) {
+					sum += perf_ngword_naive(dict, texts[i], user);
+				} else {
+					sum += ngword_match(dict, texts[i], user);
+				}
+			}
+			count++;
+		}
+		(void)sum;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64 res = timespec_to_usec(&end) - timespec_to_usec(&start);
+		double us = (double)res / count / NTEXTS;
+		printf("count=%u, %.3f usec/text\n", count, us);
+	}
+
+	for (uint i = 0; i < NTEXTS; i++) {
+		string_free(texts[i]);
+	}
+	string_free(user);
+	ngword_destroy(dict);
+}
+
+// Blurhash を高速版と厳密版で展開して、差と速度を比べる。
+static void
+perf_blurhash(void)
+{
+	static const int SEC = 2;
+	static const uint NHASH = 50;
+	static const struct {
+		uint width;
+		uint height;
+	} sizes[] = {
+		{ 48,	48 },	// アイコン程度
+		{ 400,	300 },	// サムネイル程度
+	};
+	struct diag *diag = diag_alloc();
+	struct timespec start, end;
+	char *hashes[NHASH];
+	uint32 count;
+
+	// コンポーネント数もデータも適当な Blurhash を NHASH 個。
+	for (uint i = 0; i < NHASH; i++) {
+		uint compx = xorshift() % 9 + 1;
+		uint compy = xorshift() % 9 + 1;
+		uint len = compx * compy * 2 + 4;
+		char *h = malloc(len + 1);
+		h[0] = blurhash_chars[(compx - 1) + (compy - 1) * 9];
+		for (uint j = 1; j < len; j++) {
+			h[j] = blurhash_chars[xorshift() % 83];
+		}
+		h[len] = '\0';
+		hashes[i] = h;
+	}
+
+	signal(SIGALRM, signal_handler);
+	for (uint k = 0; k < countof(sizes); k++) {
+		const uint width  = sizes[k].width;
+		const uint height = sizes[k].height;
+
+		// 精度。
+		double maxdiff = 0;
+		double sum = 0;
+		for (uint i = 0; i < NHASH; i++) {
+			double m;
+			double avg = blurhash_compare(hashes[i], width, height, &m, diag);
+			if (avg < 0) {
+				errx(1, "%s: decode failed: %s", __func__, hashes[i]);
+			}
+			maxdiff = MAX(maxdiff, m);
+			sum += avg;
+		}
+		printf("%s %ux%u maxdiff=%.3f, avgdiff=%.3f [step]\n", __func__,
+			width, height, maxdiff, sum / NHASH);
+
+		// 速度。
+		for (int pass = 0; pass < 2; pass++) {
+			printf("%s %ux%u %s ", __func__, width, height,
+				(pass == 0) ? "exact" : "fast");
+			fflush(stdout);
+
+			signaled = 0;
+			count = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			alarm(SEC);
+			while (signaled == 0) {
+				for (uint i = 0; i < NHASH; i++) {
+					FILE *fp = fmemopen(hashes[i], strlen(hashes[i]), "r");
+					struct image *img;
+					if (pass == 0) {
+						img = image_blurhash_read_exact(fp, width, height, diag);
+					} else {
+						img = image_blurhash_read(fp, width, height, diag);
+					}
+					fclose(fp);
+					image_free(img);
+				}
+				count++;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			uint64 res = timespec_to_usec(&end) - timespec_to_usec(&start);
+			double us = (double)res / count / NHASH;
+			printf("count=%u, %.3f usec/image\n", count, us);
+		}
+	}
+
+	for (uint i = 0; i < NHASH; i++) {
+		free(hashes[i]);
+	}
+	diag_free(diag);
+}
+
+// 録画して再生すると元に戻るか。
+static void
+test_record_format(uint format, uint n, uint64 seekidx)
+{
+	char filename[] = "/tmp/sayaka_test.XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd < 0) {
+		err(1, "%s: mkstemp", __func__);
+	}
+	close(fd);
+
+	// メッセージ i は 1秒ごとに受信したことにする。
+	// 追記も試すため 2回に分けて録画する。
+	const uint64 base = 1700000000ULL * 1000 * 1000;
+	string *msg = string_init();
+	for (uint i = 0; i < n; ) {
+		struct recorder *rec = recorder_open(filename, format);
+		if (rec == NULL) {
+			fail("format=%u: recorder_open failed", format);
+			goto done;
+		}
+		for (uint end = (i == 0) ? n / 2 : n; i < end; i++) {
+			string_clear(msg);
+			string_append_printf(msg, "{\"id\":%u}", i);
+			recorder_write(rec, msg, base + i * 1000 * 1000);
+		}
+		// 受信がなくても時間が経てば閉じる前に全部読めるようになる。
+		recorder_flush(rec, base + (i + 10) * 1000 * 1000);
+		struct playback *pb = playback_open(filename);
+		if (pb) {
+			uint count = 0;
+			string *s;
+			while ((s = playback_read(pb, NULL)) != NULL) {
+				string_free(s);
+				count++;
+			}
+			if (count != i) {
+				fail("format=%u: flush expects %u but %u", format, i, count);
+			}
+			playback_close(pb);
+		}
+		recorder_close(rec);
+	}
+
+	struct playback *pb = playback_open(filename);
+	if (pb == NULL) {
+		fail("format=%u: playback_open failed", format);
+		goto done;
+	}
+	uint i;
+	string *s;
+	uint64 ts;
+	for (i = 0; (s = playback_read(pb, &ts)) != NULL; i++) {
+		string_clear(msg);
+		string_append_printf(msg, "{\"id\":%u}", i);
+		if (format == RECORD_JSONL) {
+			string_rtrim_inplace(s);
+		} else if (ts != base + i * 1000 * 1000) {
+			fail("format=%u: [%u] ts expects %" PRIu64 " but %" PRIu64,
+				format, i, base + i * 1000 * 1000, ts);
+		}
+		if (string_equal(s, msg) == false) {
+			fail("format=%u: [%u] expects \"%s\" but \"%s\"",
+				format, i, string_get(msg), string_get(s));
+		}
+		string_free(s);
+	}
+	if (i != n) {
+		fail("format=%u: count expects %u but %u", format, n, i);
+	}
+
+	if (format != RECORD_JSONL) {
+		// 最初の録画分と追記した分のどちらも試す。
+		const uint64 seektable[] = { 0, n / 4, seekidx, n - 1, n };
+		for (uint j = 0; j < countof(seektable); j++) {
+			uint64 idx = seektable[j];
+			if (playback_seek(pb, base + idx * 1000 * 1000) == false) {
+				fail("format=%u: seek(%" PRIu64 ") failed", format, idx);
+				continue;
+			}
+			s = playback_read(pb, &ts);
+			if (idx == n) {
+				if (s != NULL) {
+					fail("format=%u: seek(%" PRIu64 ") expects EOF but \"%s\"",
+						format, idx, string_get(s));
+				}
+			} else {
+				string_clear(msg);
+				string_append_printf(msg, "{\"id\":%u}", (uint)idx);
+				if (s == NULL || string_equal(s, msg) == false) {
+					fail("format=%u: seek(%" PRIu64 ") expects \"%s\" but \"%s\"",
+						format, idx, string_get(msg),
+						s ? string_get(s) : "(NULL)");
+				}
+			}
+			string_free(s);
+		}
+	}
+	playback_close(pb);
+
+ done:
+	string_free(msg);
+	unlink(filename);
+}
+
+static void
+test_record(void)
+{
+	printf("%s\n", __func__);
+
+	test_record_format(RECORD_JSONL, 100, 0);
+#if defined(HAVE_ZLIB)
+	// 10秒ごとのブロックが 64 個でインデックスが書かれる。
+	test_record_format(RECORD_DEFLATE, 2000, 1234);
+#endif
+}
+
 static void
 test_stou32def(void)
 {
@@ -401,6 +1614,78 @@ test_stox32def(void)
 #undef DEF
 }
 
+static void
+test_string_arena(void)
+{
+	printf("%s\n", __func__);
+
+	// チャンクを溢れさせたいので小さめに作る。
+	struct arena *a = arena_create(64);
+	struct arena *prev = arena_set_current(a);
+	if (prev != NULL) {
+		fail("prev expects NULL but %p", prev);
+	}
+
+	for (int round = 0; round < 3; round++) {
+		string *s1 = string_init();
+		string *s2 = string_from_cstr("x");
+		ustring *u = ustring_init();
+		if (s1->arena != a || s2->arena != a || u->arena != a) {
+			fail("round %d: not allocated from the arena", round);
+		}
+
+		// 交互に伸ばして、その場で伸ばせる場合とコピーする場合の両方を通す。
+		char exp1[201];
+		char exp2[202];
+		exp2[0] = 'x';
+		for (int i = 0; i < 200; i++) {
+			char c = 'a' + (i % 26);
+			string_append_char(s1, c);
+			string_append_printf(s2, "%c", c);
+			ustring_append_unichar(u, 0x3041 + i);
+			exp1[i] = c;
+			exp2[i + 1] = c;
+		}
+		exp1[200] = '\0';
+		exp2[201] = '\0';
+		if (strcmp(string_get(s1), exp1) != 0) {
+			fail("round %d: s1 \"%s\"", round, string_get(s1));
+		}
+		if (strcmp(string_get(s2), exp2) != 0) {
+			fail("round %d: s2 \"%s\"", round, string_get(s2));
+		}
+		for (int i = 0; i < 200; i++) {
+			if (ustring_at(u, i) != 0x3041 + i) {
+				fail("round %d: u[%d] expects %04x but %04x", round, i,
+					0x3041 + i, ustring_at(u, i));
+				break;
+			}
+		}
+
+		// 直近に確保したものは解放すると巻き戻るので次の確保で再利用される。
+		string *s3 = string_alloc(32);
+		string_free(s3);
+		string *s4 = string_alloc(32);
+		if (s4 != s3) {
+			fail("round %d: s4 expects %p but %p", round, s3, s4);
+		}
+
+		string_free(s1);
+		string_free(s2);
+		string_free(s4);
+		ustring_free(u);
+		arena_reset(a);
+	}
+
+	arena_set_current(NULL);
+	string *s = string_init();
+	if (s->arena != NULL) {
+		fail("s->arena expects NULL but %p", s->arena);
+	}
+	string_free(s);
+	arena_destroy(a);
+}
+
 static void
 test_string_rtrim_inplace(void)
 {
@@ -441,6 +1726,68 @@ test_string_rtrim_inplace(void)
 	}
 }
 
+static void
+test_ustring_to_string(void)
+{
+	printf("%s\n", __func__);
+
+#if defined(HAVE_ICONV)
+	struct {
+		const char *src;
+		const char *exp;
+	} table[] = {
+		// input			expected
+		{ "",				"" },
+		{ "abc",			"abc" },
+		{ "あ",				ESC "$B$\"" ESC "(B" },
+		{ "aあいb",			"a" ESC "$B$\"$$" ESC "(Bb" },
+		{ "あ\x1b[0mい",	ESC "$B$\"" ESC "(B" ESC "[0m" ESC "$B$$" ESC "(B" },
+		{ "a\xf0\x9f\x98\x80", "a" ESC "$B\"." ESC "(B" },	// 変換不可はゲタ
+	};
+
+	if (init_codeset("iso-2022-jp") == false) {
+		fail("init_codeset failed: %s", strerror(errno));
+		return;
+	}
+	for (uint i = 0; i < countof(table); i++) {
+		const char *src = table[i].src;
+		const char *exp = table[i].exp;
+
+		ustring *u = ustring_from_utf8(src);
+		string *act = ustring_to_string(u);
+		if (strcmp(exp, string_get(act)) != 0) {
+			string *src_esc = string_escape_c(src);
+			string *act_esc = string_escape_c(string_get(act));
+			string *exp_esc = string_escape_c(exp);
+			fail("\"%s\" expects \"%s\" but \"%s\"",
+				string_get(src_esc), string_get(exp_esc), string_get(act_esc));
+			string_free(src_esc);
+			string_free(act_esc);
+			string_free(exp_esc);
+		}
+		string_free(act);
+		ustring_free(u);
+	}
+
+	// 別の文字コードで初期化し直したら前の変換結果は使わないこと。
+	if (init_codeset("euc-jp") == false) {
+		fail("init_codeset(euc-jp) failed: %s", strerror(errno));
+	} else {
+		ustring *u = ustring_from_utf8("aあ");
+		string *act = ustring_to_string(u);
+		if (strcmp(string_get(act), "a\xa4\xa2") != 0) {
+			string *act_esc = string_escape_c(string_get(act));
+			fail("euc-jp: \"aあ\" expects \"a\\xa4\\xa2\" but \"%s\"",
+				string_get(act_esc));
+			string_free(act_esc);
+		}
+		string_free(act);
+		ustring_free(u);
+	}
+	init_codeset(NULL);
+#endif
+}
+
 static void
 test_urlinfo_parse(void)
 {
@@ -533,7 +1880,11 @@ main(int ac, char *av[])
 	while ((c = getopt(ac, av, "p:")) != -1) {
 		switch (c) {
 		 case 'p':
-			if (strcmp(optarg, "putd") == 0) {
+			if (strcmp(optarg, "blurhash") == 0) {
+				perf_blurhash();
+			} else if (strcmp(optarg, "ngword") == 0) {
+				perf_ngword();
+			} else if (strcmp(optarg, "putd") == 0) {
 				perf_putd();
 			} else {
 				err(1, "usage: -p <perf-testname>");
@@ -546,11 +1897,23 @@ main(int ac, char *av[])
 
 	test_base64_encode();
 	test_decode_isotime();
+	test_evloop();
+	test_httpclient_arena();
+	test_image_blurhash();
+	test_image_scaler();
 	test_json_unescape();
+	test_mfm_display_text();
+	test_netstat();
+	test_ngword_match();
+	test_ngword_regex_literal();
+	test_pstream();
 	test_putd();
+	test_record();
 	test_stou32def();
 	test_stox32def();
+	test_string_arena();
 	test_string_rtrim_inplace();
 	test_urlinfo_parse();
+	test_ustring_to_string();
 	return 0;
 }
@@ -42,7 +42,12 @@
 #undef xchar
 
 #if defined(HAVE_ICONV)
-static string *utf8_to_outcode(const string *);
+struct outcode;
+static void outcode_clear(void);
+static const struct outcode *outcode_lookup(unichar);
+static bool outcode_fill(struct outcode *, unichar);
+static uint outcode_intern_shift(const char *, uint);
+static string *ustring_to_outcode(const ustring *);
 #endif
 static unichar uchar_from_utf8(const char **);
 
@@ -53,8 +58,34 @@ static bool use_iconv;
 // UTF-8 以外の文字コードへの変換用。
 static iconv_t cd;
 
+// 1文字分の変換結果。
+// ISO-2022-JP のような状態を持つ文字コードの場合、bytes[] には
+// 指示シーケンスを取り除いた文字本体のみを置き、どの指示(シフト状態)で
+// 出力すべきかを shift に持つ。shift == 0 は初期状態 (ASCII)。
+struct outcode {
+	uint8 valid;		// 変換済みなら 1
+	uint8 shift;		// シフト状態 (shift_seq[] のインデックス)
+	uint8 len;			// bytes の長さ
+	char bytes[13];
+};
+
+// 変換結果テーブル。初めて出てきた文字だけを iconv で変換して
+// ここに覚えておき、次からは表引きのみで済ませる。
+// Unicode 全域 (0x110000 文字) を 256 文字ずつのページに分けて
+// 使ったページだけを確保する。
+#define OUTCODE_PAGESIZE	(256)
+#define OUTCODE_PAGES		(0x110000 / OUTCODE_PAGESIZE)
+static struct outcode *outcode_page[OUTCODE_PAGES];
+
+// シフト状態ごとの指示シーケンス。
+// [0] は初期状態 (ASCII) へ戻すシーケンス。
+// 状態を持たない文字コードなら [0] だけで、しかも空のまま。
+#define OUTCODE_MAXSHIFT	(8)
+static char shift_seq[OUTCODE_MAXSHIFT][8];
+static uint shift_count;
+
 // 代替文字
-static string *altchar;
+static struct outcode altchar;
 #endif
 
 // 文字コードの初期化。
@@ -63,6 +94,10 @@ static string *altchar;
 bool
 init_codeset(const char *codeset)
 {
+#if defined(HAVE_ICONV)
+	// 前回の文字コードの変換結果が残っていれば捨てる。
+	outcode_clear();
+#endif
 	use_iconv = false;
 
 	if (codeset == NULL) {
@@ -75,14 +110,16 @@ init_codeset(const char *codeset)
 			return false;
 		}
 		use_iconv = true;
+		shift_count = 1;
 
 		// UTF-8 を codeset に変換出来なかった時に出力する代替文字(ゲタ)を
-		// ここで用意しておく。
-		string *altsrc = string_from_cstr("〓");
-		if (altsrc) {
-			altchar = utf8_to_outcode(altsrc);
+		// ここで用意しておく。それすら変換できなければ '?' にする。
+		if (outcode_fill(&altchar, 0x3013) == false) {
+			memset(&altchar, 0, sizeof(altchar));
+			altchar.bytes[0] = '?';
+			altchar.len = 1;
 		}
-		string_free(altsrc);
+		altchar.valid = 1;
 
 		return true;
 #else
@@ -154,10 +191,9 @@ ustring_set_at(ustring *u, int i, unichar c)
 	u->buf[i] = c;
 }
 
-// u を newlen 文字分が追加できるようブロック単位で拡大する。
+// u を newlen 文字分が追加できるよう拡大する。
 #define ustring_expand(u, newlen)	do {	\
-	uint newcap_ = roundup((u)->len + (newlen) + 1, 64);	\
-	if (__predict_false(ustring_realloc(u, newcap_) == false)) {	\
+	if (__predict_false(ustring_reserve(u, newlen) == false)) {	\
 		return;	\
 	}	\
 } while (0)
@@ -255,82 +291,174 @@ ustring_to_utf8(const ustring *src)
 string *
 ustring_to_string(const ustring *src)
 {
-	string *utf8 = ustring_to_utf8(src);
-	if (utf8 == NULL) {
-		return NULL;
-	}
 #if defined(HAVE_ICONV)
 	if (use_iconv) {
-		string *dst = utf8_to_outcode(utf8);
-		string_free(utf8);
-		return dst;
-	} else
-#endif
-	{
-		return utf8;
+		return ustring_to_outcode(src);
 	}
+#endif
+	return ustring_to_utf8(src);
 }
 
 #if defined(HAVE_ICONV)
-// UTF-8 文字列を、初期化時に設定した出力文字コードに変換して返す。
+// ustring を、初期化時に設定した出力文字コードに変換して返す。
+// 1文字ずつ変換テーブルを引いて連結するだけ。
+// シフト状態が変わるところでは指示シーケンスを挿入し、
+// 文字列の最後では初期状態に戻しておく。
 static string *
-utf8_to_outcode(const string *utf8)
+ustring_to_outcode(const ustring *src)
 {
-	size_t tmpsize = 2048;
-	char *tmpbuf = malloc(tmpsize);
-	if (tmpbuf == NULL) {
+	assert(src);
+
+	string *dst = string_alloc(src->len * 2 + 16);
+	if (dst == NULL) {
 		return NULL;
 	}
 
-	string *dst = string_init();
-	if (dst == NULL) {
-		goto done;
+	uint shift = 0;
+	for (uint i = 0; i < src->len; i++) {
+		const struct outcode *oc = outcode_lookup(src->buf[i]);
+		if (__predict_false(oc->shift != shift)) {
+			string_append_cstr(dst, shift_seq[oc->shift]);
+			shift = oc->shift;
+		}
+		string_append_mem(dst, oc->bytes, oc->len);
+	}
+	if (shift != 0) {
+		string_append_cstr(dst, shift_seq[0]);
 	}
 
-	// 文字列全体を変換してみる。
-	const char *src = string_get(utf8);
-	size_t srcleft = string_len(utf8);
-	char *tmp = tmpbuf;
-	size_t tmpleft = tmpsize;
-	while (srcleft) {
-		size_t r = ICONV(cd, &src, &srcleft, &tmp, &tmpleft);
-		if (r == (size_t)-1) {
-			if (errno == EILSEQ) {
-				// 変換できない文字の場合、
-				// まず代わりにゲタを出力する。
-				uint altlen = string_len(altchar);
-				if (tmpleft > altlen) {
-					strlcpy(tmp, string_get(altchar), tmpleft);
-					tmp += altlen;
-					tmpleft -= altlen;
-				} else {
-					// 足りなければ増やして、再度やり直し。
-					goto nomem;
-				}
+	return dst;
+}
+
+// 変換結果テーブルとシフトシーケンスを空にして、iconv も閉じる。
+static void
+outcode_clear(void)
+{
+	if (use_iconv) {
+		iconv_close(cd);
+	}
+	for (uint i = 0; i < countof(outcode_page); i++) {
+		free(outcode_page[i]);
+		outcode_page[i] = NULL;
+	}
+	memset(shift_seq, 0, sizeof(shift_seq));
+	shift_count = 0;
+	memset(&altchar, 0, sizeof(altchar));
+}
+
+// code の変換結果を返す。
+// まだ変換していない文字ならここで変換してテーブルに登録する。
+// 戻り値が NULL になることはない。
+static const struct outcode *
+outcode_lookup(unichar code)
+{
+	if (__predict_false(code >= 0x110000)) {
+		return &altchar;
+	}
+
+	struct outcode **pagep = &outcode_page[code / OUTCODE_PAGESIZE];
+	if (__predict_false(*pagep == NULL)) {
+		*pagep = calloc(OUTCODE_PAGESIZE, sizeof(struct outcode));
+		if (*pagep == NULL) {
+			return &altchar;
+		}
+	}
+
+	struct outcode *oc = &(*pagep)[code % OUTCODE_PAGESIZE];
+	if (__predict_false(oc->valid == 0)) {
+		if (outcode_fill(oc, code) == false) {
+			*oc = altchar;
+		}
+		oc->valid = 1;
+	}
+	return oc;
+}
+
+// code 1文字を iconv で変換して oc に格納する。
+// 変換できなければ false を返す (oc は不定)。
+static bool
+outcode_fill(struct outcode *oc, unichar code)
+{
+	char utf8buf[8];
+	char outbuf[32];
+
+	// 1文字ずつ初期状態から変換する。
+	iconv(cd, NULL, NULL, NULL, NULL);
 
-				// で、変換できなかった入力の1文字を飛ばす。
-				const char *next = src;
-				uchar_from_utf8(&next);
-				srcleft += (next - src);
-				src = next;
-
-			} else if (errno == E2BIG) {
-		nomem:
-				string_append_mem(dst, tmpbuf, tmpsize - tmpleft);
-				tmp = tmpbuf;
-				tmpleft = tmpsize;
-
-			} else {
-				// それ以外のエラーならどうする?
-				break;
+	const char *src = utf8buf;
+	size_t srcleft = uchar_to_utf8(utf8buf, code);
+	char *out = outbuf;
+	size_t outleft = sizeof(outbuf);
+	if (ICONV(cd, &src, &srcleft, &out, &outleft) == (size_t)-1) {
+		return false;
+	}
+	uint len = out - outbuf;
+
+	// 初期状態に戻すシーケンスが出てくれば、状態を持つ文字コード。
+	if (iconv(cd, NULL, NULL, &out, &outleft) == (size_t)-1) {
+		return false;
+	}
+	uint resetlen = (out - outbuf) - len;
+
+	const char *body = outbuf;
+	uint shift = 0;
+	if (resetlen > 0) {
+		if (shift_seq[0][0] == '\0' && resetlen < sizeof(shift_seq[0])) {
+			memcpy(shift_seq[0], outbuf + len, resetlen);
+			shift_seq[0][resetlen] = '\0';
+		}
+
+		// 先頭の指示シーケンス (ESC [\x20-\x2f]* [\x30-\x7e]) を
+		// 取り出して、シフト状態として登録する。
+		if (len > 0 && body[0] == ESCchar) {
+			uint n = 1;
+			while (n < len && 0x20 <= body[n] && body[n] <= 0x2f) {
+				n++;
+			}
+			if (n < len && 0x30 <= body[n] && body[n] <= 0x7e) {
+				n++;
+				shift = outcode_intern_shift(body, n);
+				if (shift == 0) {
+					return false;
+				}
+				body += n;
+				len -= n;
 			}
 		}
 	}
-	string_append_mem(dst, tmpbuf, tmpsize - tmpleft);
 
- done:
-	free(tmpbuf);
-	return dst;
+	if (len > sizeof(oc->bytes)) {
+		return false;
+	}
+	memcpy(oc->bytes, body, len);
+	oc->len = len;
+	oc->shift = shift;
+	return true;
+}
+
+// 指示シーケンス seq (長さ len) をシフト状態として登録し、その番号を返す。
+// すでにあれば既存の番号を返す。これ以上登録できなければ 0 を返す。
+static uint
+outcode_intern_shift(const char *seq, uint len)
+{
+	if (len >= sizeof(shift_seq[0])) {
+		return 0;
+	}
+
+	uint i;
+	for (i = 1; i < shift_count; i++) {
+		if (strncmp(shift_seq[i], seq, len) == 0 && shift_seq[i][len] == '\0')
+		{
+			return i;
+		}
+	}
+	if (i >= OUTCODE_MAXSHIFT) {
+		return 0;
+	}
+	memcpy(shift_seq[i], seq, len);
+	shift_seq[i][len] = '\0';
+	shift_count++;
+	return i;
 }
 #endif
 
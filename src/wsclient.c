@@ -31,9 +31,6 @@
 #include "sayaka.h"
 #include <errno.h>
 #include <string.h>
-#include <time.h>
-#include <sys/select.h>
-#include <sys/time.h>
 
 enum {
 	// フレームの +0バイト目 (の下位4ビット)
@@ -52,6 +49,15 @@ enum {
 	WS_MASK_BIT			= 0x80,	// Frame[1]
 };
 
+// 接続処理の段階。
+enum {
+	WS_CSTATE_IDLE = 0,
+	WS_CSTATE_CONNECT,	// 接続中
+	WS_CSTATE_STATUS,	// 応答行の受信中
+	WS_CSTATE_HEADER,	// 残りの応答ヘッダの受信中
+	WS_CSTATE_DONE,		// 完了 (成否問わず)
+};
+
 // バッファサイズの初期値と増分。観測結果から 16KB を超えるメッセージは
 // あまり多くはないので、このくらいでどうか。
 #define INIT_BUFSIZE	(16384)
@@ -68,6 +74,10 @@ struct wsclient {
 	uint8 opcode;		// opcode
 	string *text;		// テキストメッセージ
 
+	uint cstate;		// 接続処理の段階
+	string *request;	// 接続後に送る WebSocket ヘッダ
+	string *response;	// 受信した応答行
+
 	// テキスト受信コールバック。
 	// テキストが 1フレーム受信できた時に呼ばれる。
 	void (*callback)(const string *);
@@ -75,8 +85,11 @@ struct wsclient {
 	const struct diag *diag;
 };
 
-static inline void wsclient_send_ping(struct wsclient *);
+static int  wsclient_connect_start(struct wsclient *, const char *,
+	const struct net_opt *, bool);
+static int  wsclient_check_response(struct wsclient *);
 static inline void wsclient_send_pong(struct wsclient *);
+static bool wsclient_has_frame(const struct wsclient *);
 static int  wsclient_send(struct wsclient *, uint8, const void *, uint);
 static uint ws_encode_len(uint8 *, uint);
 static uint ws_decode_len(const uint8 *, uint *);
@@ -122,6 +135,8 @@ wsclient_destroy(struct wsclient *ws)
 		net_destroy(ws->net);
 		free(ws->buf);
 		string_free(ws->text);
+		string_free(ws->request);
+		string_free(ws->response);
 		free(ws);
 	}
 }
@@ -144,11 +159,40 @@ wsclient_init(struct wsclient *ws, void (*callback)(const string *))
 int
 wsclient_connect(struct wsclient *ws, const char *url,
 	const struct net_opt *opt)
+{
+	int r = wsclient_connect_start(ws, url, opt, false);
+	if (r < 0) {
+		return r;
+	}
+	// ソケットはブロッキングなので、ここで応答まで受け取る。
+	return wsclient_connect_step(ws);
+}
+
+// url へのノンブロッキングでの接続を開始する。
+// 接続処理中なら 1 を返すので、wsclient_get_fd() のソケットで
+// wsclient_get_want() のイベントを待ってから wsclient_connect_step() を
+// 呼ぶこと。それ以外の戻り値は wsclient_connect() と同じ。
+// 名前解決 (getaddrinfo) はここでブロックする。
+int
+wsclient_connect_async(struct wsclient *ws, const char *url,
+	const struct net_opt *opt)
+{
+	int r = wsclient_connect_start(ws, url, opt, true);
+	if (r < 0) {
+		return r;
+	}
+	return wsclient_connect_step(ws);
+}
+
+// url への接続を開始し、接続後に送る WebSocket ヘッダを用意する。
+// async なら TCP の接続を待たずに戻る。
+// 成功すれば 0 を返す。失敗すれば wsclient_connect() と同じ負数を返す。
+static int
+wsclient_connect_start(struct wsclient *ws, const char *url,
+	const struct net_opt *opt, bool async)
 {
 	const struct diag *diag = ws->diag;
 	string *key = NULL;
-	string *hdr = NULL;
-	string *response = NULL;
 	int rv = -1;
 
 	struct urlinfo *info = urlinfo_parse(url);
@@ -179,7 +223,12 @@ wsclient_connect(struct wsclient *ws, const char *url,
 		goto abort;
 	}
 
-	int r = net_connect(ws->net, scheme, host, serv, opt);
+	int r;
+	if (async) {
+		r = net_connect_async(ws->net, scheme, host, serv, opt);
+	} else {
+		r = net_connect(ws->net, scheme, host, serv, opt);
+	}
 	if (r < 0) {
 		Debug(diag, "%s: %s://%s:%s failed: %s", __func__,
 			scheme, host, serv,
@@ -193,8 +242,8 @@ wsclient_connect(struct wsclient *ws, const char *url,
 	rnd_fill(nonce, sizeof(nonce));
 	key = base64_encode(nonce, sizeof(nonce));
 
-	// WebSocket ヘッダを送信。
-	hdr = string_init();
+	// WebSocket ヘッダを作成。送信は接続できてから。
+	string *hdr = string_init();
 	string_append_printf(hdr, "GET %s HTTP/1.1\r\n", pqf);
 	string_append_printf(hdr, "Host: %s\r\n", host);
 	string_append_printf(hdr, "User-Agent: %s/%s\r\n", progname, progver);
@@ -204,66 +253,125 @@ wsclient_connect(struct wsclient *ws, const char *url,
 		"Sec-WebSocket-Version: 13\r\n");
 	string_append_printf(hdr, "Sec-WebSocket-Key: %s\r\n", string_get(key));
 	string_append_cstr(hdr,   "\r\n");
-	if (__predict_false(diag_get_level(diag) >= 2)) {
-		diag_http_header(diag, hdr);
-	}
-	int sent = net_write(ws->net, string_get(hdr), string_len(hdr));
-	if (sent < 0) {
-		Debug(diag, "%s: net_write: %s", __func__, strerrno());
-		goto abort;
-	}
+	ws->request = hdr;
+	ws->cstate = WS_CSTATE_CONNECT;
 
-	// 応答の1行目を受信。
-	response = net_gets(ws->net);
-	if (response == NULL) {
-		Debug(diag, "%s: %s", __func__, strerrno());
-		rv  = -1;
-		goto abort;
-	}
-	if (string_len(response) == 0) {
-		Debug(diag, "%s: Unexpected EOF while reading response header",
-			__func__);
-		rv = 0;
-		goto abort;
-	}
-	string_rtrim_inplace(response);
-	Trace(diag, "--> |%s|", string_get(response));
+	rv = 0;
+ abort:
+	string_free(key);
+	urlinfo_free(info);
+	return rv;
+}
+
+// 接続処理を進める。
+// 戻り値は wsclient_connect_async() と同じ。
+int
+wsclient_connect_step(struct wsclient *ws)
+{
+	const struct diag *diag = ws->diag;
+	int rv = -1;
 
-	// 残りの行は今のところ使ってないので読み捨てる。
 	for (;;) {
-		string *recvhdr;
+		switch (ws->cstate) {
+		 case WS_CSTATE_CONNECT:
+		 {
+			int r = net_connect_step(ws->net);
+			if (r == 1) {
+				return 1;
+			}
+			if (r < 0) {
+				Debug(diag, "%s: net_connect_step: %s", __func__, strerrno());
+				goto done;
+			}
 
-		recvhdr = net_gets(ws->net);
-		if (recvhdr == NULL) {
-			Debug(diag, "%s: %s", __func__, strerrno());
-			rv = -1;
-			goto abort;
-		}
-		if (string_len(recvhdr) == 0) {
-			Debug(diag, "%s: Unexpected EOF while reading header", __func__);
-			string_free(recvhdr);
-			rv = 0;
-			goto abort;
-		}
+			// WebSocket ヘッダを送信。
+			string *hdr = ws->request;
+			if (__predict_false(diag_get_level(diag) >= 2)) {
+				diag_http_header(diag, hdr);
+			}
+			int sent = net_write(ws->net, string_get(hdr), string_len(hdr));
+			if (sent < 0) {
+				Debug(diag, "%s: net_write: %s", __func__, strerrno());
+				goto done;
+			}
+			string_free(ws->request);
+			ws->request = NULL;
+			ws->cstate = WS_CSTATE_STATUS;
+			break;
+		 }
+
+		 case WS_CSTATE_STATUS:
+		 case WS_CSTATE_HEADER:
+		 {
+			// ノンブロッキングなら受信途中の行は net が持っている。
+			string *line = net_gets(ws->net);
+			if (line == NULL) {
+				if (errno == EAGAIN) {
+					return 1;
+				}
+				Debug(diag, "%s: %s", __func__, strerrno());
+				goto done;
+			}
+			if (string_len(line) == 0) {
+				Debug(diag, "%s: Unexpected EOF while reading %s", __func__,
+					(ws->cstate == WS_CSTATE_STATUS ? "response header"
+						: "header"));
+				string_free(line);
+				rv = 0;
+				goto done;
+			}
+			string_rtrim_inplace(line);
+			Trace(diag, "--> |%s|", string_get(line));
+
+			// 1行目は応答行。
+			if (ws->cstate == WS_CSTATE_STATUS) {
+				ws->response = line;
+				ws->cstate = WS_CSTATE_HEADER;
+				break;
+			}
 
-		string_rtrim_inplace(recvhdr);
-		bool newline = (string_len(recvhdr) == 0);
-		Trace(diag, "--> |%s|", string_get(recvhdr));
-		string_free(recvhdr);
-		if (newline) {
+			// 残りの行は今のところ使ってないので読み捨てる。
+			bool newline = (string_len(line) == 0);
+			string_free(line);
+			if (newline) {
+				rv = wsclient_check_response(ws);
+				goto done;
+			}
 			break;
+		 }
+
+		 default:
+			errno = ENOTCONN;
+			return -1;
 		}
 	}
 
+ done:
+	ws->cstate = WS_CSTATE_DONE;
+	string_free(ws->request);
+	ws->request = NULL;
+	string_free(ws->response);
+	ws->response = NULL;
+	return rv;
+}
+
+// 受信した応答行を調べる。
+// 失敗すれば errno をセットして -1 を返す。
+// そうでなければ応答コードを返す (101 なら成功)。
+static int
+wsclient_check_response(struct wsclient *ws)
+{
+	const struct diag *diag = ws->diag;
+
 	// 1行目を雑にチェックする。
 	// "HTTP/1.1 101 Switching Protocols\r\n" みたいなのが来るはず。
 
 	// 先頭が "HTTP/1.1"。
-	const char *recvbuf = string_get(response);
+	const char *recvbuf = string_get(ws->response);
 	if (strncmp(recvbuf, "HTTP/1.1", 8) != 0) {
 		Debug(diag, "%s: No HTTP/1.1 response?", __func__);
 		errno = EPROTO;
-		goto abort;
+		return -1;
 	}
 
 	// 空白をスキップ。
@@ -275,22 +383,24 @@ wsclient_connect(struct wsclient *ws, const char *url,
 	int rescode = atoi(p);
 	if (rescode != 101) {
 		Debug(diag, "%s: Upgrading failed by %u", __func__, rescode);
-		rv = rescode;
-		goto abort;
+		return rescode;
 	}
 
 	// XXX Sec-WebSocket-Accept のチェックとか。
 
-	rv = rescode;
- abort:
-	string_free(response);
-	string_free(hdr);
-	string_free(key);
-	urlinfo_free(info);
-	return rv;
+	// 以降はイベントループから使うのでノンブロッキングにする。
+	if (net_set_nonblock(ws->net) < 0) {
+		Debug(diag, "%s: net_set_nonblock: %s", __func__, strerrno());
+		return -1;
+	}
+
+	return rescode;
 }
 
-// net に着信したフレームの処理をする (受信までブロックする)。
+// net に着信したフレームの処理をする。
+// ソケットはノンブロッキングなので、受信するものがなければ errno を
+// EAGAIN にして -1 を返す。その時は wsclient_get_fd() のソケットで
+// wsclient_get_want() のイベントを待ってから再度呼ぶこと。
 // 戻り値は -1 ならエラー。0 なら EOF。
 // 1 なら何かしら処理をしたが、上位には関係がない。
 // 2 なら ws->text に上位に通知するデータが用意できた。
@@ -298,14 +408,15 @@ int
 wsclient_process(struct wsclient *ws)
 {
 	const struct diag *diag = ws->diag;
-	struct timespec now;
-	uint64 now_usec;
-	uint64 end_usec;
-	uint64 timeout_usec;
-	int fd;
 	int rv = 1;
 	int r;
 
+	// 前回の受信で次のフレームまで読めていれば、受信せずにそれを処理する。
+	// サーバが続けて送ってくると1回の受信に複数のフレームが入っている。
+	if (wsclient_has_frame(ws)) {
+		goto process;
+	}
+
 	// 受信バッファが埋まっていれば伸ばす。
 	if (ws->buflen >= ws->bufsize) {
 		uint newsize = ws->bufsize + INC_BUFSIZE;
@@ -318,45 +429,11 @@ wsclient_process(struct wsclient *ws)
 		ws->bufsize = newsize;
 	}
 
-	// キープアライブのため一定時間だけ受信を待つ。
-	fd = net_get_fd(ws->net);
-	timeout_usec = 30 * 1000 * 1000;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	now_usec = timespec_to_usec(&now);
-	end_usec = now_usec + timeout_usec;
-	for (;;) {
-		struct timeval tv;
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(fd, &rfds);
-
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		now_usec = timespec_to_usec(&now);
-		if (now_usec >= end_usec) {
-			// 一定時間何も起きなかったので PING を投げる。
-			wsclient_send_ping(ws);
-			return 1;
-		}
-
-		timeout_usec = end_usec - now_usec;
-		tv.tv_sec  = timeout_usec / 1000000;
-		tv.tv_usec = timeout_usec % 1000000;
-		r = select(fd + 1, &rfds, NULL, NULL, &tv);
-		if (r < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
-			Debug(diag, "%s: select failed: %s", __func__, strerrno());
-			return -1;
-		}
-		if (r > 0) {
-			break;
-		}
-	}
-
 	r = net_read(ws->net, ws->buf + ws->buflen, ws->bufsize - ws->buflen);
 	if (r < 0) {
-		Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
+		if (errno != EAGAIN) {
+			Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
+		}
 		return -1;
 	}
 	if (r == 0) {
@@ -377,7 +454,16 @@ wsclient_process(struct wsclient *ws)
 	}
 	ws->buflen += r;
 
+	// フレームを全部読み込めているか。
+	if (wsclient_has_frame(ws) == false) {
+		// 足りなければ次の受信を待つ。
+		Trace(diag, "%s: wait more data: filled=%u", __func__,
+			ws->buflen - ws->bufpos);
+		return 1;
+	}
+
 	// 読めたので処理する。
+ process:;
 	uint pos = ws->bufpos;
 	uint8 opbyte = ws->buf[pos++];
 	uint8 opcode = opbyte & 0x0f;
@@ -385,14 +471,6 @@ wsclient_process(struct wsclient *ws)
 	uint datalen;
 	pos += ws_decode_len(&ws->buf[pos], &datalen);
 
-	// ペイロードを全部読み込めているか。
-	if (ws->buflen - pos < datalen) {
-		// 足りなければ次のフレームを待つ。
-		Trace(diag, "%s: wait more data: filled=%u < datalen=%u", __func__,
-			ws->buflen - pos, datalen);
-		return 1;
-	}
-
 	// このペイロードは全部受信出来ているので現在位置は進めてよい。
 	ws->bufpos = pos;
 
@@ -445,6 +523,34 @@ wsclient_process(struct wsclient *ws)
 	return rv;
 }
 
+// 受信バッファの現在位置から1フレームが全部揃っていれば true を返す。
+static bool
+wsclient_has_frame(const struct wsclient *ws)
+{
+	const uint8 *p = &ws->buf[ws->bufpos];
+	uint avail = ws->buflen - ws->bufpos;
+	uint hdrlen;
+	uint datalen;
+
+	// 長さフィールドが読めるか。
+	if (avail < 2) {
+		return false;
+	}
+	if (p[1] == 126) {
+		hdrlen = 2 + 2;
+	} else if (p[1] == 127) {
+		hdrlen = 2 + 8;
+	} else {
+		hdrlen = 2;
+	}
+	if (avail < hdrlen) {
+		return false;
+	}
+
+	ws_decode_len(&p[1], &datalen);
+	return (avail - hdrlen >= datalen);
+}
+
 // テキストフレームを送信する。
 ssize_t
 wsclient_send_text(struct wsclient *ws, const char *buf)
@@ -453,13 +559,28 @@ wsclient_send_text(struct wsclient *ws, const char *buf)
 }
 
 // PING を送信する。
-static inline void
+// キープアライブのため、一定時間何も受信しなかった時に呼ぶ。
+void
 wsclient_send_ping(struct wsclient *ws)
 {
 	wsclient_send(ws, WS_OPCODE_PING, NULL, 0);
 	Trace(ws->diag, "%s", __func__);
 }
 
+// イベントループで待つソケットを返す。
+int
+wsclient_get_fd(const struct wsclient *ws)
+{
+	return net_get_fd(ws->net);
+}
+
+// wsclient_process() が EAGAIN になった時に待つべきイベントを返す。
+uint
+wsclient_get_want(const struct wsclient *ws)
+{
+	return net_get_want(ws->net);
+}
+
 // PONG 応答を送信する。
 static inline void
 wsclient_send_pong(struct wsclient *ws)
@@ -574,6 +695,7 @@ ws_decode_len(const uint8 *src, uint *lenp)
 //
 
 #include <err.h>
+#include <poll.h>
 #include <stdio.h>
 #include <signal.h>
 
@@ -646,6 +768,23 @@ testhttp(const struct diag *diag, int ac, char *av[])
 	return 0;
 }
 
+// 受信できるまで待ちながら wsclient_process() する。
+static int
+test_process(struct wsclient *ws)
+{
+	for (;;) {
+		int r = wsclient_process(ws);
+		if (r < 0 && errno == EAGAIN) {
+			struct pollfd pfd;
+			pfd.fd = wsclient_get_fd(ws);
+			pfd.events = (wsclient_get_want(ws) & EV_WRITE) ? POLLOUT : POLLIN;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		return r;
+	}
+}
+
 // 表示するだけのコールバック。
 static void
 cat_callback(const string *s)
@@ -678,7 +817,7 @@ testwsecho(const struct diag *diag, int ac, char *av[])
 	for (;;) {
 		int r;
 
-		r = wsclient_process(ws);
+		r = test_process(ws);
 		if (r < 0) {
 			warn("read");
 			break;
@@ -718,7 +857,7 @@ testmisskey(const struct diag *diag, int ac, char *av[])
 	}
 
 	for (;;) {
-		int r = wsclient_process(ws);
+		int r = test_process(ws);
 		if (r < 1) {
 			break;
 		}
@@ -32,13 +32,22 @@
 #define XCAT(x,y) XCAT_HELPER(x,y)
 
 // 空の文字列を確保して返す。
+// 現在の確保先にアリーナが設定されていればそこから確保する。
 xstring *
 XCAT(xstring,_init)(void)
 {
-	xstring *x = calloc(1, sizeof(*x));
+	struct arena *a = arena_get_current();
+	xstring *x;
+
+	if (a) {
+		x = arena_calloc(a, sizeof(*x));
+	} else {
+		x = calloc(1, sizeof(*x));
+	}
 	if (x == NULL) {
 		return NULL;
 	}
+	x->arena = a;
 	return x;
 }
 
@@ -70,7 +79,13 @@ XCAT(xstring,_realloc)(xstring *x, uint new_capacity)
 		return true;
 	}
 
-	xchar *tmp = realloc(x->buf, new_capacity * sizeof(xchar));
+	xchar *tmp;
+	if (x->arena) {
+		tmp = arena_grow(x->arena, x->buf,
+			x->capacity * sizeof(xchar), new_capacity * sizeof(xchar));
+	} else {
+		tmp = realloc(x->buf, new_capacity * sizeof(xchar));
+	}
 	if (tmp == NULL) {
 		return false;
 	}
@@ -79,12 +94,34 @@ XCAT(xstring,_realloc)(xstring *x, uint new_capacity)
 	return true;
 }
 
+// 末尾に len 文字を追加出来るよう確保量を拡大する。
+// 足りない時は倍々で増やすので、1文字ずつ追加しても再確保は
+// 長さの対数回で済む。
+// 拡大出来なければ false を返す。
+static inline bool
+XCAT(xstring,_reserve)(xstring *x, uint len)
+{
+	uint need = x->len + len + 1;
+	if (__predict_true(need <= x->capacity)) {
+		return true;
+	}
+	uint newcap = MAX(x->capacity * 2, roundup(need, 16));
+	return XCAT(xstring,_realloc)(x, newcap);
+}
+
 // x を解放する。
+// アリーナから確保したものは直近の確保分なら巻き戻し、そうでなければ
+// アリーナごと解放されるまでそのまま。
 void
 XCAT(xstring,_free)(xstring *x)
 {
 	if (x) {
-		free(x->buf);
-		free(x);
+		if (x->arena) {
+			arena_release(x->arena, x->buf, x->capacity * sizeof(xchar));
+			arena_release(x->arena, x, sizeof(*x));
+		} else {
+			free(x->buf);
+			free(x);
+		}
 	}
 }